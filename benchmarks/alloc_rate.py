@@ -0,0 +1,53 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/alloc_rate.py
+# Measures the rate of write-heavy PHAMT operations, which are dominated by the
+# allocation and freeing of short-lived nodes.
+# By Noah C. Benson
+
+"""Benchmark of node allocation rates in write-heavy PHAMT workloads.
+
+Usage: python benchmarks/alloc_rate.py [n] [ops] [repeats]
+
+For a map of `n` keys (default 1,000,000), this performs `ops` (default
+1,000,000) persistent updates of several kinds, each of which allocates a
+path of new nodes and frees the path that it replaces, and prints the number of
+operations per second (the best of `repeats` runs, default 3). To compare two
+builds of `phamt`, run the script against each.
+"""
+
+import sys, random, time
+from phamt import PHAMT
+
+def bench(label, fn, repeats):
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        nops = fn()
+        ts.append(time.perf_counter() - t0)
+    print("%-28s %8.3f Mops/s" % (label, nops / min(ts) / 1e6))
+
+def main(n=1000000, ops=1000000, repeats=3):
+    print("phamt allocation-rate benchmark: n = %d, ops = %d" % (n, ops))
+    u0 = PHAMT.from_iter(range(n))
+    ks = [random.randrange(n) for _ in range(ops)]
+    def replace():
+        u = u0
+        for k in ks: u = u.assoc(k, None)
+        return ops
+    bench("assoc (replace value)", replace, repeats)
+    def insert_delete():
+        u = u0
+        for k in ks: u = u.assoc(k + n, k).dissoc(k + n)
+        return 2*ops
+    bench("assoc + dissoc (new key)", insert_delete, repeats)
+    def build():
+        u = PHAMT.empty
+        for k in ks: u = u.assoc(k, k)
+        return ops
+    bench("assoc (build from empty)", build, repeats)
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,60 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/assoc_throughput.py
+# Measures the throughput of persistent assoc operations on PHAMTs of several
+# sizes.
+# By Noah C. Benson
+
+"""Microbenchmark of persistent assoc throughput.
+
+Usage: python benchmarks/assoc_throughput.py [ops] [repeats]
+
+For maps of 1,000, 100,000, and 1,000,000 consecutive keys, this performs `ops`
+(default 300,000) assocs to random keys and prints the time per assoc and the
+number of assocs per second (the best of `repeats` runs, default 3). Each assoc
+copies the path from the root to the key's twig, so every copied node shares all
+but one of its cells with the node it replaces. The assocs are made in three
+ways: replacing the value of a key in the latest map, so that each map's path is
+freed by the next assoc ("chained"); replacing the value of a key in the
+original map while keeping every result alive ("kept"), so that no path is
+freed; and the chained replacement of a value by a list, which the garbage
+collector must track. To compare two builds of `phamt`, run the script against
+each.
+"""
+
+import sys, random, time
+from phamt import PHAMT
+
+def best(fn, repeats):
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        fn()
+        ts.append(time.perf_counter() - t0)
+    return min(ts)
+
+def main(ops=300000, repeats=3):
+    print("phamt assoc-throughput benchmark: ops = %d" % ops)
+    print("%9s %-16s %12s %12s" % ("n", "assoc", "ns/assoc", "Massoc/s"))
+    lst = []
+    for n in (1000, 100000, 1000000):
+        u0 = PHAMT.from_iter(range(n))
+        ks = [random.randrange(n) for _ in range(ops)]
+        def chained():
+            u = u0
+            for k in ks: u = u.assoc(k, None)
+        def kept():
+            us = [u0.assoc(k, None) for k in ks]
+        def tracked():
+            u = u0
+            for k in ks: u = u.assoc(k, lst)
+        for (label, fn) in [("chained", chained), ("kept", kept),
+                            ("chained (list)", tracked)]:
+            t = best(fn, repeats)
+            print("%9d %-16s %12.1f %12.3f" % (n, label, t / ops * 1e9,
+                                               ops / t / 1e6))
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
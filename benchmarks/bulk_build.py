@@ -0,0 +1,56 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/bulk_build.py
+# Measures building a PHAMT from arrays of keys and values with a THAMT versus
+# PHAMT.from_arrays on 1, 2, 4, ... threads.
+# By Noah C. Benson
+
+"""Benchmark of bulk construction of a PHAMT from key and value arrays.
+
+Usage: python benchmarks/bulk_build.py [n] [maxthreads]
+
+An index of `n` (default 1,000,000) random 63-bit ids, each mapped to its
+offset in a table, is built from an `array('q')` of the ids and a list of the
+offsets, as a program might build it at startup. The time taken and the
+items per second are printed for:
+
+ * "THAMT", which assigns each item to a `THAMT` and persists it; and
+ * "from_arrays", which calls `PHAMT.from_arrays(ids, offsets, nthreads)`
+   for 1, 2, 4, ... up to `maxthreads` (default 4) threads.
+
+`PHAMT.from_arrays` sorts the items and fills the trie's nodes without the
+GIL, so its threads run in parallel in any build of Python.
+"""
+
+import sys, time, random
+from array import array
+from phamt import PHAMT, THAMT
+
+def timed(fn):
+    t0 = time.perf_counter()
+    u = fn()
+    return (u, time.perf_counter() - t0)
+
+def by_thamt(ids, offsets):
+    t = THAMT()
+    for (k, v) in zip(ids, offsets): t[k] = v
+    return t.persistent()
+
+def main(n=1000000, maxthreads=4):
+    ids = array('q', (random.getrandbits(63) for _ in range(n)))
+    offsets = list(range(n))
+    print("phamt bulk-build benchmark: n = %d" % n)
+    print("%-12s %8s %10s %14s" % ("method", "threads", "time (s)", "items/s"))
+    (u0, t) = timed(lambda: by_thamt(ids, offsets))
+    print("%-12s %8d %10.3f %14.0f" % ("THAMT", 1, t, n / t))
+    nthreads = 1
+    while nthreads <= maxthreads:
+        (u, t) = timed(lambda: PHAMT.from_arrays(ids, offsets, nthreads))
+        assert len(u) == len(u0)
+        print("%-12s %8d %10.3f %14.0f" % ("from_arrays", nthreads, t, n / t))
+        nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
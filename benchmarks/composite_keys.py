@@ -0,0 +1,81 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/composite_keys.py
+# Compares nested PHAMTs to 128-bit PHAMTs (PHAMT128) for two-part keys.
+# By Noah C. Benson
+
+"""Benchmark of two-part (tenant, object) keys.
+
+Usage: python benchmarks/composite_keys.py [tenants] [objects] [repeats]
+
+For `tenants` tenants (default 1,000) that each hold `objects` objects (default
+1,000) with random 63-bit object ids, this compares a `PHAMT` of `PHAMT`s (one
+per tenant) to a single `PHAMT128` keyed by `(tenant, object)` pairs. For each,
+it prints the number of bytes allocated per key (as reported by `tracemalloc`)
+and the time per key to look up every key and to assoc a new value onto every
+key (the best of `repeats` runs, default 3).
+"""
+
+import sys, gc, random, time, tracemalloc
+from phamt import PHAMT, THAMT, PHAMT128, THAMT128
+
+def best(fn, repeats):
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        fn()
+        ts.append(time.perf_counter() - t0)
+    return min(ts)
+
+def build_nested(keys):
+    t = THAMT()
+    for (tenant, objs) in keys:
+        s = THAMT()
+        for o in objs: s[o] = o
+        t[tenant] = s.persistent()
+    return t.persistent()
+def build_wide(keys):
+    t = THAMT128()
+    for (tenant, objs) in keys:
+        for o in objs: t[(tenant, o)] = o
+    return t.persistent()
+
+def main(tenants=1000, objects=1000, repeats=3):
+    print("phamt composite-key benchmark: %d tenants x %d objects" % (tenants,
+                                                                    objects))
+    keys = [(tenant, [random.randrange(1 << 63) for _ in range(objects)])
+            for tenant in range(tenants)]
+    pairs = [(tenant, o) for (tenant, objs) in keys for o in objs]
+    n = len(pairs)
+    print("%-10s %12s %12s %12s" % ("layout", "bytes/key", "get (ns)",
+                                     "assoc (ns)"))
+    gc.collect()
+    tracemalloc.start()
+    u = build_nested(keys)
+    nbytes = tracemalloc.get_traced_memory()[0]
+    tracemalloc.stop()
+    def get():
+        for (tenant, o) in pairs: u[tenant][o]
+    def assoc():
+        for (tenant, o) in pairs: u.assoc(tenant, u[tenant].assoc(o, None))
+    print("%-10s %12.1f %12.1f %12.1f" % ("nested", nbytes / n,
+                                          best(get, repeats) / n * 1e9,
+                                          best(assoc, repeats) / n * 1e9))
+    del u
+    gc.collect()
+    tracemalloc.start()
+    w = build_wide(keys)
+    nbytes = tracemalloc.get_traced_memory()[0]
+    tracemalloc.stop()
+    def get():
+        for k in pairs: w[k]
+    def assoc():
+        for k in pairs: w.assoc(k, None)
+    print("%-10s %12.1f %12.1f %12.1f" % ("PHAMT128", nbytes / n,
+                                          best(get, repeats) / n * 1e9,
+                                          best(assoc, repeats) / n * 1e9))
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
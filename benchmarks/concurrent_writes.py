@@ -0,0 +1,108 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/concurrent_writes.py
+# Measures concurrent writes to, and snapshots of, a mutable map shared between
+# threads: a THAMT guarded by a lock, a PHAMTRef, and a ConcurrentTHAMT.
+# By Noah C. Benson
+
+"""Benchmark of concurrent writes to and snapshots of a shared mutable map.
+
+Usage: python benchmarks/concurrent_writes.py [n] [ops] [maxthreads] [every]
+
+This starts with a map of `n` (default 100,000) keys, then for 1, 2, 4, ...
+up to `maxthreads` (default 4) threads, has each thread write `ops` (default
+100,000) random keys to the shared map, taking a snapshot of the map (as a
+`PHAMT`) after every `every` (default 100) writes. It prints the total writes
+per second, and the mean time taken by a snapshot, for three maps:
+
+ * "THAMT" is a `THAMT` that is written (`t[k] = v`) and persisted
+   (`t.persistent()`) while holding a `threading.Lock`; and
+ * "PHAMTRef" is a `PHAMTRef` that is written (`ref.assoc(k, v)`) and read
+   (`ref.get()`) without a lock; and
+ * "concurrent" is a `ConcurrentTHAMT` that is written and persisted
+   (`c.persistent()`) without a lock.
+
+A `THAMT` edits its transient nodes in place, so its writes are cheaper, but
+each snapshot must persist the nodes edited since the last one. Every write to
+a `PHAMTRef` replaces its root, so concurrent writers retry each other's work,
+whereas writers to a `ConcurrentTHAMT` only contend when they edit the same
+subtree. Only free-threaded builds of Python can run the threads in parallel.
+"""
+
+import sys, time, random, threading
+from array import array
+from phamt import PHAMT, THAMT, PHAMTRef, ConcurrentTHAMT
+
+class Locked(object):
+    def __init__(self, u):
+        self.thamt = THAMT(u)
+        self.lock = threading.Lock()
+    def __setitem__(self, k, v):
+        with self.lock:
+            self.thamt[k] = v
+    def snapshot(self):
+        with self.lock:
+            return self.thamt.persistent()
+
+class Ref(object):
+    def __init__(self, u):
+        self.ref = PHAMTRef(u)
+    def __setitem__(self, k, v):
+        self.ref.assoc(k, v)
+    def snapshot(self):
+        return self.ref.get()
+
+class Concurrent(object):
+    def __init__(self, u):
+        self.cthamt = ConcurrentTHAMT(u)
+    def __setitem__(self, k, v):
+        self.cthamt[k] = v
+    def snapshot(self):
+        return self.cthamt.persistent()
+
+def run(m, ks, nthreads, every):
+    barrier = threading.Barrier(nthreads + 1)
+    snaps = []
+    def work():
+        ii = 0
+        barrier.wait()
+        for k in ks:
+            m[k] = None
+            ii += 1
+            if ii == every:
+                ii = 0
+                t0 = time.perf_counter()
+                m.snapshot()
+                snaps.append(time.perf_counter() - t0)
+        barrier.wait()
+    ths = [threading.Thread(target=work) for _ in range(nthreads)]
+    for th in ths: th.start()
+    barrier.wait()
+    t0 = time.perf_counter()
+    barrier.wait()
+    t = time.perf_counter() - t0
+    for th in ths: th.join()
+    return (nthreads * len(ks) / t, sum(snaps) / max(len(snaps), 1))
+
+def main(n=100000, ops=100000, maxthreads=4, every=100):
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print("phamt concurrent-write benchmark: n = %d, ops = %d, GIL %s" % (
+        n, ops, "enabled" if gil else "disabled"))
+    print("%-12s %8s %14s %14s" % ("map", "threads", "writes/s",
+                                   "snapshot (us)"))
+    ks = array('q', [random.randrange(n) for _ in range(ops)])
+    u = PHAMT.from_iter(range(n))
+    nthreads = 1
+    while nthreads <= maxthreads:
+        for (label, m) in [("THAMT", Locked(u)),
+                           ("PHAMTRef", Ref(u)),
+                           ("concurrent", Concurrent(u))]:
+            (rate, snap) = run(m, ks, nthreads, every)
+            print("%-12s %8d %14.0f %14.2f" % (label, nthreads, rate,
+                                               snap * 1e6))
+        nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
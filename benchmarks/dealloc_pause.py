@@ -0,0 +1,84 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/dealloc_pause.py
+# Measures the pauses caused by freeing a large PHAMT, with and without
+# deferred freeing.
+# By Noah C. Benson
+
+"""Benchmark of the pauses caused by freeing a large PHAMT.
+
+Usage: python benchmarks/dealloc_pause.py [n] [slice]
+
+This builds a `PHAMT` of `n` (default 2,000,000) keys and drops it in several
+ways, printing for each the time taken by the `del` statement itself, the
+longest single pause spent freeing its nodes, the total time spent freeing
+them, and the number of calls over which that time was spread:
+
+ * "immediate" frees the `PHAMT` when it is dropped (the default);
+ * "reclaim(slice)" defers freeing (`set_deferred_free(0)`) and then calls
+   `reclaim(slice)` (`slice` defaults to 1,000) until the queue is empty; and
+ * "budget b" defers freeing with an allocation budget of `b`
+   (`set_deferred_free(b)`) and then performs assocs on a small `PHAMT`
+   (keeping each result alive) until the queue is empty; these pauses include
+   the time taken by the assocs themselves.
+"""
+
+import sys, gc, time
+from phamt import PHAMT, set_deferred_free, reclaim
+
+def report(label, drop, pauses):
+    print("%-16s %12.3f %12.3f %12.1f %10d" % (label, drop * 1e3,
+                                              max(pauses) * 1e3,
+                                              sum(pauses) * 1e3,
+                                              len(pauses)))
+
+def main(n=2000000, slice=1000):
+    print("phamt dealloc-pause benchmark: n = %d" % n)
+    print("%-16s %12s %12s %12s %10s" % ("mode", "drop (ms)", "max (ms)",
+                                         "total (ms)", "calls"))
+    gc.collect()
+    # Immediate freeing.
+    u = PHAMT.from_iter(range(n))
+    t0 = time.perf_counter()
+    del u
+    t = time.perf_counter() - t0
+    report("immediate", t, [t])
+    # Deferred freeing, drained by explicit calls to reclaim.
+    set_deferred_free(0)
+    try:
+        u = PHAMT.from_iter(range(n))
+        t0 = time.perf_counter()
+        del u
+        drop = time.perf_counter() - t0
+        pauses = []
+        while True:
+            t0 = time.perf_counter()
+            left = reclaim(slice)
+            pauses.append(time.perf_counter() - t0)
+            if not left: break
+        report("reclaim(%d)" % slice, drop, pauses)
+    finally:
+        set_deferred_free(None)
+    # Deferred freeing, drained by the allocations of other updates.
+    for budget in (4, 32):
+        set_deferred_free(budget)
+        try:
+            w = PHAMT.from_iter(range(1000))
+            u = PHAMT.from_iter(range(n))
+            t0 = time.perf_counter()
+            del u
+            drop = time.perf_counter() - t0
+            pauses = []
+            ws = []
+            while reclaim(0):
+                t0 = time.perf_counter()
+                ws.append(w.assoc(len(ws) % 1000, None))
+                pauses.append(time.perf_counter() - t0)
+            report("budget %d" % budget, drop, pauses)
+        finally:
+            set_deferred_free(None)
+        del ws
+
+if __name__ == '__main__':
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,83 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/fork_sharing.py
+# Measures how much of a PHAMT that a forked worker process copies, with and
+# without freezing the PHAMT first.
+# By Noah C. Benson
+
+"""Benchmark of the memory that forked workers copy from a shared PHAMT.
+
+Usage: python benchmarks/fork_sharing.py [n] [ops]
+
+This builds a `PHAMT` of `n` (default 2,000,000) keys, then forks a worker
+process for each of several workloads: `ops` (default 200,000) lookups of random
+keys; `ops` assocs to random keys (whose results are discarded); and a full
+garbage collection. Each worker measures the growth of its private dirty memory
+(from `/proc/self/smaps_rollup`, so this runs only on Linux), i.e., the pages
+that it has copied from its parent, while running its workload. This is done
+once for the `PHAMT` as built and once for its frozen copy (see
+`phamt.freeze`). Every value of the `PHAMT` is the same list, so that only the
+nodes themselves are measured, and so that the garbage collector tracks the
+nodes of the unfrozen `PHAMT`. (The parent calls `gc.freeze()` before forking
+and the worker calls `gc.unfreeze()` before collecting.) In versions of Python
+before 3.12, whose objects can't be immortal, assocs still write to the nodes
+of frozen `PHAMT`s.
+"""
+
+import os, sys, gc, random
+from array import array
+from phamt import PHAMT, freeze
+
+def private_dirty():
+    with open('/proc/self/smaps_rollup') as fl:
+        for ln in fl:
+            if ln.startswith('Private_Dirty:'):
+                return int(ln.split()[1]) * 1024
+    return 0
+
+def in_worker(fn):
+    (rd, wr) = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(rd)
+        m0 = private_dirty()
+        fn()
+        m1 = private_dirty()
+        os.write(wr, str(m1 - m0).encode())
+        os._exit(0)
+    os.close(wr)
+    with os.fdopen(rd) as fl:
+        res = int(fl.read())
+    os.waitpid(pid, 0)
+    return res
+
+def run(label, u, ks):
+    def get():
+        for k in ks: u[k]
+    def assoc():
+        for k in ks: u.assoc(k, 0)
+    def collect():
+        gc.unfreeze()
+        gc.collect()
+    for (wl, fn) in [("get", get), ("assoc", assoc), ("gc", collect)]:
+        print("%-8s %-12s %14.1f" % (label, wl, in_worker(fn) / 2**20))
+
+def main(n=2000000, ops=200000):
+    print("phamt fork-sharing benchmark: n = %d, ops = %d" % (n, ops))
+    print("%-8s %-12s %14s" % ("PHAMT", "workload", "copied (MB)"))
+    # The keys are kept in an array so that the workers don't write to them.
+    ks = array('q', [random.randrange(n) for _ in range(ops)])
+    u = PHAMT.from_iter([[]] * n)
+    gc.collect()
+    gc.freeze()
+    run("plain", u, ks)
+    gc.unfreeze()
+    u = freeze(u)
+    gc.collect()
+    gc.freeze()
+    run("frozen", u, ks)
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
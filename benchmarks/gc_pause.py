@@ -0,0 +1,54 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/gc_pause.py
+# Measures the pauses that full garbage collections incur when large PHAMTs are
+# alive.
+# By Noah C. Benson
+
+"""Benchmark of full (generation 2) garbage-collection pauses with large PHAMTs.
+
+Usage: python benchmarks/gc_pause.py [n] [repeats]
+
+For maps of `n` keys (default 5,000,000) whose values are ints (which can't
+take part in reference cycles) and whose values are lists (which can), this
+prints the number of PHAMT nodes that the garbage collector tracks and the
+time taken by `gc.collect()`. To compare two builds of `phamt`, run the script
+against each.
+"""
+
+import sys, gc, time
+from phamt import PHAMT, THAMT
+
+def bench(label, make, repeats):
+    u = make()
+    gc.collect()
+    ntracked = sum(1 for obj in gc.get_objects() if type(obj) is PHAMT)
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        gc.collect()
+        ts.append(time.perf_counter() - t0)
+    print("%-24s tracked: %10d   gc.collect(): min %8.2f ms, max %8.2f ms"
+          % (label, ntracked, 1000*min(ts), 1000*max(ts)))
+    return u
+
+def main(n=5000000, repeats=5):
+    print("phamt GC pause benchmark: n = %d" % n)
+    bench("int values (from_iter)", lambda: PHAMT.from_iter(range(n)), repeats)
+    def make_assoc():
+        u = PHAMT.empty
+        for k in range(0, 64*(n // 64), 64):
+            u = u.assoc(k, k)
+        return u
+    bench("sparse int values", make_assoc, repeats)
+    lsts = [[] for _ in range(n // 100)]
+    def make_mixed():
+        t = THAMT(PHAMT.from_iter(range(n)))
+        for (ii,l) in enumerate(lsts):
+            t[ii*100] = l
+        return t.persistent()
+    bench("1% list values", make_mixed, repeats)
+
+if __name__ == '__main__':
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,45 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/hugepage_lookup.py
+# Measures random lookups in a large PHAMT, whose cost is dominated by cache and
+# TLB misses, to compare builds with and without PHAMT_HUGEPAGE_SLABS.
+# By Noah C. Benson
+
+"""Benchmark of random lookups in a large PHAMT.
+
+Usage: python benchmarks/hugepage_lookup.py [n] [lookups] [repeats]
+
+A `PHAMT` of `n` (default 4,000,000) random keys, each mapped to itself, is
+built, and `lookups` (default 1,000,000) of its keys, in random order, are
+looked up; the number of lookups per second (the best of `repeats` runs,
+default 3) is printed. Lookups in a map this large miss the TLB on most of the
+nodes that they visit, which the huge-page slabs that a build made with
+`CFLAGS=-DPHAMT_HUGEPAGE_SLABS` (on Linux) allocates its nodes from avoid. To
+compare the two allocators, run the script against each build.
+"""
+
+import sys, time, random
+from phamt import PHAMT, THAMT, c_core
+
+def main(n=4000000, lookups=1000000, repeats=3):
+    slabs = c_core._freelists()[2]
+    print("phamt large-map lookup benchmark: n = %d, huge-page slabs %s" % (
+        n, "on" if slabs else "off"))
+    t = THAMT()
+    for k in random.sample(range(2**40), n): t[k] = k
+    u = t.persistent()
+    del t
+    ks = list(u.keys())
+    random.shuffle(ks)
+    ks = ks[:lookups]
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        for k in ks: u[k]
+        ts.append(time.perf_counter() - t0)
+    print("%-28s %8.3f Mops/s" % ("lookup", len(ks) / min(ts) / 1e6))
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,62 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/narrow_keys.py
+# Compares the PHAMTs with 64-bit keys to those with 32-bit keys (PHAMT32).
+# By Noah C. Benson
+
+"""Benchmark of the PHAMTs with 32-bit keys.
+
+Usage: python benchmarks/narrow_keys.py [n] [repeats]
+
+For the builds `phamt.c_core` (64-bit keys) and `phamt.c_core32` (32-bit keys),
+this prints the number of levels in the trie along with, for a map of `n` keys
+(default 1,000,000) that are either dense (`0` to `n-1`) or sparse (spread over
+the whole 32-bit key space), the number of bytes allocated per key (as reported
+by `tracemalloc`), the time per key to look up every key, and the time per key
+to assoc a new value onto every key of the map (the best of `repeats` runs,
+default 3).
+"""
+
+import sys, gc, random, time, tracemalloc
+from phamt import c_core, c_core32
+
+def best(fn, repeats):
+    ts = []
+    for _ in range(repeats):
+        t0 = time.perf_counter()
+        fn()
+        ts.append(time.perf_counter() - t0)
+    return min(ts)
+
+def main(n=1000000, repeats=3):
+    print("phamt narrow-key benchmark: n = %d" % n)
+    dense = list(range(n))
+    sparse = [random.randrange(1 << 32) - (1 << 31) for _ in range(n)]
+    print("%-10s %9s %6s %7s %12s %12s %12s" % ("module", "key bits", "levels",
+                                                "keys", "bytes/key",
+                                                "get (ns)", "assoc (ns)"))
+    for m in (c_core, c_core32):
+        for (label, ks) in [("dense", dense), ("sparse", sparse)]:
+            gc.collect()
+            tracemalloc.start()
+            t = m.THAMT(m.PHAMT.empty)
+            for k in ks: t[k] = k
+            u = t.persistent()
+            del t
+            nbytes = tracemalloc.get_traced_memory()[0]
+            tracemalloc.stop()
+            def get():
+                for k in ks: u[k]
+            def assoc():
+                for k in ks: u.assoc(k, None)
+            tg = best(get, repeats)
+            ta = best(assoc, repeats)
+            print("%-10s %9d %6d %7s %12.1f %12.1f %12.1f" % (
+                m.__name__.split('.')[-1], m.hash_bits, m.levels, label,
+                nbytes / n, tg / n * 1e9, ta / n * 1e9))
+            del u
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,52 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/node_memory.py
+# Measures the memory that PHAMT nodes occupy per stored element.
+# By Noah C. Benson
+
+"""Benchmark of the resident memory of PHAMT nodes.
+
+Usage: python benchmarks/node_memory.py [n]
+
+For maps of `n` keys (default 1,000,000) built in several ways, this prints the
+number of bytes allocated (as reported by `tracemalloc`) per element of the
+map. Values are `None` so that only the nodes themselves are counted. To
+compare two builds of `phamt`, run the script against each.
+"""
+
+import sys, gc, random, tracemalloc
+from phamt import PHAMT, THAMT
+
+def bench(label, make):
+    gc.collect()
+    tracemalloc.start()
+    u = make()
+    nbytes = tracemalloc.get_traced_memory()[0]
+    tracemalloc.stop()
+    print("%-24s %8.2f bytes/element" % (label, nbytes / len(u)))
+
+def main(n=1000000):
+    print("phamt node memory benchmark: n = %d" % n)
+    def make_sparse():
+        u = PHAMT.empty
+        for k in random.sample(range(1 << 40), n):
+            u = u.assoc(k, None)
+        return u
+    bench("sparse keys (assoc)", make_sparse)
+    def make_dense():
+        u = PHAMT.empty
+        for k in range(n):
+            u = u.assoc(k, None)
+        return u
+    bench("dense keys (assoc)", make_dense)
+    def make_thamt():
+        t = THAMT(PHAMT.empty)
+        for k in random.sample(range(1 << 40), n):
+            t[k] = None
+        return t.persistent()
+    bench("sparse keys (THAMT)", make_thamt)
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -0,0 +1,62 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/read_scaling.py
+# Measures how lookups into a shared PHAMT scale with the number of threads
+# performing them.
+# By Noah C. Benson
+
+"""Benchmark of concurrent lookups into a shared PHAMT.
+
+Usage: python benchmarks/read_scaling.py [n] [ops] [maxthreads]
+
+This builds a `PHAMT` of `n` (default 1,000,000) keys, then for 1, 2, 4, ...
+up to `maxthreads` (default 8) threads, has each thread perform `ops` (default
+500,000) lookups of random keys in the shared `PHAMT`, and prints the total
+lookups per second and the speedup over a single thread. This is done once for
+the `PHAMT` as built and once for its frozen copy (see `phamt.freeze`), whose
+nodes are immortal (in Python 3.12 and later), so that threads reading it don't
+contend for its reference count. Only free-threaded builds of Python (in which
+`sys._is_gil_enabled()` returns `False`) can run the threads in parallel; with
+the GIL, the speedup stays near (or below) 1.
+"""
+
+import sys, time, random, threading
+from array import array
+from phamt import PHAMT, freeze
+
+def run(u, ks, nthreads):
+    barrier = threading.Barrier(nthreads + 1)
+    def work():
+        get = u.get
+        barrier.wait()
+        for k in ks: get(k)
+        barrier.wait()
+    ths = [threading.Thread(target=work) for _ in range(nthreads)]
+    for th in ths: th.start()
+    barrier.wait()
+    t0 = time.perf_counter()
+    barrier.wait()
+    t = time.perf_counter() - t0
+    for th in ths: th.join()
+    return nthreads * len(ks) / t
+
+def main(n=1000000, ops=500000, maxthreads=8):
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print("phamt read-scaling benchmark: n = %d, ops = %d, GIL %s" % (
+        n, ops, "enabled" if gil else "disabled"))
+    print("%-8s %8s %14s %8s" % ("PHAMT", "threads", "lookups/s", "speedup"))
+    ks = array('q', [random.randrange(n) for _ in range(ops)])
+    u = PHAMT.from_iter(range(n))
+    for (label, v) in [("plain", u), ("frozen", freeze(u))]:
+        base = None
+        nthreads = 1
+        while nthreads <= maxthreads:
+            rate = run(v, ks, nthreads)
+            if base is None: base = rate
+            print("%-8s %8d %14.0f %8.2f" % (label, nthreads, rate, rate/base))
+            nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
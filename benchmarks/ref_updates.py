@@ -0,0 +1,77 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/ref_updates.py
+# Measures the rate of concurrent updates to a shared PHAMT, made under a lock
+# or through a PHAMTRef.
+# By Noah C. Benson
+
+"""Benchmark of concurrent updates to a PHAMT shared between threads.
+
+Usage: python benchmarks/ref_updates.py [n] [ops] [maxthreads]
+
+This starts with a `PHAMT` of `n` (default 100,000) keys, then for 1, 2, 4, ...
+up to `maxthreads` (default 4) threads, has each thread make `ops` (default
+100,000) updates of random keys to the shared state, and prints the total
+updates per second. The state is updated in each of three ways:
+
+ * "lock" reads the state, assocs the key, and publishes the result while
+   holding a global `threading.Lock`;
+ * "swap" calls `ref.swap(PHAMT.assoc, k, v)` on a `PHAMTRef`; and
+ * "assoc" calls `ref.assoc(k, v)` on a `PHAMTRef`, which makes the update
+   without calling back into Python.
+
+Only free-threaded builds of Python can run the threads in parallel; with the
+GIL, these differ only in the overhead of each update.
+"""
+
+import sys, time, random, threading
+from array import array
+from phamt import PHAMT, PHAMTRef
+
+class Locked(object):
+    def __init__(self, u):
+        self.state = u
+        self.lock = threading.Lock()
+    def assoc(self, k, v):
+        with self.lock:
+            self.state = self.state.assoc(k, v)
+
+def run(update, ks, nthreads):
+    barrier = threading.Barrier(nthreads + 1)
+    def work():
+        barrier.wait()
+        for k in ks: update(k)
+        barrier.wait()
+    ths = [threading.Thread(target=work) for _ in range(nthreads)]
+    for th in ths: th.start()
+    barrier.wait()
+    t0 = time.perf_counter()
+    barrier.wait()
+    t = time.perf_counter() - t0
+    for th in ths: th.join()
+    return nthreads * len(ks) / t
+
+def main(n=100000, ops=100000, maxthreads=4):
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print("phamt ref-update benchmark: n = %d, ops = %d, GIL %s" % (
+        n, ops, "enabled" if gil else "disabled"))
+    print("%-8s %8s %14s" % ("mode", "threads", "updates/s"))
+    ks = array('q', [random.randrange(n) for _ in range(ops)])
+    u = PHAMT.from_iter(range(n))
+    nthreads = 1
+    while nthreads <= maxthreads:
+        st = Locked(u)
+        rate = run(lambda k: st.assoc(k, None), ks, nthreads)
+        print("%-8s %8d %14.0f" % ("lock", nthreads, rate))
+        ref = PHAMTRef(u)
+        rate = run(lambda k: ref.swap(PHAMT.assoc, k, None), ks, nthreads)
+        print("%-8s %8d %14.0f" % ("swap", nthreads, rate))
+        ref = PHAMTRef(u)
+        rate = run(lambda k: ref.assoc(k, None), ks, nthreads)
+        print("%-8s %8d %14.0f" % ("assoc", nthreads, rate))
+        nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
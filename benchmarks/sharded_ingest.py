@@ -0,0 +1,94 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/sharded_ingest.py
+# Measures ingestion by one writer thread per partition into a THAMT guarded by
+# a lock versus a ShardedTHAMT whose shards are owned by the writers.
+# By Noah C. Benson
+
+"""Benchmark of partitioned ingestion into a shared transient map.
+
+Usage: python benchmarks/sharded_ingest.py [ops] [maxthreads]
+
+For 1, 2, 4, ... up to `maxthreads` (default 4) writer threads, each writer
+owns one partition of the key space--the keys whose top bits select one cell
+of the root of a `PHAMT`--and writes `ops` (default 200,000) random keys of
+its partition. The total writes per second and the time taken to produce the
+final `PHAMT` are printed for two maps:
+
+ * "THAMT" is one `THAMT` that each writer writes while holding a
+   `threading.Lock`; and
+ * "sharded" is a `ShardedTHAMT`, each of whose writers writes directly to
+   the `THAMT` of its own shard (`s.shard(i)`), without a lock; the final
+   `PHAMT` is made by `s.persistent()`, which joins the shards' roots.
+
+Only free-threaded builds of Python can run the writers in parallel.
+"""
+
+import sys, time, random, threading
+import phamt.c_core as core
+from phamt import THAMT, ShardedTHAMT
+
+def shard_keys(i, ops):
+    # Keys whose top root_shift bits (as unsigned hashes) are i.
+    low = core.hash_bits - core.root_shift
+    ks = [(i << low) | random.randrange(1 << low) for _ in range(ops)]
+    return [k - (1 << core.hash_bits) if k >> (core.hash_bits - 1) else k
+            for k in ks]
+
+def run(make, keys):
+    nthreads = len(keys)
+    barrier = threading.Barrier(nthreads + 1)
+    (target, finish) = make()
+    def work(i):
+        put = target(i)
+        barrier.wait()
+        for k in keys[i]: put(k)
+        barrier.wait()
+    ths = [threading.Thread(target=work, args=(i,)) for i in range(nthreads)]
+    for th in ths: th.start()
+    barrier.wait()
+    t0 = time.perf_counter()
+    barrier.wait()
+    t = time.perf_counter() - t0
+    for th in ths: th.join()
+    t0 = time.perf_counter()
+    u = finish()
+    tf = time.perf_counter() - t0
+    assert len(u) == len(set(k for ks in keys for k in ks))
+    return (sum(len(ks) for ks in keys) / t, tf)
+
+def locked():
+    t = THAMT()
+    lock = threading.Lock()
+    def target(i):
+        def put(k):
+            with lock: t[k] = None
+        return put
+    return (target, t.persistent)
+
+def sharded():
+    s = ShardedTHAMT()
+    def target(i):
+        sh = s.shard(i)
+        return lambda k: sh.__setitem__(k, None)
+    return (target, s.persistent)
+
+def main(ops=200000, maxthreads=4):
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print("phamt sharded-ingest benchmark: ops = %d, GIL %s" % (
+        ops, "enabled" if gil else "disabled"))
+    print("%-10s %8s %14s %12s" % ("map", "threads", "writes/s",
+                                   "persist (ms)"))
+    nthreads = 1
+    while nthreads <= min(maxthreads, 1 << core.root_shift):
+        keys = [shard_keys(i, ops) for i in range(nthreads)]
+        for (label, make) in [("THAMT", locked), ("sharded", sharded)]:
+            (rate, tf) = run(make, keys)
+            print("%-10s %8d %14.0f %12.3f" % (label, nthreads, rate,
+                                               tf * 1e3))
+        nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
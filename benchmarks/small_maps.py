@@ -0,0 +1,56 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/small_maps.py
+# Measures the memory and speed of many PHAMTs that each hold only a few keys.
+# By Noah C. Benson
+
+"""Benchmark of large numbers of small PHAMTs.
+
+Usage: python benchmarks/small_maps.py [m] [repeats]
+
+For `m` maps (default 100,000) of each size from 2 to 12 keys, whose keys are
+spread over the whole 64-bit key space, this prints the number of bytes
+allocated per map (as reported by `tracemalloc`) along with the time per key
+to build the maps by assoc'ing and to look up each of their keys (the best of
+`repeats` runs, default 3). To compare two builds of `phamt`, run the script
+against each.
+"""
+
+import sys, gc, random, time, tracemalloc
+from phamt import PHAMT
+
+def main(m=100000, repeats=3):
+    print("phamt small-map benchmark: m = %d" % m)
+    print("%5s %12s %12s %12s" % ("keys", "bytes/map", "assoc (ns)", "get (ns)"))
+    for n in [2, 4, 6, 8, 10, 12]:
+        keys = [[random.randrange(1 << 64) - (1 << 63) for _ in range(n)]
+                for _ in range(m)]
+        def build():
+            maps = []
+            for ks in keys:
+                u = PHAMT.empty
+                for k in ks: u = u.assoc(k, None)
+                maps.append(u)
+            return maps
+        gc.collect()
+        tracemalloc.start()
+        maps = build()
+        nbytes = tracemalloc.get_traced_memory()[0]
+        tracemalloc.stop()
+        (tb, tg) = ([], [])
+        for _ in range(repeats):
+            t0 = time.perf_counter()
+            build()
+            tb.append(time.perf_counter() - t0)
+            t0 = time.perf_counter()
+            for (u, ks) in zip(maps, keys):
+                for k in ks: u[k]
+            tg.append(time.perf_counter() - t0)
+        print("%5d %12.1f %12.1f %12.1f" % (n, nbytes / m,
+                                            min(tb) / (m*n) * 1e9,
+                                            min(tg) / (m*n) * 1e9))
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
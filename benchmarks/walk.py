@@ -0,0 +1,66 @@
+# -*- coding: utf-8 -*-
+################################################################################
+# benchmarks/walk.py
+# Measures reductions over a PHAMT by iteration versus the foreach and reduce
+# methods on 1, 2, 4, ... threads.
+# By Noah C. Benson
+
+"""Benchmark of internal traversal of a PHAMT.
+
+Usage: python benchmarks/walk.py [n] [maxthreads]
+
+The values of a `PHAMT` of `n` (default 1,000,000) random keys are summed:
+
+ * "iter" loops over the `(k, v)` items of the `PHAMT`;
+ * "foreach" calls `u.foreach(fn)`, which walks the trie directly, with an
+   `fn` that adds each value to a running total; and
+ * "reduce" calls `u.reduce(fn, 0, operator.add, nthreads)` for 1, 2, 4, ...
+   up to `maxthreads` (default 4) threads.
+
+The time taken and the items per second are printed. The threads of a walk
+only call the Python function in parallel in free-threaded builds of Python.
+"""
+
+import sys, time, random, operator
+from phamt import PHAMT
+
+def timed(fn):
+    t0 = time.perf_counter()
+    s = fn()
+    return (s, time.perf_counter() - t0)
+
+def by_iter(u):
+    s = 0
+    for (k, v) in u: s += v
+    return s
+
+def by_foreach(u):
+    total = [0]
+    def add(k, v): total[0] += v
+    u.foreach(add)
+    return total[0]
+
+def main(n=1000000, maxthreads=4):
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    ks = [random.getrandbits(63) for _ in range(n)]
+    u = PHAMT.from_arrays(ks, list(range(n)))
+    print("phamt walk benchmark: n = %d, GIL %s" % (
+        n, "enabled" if gil else "disabled"))
+    print("%-10s %8s %10s %14s" % ("method", "threads", "time (s)", "items/s"))
+    (s0, t) = timed(lambda: by_iter(u))
+    print("%-10s %8d %10.3f %14.0f" % ("iter", 1, t, len(u) / t))
+    (s, t) = timed(lambda: by_foreach(u))
+    assert s == s0
+    print("%-10s %8d %10.3f %14.0f" % ("foreach", 1, t, len(u) / t))
+    nthreads = 1
+    while nthreads <= maxthreads:
+        (s, t) = timed(lambda: u.reduce(lambda acc, k, v: acc + v, 0,
+                                        operator.add, nthreads))
+        assert s == s0
+        print("%-10s %8d %10.3f %14.0f" % ("reduce", nthreads, t, len(u) / t))
+        nthreads *= 2
+
+if __name__ == '__main__':
+    random.seed(0)
+    args = [int(a) for a in sys.argv[1:]]
+    main(*args)
@@ -7,8 +7,20 @@
 """Persistent and Transient Hash Array Mapped Trie data structures for Python.
 """
 
-try:              from .c_core  import (PHAMT, THAMT)
-except Exception: from .py_core import (PHAMT, THAMT)
+try:              from .c_core  import (PHAMT, THAMT, ShardedTHAMT, PHAMTRef,
+                                        ConcurrentTHAMT, morton_encode,
+                                        morton_decode, set_deferred_free,
+                                        reclaim, freeze)
+except Exception: from .py_core import (PHAMT, THAMT, ShardedTHAMT, PHAMTRef,
+                                        ConcurrentTHAMT, morton_encode,
+                                        morton_decode, set_deferred_free,
+                                        reclaim, freeze)
+# The PHAMTs with 32-bit and 128-bit keys are only available from the C
+# implementation.
+try:              from .c_core32 import (PHAMT as PHAMT32, THAMT as THAMT32)
+except Exception: pass
+try:              from .c_core128 import (PHAMT as PHAMT128, THAMT as THAMT128)
+except Exception: pass
 
 __version__ = "0.1.7"
 
@@ -8,19 +8,209 @@
 // various inline functions defined there.
 //#define __PHAMT_DEBUG
 
+// The optional huge-page slabs (see PHAMT_HUGEPAGE_SLABS below) need mmap's
+// MAP_ANONYMOUS and madvise, which strict C11 mode hides.
+#if defined(PHAMT_HUGEPAGE_SLABS) && !defined(_DEFAULT_SOURCE)
+#  define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <stddef.h>
+#include <string.h>
+#include <stdint.h>
 #include <Python.h>
 #include "phamt.h"
 
+// Older versions of Python lack the Py_SET_SIZE macro, which we use when
+// trimming the lists that we allocate for chunked iteration.
+#ifndef Py_SET_SIZE
+#  define Py_SET_SIZE(obj, size) (Py_SIZE(obj) = (size))
+#endif
+// The same goes for Py_SET_REFCNT, which we use when freezing nodes.
+#ifndef Py_SET_REFCNT
+#  define Py_SET_REFCNT(obj, refcnt) (Py_REFCNT(obj) = (refcnt))
+#endif
+// Freed nodes are kept on per-size-class freelists (one list for each cell
+// count, separately for nodes with and without a GC header) so that
+// write-heavy code, which frees and allocates a few short-lived nodes of only a
+// handful of sizes with every assoc, rarely reaches the allocator.
+// PHAMT_FREELIST_MAXLEN is the maximum length of each list; it may be defined
+// as 0 to disable the freelists, which are always disabled in free-threaded
+// builds of Python.
+#if defined(Py_GIL_DISABLED)
+#  undef  PHAMT_FREELIST_MAXLEN
+#  define PHAMT_FREELIST_MAXLEN 0
+#elif !defined(PHAMT_FREELIST_MAXLEN)
+#  define PHAMT_FREELIST_MAXLEN 80
+#endif
+// If PHAMT_HUGEPAGE_SLABS is defined when compiling (e.g., with
+// CFLAGS=-DPHAMT_HUGEPAGE_SLABS on Linux), then nodes without a GC header are
+// carved out of 2 MB slabs that are advised to be backed by transparent huge
+// pages, which reduces TLB misses when chasing pointers through very large
+// maps. Slab memory is never returned to the system; freed slab nodes are
+// instead kept on their (unbounded) freelists for reuse.
+#if defined(PHAMT_HUGEPAGE_SLABS) \
+    && (!defined(__linux__) || defined(Py_GIL_DISABLED))
+#  undef PHAMT_HUGEPAGE_SLABS
+#endif
+#ifdef PHAMT_HUGEPAGE_SLABS
+#  include <sys/mman.h>
+#  define PHAMT_SLAB_SIZE ((size_t)2 << 20)
+#endif
+// The number of items that the next_chunk methods gather on the stack at a
+// time before converting them into Python objects.
+#define PHAMT_CHUNK_BUFSIZE 256
+// The bulk constructors (see phamt_from_arrays) and the parallel walks (see
+// phamt_walk) run on a pool of up to PHAMT_POOL_MAXTHREADS threads (counting
+// the calling thread). The bulk constructors give each thread at least
+// PHAMT_BULK_GRAIN items, and the walks don't split subtrees of fewer than
+// PHAMT_WALK_GRAIN items.
+#ifndef PHAMT_POOL_MAXTHREADS
+#  define PHAMT_POOL_MAXTHREADS 256
+#endif
+#define PHAMT_BULK_GRAIN 4096
+#define PHAMT_WALK_GRAIN 1024
+// A worker of a walk that finds no subtree to steal naps before it looks again,
+// for up to PHAMT_WALK_NAP microseconds (see _phamt_walk_task).
+#define PHAMT_WALK_NAP 1000
+// The pool's threads don't survive a fork, so where fork() exists the child
+// forgets them (see _phamt_pool_atfork).
+#if defined(HAVE_FORK) && defined(HAVE_PTHREAD_H)
+#  include <pthread.h>
+#  define PHAMT_POOL_ATFORK
+#endif
+// In free-threaded builds of Python, PHAMTs are read and copied without any
+// locking because their nodes never change once they are persistent. THAMTs,
+// whose transient nodes are edited in place, and iterators, whose paths change
+// as they advance, are instead used only inside critical sections on them
+// (which CPython releases whenever a thread blocks, so they can't deadlock).
+// In other builds, the GIL already serializes these, and the macros are just
+// braces.
+#ifdef Py_GIL_DISABLED
+#  define PHAMT_BEGIN_LOCK(obj)   Py_BEGIN_CRITICAL_SECTION(obj)
+#  define PHAMT_BEGIN_LOCK2(a, b) Py_BEGIN_CRITICAL_SECTION2(a, b)
+#  define PHAMT_END_LOCK()        Py_END_CRITICAL_SECTION()
+#  define PHAMT_END_LOCK2()       Py_END_CRITICAL_SECTION2()
+#else
+#  define PHAMT_BEGIN_LOCK(obj)   {
+#  define PHAMT_BEGIN_LOCK2(a, b) {
+#  define PHAMT_END_LOCK()        }
+#  define PHAMT_END_LOCK2()       }
+#endif
+// This file is compiled once for each node layout (see PHAMT_NODE_SHIFT in
+// phamt.h); each build is a separate module named phamt.<PHAMT_MODULE>, which
+// is phamt.c_core by default.
+#ifndef PHAMT_MODULE
+#  define PHAMT_MODULE c_core
+#endif
+#define PHAMT_STR_(x)     #x
+#define PHAMT_STR(x)      PHAMT_STR_(x)
+#define PHAMT_CAT_(a, b)  a ## b
+#define PHAMT_CAT(a, b)   PHAMT_CAT_(a, b)
+#define PHAMT_MODULE_NAME "phamt." PHAMT_STR(PHAMT_MODULE)
+// The state of the bulk-export methods (to_dict, to_lists, keys_array, and
+// values_array) as they walk a PHAMT with phamt_foreach.
+typedef struct {
+   PyObject* keys;  // The dict or the list of keys being filled.
+   PyObject* vals;  // The list of values being filled.
+   char*     buf;   // The buffer of 64-bit numbers being filled.
+   hash_t    count; // The number of items exported so far.
+   char      kind;  // The buffer's format: 'q', 'Q', or 'd'.
+} PHAMT_export_t;
+// A job of the thread pool calls a phamt_taskfn_t once for each of its tasks;
+// worker is the index (from 0) of the pool thread that runs the task.
+typedef void (*phamt_taskfn_t)(void* arg, Py_ssize_t task, int worker);
+// An item of a bulk build.
+typedef struct {
+   hash_t key;
+   void*  val;
+} PHAMT_item_t;
+// A bulk build splits the items into buckets of adjacent keys, each of which is
+// built into its own subtrie in two passes: the first sorts the bucket and
+// records the size of each node that it needs, and the second, once the nodes
+// have been allocated, fills them in (in the same order).
+typedef struct {
+   PHAMT_item_t* items;  // The bucket's items; sorted and unique once planned.
+   Py_ssize_t    n;      // The number of items.
+   unsigned*     sizes;  // The cell counts of the nodes, in the order built.
+   Py_ssize_t    nnodes; // The number of nodes.
+   Py_ssize_t    cap;    // The capacity of sizes.
+   PHAMT_t*      nodes;  // The allocated nodes, or NULL while planning.
+   Py_ssize_t    next;   // The number of nodes filled in (or allocated).
+   PHAMT_t       root;   // The root of the bucket's subtrie, once filled.
+   uint8_t       flag_pyobject;
+   uint8_t       err;    // Set if memory ran out while planning.
+} PHAMT_bucket_t;
+// The state of a bulk build (see phamt_from_arrays).
+typedef struct {
+   const hash_t*   keys;     // The keys and values of the items.
+   void* const*    vals;
+   Py_ssize_t      n;
+   PHAMT_item_t*   items;    // The items, grouped by bucket.
+   Py_ssize_t      nchunks;  // The input is partitioned in chunks of items.
+   hash_t*         bounds;   // The least and greatest key of each chunk.
+   Py_ssize_t*     counts;   // The count (then the offset) of each bucket in
+                             // each chunk, indexed by chunk*nbuckets + bucket.
+   unsigned        shift;    // The bucket of key k is (k >> shift) & mask,
+   hash_t          mask;     // where mask is nbuckets - 1.
+   Py_ssize_t      nbuckets;
+   PHAMT_bucket_t* buckets;
+} PHAMT_bulk_t;
+// The state of a parallel walk (see phamt_walk). Each worker has a deque of
+// subtrees: it pushes and pops subtrees at the back of its own deque, and when
+// that is empty, it steals the subtree at the front of another worker's deque,
+// which is (at least as) large as any other. All of the deques are guarded by
+// one lock, which is only taken once per subtree.
+typedef struct {
+   PHAMT_t*           deques;  // Worker w's deque is deques + w*cap.
+   Py_ssize_t*        fronts;  // The indices of the first subtree of each deque
+   Py_ssize_t*        backs;   // and of the position after its last subtree.
+   Py_ssize_t         cap;
+   int                nworkers;
+   Py_ssize_t         pending; // The subtrees pushed but not yet walked.
+   numel_t            grain;
+   int                result;  // The first non-zero result of fn, if any.
+   PyThread_type_lock lock;
+   PyThread_type_lock nap;     // Always held, so that waiting on it sleeps.
+   phamt_walkfn_t     fn;
+   void*              arg;
+} PHAMT_walk_t;
+// The state of each worker in a walk of a PHAMT by the foreach or reduce
+// methods: the worker's accumulator (reduce only) and the exception that it
+// raised, if any.
+typedef struct {
+   PyObject* acc;
+#if PY_VERSION_HEX >= 0x030C0000
+   PyObject* exc;
+#else
+   PyObject* exc[3];
+#endif
+} PHAMT_pyworker_t;
+// The state of the foreach or reduce method.
+typedef struct {
+   PyObject*         fn;
+   PyObject*         initial; // NULL for foreach.
+   PHAMT_pyworker_t* workers;
+} PHAMT_pywalk_t;
 
 //==============================================================================
 // Function Declarations.
 // This section declares all this file's functions up-font, excepting the module
 // init function, which comes at the very end of the file.
 
+//------------------------------------------------------------------------------
+// Keys
+
+static inline int       _py_is_key(PyObject* key);
+static inline int       _py_key_to_hash(PyObject* key, hash_t* h);
+static inline PyObject* _py_hash_to_key(hash_t h);
+static inline PyObject* _py_hash_to_int(hash_t h);
+#if HASH_BITCOUNT > 64
+static PyObject*        _py_join64(PyObject* hi, unsigned long long lo);
+#endif
+
 //------------------------------------------------------------------------------
 // PHAMT methods
 
@@ -32,9 +222,44 @@ static int        py_phamt_contains(PHAMT_t self, PyObject* key);
 static PyObject*  py_phamt_subscript(PHAMT_t self, PyObject* key);
 static Py_ssize_t py_phamt_len(PHAMT_t self);
 static PyObject*  py_phamt_iter(PHAMT_t self);
+static PyObject*  py_phamt_keys(PHAMT_t self);
+static PyObject*  py_phamt_values(PHAMT_t self);
+static PyObject*  py_phamt_items(PHAMT_t self);
+static PyObject*  _py_phamt_newiter(PHAMT_t self, PyTypeObject* type);
+static PyObject*  py_phamt_shards(PHAMT_t self, PyObject* arg);
+static PyObject*  py_phamt_query_box(PHAMT_t self, PyObject* varargs);
+static PyObject*  py_phamt_to_dict(PHAMT_t self);
+static PyObject*  py_phamt_to_lists(PHAMT_t self);
+static PyObject*  py_phamt_keys_array(PHAMT_t self, PyObject* args,
+                                      PyObject* kw);
+static PyObject*  py_phamt_values_array(PHAMT_t self, PyObject* args,
+                                        PyObject* kw);
+static PyObject*  _py_phamt_to_array(PHAMT_t self, PyObject* dtype,
+                                     PyObject* out, char kind,
+                                     phamt_eachfn_t fn);
+static char       _py_parse_dtype(PyObject* dtype, char kind);
+static int        _py_export_dict(hash_t k, void* v, void* arg);
+static int        _py_export_lists(hash_t k, void* v, void* arg);
+static int        _py_export_keynum(hash_t k, void* v, void* arg);
+static int        _py_export_valnum(hash_t k, void* v, void* arg);
+static PyObject*  py_phamt_assoc_arrays(PHAMT_t self, PyObject* args,
+                                        PyObject* kw);
+static PyObject*  _py_phamt_bulk(PHAMT_t node, PyObject* keys,
+                                 PyObject* values, PyObject* nthreads);
+static const hash_t* _py_bulk_hashes(Py_buffer* view, Py_ssize_t n,
+                                     hash_t** hs);
+static int        _py_parse_nthreads(PyObject* obj);
+static PyObject*  py_phamt_foreach(PHAMT_t self, PyObject* args, PyObject* kw);
+static PyObject*  py_phamt_reduce(PHAMT_t self, PyObject* args, PyObject* kw);
+static int        _py_phamt_walk(PHAMT_t self, PHAMT_pywalk_t* st,
+                                 int nthreads);
+static int        _py_walk_task(PHAMT_t node, int worker, void* arg);
+static int        _py_walk_item(hash_t k, void* v, void* arg);
 static void       py_phamt_dealloc(PHAMT_t self);
 static int        py_phamt_traverse(PHAMT_t self, visitproc visit, void *arg);
 static int        py_phamt_clear(PHAMT_t self);
+static int        py_phamt_is_gc(PHAMT_t self);
+static void       py_phamt_free(void* self);
 static PyObject*  py_phamt_repr(PHAMT_t self);
 
 //------------------------------------------------------------------------------
@@ -47,6 +272,37 @@ static int       py_phamtiter_clear(PHAMT_iter_t self);
 static PyObject* py_phamtiter_repr(PHAMT_iter_t self);
 static PyObject* py_phamtiter_iter(PHAMT_iter_t self);
 static PyObject* py_phamtiter_next(PHAMT_iter_t self);
+static PyObject* py_phamtkeyiter_next(PHAMT_iter_t self);
+static PyObject* py_phamtvaliter_next(PHAMT_iter_t self);
+static void*     _py_phamtiter_step(PHAMT_iter_t self, hash_t* key);
+static PyObject* py_phamtiter_next_chunk(PHAMT_iter_t self, PyObject* arg);
+static PyObject* _py_iter_next_chunk(PHAMT_t node, PHAMT_path_t* path,
+                                     PyObject* arg);
+
+//------------------------------------------------------------------------------
+// PHAMT_view Methods
+
+static PyObject*  _py_phamtview_new(PHAMT_t phamt, PyTypeObject* type);
+static void       py_phamtview_dealloc(PHAMT_view_t self);
+static int        py_phamtview_traverse(PHAMT_view_t self, visitproc visit,
+                                        void *arg);
+static int        py_phamtview_clear(PHAMT_view_t self);
+static Py_ssize_t py_phamtview_len(PHAMT_view_t self);
+static PyObject*  py_phamtview_repr(PHAMT_view_t self);
+static PyObject*  py_phamtview_mapping(PHAMT_view_t self, void* closure);
+static PyObject*  py_phamtkeys_iter(PHAMT_view_t self);
+static int        py_phamtkeys_contains(PHAMT_view_t self, PyObject* key);
+static PyObject*  py_phamtkeys_and(PyObject* a, PyObject* b);
+static PyObject*  py_phamtkeys_or(PyObject* a, PyObject* b);
+static PyObject*  py_phamtkeys_sub(PyObject* a, PyObject* b);
+static PyObject*  py_phamtkeys_xor(PyObject* a, PyObject* b);
+static PyObject*  _py_phamtkeys_setop(PyObject* a, PyObject* b,
+                                      PHAMT_t (*op)(PHAMT_t, PHAMT_t),
+                                      const char* method);
+static PyObject*  py_phamtvalues_iter(PHAMT_view_t self);
+static int        py_phamtvalues_contains(PHAMT_view_t self, PyObject* val);
+static PyObject*  py_phamtitems_iter(PHAMT_view_t self);
+static int        py_phamtitems_contains(PHAMT_view_t self, PyObject* item);
 
 //------------------------------------------------------------------------------
 // PHAMT-type methods (i.e., classmethods)
@@ -54,6 +310,8 @@ static PyObject* py_phamtiter_next(PHAMT_iter_t self);
 static PyObject* py_PHAMT_getitem(PyObject *type, PyObject *item);
 static PyObject* py_PHAMT_from_iter(PyObject* self, PyObject *const *args,
                                     Py_ssize_t nargs);
+static PyObject* py_PHAMT_from_arrays(PyObject* type, PyObject* args,
+                                      PyObject* kw);
 
 //------------------------------------------------------------------------------
 // THAMT methods
@@ -72,6 +330,7 @@ static int        py_thamt_clear(THAMT_t self);
 static PyObject*  py_thamt_repr(THAMT_t self);
 static PyObject*  py_thamt_new(PyTypeObject *subtype, PyObject *args,
                                PyObject *kwds);
+static PyObject*  _py_thamt_from_mapping(PyObject* mapping);
 
 //------------------------------------------------------------------------------
 // THAMT_iter Methods
@@ -83,16 +342,139 @@ static int       py_thamtiter_clear(THAMT_iter_t self);
 static PyObject* py_thamtiter_repr(THAMT_iter_t self);
 static PyObject* py_thamtiter_iter(THAMT_iter_t self);
 static PyObject* py_thamtiter_next(THAMT_iter_t self);
+static PyObject* py_thamtiter_next_chunk(THAMT_iter_t self, PyObject* arg);
+
+//------------------------------------------------------------------------------
+// ShardedTHAMT Methods
+
+static PyObject*  py_sthamt_new(PyTypeObject *subtype, PyObject *args,
+                                PyObject *kw);
+static void       py_sthamt_dealloc(THAMT_sharded_t self);
+static int        py_sthamt_traverse(THAMT_sharded_t self, visitproc visit,
+                                     void *arg);
+static int        py_sthamt_clear(THAMT_sharded_t self);
+static PyObject*  py_sthamt_repr(THAMT_sharded_t self);
+static PyObject*  py_sthamt_get(THAMT_sharded_t self, PyObject* varargs);
+static PyObject*  py_sthamt_persistent(THAMT_sharded_t self);
+static PyObject*  py_sthamt_shard(THAMT_sharded_t self, PyObject* arg);
+static PyObject*  py_sthamt_shard_of(THAMT_sharded_t self, PyObject* key);
+static PyObject*  py_sthamt_nshards(THAMT_sharded_t self, void* closure);
+static int        py_sthamt_contains(THAMT_sharded_t self, PyObject* key);
+static PyObject*  py_sthamt_subscript(THAMT_sharded_t self, PyObject* key);
+static int        py_sthamt_ass_subscript(THAMT_sharded_t self, PyObject *key,
+                                          PyObject* val);
+static Py_ssize_t py_sthamt_len(THAMT_sharded_t self);
+static PyObject*  py_sthamt_iter(THAMT_sharded_t self);
+static THAMT_t    _py_sthamt_shard(THAMT_sharded_t self, PyObject* key);
+
+//------------------------------------------------------------------------------
+// PHAMTRef Methods
+
+static PyObject*  py_phamtref_new(PyTypeObject *subtype, PyObject *args,
+                                  PyObject *kw);
+static void       py_phamtref_dealloc(PHAMT_ref_t self);
+static int        py_phamtref_traverse(PHAMT_ref_t self, visitproc visit,
+                                       void *arg);
+static int        py_phamtref_clear(PHAMT_ref_t self);
+static PyObject*  py_phamtref_repr(PHAMT_ref_t self);
+static PyObject*  py_phamtref_get(PHAMT_ref_t self);
+static PyObject*  py_phamtref_compare_and_set(PHAMT_ref_t self,
+                                              PyObject* varargs);
+static PyObject*  py_phamtref_reset(PHAMT_ref_t self, PyObject* arg);
+static PyObject*  py_phamtref_swap(PHAMT_ref_t self, PyObject* varargs);
+static PyObject*  py_phamtref_assoc(PHAMT_ref_t self, PyObject* varargs);
+static PyObject*  py_phamtref_dissoc(PHAMT_ref_t self, PyObject* varargs);
+
+//------------------------------------------------------------------------------
+// ConcurrentTHAMT Methods
+
+static void       py_inode_dealloc(PHAMT_inode_t self);
+static int        py_inode_traverse(PHAMT_inode_t self, visitproc visit,
+                                    void *arg);
+static int        py_inode_clear(PHAMT_inode_t self);
+static PyObject*  py_cthamt_new(PyTypeObject *subtype, PyObject *args,
+                                PyObject *kw);
+static void       py_cthamt_dealloc(THAMT_concurrent_t self);
+static int        py_cthamt_traverse(THAMT_concurrent_t self, visitproc visit,
+                                     void *arg);
+static int        py_cthamt_clear(THAMT_concurrent_t self);
+static PyObject*  py_cthamt_repr(THAMT_concurrent_t self);
+static PyObject*  py_cthamt_get(THAMT_concurrent_t self, PyObject* varargs);
+static PyObject*  py_cthamt_snapshot(THAMT_concurrent_t self);
+static PyObject*  py_cthamt_persistent(THAMT_concurrent_t self);
+static int        py_cthamt_contains(THAMT_concurrent_t self, PyObject* key);
+static PyObject*  py_cthamt_subscript(THAMT_concurrent_t self, PyObject* key);
+static int        py_cthamt_ass_subscript(THAMT_concurrent_t self,
+                                          PyObject *key, PyObject* val);
+static Py_ssize_t py_cthamt_len(THAMT_concurrent_t self);
+static PyObject*  py_cthamt_iter(THAMT_concurrent_t self);
 
 //------------------------------------------------------------------------------
 // THAMT-type methods (i.e., classmethods)
 
 static PyObject* py_THAMT_getitem(PyObject *type, PyObject *item);
 
+//------------------------------------------------------------------------------
+// Node allocation
+
+static inline PHAMT_t _phamt_freelist_pop(int gc, unsigned ncells);
+static size_t         _phamt_frozen_size(PHAMT_t node);
+static PHAMT_t        _phamt_freeze_into(PHAMT_t node, char** next);
+static inline int     _phamt_freelist_push(PHAMT_t node);
+static void           _phamt_clear_freelists(void);
+#ifdef PHAMT_HUGEPAGE_SLABS
+static void*          _phamt_slab_alloc(size_t size);
+#endif
+static inline int     _phamt_reclaim_push(PHAMT_t node);
+static Py_ssize_t     _phamt_reclaim(Py_ssize_t budget);
+static inline void    _phamt_reclaim_due(void);
+static void           _phamt_reclaim_pay(void);
+
+//------------------------------------------------------------------------------
+// Bulk construction
+
+static void    _phamt_pool_thread(void* arg);
+static void    _phamt_pool_work(int worker);
+static void    _phamt_pool_run(int nthreads, Py_ssize_t ntasks,
+                               phamt_taskfn_t fn, void* arg);
+#ifdef PHAMT_POOL_ATFORK
+static void    _phamt_pool_atfork(void);
+#endif
+static void    _phamt_sort_items(PHAMT_item_t* items, PHAMT_item_t* tmp,
+                                 Py_ssize_t n);
+static PHAMT_t _phamt_bulk_twig(PHAMT_scratch_t* scratch,
+                                const PHAMT_item_t* items, Py_ssize_t n,
+                                uint8_t flag_pyobject);
+static PHAMT_t _phamt_bulk_emit(PHAMT_bucket_t* bk, PHAMT_t node);
+static PHAMT_t _phamt_bulk_node(PHAMT_bucket_t* bk, const PHAMT_item_t* items,
+                                Py_ssize_t n);
+static void    _phamt_bulk_discard(PHAMT_t node);
+static void    _phamt_bulk_range(void* arg, Py_ssize_t chunk, int worker);
+static void    _phamt_bulk_count(void* arg, Py_ssize_t chunk, int worker);
+static void    _phamt_bulk_scatter(void* arg, Py_ssize_t chunk, int worker);
+static void    _phamt_bulk_plan(void* arg, Py_ssize_t bucket, int worker);
+static void    _phamt_bulk_fill(void* arg, Py_ssize_t bucket, int worker);
+
+//------------------------------------------------------------------------------
+// Parallel traversal
+
+static inline int _phamt_walk_splits(PHAMT_walk_t* st, PHAMT_t node);
+static void       _phamt_walk_task(void* arg, Py_ssize_t task, int worker);
+static int        _phamt_walk_each(PHAMT_t node, int worker, void* arg);
+
 //------------------------------------------------------------------------------
 // Module-level Functions
 
-static void py_phamtmod_free(void* mod);
+static void      py_phamtmod_free(void* mod);
+static PyObject* py_morton_encode(PyObject* self, PyObject* arg);
+static PyObject* py_morton_decode(PyObject* self, PyObject* varargs);
+static PyObject* py_set_deferred_free(PyObject* self, PyObject* arg);
+static PyObject* py_reclaim(PyObject* self, PyObject* varargs);
+static PyObject* py_freeze(PyObject* self, PyObject* arg);
+static PyObject* py_ctype_build(PyObject* self, PyObject* varargs);
+static PyObject* py_freelists(PyObject* self, PyObject* varargs);
+static int       _py_parse_coords(PyObject* seq, hash_t* coords,
+                                  unsigned* ndim);
 
 
 //==============================================================================
@@ -109,6 +491,75 @@ static PHAMT_t PHAMT_EMPTY = NULL;
 // The empty (C type) PHAMT.
 static PHAMT_t PHAMT_EMPTY_CTYPE = NULL;
 
+//------------------------------------------------------------------------------
+// Node Allocation
+
+// The freelists of nodes, indexed by flag_gc and then by number of cells. Each
+// list is linked through the first cell of its nodes (nodes with 0 cells are
+// never put on a freelist).
+static PHAMT_t  phamt_freelist[2][PHAMT_ANY_MAXCELLS + 1];
+static unsigned phamt_numfree[2][PHAMT_ANY_MAXCELLS + 1];
+#ifdef PHAMT_HUGEPAGE_SLABS
+// The unused part of the current slab.
+static char* phamt_slab_next = NULL;
+static char* phamt_slab_end = NULL;
+#endif
+
+//------------------------------------------------------------------------------
+// Deferred Freeing
+
+// The number of queued nodes that each allocated node pays for freeing, or -1
+// if dead nodes are freed immediately (the default).
+static Py_ssize_t phamt_reclaim_budget = -1;
+// The number of queued nodes that have been paid for but not yet freed.
+static Py_ssize_t phamt_reclaim_paid = 0;
+// The reclamation queue of dead nodes whose children have not been released.
+// It is drained last-in first-out, so that while a large PHAMT is being freed
+// it holds little more than the frontier of a depth-first walk of the PHAMT.
+static PHAMT_t*   phamt_reclaim_queue = NULL;
+static Py_ssize_t phamt_reclaim_len = 0;
+static Py_ssize_t phamt_reclaim_cap = 0;
+// In free-threaded builds, the variables above are guarded by a mutex, except
+// that phamt_reclaim_budget is also read atomically without it so that nodes
+// can be allocated and freed without taking the mutex unless freeing is
+// deferred.
+#ifdef Py_GIL_DISABLED
+static PyMutex phamt_reclaim_mutex = {0};
+#  define PHAMT_RECLAIM_LOCK()   PyMutex_Lock(&phamt_reclaim_mutex)
+#  define PHAMT_RECLAIM_UNLOCK() PyMutex_Unlock(&phamt_reclaim_mutex)
+#  define PHAMT_RECLAIM_BUDGET() \
+      _Py_atomic_load_ssize_relaxed(&phamt_reclaim_budget)
+#  define PHAMT_RECLAIM_SET_BUDGET(b) \
+      _Py_atomic_store_ssize_relaxed(&phamt_reclaim_budget, (b))
+#else
+#  define PHAMT_RECLAIM_LOCK()
+#  define PHAMT_RECLAIM_UNLOCK()
+#  define PHAMT_RECLAIM_BUDGET()      phamt_reclaim_budget
+#  define PHAMT_RECLAIM_SET_BUDGET(b) (phamt_reclaim_budget = (b))
+#endif
+
+//------------------------------------------------------------------------------
+// The Thread Pool
+
+// The worker threads of the bulk constructors and of the parallel walks are
+// started on demand and then kept for later jobs, each waiting on its own go
+// lock. They run without the GIL, and only the tasks of a walk whose callback
+// needs the Python API attach a thread state to them. The pool runs one job at
+// a time: the thread that holds the busy lock runs the job as worker 0,
+// alongside the workers 1 and up, and each worker claims the job's tasks in
+// order until none are left; the last worker to finish releases the done lock.
+// A thread that finds the pool busy runs its job alone.
+static PyThread_type_lock phamt_pool_mutex = NULL; // Guards the two counters.
+static PyThread_type_lock phamt_pool_busy = NULL;
+static PyThread_type_lock phamt_pool_done = NULL;
+static PyThread_type_lock phamt_pool_go[PHAMT_POOL_MAXTHREADS];
+static int            phamt_pool_size = 0;   // The number of workers started.
+static int            phamt_pool_active = 0; // Workers yet to finish the job.
+static Py_ssize_t     phamt_pool_next = 0;   // The job's next unclaimed task.
+static Py_ssize_t     phamt_pool_ntasks = 0;
+static phamt_taskfn_t phamt_pool_fn = NULL;
+static void*          phamt_pool_arg = NULL;
+
 //------------------------------------------------------------------------------
 // Python Data Structures
 // These values represent data structures that define the Python-C interface for
@@ -128,6 +579,38 @@ static PyMethodDef PHAMT_methods[] = {
    {"from_iter",         (PyCFunction)py_PHAMT_from_iter,
                          METH_FASTCALL|METH_CLASS,
                          PyDoc_STR(PHAMT_FROM_ITER_DOCSTRING)},
+   {"from_arrays",       (PyCFunction)(void(*)(void))py_PHAMT_from_arrays,
+                         METH_VARARGS|METH_KEYWORDS|METH_CLASS,
+                         PyDoc_STR(PHAMT_FROM_ARRAYS_DOCSTRING)},
+   {"assoc_arrays",      (PyCFunction)(void(*)(void))py_phamt_assoc_arrays,
+                         METH_VARARGS|METH_KEYWORDS,
+                         PyDoc_STR(PHAMT_ASSOC_ARRAYS_DOCSTRING)},
+   {"foreach",           (PyCFunction)(void(*)(void))py_phamt_foreach,
+                         METH_VARARGS|METH_KEYWORDS,
+                         PyDoc_STR(PHAMT_FOREACH_DOCSTRING)},
+   {"reduce",            (PyCFunction)(void(*)(void))py_phamt_reduce,
+                         METH_VARARGS|METH_KEYWORDS,
+                         PyDoc_STR(PHAMT_REDUCE_DOCSTRING)},
+   {"query_box",         (PyCFunction)py_phamt_query_box, METH_VARARGS,
+                         PyDoc_STR(PHAMT_QUERY_BOX_DOCSTRING)},
+   {"shards",            (PyCFunction)py_phamt_shards, METH_O,
+                         PyDoc_STR(PHAMT_SHARDS_DOCSTRING)},
+   {"to_dict",           (PyCFunction)py_phamt_to_dict, METH_NOARGS,
+                         PyDoc_STR(PHAMT_TO_DICT_DOCSTRING)},
+   {"to_lists",          (PyCFunction)py_phamt_to_lists, METH_NOARGS,
+                         PyDoc_STR(PHAMT_TO_LISTS_DOCSTRING)},
+   {"keys_array",        (PyCFunction)(void(*)(void))py_phamt_keys_array,
+                         METH_VARARGS|METH_KEYWORDS,
+                         PyDoc_STR(PHAMT_KEYS_ARRAY_DOCSTRING)},
+   {"values_array",      (PyCFunction)(void(*)(void))py_phamt_values_array,
+                         METH_VARARGS|METH_KEYWORDS,
+                         PyDoc_STR(PHAMT_VALUES_ARRAY_DOCSTRING)},
+   {"keys",              (PyCFunction)py_phamt_keys, METH_NOARGS,
+                         PyDoc_STR(PHAMT_KEYS_DOCSTRING)},
+   {"values",            (PyCFunction)py_phamt_values, METH_NOARGS,
+                         PyDoc_STR(PHAMT_VALUES_DOCSTRING)},
+   {"items",             (PyCFunction)py_phamt_items, METH_NOARGS,
+                         PyDoc_STR(PHAMT_ITEMS_DOCSTRING)},
    {NULL, NULL, 0, NULL}
 };
 // The PHAMT implementation of the sequence interface.
@@ -153,7 +636,7 @@ static PyMappingMethods PHAMT_as_mapping = {
 static PyTypeObject PHAMT_type = {
    //PyVarObject_HEAD_INIT(&PyType_Type, 0)
    PyVarObject_HEAD_INIT(NULL, 0)
-   "phamt.c_core.PHAMT",
+   PHAMT_MODULE_NAME ".PHAMT",
    .tp_doc = PyDoc_STR(PHAMT_DOCSTRING),
    .tp_basicsize = PHAMT_SIZE,
    .tp_itemsize = sizeof(void*),
@@ -166,14 +649,22 @@ static PyTypeObject PHAMT_type = {
    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
    .tp_traverse = (traverseproc)py_phamt_traverse,
    .tp_clear = (inquiry)py_phamt_clear,
+   .tp_is_gc = (inquiry)py_phamt_is_gc,
+   .tp_free = (freefunc)py_phamt_free,
    .tp_repr = (reprfunc)py_phamt_repr,
    .tp_str = (reprfunc)py_phamt_repr
 };
+// The PHAMT_iter methods.
+static PyMethodDef PHAMT_iter_methods[] = {
+   {"next_chunk",        (PyCFunction)py_phamtiter_next_chunk, METH_O,
+                         PyDoc_STR(PHAMT_ITER_NEXT_CHUNK_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
 // The PHAMT_iter Type object data.
 static PyTypeObject PHAMT_iter_type = {
    //PyVarObject_HEAD_INIT(&PyType_Type, 0)
    PyVarObject_HEAD_INIT(NULL, 0)
-   .tp_name = "phamt.c_core.PHAMT_iter",
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_iter",
    .tp_basicsize = sizeof(struct PHAMT_iter),
    .tp_itemsize = 0,
    .tp_dealloc = (destructor)py_phamtiter_dealloc,
@@ -184,6 +675,123 @@ static PyTypeObject PHAMT_iter_type = {
    .tp_clear = (inquiry)py_phamtiter_clear,
    .tp_iter = (getiterfunc)py_phamtiter_iter,
    .tp_iternext = (iternextfunc)py_phamtiter_next,
+   .tp_methods = PHAMT_iter_methods,
+};
+// The PHAMT_keyiter Type object data; this type shares the PHAMT_iter struct
+// but yields only the keys.
+static PyTypeObject PHAMT_keyiter_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_keyiter",
+   .tp_basicsize = sizeof(struct PHAMT_iter),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_phamtiter_dealloc,
+   .tp_repr = (reprfunc)py_phamtiter_repr,
+   .tp_str = (reprfunc)py_phamtiter_repr,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_phamtiter_traverse,
+   .tp_clear = (inquiry)py_phamtiter_clear,
+   .tp_iter = (getiterfunc)py_phamtiter_iter,
+   .tp_iternext = (iternextfunc)py_phamtkeyiter_next,
+   .tp_methods = PHAMT_iter_methods,
+};
+// The PHAMT_valiter Type object data; this type shares the PHAMT_iter struct
+// but yields only the values.
+static PyTypeObject PHAMT_valiter_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_valiter",
+   .tp_basicsize = sizeof(struct PHAMT_iter),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_phamtiter_dealloc,
+   .tp_repr = (reprfunc)py_phamtiter_repr,
+   .tp_str = (reprfunc)py_phamtiter_repr,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_phamtiter_traverse,
+   .tp_clear = (inquiry)py_phamtiter_clear,
+   .tp_iter = (getiterfunc)py_phamtiter_iter,
+   .tp_iternext = (iternextfunc)py_phamtvaliter_next,
+   .tp_methods = PHAMT_iter_methods,
+};
+
+// PHAMT views .................................................................
+// The attributes shared by all the PHAMT view types.
+static PyGetSetDef PHAMT_view_getset[] = {
+   {"mapping", (getter)py_phamtview_mapping, NULL,
+    PyDoc_STR("The PHAMT object that the view refers to."), NULL},
+   {NULL, NULL, NULL, NULL, NULL}
+};
+// The PHAMT_keys implementation of the number interface (for set operations).
+static PyNumberMethods PHAMT_keys_as_number = {
+   .nb_subtract = (binaryfunc)py_phamtkeys_sub,
+   .nb_and = (binaryfunc)py_phamtkeys_and,
+   .nb_xor = (binaryfunc)py_phamtkeys_xor,
+   .nb_or = (binaryfunc)py_phamtkeys_or,
+};
+// The PHAMT_keys implementation of the sequence interface.
+static PySequenceMethods PHAMT_keys_as_sequence = {
+   .sq_length = (lenfunc)py_phamtview_len,
+   .sq_contains = (objobjproc)py_phamtkeys_contains,
+};
+// The PHAMT_keys Type object data.
+static PyTypeObject PHAMT_keys_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_keys",
+   .tp_doc = PyDoc_STR(PHAMT_KEYS_DOCSTRING),
+   .tp_basicsize = sizeof(struct PHAMT_view),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_phamtview_dealloc,
+   .tp_repr = (reprfunc)py_phamtview_repr,
+   .tp_str = (reprfunc)py_phamtview_repr,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_phamtview_traverse,
+   .tp_clear = (inquiry)py_phamtview_clear,
+   .tp_getset = PHAMT_view_getset,
+   .tp_iter = (getiterfunc)py_phamtkeys_iter,
+   .tp_as_number = &PHAMT_keys_as_number,
+   .tp_as_sequence = &PHAMT_keys_as_sequence,
+};
+// The PHAMT_values implementation of the sequence interface.
+static PySequenceMethods PHAMT_values_as_sequence = {
+   .sq_length = (lenfunc)py_phamtview_len,
+   .sq_contains = (objobjproc)py_phamtvalues_contains,
+};
+// The PHAMT_values Type object data.
+static PyTypeObject PHAMT_values_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_values",
+   .tp_doc = PyDoc_STR(PHAMT_VALUES_DOCSTRING),
+   .tp_basicsize = sizeof(struct PHAMT_view),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_phamtview_dealloc,
+   .tp_repr = (reprfunc)py_phamtview_repr,
+   .tp_str = (reprfunc)py_phamtview_repr,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_phamtview_traverse,
+   .tp_clear = (inquiry)py_phamtview_clear,
+   .tp_getset = PHAMT_view_getset,
+   .tp_iter = (getiterfunc)py_phamtvalues_iter,
+   .tp_as_sequence = &PHAMT_values_as_sequence,
+};
+// The PHAMT_items implementation of the sequence interface.
+static PySequenceMethods PHAMT_items_as_sequence = {
+   .sq_length = (lenfunc)py_phamtview_len,
+   .sq_contains = (objobjproc)py_phamtitems_contains,
+};
+// The PHAMT_items Type object data.
+static PyTypeObject PHAMT_items_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMT_items",
+   .tp_doc = PyDoc_STR(PHAMT_ITEMS_DOCSTRING),
+   .tp_basicsize = sizeof(struct PHAMT_view),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_phamtview_dealloc,
+   .tp_repr = (reprfunc)py_phamtview_repr,
+   .tp_str = (reprfunc)py_phamtview_repr,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_phamtview_traverse,
+   .tp_clear = (inquiry)py_phamtview_clear,
+   .tp_getset = PHAMT_view_getset,
+   .tp_iter = (getiterfunc)py_phamtitems_iter,
+   .tp_as_sequence = &PHAMT_items_as_sequence,
 };
 
 // THAMTs ......................................................................
@@ -220,7 +828,7 @@ static PyMappingMethods THAMT_as_mapping = {
 static PyTypeObject THAMT_type = {
    //PyVarObject_HEAD_INIT(&PyType_Type, 0)
    PyVarObject_HEAD_INIT(NULL, 0)
-   "phamt.c_core.THAMT",
+   PHAMT_MODULE_NAME ".THAMT",
    .tp_doc = PyDoc_STR(THAMT_DOCSTRING),
    .tp_basicsize = sizeof(struct THAMT),
    .tp_itemsize = 0,
@@ -238,11 +846,17 @@ static PyTypeObject THAMT_type = {
    .tp_repr = (reprfunc)py_thamt_repr,
    .tp_str = (reprfunc)py_thamt_repr,
 };
+// The THAMT_iter methods.
+static PyMethodDef THAMT_iter_methods[] = {
+   {"next_chunk",        (PyCFunction)py_thamtiter_next_chunk, METH_O,
+                         PyDoc_STR(PHAMT_ITER_NEXT_CHUNK_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
 // The THAMT_iter Type object data.
 static PyTypeObject THAMT_iter_type = {
    //PyVarObject_HEAD_INIT(&PyType_Type, 0)
    PyVarObject_HEAD_INIT(NULL, 0)
-   .tp_name = "phamt.c_core.THAMT_iter",
+   .tp_name = PHAMT_MODULE_NAME ".THAMT_iter",
    .tp_basicsize = sizeof(struct THAMT_iter),
    .tp_itemsize = 0,
    .tp_dealloc = (destructor)py_thamtiter_dealloc,
@@ -253,15 +867,192 @@ static PyTypeObject THAMT_iter_type = {
    .tp_clear = (inquiry)py_thamtiter_clear,
    .tp_iter = (getiterfunc)py_thamtiter_iter,
    .tp_iternext = (iternextfunc)py_thamtiter_next,
+   .tp_methods = THAMT_iter_methods,
+};
+
+// ShardedTHAMTs ...............................................................
+// The ShardedTHAMT methods.
+static PyMethodDef THAMT_sharded_methods[] = {
+   {"get",               (PyCFunction)py_sthamt_get, METH_VARARGS,
+                         NULL},
+   {"persistent",        (PyCFunction)py_sthamt_persistent, METH_NOARGS,
+                         THAMT_PERSISTENT_DOCSTRING},
+   {"shard",             (PyCFunction)py_sthamt_shard, METH_O,
+                         PyDoc_STR(SHARDED_THAMT_SHARD_DOCSTRING)},
+   {"shard_of",          (PyCFunction)py_sthamt_shard_of, METH_O,
+                         PyDoc_STR(SHARDED_THAMT_SHARD_OF_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
+// The ShardedTHAMT properties.
+static PyGetSetDef THAMT_sharded_getset[] = {
+   {"nshards", (getter)py_sthamt_nshards, NULL,
+    PyDoc_STR("The number of shards of the ShardedTHAMT."), NULL},
+   {NULL, NULL, NULL, NULL, NULL}
+};
+// The ShardedTHAMT implementation of the sequence interface.
+static PySequenceMethods THAMT_sharded_as_sequence = {
+   0,                              // sq_length
+   0,                              // sq_concat
+   0,                              // sq_repeat
+   0,                              // sq_item
+   0,                              // sq_slice
+   0,                              // sq_ass_item
+   0,                              // sq_ass_slice
+   (objobjproc)py_sthamt_contains, // sq_contains
+   0,                              // sq_inplace_concat
+   0,                              // sq_inplace_repeat
+};
+// The ShardedTHAMT implementation of the Mapping interface.
+static PyMappingMethods THAMT_sharded_as_mapping = {
+   (lenfunc)py_sthamt_len,                // mp_length
+   (binaryfunc)py_sthamt_subscript,       // mp_subscript
+   (objobjargproc)py_sthamt_ass_subscript // mp_ass_subscript
+};
+// The ShardedTHAMT Type object data.
+static PyTypeObject THAMT_sharded_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".ShardedTHAMT",
+   .tp_doc = PyDoc_STR(SHARDED_THAMT_DOCSTRING),
+   .tp_basicsize = sizeof(struct THAMT_sharded),
+   .tp_itemsize = 0,
+   .tp_methods = THAMT_sharded_methods,
+   .tp_getset = THAMT_sharded_getset,
+   .tp_as_mapping = &THAMT_sharded_as_mapping,
+   .tp_as_sequence = &THAMT_sharded_as_sequence,
+   .tp_iter = (getiterfunc)py_sthamt_iter,
+   .tp_dealloc = (destructor)py_sthamt_dealloc,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_sthamt_traverse,
+   .tp_clear = (inquiry)py_sthamt_clear,
+   .tp_new = (newfunc)py_sthamt_new,
+   .tp_repr = (reprfunc)py_sthamt_repr,
+   .tp_str = (reprfunc)py_sthamt_repr,
+};
+
+// PHAMTRefs ...................................................................
+// The PHAMTRef methods.
+static PyMethodDef PHAMT_ref_methods[] = {
+   {"get",               (PyCFunction)py_phamtref_get, METH_NOARGS,
+                         PyDoc_STR(PHAMTREF_GET_DOCSTRING)},
+   {"compare_and_set",   (PyCFunction)py_phamtref_compare_and_set, METH_VARARGS,
+                         PyDoc_STR(PHAMTREF_COMPARE_AND_SET_DOCSTRING)},
+   {"reset",             (PyCFunction)py_phamtref_reset, METH_O,
+                         PyDoc_STR(PHAMTREF_RESET_DOCSTRING)},
+   {"swap",              (PyCFunction)py_phamtref_swap, METH_VARARGS,
+                         PyDoc_STR(PHAMTREF_SWAP_DOCSTRING)},
+   {"assoc",             (PyCFunction)py_phamtref_assoc, METH_VARARGS,
+                         PyDoc_STR(PHAMTREF_ASSOC_DOCSTRING)},
+   {"dissoc",            (PyCFunction)py_phamtref_dissoc, METH_VARARGS,
+                         PyDoc_STR(PHAMTREF_DISSOC_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
+// The PHAMTRef Type object data.
+static PyTypeObject PHAMT_ref_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".PHAMTRef",
+   .tp_doc = PyDoc_STR(PHAMTREF_DOCSTRING),
+   .tp_basicsize = sizeof(struct PHAMT_ref),
+   .tp_itemsize = 0,
+   .tp_methods = PHAMT_ref_methods,
+   .tp_dealloc = (destructor)py_phamtref_dealloc,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   // The referenced PHAMT may contain the PHAMTRef itself.
+   .tp_traverse = (traverseproc)py_phamtref_traverse,
+   .tp_clear = (inquiry)py_phamtref_clear,
+   .tp_new = (newfunc)py_phamtref_new,
+   .tp_repr = (reprfunc)py_phamtref_repr,
+   .tp_str = (reprfunc)py_phamtref_repr,
+};
+
+// ConcurrentTHAMTs ............................................................
+// The I-node Type object data. I-nodes are never given to Python code; they
+// are Python objects so that the C-nodes that hold them can release them and
+// the garbage collector can visit them like any other cell.
+static PyTypeObject PHAMT_inode_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".ConcurrentTHAMTNode",
+   .tp_doc = PyDoc_STR("An I-node of a ConcurrentTHAMT."),
+   .tp_basicsize = sizeof(struct PHAMT_inode),
+   .tp_itemsize = 0,
+   .tp_dealloc = (destructor)py_inode_dealloc,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_inode_traverse,
+   .tp_clear = (inquiry)py_inode_clear,
+};
+// The ConcurrentTHAMT methods.
+static PyMethodDef THAMT_concurrent_methods[] = {
+   {"get",               (PyCFunction)py_cthamt_get, METH_VARARGS,
+                         NULL},
+   {"snapshot",          (PyCFunction)py_cthamt_snapshot, METH_NOARGS,
+                         PyDoc_STR(CONCURRENT_THAMT_SNAPSHOT_DOCSTRING)},
+   {"persistent",        (PyCFunction)py_cthamt_persistent, METH_NOARGS,
+                         PyDoc_STR(CONCURRENT_THAMT_PERSISTENT_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
+// The ConcurrentTHAMT implementation of the sequence interface.
+static PySequenceMethods THAMT_concurrent_as_sequence = {
+   0,                              // sq_length
+   0,                              // sq_concat
+   0,                              // sq_repeat
+   0,                              // sq_item
+   0,                              // sq_slice
+   0,                              // sq_ass_item
+   0,                              // sq_ass_slice
+   (objobjproc)py_cthamt_contains, // sq_contains
+   0,                              // sq_inplace_concat
+   0,                              // sq_inplace_repeat
+};
+// The ConcurrentTHAMT implementation of the Mapping interface.
+static PyMappingMethods THAMT_concurrent_as_mapping = {
+   (lenfunc)py_cthamt_len,                // mp_length
+   (binaryfunc)py_cthamt_subscript,       // mp_subscript
+   (objobjargproc)py_cthamt_ass_subscript // mp_ass_subscript
+};
+// The ConcurrentTHAMT Type object data.
+static PyTypeObject THAMT_concurrent_type = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   .tp_name = PHAMT_MODULE_NAME ".ConcurrentTHAMT",
+   .tp_doc = PyDoc_STR(CONCURRENT_THAMT_DOCSTRING),
+   .tp_basicsize = sizeof(struct THAMT_concurrent),
+   .tp_itemsize = 0,
+   .tp_methods = THAMT_concurrent_methods,
+   .tp_as_mapping = &THAMT_concurrent_as_mapping,
+   .tp_as_sequence = &THAMT_concurrent_as_sequence,
+   .tp_iter = (getiterfunc)py_cthamt_iter,
+   .tp_dealloc = (destructor)py_cthamt_dealloc,
+   .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+   .tp_traverse = (traverseproc)py_cthamt_traverse,
+   .tp_clear = (inquiry)py_cthamt_clear,
+   .tp_new = (newfunc)py_cthamt_new,
+   .tp_repr = (reprfunc)py_cthamt_repr,
+   .tp_str = (reprfunc)py_cthamt_repr,
 };
 
+// The phamt.c_core module functions.
+static PyMethodDef phamt_pymodule_methods[] = {
+   {"morton_encode",     (PyCFunction)py_morton_encode, METH_O,
+                         PyDoc_STR(MORTON_ENCODE_DOCSTRING)},
+   {"morton_decode",     (PyCFunction)py_morton_decode, METH_VARARGS,
+                         PyDoc_STR(MORTON_DECODE_DOCSTRING)},
+   {"set_deferred_free", (PyCFunction)py_set_deferred_free, METH_O,
+                         PyDoc_STR(SET_DEFERRED_FREE_DOCSTRING)},
+   {"reclaim",           (PyCFunction)py_reclaim, METH_VARARGS,
+                         PyDoc_STR(RECLAIM_DOCSTRING)},
+   {"freeze",            (PyCFunction)py_freeze, METH_O,
+                         PyDoc_STR(FREEZE_DOCSTRING)},
+   {"_ctype_build",      (PyCFunction)py_ctype_build, METH_VARARGS,
+                         PyDoc_STR(CTYPE_BUILD_DOCSTRING)},
+   {"_freelists",        (PyCFunction)py_freelists, METH_VARARGS,
+                         PyDoc_STR(FREELISTS_DOCSTRING)},
+   {NULL, NULL, 0, NULL}
+};
 // The phamt.c_core module data.
 static struct PyModuleDef phamt_pymodule = {
    PyModuleDef_HEAD_INIT,
-   "c_core",
+   PHAMT_STR(PHAMT_MODULE),
    NULL,
    -1,
-   NULL,
+   phamt_pymodule_methods,
    NULL,
    NULL,
    NULL,
@@ -274,6 +1065,120 @@ static struct PyModuleDef phamt_pymodule = {
 // This section contains the implementatin of the PHAMT methods and the PHAMT
 // type functions for the Python-C interface.
 
+//------------------------------------------------------------------------------
+// Keys
+
+// _py_is_key(key)
+// Yields 1 if key has a type that PHAMT keys may have and 0 otherwise. Keys are
+// Python integers; with 128-bit hashes, (hi, lo) tuples are also keys.
+static inline int _py_is_key(PyObject* key)
+{
+#if HASH_BITCOUNT > 64
+   if (PyTuple_Check(key)) return 1;
+#endif
+   return PyLong_Check(key);
+}
+// _py_key_to_hash(key, h)
+// Converts the Python integer key into its hash, which is put in h. Yields 1 on
+// success and 0, without setting an exception, if key lies outside of the range
+// of PHAMT keys (so it can't be in any PHAMT). With 128-bit hashes, the key may
+// also be a tuple (hi, lo) of a signed and an unsigned 64-bit integer, which
+// stands for the key (hi << 64) | lo.
+static inline int _py_key_to_hash(PyObject* key, hash_t* h)
+{
+   int overflow;
+   long long k;
+#if HASH_BITCOUNT > 64
+   PyObject* hi, *lo, *sh;
+   unsigned long long l;
+   if (PyTuple_Check(key)) {
+      if (PyTuple_GET_SIZE(key) != 2) return 0;
+      hi = PyTuple_GET_ITEM(key, 0);
+      lo = PyTuple_GET_ITEM(key, 1);
+      if (!PyLong_Check(hi) || !PyLong_Check(lo)) return 0;
+      k = PyLong_AsLongLongAndOverflow(hi, &overflow);
+      if (overflow) return 0;
+      l = PyLong_AsUnsignedLongLong(lo);
+      if (l == (unsigned long long)-1 && PyErr_Occurred()) {
+         PyErr_Clear();
+         return 0;
+      }
+      *h = ((hash_t)(unsigned long long)k << 64) | l;
+      return 1;
+   }
+   k = PyLong_AsLongLongAndOverflow(key, &overflow);
+   if (!overflow) {
+      *h = (hash_t)(phamt_key_t)k;
+      return 1;
+   }
+   // Wider keys are split into their high and low 64 bits.
+   l = PyLong_AsUnsignedLongLongMask(key);
+   sh = PyLong_FromLong(64);
+   hi = sh ? PyNumber_Rshift(key, sh) : NULL;
+   Py_XDECREF(sh);
+   if (!hi) {
+      PyErr_Clear();
+      return 0;
+   }
+   k = PyLong_AsLongLongAndOverflow(hi, &overflow);
+   Py_DECREF(hi);
+   if (overflow) return 0;
+   *h = ((hash_t)(unsigned long long)k << 64) | l;
+   return 1;
+#else
+   k = PyLong_AsLongLongAndOverflow(key, &overflow);
+   if (overflow || k < PHAMT_KEY_MIN || k > PHAMT_KEY_MAX)
+      return 0;
+   *h = (hash_t)k;
+   return 1;
+#endif
+}
+// _py_hash_to_key(h)
+// Yields a new Python integer for the key whose hash is h.
+static inline PyObject* _py_hash_to_key(hash_t h)
+{
+   phamt_key_t k = phamt_key(h);
+#if HASH_BITCOUNT > 64
+   if (k < LLONG_MIN || k > LLONG_MAX)
+      return _py_join64(PyLong_FromLongLong((long long)(k >> 64)),
+                        (unsigned long long)h);
+#endif
+   return PyLong_FromLongLong((long long)k);
+}
+// _py_hash_to_int(h)
+// Yields a new Python integer whose value is h itself (i.e., h is treated as an
+// unsigned integer rather than as a key).
+static inline PyObject* _py_hash_to_int(hash_t h)
+{
+#if HASH_BITCOUNT > 64
+   if (h > ULLONG_MAX)
+      return _py_join64(PyLong_FromUnsignedLongLong(
+                           (unsigned long long)(h >> 64)),
+                        (unsigned long long)h);
+#endif
+   return PyLong_FromUnsignedLongLong((unsigned long long)h);
+}
+#if HASH_BITCOUNT > 64
+// _py_join64(hi, lo)
+// Yields the Python integer (hi << 64) | lo; the reference to hi, which may be
+// NULL if there was an error, is stolen.
+static PyObject* _py_join64(PyObject* hi, unsigned long long lo)
+{
+   PyObject* sh, *u, *res;
+   if (!hi) return NULL;
+   sh = PyLong_FromLong(64);
+   u = sh ? PyNumber_Lshift(hi, sh) : NULL;
+   Py_DECREF(hi);
+   Py_XDECREF(sh);
+   if (!u) return NULL;
+   hi = PyLong_FromUnsignedLongLong(lo);
+   res = hi ? PyNumber_Or(u, hi) : NULL;
+   Py_DECREF(u);
+   Py_XDECREF(hi);
+   return res;
+}
+#endif
+
 //------------------------------------------------------------------------------
 // PHAMT methods
 
@@ -281,34 +1186,44 @@ static PyObject* py_phamt_assoc(PHAMT_t self, PyObject* varargs)
 {
    hash_t h;
    PyObject* key, *val;
+   _phamt_reclaim_due();
    if (!PyArg_ParseTuple(varargs, "OO:assoc", &key, &val))
       return NULL;
-   if (!PyLong_Check(key)) {
+   if (!_py_is_key(key)) {
       PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
       return NULL;
    }
-   h = (hash_t)PyLong_AsSsize_t(key);
+   if (!_py_key_to_hash(key, &h)) {
+      PyErr_SetObject(PyExc_KeyError, key);
+      return NULL;
+   }
    return (PyObject*)phamt_assoc(self, h, val);
 }
 static PyObject* py_phamt_dissoc(PHAMT_t self, PyObject* varargs)
 {
    hash_t h;
    PyObject* key;
+   _phamt_reclaim_due();
    if (!PyArg_ParseTuple(varargs, "O:dissoc", &key))
       return NULL;
-   if (!PyLong_Check(key)) {
+   if (!_py_is_key(key)) {
       PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
       return NULL;
    }
-   h = (hash_t)PyLong_AsSsize_t(key);
+   if (!_py_key_to_hash(key, &h)) {
+      // Keys out of range can't be in self.
+      Py_INCREF(self);
+      return (PyObject*)self;
+   }
    return (PyObject*)phamt_dissoc(self, h);
 }
 static PyObject* py_phamt_transient(PHAMT_t self)
 {
    THAMT_t u = (THAMT_t)PyObject_GC_NewVar(struct THAMT, &THAMT_type, 0);
-   Py_INCREF(self);
-   u->phamt = self;
+   // THAMTs never wrap small maps, so we expand them here.
+   u->phamt = phamt_expand(self);
    u->version = 0;
+   u->iterators = 0;
    PyObject_GC_Track((PyObject*)u);
    return (PyObject*)u;
 }
@@ -329,12 +1244,14 @@ static PyObject* py_phamt_get(PHAMT_t self, PyObject* varargs)
       PyErr_SetString(PyExc_ValueError, "get requires 1 or 2 arguments");
       return NULL;
    }
-   if (!PyLong_Check(key)) {
+   if (!_py_is_key(key)) {
       PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
       return NULL;
    }
-   h = (hash_t)PyLong_AsSsize_t(key);
-   res = (PyObject*)phamt_lookup(self, h, &found);
+   if (_py_key_to_hash(key, &h))
+      res = (PyObject*)phamt_lookup(self, h, &found);
+   else
+      found = 0;
    if (found) {
       Py_INCREF(res);
       return res;
@@ -349,8 +1266,7 @@ static int py_phamt_contains(PHAMT_t self, PyObject* key)
 {
    hash_t h;
    int found;
-   if (!PyLong_Check(key)) return 0;
-   h = (hash_t)PyLong_AsSsize_t(key);
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) return 0;
    key = phamt_lookup(self, h, &found);
    return found;
 }
@@ -359,11 +1275,10 @@ static PyObject* py_phamt_subscript(PHAMT_t self, PyObject* key)
    PyObject* val;
    int found;
    hash_t h;
-   if (!PyLong_Check(key)) {
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) {
       PyErr_SetObject(PyExc_KeyError, key);
       return NULL;
    }
-   h = (hash_t)PyLong_AsSsize_t(key);
    val = phamt_lookup(self, h, &found);
    // We assume here that self is a pyobject PHAMT; if Python has access to a
    // ctype PHAMT then something has gone wrong already.
@@ -379,350 +1294,3247 @@ static Py_ssize_t py_phamt_len(PHAMT_t self)
 }
 static PyObject *py_phamt_iter(PHAMT_t self)
 {
-   PHAMT_iter_t it = (PHAMT_iter_t)PyObject_GC_NewVar(struct PHAMT_iter,
-                                                      &PHAMT_iter_type, 0);
-   uint8_t d = self->addr_depth;
-   Py_INCREF(self);
-   it->path.steps[d].node = self;
-   it->path.min_depth = d;
-   it->path.value_found = 0xff; // indicates we haven't started.
-   PyObject_GC_Track(it);
-   return (PyObject*)it;
-}
-static void py_phamt_dealloc(PHAMT_t self)
-{
-   PyTypeObject* tp = Py_TYPE(self);
-   // Untrack ourself.
-   PyObject_GC_UnTrack(self);
-   // Clear the children.
-   py_phamt_clear(self);
-   // Free the node.
-   tp->tp_free(self);
+   return _py_phamt_newiter(self, &PHAMT_iter_type);
 }
-static int py_phamt_traverse(PHAMT_t self, visitproc visit, void *arg)
+static PyObject* py_phamt_keys(PHAMT_t self)
 {
-   hash_t ii, ncells;
-   PyTypeObject* tp;
-   tp = Py_TYPE(self);
-   Py_VISIT(tp);
-   if (self->addr_depth == PHAMT_TWIG_DEPTH && !self->flag_pyobject)
-      return 0;
-   if (self->flag_full) {
-      for (ncells = self->bits; ncells; ncells &= ~(BITS_ONE << ii)) {
-         ii = ctz_bits(ncells);
-         Py_VISIT(((PHAMT_t)self)->cells[ii]);
-      }
-   } else {
-      ncells = phamt_cellcount(self);
-      for (ii = 0; ii < ncells; ++ii) {
-         Py_VISIT(((PHAMT_t)self)->cells[ii]);
-      }
-   }
-   return 0;
+   return _py_phamtview_new(self, &PHAMT_keys_type);
 }
-static int py_phamt_clear(PHAMT_t self)
+static PyObject* py_phamt_values(PHAMT_t self)
 {
-   bits_t ii, ncells;
-   // Walk through the children, clearing them.
-   if (self->addr_depth < PHAMT_TWIG_DEPTH || self->flag_pyobject) {
-      if (self->flag_full) {
-         // Use ncells as the iteration variable since we won't need it.
-         for (ncells = self->bits; ncells; ncells &= ~(BITS_ONE << ii)) {
-            ii = ctz_bits(ncells);
-            Py_CLEAR(self->cells[ii]);
-         }
-      } else {
-         ncells = phamt_cellcount(self);
-         for (ii = 0; ii < ncells; ++ii) {
-            Py_CLEAR(self->cells[ii]);
-         }
-      }
-   }
-   return 0;
+   return _py_phamtview_new(self, &PHAMT_values_type);
 }
-static PyObject* py_phamt_repr(PHAMT_t self)
+static PyObject* py_phamt_items(PHAMT_t self)
 {
-   dbgnode("[py_phamt_repr]", self);
-   return PyUnicode_FromFormat("<PHAMT:n=%u>", (unsigned)self->numel);
+   return _py_phamtview_new(self, &PHAMT_items_type);
 }
-
-//------------------------------------------------------------------------------
-// PHAMT Constructors
-// These are constructors intended for use in the C-API, not thee Python
-// constructors.
-
-// phamt_empty()
-// Returns the empty PHAMT--this is not static because we want it to be
-// available to other C modules. (It is in fact declared in the header file.)
-PHAMT_t phamt_empty(void)
+static PyObject* py_phamt_query_box(PHAMT_t self, PyObject* varargs)
 {
-   Py_INCREF(PHAMT_EMPTY);
-   return PHAMT_EMPTY;
+   hash_t lo[PHAMT_MORTON_MAXDIMS], hi[PHAMT_MORTON_MAXDIMS];
+   unsigned ndim = 0;
+   PyObject* lo_obj, *hi_obj;
+   if (!PyArg_ParseTuple(varargs, "OO:query_box", &lo_obj, &hi_obj))
+      return NULL;
+   if (_py_parse_coords(lo_obj, lo, &ndim) < 0 ||
+       _py_parse_coords(hi_obj, hi, &ndim) < 0)
+      return NULL;
+   return (PyObject*)phamt_query_box(self, ndim, lo, hi);
 }
-// phamt_empty_ctype()
-// Returns the empty PHAMT whose objects must be C-types.
-PHAMT_t phamt_empty_ctype(void)
+static PyObject* py_phamt_shards(PHAMT_t self, PyObject* arg)
 {
-   Py_INCREF(PHAMT_EMPTY_CTYPE);
-   return PHAMT_EMPTY_CTYPE;
+   PHAMT_t* buf;
+   PyObject* res;
+   hash_t ii, count;
+   Py_ssize_t n = PyLong_AsSsize_t(arg);
+   if (n == -1 && PyErr_Occurred())
+      return NULL;
+   if (n < 1) {
+      PyErr_SetString(PyExc_ValueError, "shards requires a count >= 1");
+      return NULL;
+   }
+   // There's no point in asking for more shards than elements.
+   if ((hash_t)n > self->numel)
+      n = (Py_ssize_t)self->numel;
+   buf = (PHAMT_t*)PyMem_Malloc(sizeof(PHAMT_t) * (n ? n : 1));
+   if (!buf) return PyErr_NoMemory();
+   count = phamt_shards(self, (hash_t)n, buf);
+   if (count == 0 && PyErr_Occurred()) {
+      PyMem_Free(buf);
+      return NULL;
+   }
+   res = PyList_New((Py_ssize_t)count);
+   if (res) {
+      for (ii = 0; ii < count; ++ii)
+         PyList_SET_ITEM(res, ii, (PyObject*)buf[ii]);
+   } else {
+      for (ii = 0; ii < count; ++ii)
+         Py_DECREF(buf[ii]);
+   }
+   PyMem_Free(buf);
+   return res;
 }
-// _phamt_new(ncells)
-// Returns a newly allocated PHAMT object with the given number of cells. The
-// PHAMT has a refcount of 1 but it's PHAMT data are not initialized.
-PHAMT_t _phamt_new(unsigned ncells)
+static PyObject* py_phamt_to_dict(PHAMT_t self)
 {
-   return (PHAMT_t)PyObject_GC_NewVar(struct PHAMT, &PHAMT_type, ncells);
+   PHAMT_export_t st;
+#if PY_VERSION_HEX < 0x030D0000
+   st.keys = _PyDict_NewPresized((Py_ssize_t)self->numel);
+#else
+   st.keys = PyDict_New();
+#endif
+   if (!st.keys) return NULL;
+   if (phamt_foreach(self, _py_export_dict, &st)) {
+      Py_DECREF(st.keys);
+      return NULL;
+   }
+   return st.keys;
 }
-
-//------------------------------------------------------------------------------
-// PHAMT_iter Methods
-
-static void py_phamtiter_dealloc(PHAMT_iter_t self)
+static PyObject* py_phamt_to_lists(PHAMT_t self)
 {
-   PyTypeObject* tp;
-   tp = Py_TYPE(self);
-   // Untrack ourself.
-   PyObject_GC_UnTrack(self);
-   // Clear the children.
-   py_phamtiter_clear(self);
-   // Free the object.
-   tp->tp_free(self);
+   PHAMT_export_t st;
+   st.count = 0;
+   st.keys = PyList_New((Py_ssize_t)self->numel);
+   st.vals = PyList_New((Py_ssize_t)self->numel);
+   if (!st.keys || !st.vals || phamt_foreach(self, _py_export_lists, &st)) {
+      Py_XDECREF(st.keys);
+      Py_XDECREF(st.vals);
+      return NULL;
+   }
+   return Py_BuildValue("(NN)", st.keys, st.vals);
 }
-static int py_phamtiter_traverse(PHAMT_iter_t self, visitproc visit, void *arg)
+static PyObject* py_phamt_keys_array(PHAMT_t self, PyObject* args,
+                                     PyObject* kw)
 {
-   Py_VISIT(Py_TYPE(self));
-   Py_VISIT(self->path.steps[self->path.min_depth].node);
-   return 0;
+   static char* kwlist[] = {"dtype", "out", NULL};
+   PyObject* dtype = NULL, *out = NULL;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO:keys_array", kwlist,
+                                    &dtype, &out))
+      return NULL;
+   return _py_phamt_to_array(self, dtype, out, 'q', _py_export_keynum);
 }
-static int py_phamtiter_clear(PHAMT_iter_t self)
+static PyObject* py_phamt_values_array(PHAMT_t self, PyObject* args,
+                                       PyObject* kw)
 {
-   Py_CLEAR(self->path.steps[self->path.min_depth].node);   
-   return 0;
+   static char* kwlist[] = {"dtype", "out", NULL};
+   PyObject* dtype = NULL, *out = NULL;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO:values_array", kwlist,
+                                    &dtype, &out))
+      return NULL;
+   return _py_phamt_to_array(self, dtype, out, 'd', _py_export_valnum);
 }
-static PyObject* py_phamtiter_repr(PHAMT_iter_t self)
+// _py_phamt_to_array(self, dtype, out, kind, fn)
+// Implements the keys_array and values_array methods: kind is the default
+// format of the buffer, and fn is the function that writes each item into it.
+// If out is NULL or None, a new bytearray is filled and a memoryview of it is
+// returned; otherwise out must be a writable buffer of the right type and size.
+static PyObject* _py_phamt_to_array(PHAMT_t self, PyObject* dtype,
+                                    PyObject* out, char kind,
+                                    phamt_eachfn_t fn)
+{
+   PHAMT_export_t st;
+   Py_buffer view;
+   PyObject* buf, *mv, *res;
+   const char* fmt;
+   char fmtstr[2];
+   st.count = 0;
+   st.kind = _py_parse_dtype(dtype, kind);
+   if (!st.kind) return NULL;
+   if (out == NULL || out == Py_None) {
+      buf = PyByteArray_FromStringAndSize(NULL, 8*(Py_ssize_t)self->numel);
+      if (!buf) return NULL;
+      st.buf = PyByteArray_AS_STRING(buf);
+      if (phamt_foreach(self, fn, &st)) {
+         Py_DECREF(buf);
+         return NULL;
+      }
+      mv = PyMemoryView_FromObject(buf);
+      Py_DECREF(buf);
+      if (!mv) return NULL;
+      fmtstr[0] = st.kind;
+      fmtstr[1] = 0;
+      res = PyObject_CallMethod(mv, "cast", "s", fmtstr);
+      Py_DECREF(mv);
+      return res;
+   }
+   if (PyObject_GetBuffer(out, &view, PyBUF_WRITABLE | PyBUF_FORMAT |
+                                      PyBUF_C_CONTIGUOUS) < 0)
+      return NULL;
+   // We accept any native 64-bit format of the requested kind.
+   fmt = view.format ? view.format : "B";
+   if (*fmt == '@' || *fmt == '=' || *fmt == (PY_LITTLE_ENDIAN ? '<' : '>'))
+      ++fmt;
+   if (view.itemsize != 8 || fmt[0] == 0 || fmt[1] != 0 ||
+       !strchr(st.kind == 'q' ? "qln" : st.kind == 'Q' ? "QLN" : "d", *fmt)) {
+      PyErr_Format(PyExc_ValueError,
+                   "out must be a buffer of 64-bit items of format '%c'",
+                   st.kind);
+      PyBuffer_Release(&view);
+      return NULL;
+   }
+   if (view.len < 8*(Py_ssize_t)self->numel) {
+      PyErr_SetString(PyExc_ValueError, "out is too small");
+      PyBuffer_Release(&view);
+      return NULL;
+   }
+   st.buf = (char*)view.buf;
+   if (phamt_foreach(self, fn, &st)) {
+      PyBuffer_Release(&view);
+      return NULL;
+   }
+   PyBuffer_Release(&view);
+   Py_INCREF(out);
+   return out;
+}
+// _py_parse_dtype(dtype, kind)
+// Converts the dtype argument of keys_array or values_array into one of the
+// format characters 'q', 'Q', or 'd'; if dtype is NULL or None, kind is
+// returned. Strings such as 'int64' and objects with such a name, like numpy's
+// dtypes, are also accepted. On error, 0 is returned and an exception is set.
+static char _py_parse_dtype(PyObject* dtype, char kind)
+{
+   PyObject* name;
+   const char* s;
+   char res = 0;
+   if (dtype == NULL || dtype == Py_None) return kind;
+   if (PyUnicode_Check(dtype)) {
+      name = dtype;
+      Py_INCREF(name);
+   } else if (PyObject_HasAttrString(dtype, "name")) {
+      name = PyObject_GetAttrString(dtype, "name");
+   } else {
+      name = PyObject_GetAttrString(dtype, "__name__");
+   }
+   if (!name) return 0;
+   s = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+   if (s) {
+      if (!strcmp(s, "q") || !strcmp(s, "int64") || !strcmp(s, "i8"))
+         res = 'q';
+      else if (!strcmp(s, "Q") || !strcmp(s, "uint64") || !strcmp(s, "u8"))
+         res = 'Q';
+      else if (!strcmp(s, "d") || !strcmp(s, "float64") || !strcmp(s, "f8"))
+         res = 'd';
+   }
+   if (!res && !PyErr_Occurred())
+      PyErr_Format(PyExc_ValueError,
+                   "dtype must be int64 ('q'), uint64 ('Q'), or float64 ('d')");
+   Py_DECREF(name);
+   return res;
+}
+static int _py_export_dict(hash_t k, void* v, void* arg)
+{
+   PHAMT_export_t* st = (PHAMT_export_t*)arg;
+   PyObject* key = _py_hash_to_key(k);
+   int r;
+   if (!key) return -1;
+   r = PyDict_SetItem(st->keys, key, (PyObject*)v);
+   Py_DECREF(key);
+   return r;
+}
+static int _py_export_lists(hash_t k, void* v, void* arg)
+{
+   PHAMT_export_t* st = (PHAMT_export_t*)arg;
+   PyObject* key = _py_hash_to_key(k);
+   if (!key) return -1;
+   PyList_SET_ITEM(st->keys, st->count, key);
+   Py_INCREF((PyObject*)v);
+   PyList_SET_ITEM(st->vals, st->count, (PyObject*)v);
+   ++st->count;
+   return 0;
+}
+static int _py_export_keynum(hash_t k, void* v, void* arg)
+{
+   PHAMT_export_t* st = (PHAMT_export_t*)arg;
+   char* p = st->buf + 8*(st->count++);
+   phamt_key_t key = phamt_key(k);
+   int64_t i;
+   uint64_t u;
+   double d;
+#if HASH_BITCOUNT > 64
+   // Keys that don't fit in 64 bits can only be exported as floats.
+   if (st->kind != 'd' &&
+       (key < INT64_MIN || key > (st->kind == 'q' ? INT64_MAX : UINT64_MAX))) {
+      PyErr_SetString(PyExc_OverflowError, "key does not fit in 64 bits");
+      return -1;
+   }
+#endif
+   if (st->kind == 'q') {
+      i = (int64_t)key;
+      memcpy(p, &i, 8);
+   } else if (st->kind == 'Q') {
+      u = (uint64_t)key;
+      memcpy(p, &u, 8);
+   } else {
+      d = (double)key;
+      memcpy(p, &d, 8);
+   }
+   return 0;
+}
+static int _py_export_valnum(hash_t k, void* v, void* arg)
+{
+   PHAMT_export_t* st = (PHAMT_export_t*)arg;
+   char* p = st->buf + 8*(st->count++);
+   long long i;
+   unsigned long long u;
+   double d;
+   if (st->kind == 'q') {
+      i = PyLong_AsLongLong((PyObject*)v);
+      if (i == -1 && PyErr_Occurred()) return -1;
+      memcpy(p, &i, 8);
+   } else if (st->kind == 'Q') {
+      u = PyLong_AsUnsignedLongLong((PyObject*)v);
+      if (u == (unsigned long long)-1 && PyErr_Occurred()) return -1;
+      memcpy(p, &u, 8);
+   } else {
+      d = PyFloat_AsDouble((PyObject*)v);
+      if (d == -1.0 && PyErr_Occurred()) return -1;
+      memcpy(p, &d, 8);
+   }
+   return 0;
+}
+static PyObject* py_phamt_assoc_arrays(PHAMT_t self, PyObject* args,
+                                       PyObject* kw)
+{
+   static char* kwlist[] = {"keys", "values", "nthreads", NULL};
+   PyObject* keys, *values, *nthreads = NULL;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O:assoc_arrays", kwlist,
+                                    &keys, &values, &nthreads))
+      return NULL;
+   return _py_phamt_bulk(self, keys, values, nthreads);
+}
+// _py_phamt_bulk(node, keys, values, nthreads)
+// Implements PHAMT.from_arrays (if node is NULL) and the assoc_arrays method.
+static PyObject* _py_phamt_bulk(PHAMT_t node, PyObject* keys,
+                                PyObject* values, PyObject* nthreads)
+{
+   Py_buffer view;
+   PyObject* vals, *seq = NULL, *key;
+   const hash_t* ks = NULL;
+   hash_t* hs = NULL;
+   PHAMT_t u = NULL;
+   Py_ssize_t n, ii;
+   int nth = _py_parse_nthreads(nthreads);
+   if (!nth) return NULL;
+   // The values are held in a tuple whose items are read without the GIL.
+   vals = PySequence_Tuple(values);
+   if (!vals) return NULL;
+   n = PyTuple_GET_SIZE(vals);
+   view.obj = NULL;
+   if (PyObject_CheckBuffer(keys)) {
+      if (PyObject_GetBuffer(keys, &view, PyBUF_FORMAT|PyBUF_C_CONTIGUOUS) < 0)
+         goto done;
+      ks = _py_bulk_hashes(&view, n, &hs);
+   } else {
+      seq = PySequence_Fast(keys, "keys must be a buffer or a sequence");
+      if (!seq) goto done;
+      if (PySequence_Fast_GET_SIZE(seq) != n) {
+         PyErr_SetString(PyExc_ValueError,
+                         "keys and values must have the same length");
+         goto done;
+      }
+      hs = (hash_t*)PyMem_RawMalloc(sizeof(hash_t)*(n ? n : 1));
+      if (!hs) {
+         PyErr_NoMemory();
+         goto done;
+      }
+      for (ii = 0; ii < n; ++ii) {
+         key = PySequence_Fast_GET_ITEM(seq, ii);
+         if (!_py_is_key(key)) {
+            PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
+            goto done;
+         }
+         if (!_py_key_to_hash(key, hs + ii)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            goto done;
+         }
+      }
+      ks = hs;
+   }
+   if (!ks) goto done;
+   if (node)
+      u = phamt_assoc_arrays(node, ks, (void* const*)PySequence_Fast_ITEMS(vals),
+                             n, nth);
+   else
+      u = phamt_from_arrays(ks, (void* const*)PySequence_Fast_ITEMS(vals), n,
+                            1, nth);
+done:
+   if (view.obj) PyBuffer_Release(&view);
+   Py_XDECREF(seq);
+   Py_DECREF(vals);
+   PyMem_RawFree(hs);
+   return (PyObject*)u;
+}
+// _py_bulk_hashes(view, n, hs)
+// Yields the hashes of the n keys in the buffer view, which must hold native
+// signed 64-bit integers. When the keys are their own hashes, the buffer's
+// memory is returned; otherwise the hashes are written into a new array that
+// is put in *hs and must be freed with PyMem_RawFree. On error, NULL is
+// returned and an exception is set.
+static const hash_t* _py_bulk_hashes(Py_buffer* view, Py_ssize_t n,
+                                     hash_t** hs)
+{
+   const char* fmt = view->format ? view->format : "B";
+   const long long* ks = (const long long*)view->buf;
+#if HASH_BITCOUNT <= 64
+   PyObject* key;
+#endif
+   Py_ssize_t ii;
+   if (*fmt == '@' || *fmt == '=' || *fmt == (PY_LITTLE_ENDIAN ? '<' : '>'))
+      ++fmt;
+   if (view->itemsize != 8 || fmt[0] == 0 || fmt[1] != 0 ||
+       !strchr("qln", *fmt)) {
+      PyErr_SetString(PyExc_ValueError,
+                      "keys must be a buffer of 64-bit items of format 'q'");
+      return NULL;
+   }
+   if (view->len != 8*n) {
+      PyErr_SetString(PyExc_ValueError,
+                      "keys and values must have the same length");
+      return NULL;
+   }
+#if HASH_BITCOUNT == 64
+   if (sizeof(hash_t) == sizeof(long long)) return (const hash_t*)ks;
+#endif
+   *hs = (hash_t*)PyMem_RawMalloc(sizeof(hash_t)*(n ? n : 1));
+   if (!*hs) {
+      PyErr_NoMemory();
+      return NULL;
+   }
+   // (In the 128-bit build, every 64-bit key is in range.)
+   for (ii = 0; ii < n; ++ii) {
+#if HASH_BITCOUNT <= 64
+      if ((phamt_key_t)ks[ii] < PHAMT_KEY_MIN ||
+          (phamt_key_t)ks[ii] > PHAMT_KEY_MAX) {
+         key = PyLong_FromLongLong(ks[ii]);
+         if (key) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+         }
+         return NULL;
+      }
+#endif
+      (*hs)[ii] = (hash_t)(phamt_key_t)ks[ii];
+   }
+   return *hs;
+}
+// _py_parse_nthreads(obj)
+// Converts the nthreads argument of the bulk constructors into a number of
+// threads; if obj is NULL or None, this is os.cpu_count(). On error, 0 is
+// returned and an exception is set.
+static int _py_parse_nthreads(PyObject* obj)
+{
+   PyObject* os, *res;
+   long nth;
+   if (obj == NULL || obj == Py_None) {
+      os = PyImport_ImportModule("os");
+      if (!os) return 0;
+      res = PyObject_CallMethod(os, "cpu_count", NULL);
+      Py_DECREF(os);
+      if (!res) return 0;
+      nth = (res == Py_None ? 1 : PyLong_AsLong(res));
+      Py_DECREF(res);
+      if (nth == -1 && PyErr_Occurred()) return 0;
+   } else {
+      nth = PyLong_AsLong(obj);
+      if (nth == -1 && PyErr_Occurred()) return 0;
+      if (nth < 1) {
+         PyErr_SetString(PyExc_ValueError, "nthreads must be positive");
+         return 0;
+      }
+   }
+   if (nth < 1) nth = 1;
+   return (nth > PHAMT_POOL_MAXTHREADS ? PHAMT_POOL_MAXTHREADS : (int)nth);
+}
+static PyObject* py_phamt_foreach(PHAMT_t self, PyObject* args, PyObject* kw)
+{
+   static char* kwlist[] = {"fn", "nthreads", NULL};
+   PHAMT_pywalk_t st;
+   PyObject* nthreads = NULL;
+   int nth;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O:foreach", kwlist,
+                                    &st.fn, &nthreads))
+      return NULL;
+   nth = (nthreads && nthreads != Py_None ? _py_parse_nthreads(nthreads) : 1);
+   if (!nth) return NULL;
+   st.initial = NULL;
+   if (_py_phamt_walk(self, &st, nth)) return NULL;
+   PyMem_Free(st.workers);
+   Py_RETURN_NONE;
+}
+static PyObject* py_phamt_reduce(PHAMT_t self, PyObject* args, PyObject* kw)
+{
+   static char* kwlist[] = {"fn", "initial", "combine", "nthreads", NULL};
+   PHAMT_pywalk_t st;
+   PyObject* combine = Py_None, *nthreads = NULL, *res = NULL, *acc, *tmp;
+   int nth, ii, first;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|OO:reduce", kwlist,
+                                    &st.fn, &st.initial, &combine, &nthreads))
+      return NULL;
+   nth = (nthreads && nthreads != Py_None ? _py_parse_nthreads(nthreads) : 1);
+   if (!nth) return NULL;
+   if (nth > 1 && combine == Py_None) {
+      PyErr_SetString(PyExc_ValueError,
+                      "reduce requires combine when nthreads > 1");
+      return NULL;
+   }
+   if (_py_phamt_walk(self, &st, nth)) return NULL;
+   // The workers' results are combined in the order of the workers.
+   for (ii = 0, first = 1; ii < nth; ++ii) {
+      acc = st.workers[ii].acc;
+      if (!acc) continue;
+      if (first) {
+         res = acc;
+         first = 0;
+         continue;
+      }
+      if (res) {
+         tmp = PyObject_CallFunctionObjArgs(combine, res, acc, NULL);
+         Py_DECREF(res);
+         res = tmp;
+      }
+      Py_DECREF(acc);
+   }
+   PyMem_Free(st.workers);
+   return res;
+}
+// _py_phamt_walk(self, st, nthreads)
+// Implements the foreach and reduce methods by calling st->fn on each item of
+// self on nthreads threads (see phamt_walk). On success, 0 is returned, and
+// the caller must free st->workers and the accumulators in it; otherwise, an
+// exception is set, and -1 is returned.
+static int _py_phamt_walk(PHAMT_t self, PHAMT_pywalk_t* st, int nthreads)
+{
+   PHAMT_pyworker_t* w;
+   int r, ii, err = 0;
+   st->workers = (PHAMT_pyworker_t*)PyMem_Calloc(nthreads,
+                                                 sizeof(PHAMT_pyworker_t));
+   if (!st->workers) {
+      PyErr_NoMemory();
+      return -1;
+   }
+   if (nthreads == 1) {
+      r = _py_walk_task(self, 0, st);
+   } else {
+      Py_BEGIN_ALLOW_THREADS
+      r = phamt_walk(self, _py_walk_task, st, nthreads, 0);
+      Py_END_ALLOW_THREADS
+   }
+   if (!r) return 0;
+   // The first worker's exception is raised; any others are dropped.
+   for (ii = 0; ii < nthreads; ++ii) {
+      w = st->workers + ii;
+      Py_XDECREF(w->acc);
+#if PY_VERSION_HEX >= 0x030C0000
+      if (!w->exc) continue;
+      if (err) Py_DECREF(w->exc);
+      else PyErr_SetRaisedException(w->exc);
+#else
+      if (!w->exc[0]) continue;
+      if (err) {
+         Py_DECREF(w->exc[0]);
+         Py_XDECREF(w->exc[1]);
+         Py_XDECREF(w->exc[2]);
+      } else {
+         PyErr_Restore(w->exc[0], w->exc[1], w->exc[2]);
+      }
+#endif
+      err = 1;
+   }
+   PyMem_Free(st->workers);
+   return -1;
+}
+// _py_walk_task(node, worker, arg)
+// The walk function of _py_phamt_walk(), which may run on any thread: it calls
+// the Python function on each item of node, and if that raises an exception,
+// it saves the exception in the worker's state and returns -1.
+static int _py_walk_task(PHAMT_t node, int worker, void* arg)
+{
+   PHAMT_pywalk_t* st = (PHAMT_pywalk_t*)arg;
+   PHAMT_pyworker_t* w = st->workers + worker;
+   void* ctx[2];
+   PyGILState_STATE gs = PyGILState_Ensure();
+   int r;
+   if (st->initial && !w->acc) {
+      Py_INCREF(st->initial);
+      w->acc = st->initial;
+   }
+   ctx[0] = st;
+   ctx[1] = w;
+   r = phamt_foreach(node, _py_walk_item, ctx);
+   if (r) {
+#if PY_VERSION_HEX >= 0x030C0000
+      w->exc = PyErr_GetRaisedException();
+#else
+      PyErr_Fetch(&w->exc[0], &w->exc[1], &w->exc[2]);
+#endif
+   }
+   PyGILState_Release(gs);
+   return r;
+}
+// _py_walk_item(k, v, arg)
+// Calls the Python function of a foreach or reduce method on one item; arg
+// holds the method's state and the worker's state.
+static int _py_walk_item(hash_t k, void* v, void* arg)
+{
+   PHAMT_pywalk_t* st = (PHAMT_pywalk_t*)((void**)arg)[0];
+   PHAMT_pyworker_t* w = (PHAMT_pyworker_t*)((void**)arg)[1];
+   PyObject* key = _py_hash_to_key(k), *res;
+   if (!key) return -1;
+   if (st->initial)
+      res = PyObject_CallFunctionObjArgs(st->fn, w->acc, key, (PyObject*)v,
+                                         NULL);
+   else
+      res = PyObject_CallFunctionObjArgs(st->fn, key, (PyObject*)v, NULL);
+   Py_DECREF(key);
+   if (!res) return -1;
+   if (st->initial) {
+      Py_DECREF(w->acc);
+      w->acc = res;
+   } else {
+      Py_DECREF(res);
+   }
+   return 0;
+}
+// _py_phamt_newiter(self, type)
+// Creates a new iterator over the PHAMT self; the type must be one of the types
+// that share the PHAMT_iter struct (PHAMT_iter_type, PHAMT_keyiter_type, or
+// PHAMT_valiter_type).
+static PyObject* _py_phamt_newiter(PHAMT_t self, PyTypeObject* type)
+{
+   PHAMT_iter_t it = (PHAMT_iter_t)PyObject_GC_NewVar(struct PHAMT_iter,
+                                                      type, 0);
+   uint8_t d = self->addr_depth;
+   Py_INCREF(self);
+   it->path.steps[d].node = self;
+   it->path.min_depth = d;
+   it->path.value_found = 0xff; // indicates we haven't started.
+   PyObject_GC_Track(it);
+   return (PyObject*)it;
+}
+static void py_phamt_dealloc(PHAMT_t self)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   // Untrack ourself (if we were allocated with a GC header at all).
+   if (self->flag_gc) PyObject_GC_UnTrack(self);
+   // When freeing is deferred, a node with children is queued instead; its
+   // children are released when the queue is drained (see _phamt_reclaim).
+   if (PHAMT_RECLAIM_BUDGET() >= 0 &&
+       (self->flag_pyobject ||
+        (!self->flag_small && self->addr_depth < PHAMT_TWIG_DEPTH)) &&
+       _phamt_reclaim_push(self))
+      return;
+   // Clear the children.
+   py_phamt_clear(self);
+   // Free the node.
+   tp->tp_free(self);
+}
+static int py_phamt_traverse(PHAMT_t self, visitproc visit, void *arg)
+{
+   hash_t ii, ncells;
+   PyTypeObject* tp;
+   tp = Py_TYPE(self);
+   Py_VISIT(tp);
+   if (self->flag_small) {
+      // Only the values (which follow the keys) of a small map are objects.
+      if (self->flag_pyobject) {
+         for (ii = 0; ii < self->numel; ++ii)
+            Py_VISIT(self->cells[self->numel + ii]);
+      }
+      return 0;
+   }
+   if (self->addr_depth == PHAMT_TWIG_DEPTH && !self->flag_pyobject)
+      return 0;
+   if (self->flag_full) {
+      for (ncells = self->bits; ncells; ncells &= ~(BITS_ONE << ii)) {
+         ii = ctz_bits(ncells);
+         Py_VISIT(((PHAMT_t)self)->cells[ii]);
+      }
+   } else {
+      ncells = phamt_cellcount(self);
+      for (ii = 0; ii < ncells; ++ii) {
+         Py_VISIT(((PHAMT_t)self)->cells[ii]);
+      }
+   }
+   return 0;
+}
+static int py_phamt_clear(PHAMT_t self)
+{
+   bits_t ii, ncells;
+   // Walk through the children, clearing them.
+   if (self->flag_small) {
+      if (self->flag_pyobject) {
+         for (ii = 0; ii < self->numel; ++ii)
+            Py_CLEAR(self->cells[self->numel + ii]);
+      }
+   } else if (self->addr_depth < PHAMT_TWIG_DEPTH || self->flag_pyobject) {
+      if (self->flag_full) {
+         // Use ncells as the iteration variable since we won't need it.
+         for (ncells = self->bits; ncells; ncells &= ~(BITS_ONE << ii)) {
+            ii = ctz_bits(ncells);
+            Py_CLEAR(self->cells[ii]);
+         }
+      } else {
+         ncells = phamt_cellcount(self);
+         for (ii = 0; ii < ncells; ++ii) {
+            Py_CLEAR(self->cells[ii]);
+         }
+      }
+   }
+   return 0;
+}
+static int py_phamt_is_gc(PHAMT_t self)
+{
+   return self->flag_gc;
+}
+static void py_phamt_free(void* self)
+{
+   if (_phamt_freelist_push((PHAMT_t)self)) return;
+   if (((PHAMT_t)self)->flag_gc) PyObject_GC_Del(self);
+   else PyObject_Free(self);
+}
+static PyObject* py_phamt_repr(PHAMT_t self)
+{
+   dbgnode("[py_phamt_repr]", self);
+   return PyUnicode_FromFormat("<PHAMT:n=%u>", (unsigned)self->numel);
+}
+
+//------------------------------------------------------------------------------
+// PHAMT Constructors
+// These are constructors intended for use in the C-API, not thee Python
+// constructors.
+
+// phamt_empty()
+// Returns the empty PHAMT--this is not static because we want it to be
+// available to other C modules. (It is in fact declared in the header file.)
+PHAMT_t phamt_empty(void)
+{
+   Py_INCREF(PHAMT_EMPTY);
+   return PHAMT_EMPTY;
+}
+// phamt_empty_ctype()
+// Returns the empty PHAMT whose objects must be C-types.
+PHAMT_t phamt_empty_ctype(void)
+{
+   Py_INCREF(PHAMT_EMPTY_CTYPE);
+   return PHAMT_EMPTY_CTYPE;
+}
+// _phamt_freelist_pop(gc, ncells)
+// Returns a node with ncells cells taken from the freelist for nodes with
+// (gc = 1) or without (gc = 0) a GC header, re-initialized as a new PHAMT
+// object, or NULL if the freelist is empty.
+static inline PHAMT_t _phamt_freelist_pop(int gc, unsigned ncells)
+{
+   PHAMT_t u = phamt_freelist[gc][ncells];
+   if (!u) return NULL;
+   phamt_freelist[gc][ncells] = (PHAMT_t)u->cells[0];
+   --phamt_numfree[gc][ncells];
+   PyObject_InitVar((PyVarObject*)u, &PHAMT_type, ncells);
+   return u;
+}
+// _phamt_freelist_push(node)
+// Puts the freed node onto its freelist and yields 1 or, if the freelist is
+// full, yields 0.
+static inline int _phamt_freelist_push(PHAMT_t node)
+{
+#if PHAMT_FREELIST_MAXLEN == 0 && !defined(PHAMT_HUGEPAGE_SLABS)
+   return 0;
+#else
+   Py_ssize_t n = Py_SIZE(node);
+   unsigned gc = node->flag_gc;
+#  ifdef PHAMT_HUGEPAGE_SLABS
+   // Slab nodes (those without a GC header) must always go back onto their
+   // freelist; they are allocated with room for at least one cell.
+   if (gc && (n == 0 || phamt_numfree[gc][n] >= PHAMT_FREELIST_MAXLEN))
+      return 0;
+#  else
+   if (n == 0 || phamt_numfree[gc][n] >= PHAMT_FREELIST_MAXLEN) return 0;
+#  endif
+   node->cells[0] = phamt_freelist[gc][n];
+   phamt_freelist[gc][n] = node;
+   ++phamt_numfree[gc][n];
+   return 1;
+#endif
+}
+#ifdef PHAMT_HUGEPAGE_SLABS
+// _phamt_slab_alloc(size)
+// Allocates size bytes from the current slab, first mapping a new slab aligned
+// to a huge page if the current one is used up. Yields NULL and sets a
+// MemoryError if no memory can be mapped.
+static void* _phamt_slab_alloc(size_t size)
+{
+   char *p, *slab;
+   size = (size + 15) & ~(size_t)15;
+   if ((size_t)(phamt_slab_end - phamt_slab_next) < size) {
+      // Map twice the slab size so that a huge-page-aligned slab fits inside;
+      // then unmap the excess on either side of it.
+      p = mmap(NULL, 2*PHAMT_SLAB_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+         PyErr_NoMemory();
+         return NULL;
+      }
+      slab = (char*)(((uintptr_t)p + PHAMT_SLAB_SIZE - 1)
+                     & ~(uintptr_t)(PHAMT_SLAB_SIZE - 1));
+      if (slab > p) munmap(p, slab - p);
+      munmap(slab + PHAMT_SLAB_SIZE, p + PHAMT_SLAB_SIZE - slab);
+#  ifdef MADV_HUGEPAGE
+      madvise(slab, PHAMT_SLAB_SIZE, MADV_HUGEPAGE);
+#  endif
+      phamt_slab_next = slab;
+      phamt_slab_end = slab + PHAMT_SLAB_SIZE;
+   }
+   p = phamt_slab_next;
+   phamt_slab_next += size;
+   return p;
+}
+#endif
+// _phamt_clear_freelists()
+// Frees all of the nodes on the freelists (except those carved from slabs).
+static void _phamt_clear_freelists(void)
+{
+   PHAMT_t u;
+   unsigned gc, n;
+   for (gc = 0; gc < 2; ++gc) {
+#ifdef PHAMT_HUGEPAGE_SLABS
+      if (!gc) continue;
+#endif
+      for (n = 0; n <= PHAMT_ANY_MAXCELLS; ++n) {
+         while ((u = phamt_freelist[gc][n])) {
+            phamt_freelist[gc][n] = (PHAMT_t)u->cells[0];
+            if (gc) PyObject_GC_Del(u);
+            else PyObject_Free(u);
+         }
+         phamt_numfree[gc][n] = 0;
+      }
+   }
+}
+// _phamt_reclaim_push(node)
+// Puts the dead node onto the reclamation queue and yields 1 or, if the queue
+// can't be grown, yields 0 (in which case the node must be freed immediately).
+static inline int _phamt_reclaim_push(PHAMT_t node)
+{
+   PHAMT_t* q;
+   Py_ssize_t cap;
+   int ok = 1;
+   PHAMT_RECLAIM_LOCK();
+   if (phamt_reclaim_len == phamt_reclaim_cap) {
+      cap = phamt_reclaim_cap ? 2*phamt_reclaim_cap : 256;
+      q = (PHAMT_t*)PyMem_Realloc(phamt_reclaim_queue, sizeof(PHAMT_t)*cap);
+      if (q) {
+         phamt_reclaim_queue = q;
+         phamt_reclaim_cap = cap;
+      } else {
+         ok = 0;
+      }
+   }
+   if (ok) phamt_reclaim_queue[phamt_reclaim_len++] = node;
+   PHAMT_RECLAIM_UNLOCK();
+   return ok;
+}
+// _phamt_reclaim(budget)
+// Frees up to budget nodes from the reclamation queue (or all of them, if
+// budget is negative) and yields the number of nodes that remain queued.
+// Freeing a node releases its children, which may queue them in turn, and its
+// values, which may run arbitrary code (including another _phamt_reclaim).
+static Py_ssize_t _phamt_reclaim(Py_ssize_t budget)
+{
+   PHAMT_t u;
+   Py_ssize_t n;
+   for (;; budget -= (budget > 0)) {
+      // The mutex isn't held while the node is freed, since that may queue
+      // its children.
+      PHAMT_RECLAIM_LOCK();
+      n = phamt_reclaim_len;
+      u = (budget && n) ? phamt_reclaim_queue[--phamt_reclaim_len] : NULL;
+      PHAMT_RECLAIM_UNLOCK();
+      if (!u) return n;
+      py_phamt_clear(u);
+      Py_TYPE(u)->tp_free(u);
+   }
+}
+// _phamt_reclaim_due()
+// Frees the queued nodes that allocations have paid for. This is called at
+// the start of PHAMT and THAMT updates rather than during allocation because
+// freeing nodes may run arbitrary code.
+static inline void _phamt_reclaim_due(void)
+{
+   Py_ssize_t n;
+   if (PHAMT_RECLAIM_BUDGET() <= 0) return;
+   PHAMT_RECLAIM_LOCK();
+   n = phamt_reclaim_paid;
+   phamt_reclaim_paid = 0;
+   PHAMT_RECLAIM_UNLOCK();
+   if (n) _phamt_reclaim(n);
+}
+// _phamt_reclaim_pay()
+// Called for each allocated node when freeing is deferred with a positive
+// budget: pays for freeing that many queued nodes, so long as there are
+// queued nodes that haven't been paid for.
+static void _phamt_reclaim_pay(void)
+{
+   PHAMT_RECLAIM_LOCK();
+   if (phamt_reclaim_paid < phamt_reclaim_len && phamt_reclaim_budget > 0)
+      phamt_reclaim_paid += phamt_reclaim_budget;
+   PHAMT_RECLAIM_UNLOCK();
+}
+// _phamt_new(ncells)
+// Returns a newly allocated PHAMT object with the given number of cells. The
+// PHAMT has a refcount of 1 but it's PHAMT data are not initialized.
+PHAMT_t _phamt_new(unsigned ncells)
+{
+   PHAMT_t u = _phamt_freelist_pop(1, ncells);
+   if (!u) u = (PHAMT_t)PyObject_GC_NewVar(struct PHAMT, &PHAMT_type, ncells);
+   if (!u) return NULL;
+   if (PHAMT_RECLAIM_BUDGET() > 0) _phamt_reclaim_pay();
+   u->flag_gc = 1;
+   u->flag_small = 0;
+   u->cell_packing = 0;
+   u->flag_frozen = 0;
+   return u;
+}
+// _phamt_new_nogc(ncells)
+// Returns a newly allocated PHAMT object with the given number of cells that
+// lacks a GC header and thus can never be tracked by the garbage collector.
+PHAMT_t _phamt_new_nogc(unsigned ncells)
+{
+   PHAMT_t u = _phamt_freelist_pop(0, ncells);
+   if (!u) {
+#ifdef PHAMT_HUGEPAGE_SLABS
+      u = (PHAMT_t)_phamt_slab_alloc(PHAMT_SIZE
+                                     + sizeof(void*)*(ncells + !ncells));
+      if (u) PyObject_InitVar((PyVarObject*)u, &PHAMT_type, ncells);
+#else
+      u = (PHAMT_t)PyObject_NewVar(struct PHAMT, &PHAMT_type, ncells);
+#endif
+      if (!u) return NULL;
+   }
+   if (PHAMT_RECLAIM_BUDGET() > 0) _phamt_reclaim_pay();
+   u->flag_gc = 0;
+   u->flag_small = 0;
+   u->cell_packing = 0;
+   u->flag_frozen = 0;
+   return u;
+}
+// _phamt_scratch(scratch, ncells)
+// Prepares the scratch space for a node of ncells cells; see phamt.h.
+PHAMT_t _phamt_scratch(PHAMT_scratch_t* scratch, unsigned ncells)
+{
+   PHAMT_t u = &scratch->node;
+   ((PyObject*)u)->ob_type = &PHAMT_type;
+   ((PyVarObject*)u)->ob_size = ncells;
+   u->flag_small = 0;
+   u->cell_packing = 0;
+   u->flag_frozen = 0;
+   return u;
+}
+// _phamt_frozen_size(node)
+// Yields the number of bytes that the frozen copies of node and of its
+// descendants that aren't already frozen occupy; see phamt_freeze().
+static size_t _phamt_frozen_size(PHAMT_t node)
+{
+   size_t sz;
+   bits_t b, bi, ii, ncells;
+   if (node->flag_frozen) return 0;
+   sz = (PHAMT_SIZE + sizeof(void*)*Py_SIZE(node) + 15) & ~(size_t)15;
+   if (node->flag_small || node->addr_depth == PHAMT_TWIG_DEPTH) return sz;
+   if (node->flag_full) {
+      for (b = node->bits; b; b &= ~(BITS_ONE << bi)) {
+         bi = ctz_bits(b);
+         sz += _phamt_frozen_size((PHAMT_t)node->cells[bi]);
+      }
+   } else {
+      ncells = phamt_cellcount(node);
+      for (ii = 0; ii < ncells; ++ii)
+         sz += _phamt_frozen_size((PHAMT_t)node->cells[ii]);
+   }
+   return sz;
+}
+// _phamt_freeze_into(node, next)
+// Copies node into the memory at *next, which must have room for
+// _phamt_frozen_size(node) bytes, as a frozen node, then does the same for its
+// children, advancing *next past each copy. Yields the frozen node (which is
+// node itself if it was already frozen). The values of the copies are given
+// new references, which are never released.
+static PHAMT_t _phamt_freeze_into(PHAMT_t node, char** next)
+{
+   PHAMT_t u;
+   bits_t b, bi, ii, ncells;
+   Py_ssize_t n = Py_SIZE(node);
+   if (node->flag_frozen) return node;
+   u = (PHAMT_t)*next;
+   *next += (PHAMT_SIZE + sizeof(void*)*n + 15) & ~(size_t)15;
+   PyObject_InitVar((PyVarObject*)u, &PHAMT_type, n);
+   Py_SET_REFCNT(u, PHAMT_FROZEN_REFCNT);
+   memcpy(&u->address, &node->address,
+          offsetof(struct PHAMT, cells) - offsetof(struct PHAMT, address)
+          + sizeof(void*)*n);
+   u->flag_gc = 0;
+   u->flag_frozen = 1;
+   if (u->flag_small) {
+      if (u->flag_pyobject) {
+         for (ii = 0; ii < u->numel; ++ii)
+            Py_INCREF((PyObject*)u->cells[u->numel + ii]);
+      }
+   } else if (u->addr_depth < PHAMT_TWIG_DEPTH || u->flag_pyobject) {
+      // Children are frozen in turn; values just gain a reference.
+      if (u->flag_full) {
+         for (b = u->bits; b; b &= ~(BITS_ONE << bi)) {
+            bi = ctz_bits(b);
+            if (u->addr_depth < PHAMT_TWIG_DEPTH)
+               u->cells[bi] = _phamt_freeze_into((PHAMT_t)u->cells[bi], next);
+            else
+               Py_INCREF((PyObject*)u->cells[bi]);
+         }
+      } else {
+         ncells = phamt_cellcount(u);
+         for (ii = 0; ii < ncells; ++ii) {
+            if (u->addr_depth < PHAMT_TWIG_DEPTH)
+               u->cells[ii] = _phamt_freeze_into((PHAMT_t)u->cells[ii], next);
+            else
+               Py_INCREF((PyObject*)u->cells[ii]);
+         }
+      }
+   }
+   return u;
+}
+// phamt_freeze(node)
+// Returns a frozen copy of the persistent PHAMT node; see phamt.h.
+PHAMT_t phamt_freeze(PHAMT_t node)
+{
+   size_t sz;
+   char *block, *next;
+   PHAMT_t u;
+   if (node->flag_transient) {
+      PyErr_SetString(PyExc_ValueError, "transient PHAMTs cannot be frozen");
+      return NULL;
+   }
+   // The empty PHAMTs are never freed, and frozen PHAMTs are shared.
+   if (node->numel == 0 || node->flag_frozen) {
+      Py_INCREF(node);
+      return node;
+   }
+   // The copies are laid out depth-first in a single block, so that each
+   // subtree (in particular, each path from a twig to the root) occupies as
+   // few pages as possible. The block is never freed.
+   sz = _phamt_frozen_size(node);
+   block = (char*)PyMem_RawMalloc(sz);
+   if (!block) {
+      PyErr_NoMemory();
+      return NULL;
+   }
+   next = block;
+   u = _phamt_freeze_into(node, &next);
+   return u;
+}
+//------------------------------------------------------------------------------
+// Bulk Construction
+// The bulk constructors build a PHAMT from arrays of keys and values in phases.
+// The phases that touch only the items and the nodes' memory run on the thread
+// pool without the GIL: the items are partitioned into buckets of adjacent
+// keys, then each bucket is sorted and planned (see PHAMT_bucket_t), and, once
+// the planned nodes have been allocated under the GIL, each bucket's nodes are
+// filled in. The buckets split the keys by the bits just below the prefix that
+// all of them share, rather than by the cells of the root, because keys such
+// as row ids often all fall beneath a single cell of the root. Finally, the
+// buckets' subtries are joined with phamt_union() under the GIL; since the
+// buckets are disjoint ranges of keys, this copies only the nodes along the
+// boundaries between them.
+// _phamt_pool_thread(arg)
+// The body of the pool's worker threads; arg is the worker's index.
+static void _phamt_pool_thread(void* arg)
+{
+   int worker = (int)(intptr_t)arg;
+   PyThread_type_lock go = phamt_pool_go[worker];
+   for (;;) {
+      PyThread_acquire_lock(go, WAIT_LOCK);
+      _phamt_pool_work(worker);
+   }
+}
+// _phamt_pool_work(worker)
+// Runs the current job's tasks until none are left, then checks out of the job.
+static void _phamt_pool_work(int worker)
+{
+   Py_ssize_t task;
+   int last;
+   for (;;) {
+      PyThread_acquire_lock(phamt_pool_mutex, WAIT_LOCK);
+      task = (phamt_pool_next < phamt_pool_ntasks ? phamt_pool_next++ : -1);
+      PyThread_release_lock(phamt_pool_mutex);
+      if (task < 0) break;
+      (*phamt_pool_fn)(phamt_pool_arg, task, worker);
+   }
+   PyThread_acquire_lock(phamt_pool_mutex, WAIT_LOCK);
+   last = (--phamt_pool_active == 0);
+   PyThread_release_lock(phamt_pool_mutex);
+   if (last) PyThread_release_lock(phamt_pool_done);
+}
+// _phamt_pool_run(nthreads, ntasks, fn, arg)
+// Calls fn(arg, task, worker) for each task from 0 up to ntasks on up to
+// nthreads threads, including the calling thread, and returns once all of the
+// calls have returned. This must be called without the GIL.
+static void _phamt_pool_run(int nthreads, Py_ssize_t ntasks,
+                            phamt_taskfn_t fn, void* arg)
+{
+   Py_ssize_t task;
+   int ii;
+   if ((Py_ssize_t)nthreads > ntasks) nthreads = (int)ntasks;
+   if (nthreads > PHAMT_POOL_MAXTHREADS) nthreads = PHAMT_POOL_MAXTHREADS;
+   if (nthreads > 1 && PyThread_acquire_lock(phamt_pool_busy, NOWAIT_LOCK)) {
+      // Start any workers that are missing; if a thread can't be started, we
+      // make do with those that we have.
+      while (phamt_pool_size < nthreads - 1) {
+         ii = phamt_pool_size + 1;
+         phamt_pool_go[ii] = PyThread_allocate_lock();
+         if (!phamt_pool_go[ii]) break;
+         PyThread_acquire_lock(phamt_pool_go[ii], WAIT_LOCK);
+         if (PyThread_start_new_thread(_phamt_pool_thread, (void*)(intptr_t)ii)
+             == PYTHREAD_INVALID_THREAD_ID) {
+            PyThread_free_lock(phamt_pool_go[ii]);
+            break;
+         }
+         phamt_pool_size = ii;
+      }
+      if (nthreads > phamt_pool_size + 1) nthreads = phamt_pool_size + 1;
+      phamt_pool_fn = fn;
+      phamt_pool_arg = arg;
+      phamt_pool_ntasks = ntasks;
+      phamt_pool_next = 0;
+      phamt_pool_active = nthreads;
+      for (ii = 1; ii < nthreads; ++ii) PyThread_release_lock(phamt_pool_go[ii]);
+      _phamt_pool_work(0);
+      PyThread_acquire_lock(phamt_pool_done, WAIT_LOCK);
+      PyThread_release_lock(phamt_pool_busy);
+      return;
+   }
+   for (task = 0; task < ntasks; ++task) (*fn)(arg, task, 0);
+}
+#ifdef PHAMT_POOL_ATFORK
+// _phamt_pool_atfork()
+// Called in the child after a fork, which has none of the pool's threads; new
+// ones are started when they are next needed. (If a job was running during the
+// fork, the busy lock stays held, and the child runs all of its jobs alone.)
+static void _phamt_pool_atfork(void)
+{
+   phamt_pool_size = 0;
+}
+#endif
+// _phamt_sort_items(items, tmp, n)
+// Sorts the n items by key with a merge sort, which keeps the items that have
+// equal keys in their original order; tmp must have room for n items.
+static void _phamt_sort_items(PHAMT_item_t* items, PHAMT_item_t* tmp,
+                              Py_ssize_t n)
+{
+   const Py_ssize_t run = 32;
+   PHAMT_item_t *src = items, *dst = tmp, *sw, it;
+   Py_ssize_t lo, mid, hi, ii, jj, kk, w;
+   // Runs of a few items are sorted by insertion first.
+   for (lo = 0; lo < n; lo += run) {
+      hi = (lo + run < n ? lo + run : n);
+      for (ii = lo + 1; ii < hi; ++ii) {
+         it = items[ii];
+         for (jj = ii; jj > lo && items[jj-1].key > it.key; --jj)
+            items[jj] = items[jj-1];
+         items[jj] = it;
+      }
+   }
+   for (w = run; w < n; w *= 2) {
+      for (lo = 0; lo < n; lo += 2*w) {
+         mid = (lo + w < n ? lo + w : n);
+         hi = (lo + 2*w < n ? lo + 2*w : n);
+         if (mid == hi || src[mid-1].key <= src[mid].key) {
+            memcpy(dst + lo, src + lo, sizeof(PHAMT_item_t)*(hi - lo));
+            continue;
+         }
+         for (ii = lo, jj = mid, kk = lo; ii < mid && jj < hi; )
+            dst[kk++] = (src[jj].key < src[ii].key ? src[jj++] : src[ii++]);
+         memcpy(dst + kk, src + ii, sizeof(PHAMT_item_t)*(mid - ii));
+         kk += mid - ii;
+         memcpy(dst + kk, src + jj, sizeof(PHAMT_item_t)*(hi - jj));
+      }
+      sw = src;
+      src = dst;
+      dst = sw;
+   }
+   if (src != items) memcpy(items, src, sizeof(PHAMT_item_t)*n);
+}
+// _phamt_bulk_twig(scratch, items, n, flag_pyobject)
+// Builds the twig that holds the n sorted items, which must all lie beneath one
+// twig, in the given scratch space, with its layout and packing chosen, and
+// returns it.
+static PHAMT_t _phamt_bulk_twig(PHAMT_scratch_t* scratch,
+                                const PHAMT_item_t* items, Py_ssize_t n,
+                                uint8_t flag_pyobject)
+{
+   PHAMT_t u = _phamt_scratch(scratch, (unsigned)n);
+   Py_ssize_t ii;
+   u->address = items[0].key & ~PHAMT_TWIG_MASK;
+   u->numel = n;
+   u->bits = 0;
+   for (ii = 0; ii < n; ++ii) {
+      u->bits |= BITS_ONE << (items[ii].key & PHAMT_TWIG_MASK);
+      u->cells[ii] = items[ii].val;
+   }
+   u->flag_pyobject = flag_pyobject;
+   u->flag_firstn = firstn_bits(u->bits);
+   u->flag_full = 0;
+   u->flag_transient = 0;
+   u->addr_depth = PHAMT_TWIG_DEPTH;
+   u->addr_shift = PHAMT_TWIG_SHIFT;
+   u->addr_startbit = 0;
+   _phamt_choose_layout(u);
+   _phamt_pack(u);
+   return u;
+}
+// _phamt_bulk_emit(bk, node)
+// Emits the next node of the bucket bk, whose contents have been built in
+// scratch space with their layout chosen. While the bucket is being planned,
+// this records the node's size and yields NULL; once its nodes have been
+// allocated, this copies node into the next of them and yields it.
+static PHAMT_t _phamt_bulk_emit(PHAMT_bucket_t* bk, PHAMT_t node)
+{
+   PHAMT_t u;
+   unsigned* sizes;
+   Py_ssize_t cap;
+   unsigned ncells = (unsigned)Py_SIZE(node), gc;
+   if (!bk->nodes) {
+      if (bk->nnodes == bk->cap) {
+         cap = (bk->cap ? 2*bk->cap : 64);
+         sizes = (unsigned*)PyMem_RawRealloc(bk->sizes, sizeof(unsigned)*cap);
+         if (!sizes) {
+            bk->err = 1;
+            return NULL;
+         }
+         bk->sizes = sizes;
+         bk->cap = cap;
+      }
+      bk->sizes[bk->nnodes++] = ncells;
+      return NULL;
+   }
+   u = bk->nodes[bk->next++];
+   gc = u->flag_gc;
+   memcpy(&u->address, &node->address,
+          offsetof(struct PHAMT, cells) - offsetof(struct PHAMT, address)
+          + sizeof(void*)*ncells);
+   u->flag_gc = gc;
+   u->flag_frozen = 0;
+   return u;
+}
+// _phamt_bulk_node(bk, items, n)
+// Emits the nodes of the subtrie that holds the n (at least 1) sorted, unique
+// items of the bucket bk, children before their parents, and yields the root
+// of the subtrie (or NULL while the bucket is being planned); see
+// _phamt_bulk_emit().
+static PHAMT_t _phamt_bulk_node(PHAMT_bucket_t* bk, const PHAMT_item_t* items,
+                                Py_ssize_t n)
+{
+   PHAMT_scratch_t scratch;
+   PHAMT_t u;
+   hash_t h, end;
+   bits_t bi, ii = 0;
+   Py_ssize_t lo, hi, mid, top;
+   uint8_t bit0, shift, depth;
+   if ((items[0].key ^ items[n-1].key) <= PHAMT_TWIG_MASK)
+      return _phamt_bulk_emit(bk, _phamt_bulk_twig(&scratch, items, n,
+                                                   bk->flag_pyobject));
+   // The node is the one at which the first and last keys part ways, as in
+   // _phamt_join_disjoint().
+   h = highbitdiff_hash(items[0].key, items[n-1].key);
+   if (h < HASH_BITCOUNT - PHAMT_ROOT_SHIFT) {
+      bit0 = (h - PHAMT_TWIG_SHIFT) / PHAMT_NODE_SHIFT;
+      depth = PHAMT_LEVELS - 2 - bit0;
+      bit0 = bit0*PHAMT_NODE_SHIFT + PHAMT_TWIG_SHIFT;
+      shift = PHAMT_NODE_SHIFT;
+   } else {
+      depth = PHAMT_ROOT_DEPTH;
+      bit0 = PHAMT_ROOT_FIRSTBIT;
+      shift = PHAMT_ROOT_SHIFT;
+   }
+   h = items[0].key & highmask_hash(bit0 + shift);
+   u = _phamt_scratch(&scratch, 0);
+   u->bits = 0;
+   // Each cell holds a run of items; we find the end of each run by bisection.
+   for (lo = 0; lo < n; lo = hi) {
+      bi = (bits_t)((items[lo].key >> bit0) & lowmask_hash(shift));
+      end = items[lo].key | lowmask_hash(bit0);
+      for (hi = lo + 1, top = n; hi < top; ) {
+         mid = hi + (top - hi)/2;
+         if (items[mid].key <= end) hi = mid + 1;
+         else top = mid;
+      }
+      u->bits |= BITS_ONE << bi;
+      u->cells[ii++] = (void*)_phamt_bulk_node(bk, items + lo, hi - lo);
+   }
+   Py_SET_SIZE(u, ii);
+   u->address = h;
+   u->numel = n;
+   u->flag_pyobject = bk->flag_pyobject;
+   u->flag_firstn = firstn_bits(u->bits);
+   u->flag_full = 0;
+   u->flag_transient = 0;
+   u->addr_depth = depth;
+   u->addr_shift = shift;
+   u->addr_startbit = bit0;
+   _phamt_choose_layout(u);
+   return _phamt_bulk_emit(bk, u);
+}
+// _phamt_bulk_discard(node)
+// Frees a node that was allocated for a bulk build but never filled in.
+static void _phamt_bulk_discard(PHAMT_t node)
+{
+   // An empty ctype small map owns nothing.
+   node->numel = 0;
+   node->flag_pyobject = 0;
+   node->flag_transient = 0;
+   node->flag_small = 1;
+   Py_DECREF(node);
+}
+// _phamt_bulk_range(arg, chunk, worker)
+// Finds the least and greatest key of a chunk of the items.
+static void _phamt_bulk_range(void* arg, Py_ssize_t chunk, int worker)
+{
+   PHAMT_bulk_t* st = (PHAMT_bulk_t*)arg;
+   Py_ssize_t ii = st->n * chunk / st->nchunks;
+   Py_ssize_t end = st->n * (chunk + 1) / st->nchunks;
+   hash_t lo = st->keys[ii], hi = lo;
+   for (++ii; ii < end; ++ii) {
+      if (st->keys[ii] < lo) lo = st->keys[ii];
+      else if (st->keys[ii] > hi) hi = st->keys[ii];
+   }
+   st->bounds[2*chunk] = lo;
+   st->bounds[2*chunk + 1] = hi;
+}
+// _phamt_bulk_count(arg, chunk, worker)
+// Counts the items of each bucket in a chunk of the items.
+static void _phamt_bulk_count(void* arg, Py_ssize_t chunk, int worker)
+{
+   PHAMT_bulk_t* st = (PHAMT_bulk_t*)arg;
+   Py_ssize_t ii = st->n * chunk / st->nchunks;
+   Py_ssize_t end = st->n * (chunk + 1) / st->nchunks;
+   Py_ssize_t* counts = st->counts + chunk*st->nbuckets;
+   for (; ii < end; ++ii) ++counts[(st->keys[ii] >> st->shift) & st->mask];
+}
+// _phamt_bulk_scatter(arg, chunk, worker)
+// Copies the items of a chunk into their buckets, at the offsets that the
+// counts of the chunk have been turned into.
+static void _phamt_bulk_scatter(void* arg, Py_ssize_t chunk, int worker)
+{
+   PHAMT_bulk_t* st = (PHAMT_bulk_t*)arg;
+   Py_ssize_t ii = st->n * chunk / st->nchunks;
+   Py_ssize_t end = st->n * (chunk + 1) / st->nchunks;
+   Py_ssize_t* offsets = st->counts + chunk*st->nbuckets;
+   PHAMT_item_t* it;
+   for (; ii < end; ++ii) {
+      it = st->items + offsets[(st->keys[ii] >> st->shift) & st->mask]++;
+      it->key = st->keys[ii];
+      it->val = st->vals[ii];
+   }
+}
+// _phamt_bulk_plan(arg, bucket, worker)
+// Sorts the items of a bucket, drops all but the last item of each key, and
+// plans the bucket's nodes.
+static void _phamt_bulk_plan(void* arg, Py_ssize_t bucket, int worker)
+{
+   PHAMT_bucket_t* bk = ((PHAMT_bulk_t*)arg)->buckets + bucket;
+   PHAMT_item_t* tmp;
+   Py_ssize_t ii, m;
+   if (bk->n == 0) return;
+   for (ii = 1; ii < bk->n && bk->items[ii-1].key <= bk->items[ii].key; ++ii) ;
+   if (ii < bk->n) {
+      tmp = (PHAMT_item_t*)PyMem_RawMalloc(sizeof(PHAMT_item_t)*bk->n);
+      if (!tmp) {
+         bk->err = 1;
+         return;
+      }
+      _phamt_sort_items(bk->items, tmp, bk->n);
+      PyMem_RawFree(tmp);
+   }
+   for (ii = 0, m = 0; ii < bk->n; ++ii) {
+      if (ii + 1 < bk->n && bk->items[ii+1].key == bk->items[ii].key) continue;
+      bk->items[m++] = bk->items[ii];
+   }
+   bk->n = m;
+   _phamt_bulk_node(bk, bk->items, bk->n);
+}
+// _phamt_bulk_fill(arg, bucket, worker)
+// Fills in the allocated nodes of a bucket.
+static void _phamt_bulk_fill(void* arg, Py_ssize_t bucket, int worker)
+{
+   PHAMT_bucket_t* bk = ((PHAMT_bulk_t*)arg)->buckets + bucket;
+   bk->next = 0;
+   if (bk->n) bk->root = _phamt_bulk_node(bk, bk->items, bk->n);
+}
+// phamt_from_arrays(keys, vals, n, flag_pyobject, nthreads)
+// Builds a PHAMT from arrays of keys and values; see phamt.h.
+PHAMT_t phamt_from_arrays(const hash_t* keys, void* const* vals, Py_ssize_t n,
+                          uint8_t flag_pyobject, int nthreads)
+{
+   PHAMT_bulk_t st;
+   PHAMT_bucket_t* bk;
+   PHAMT_t u = NULL, v;
+   Py_ssize_t ii, jj, c, off, m = 0;
+   hash_t lo, hi;
+   unsigned nbits = 0, nvar;
+   int err = 0;
+   if (n == 0) return (flag_pyobject ? phamt_empty() : phamt_empty_ctype());
+   if (nthreads > PHAMT_POOL_MAXTHREADS) nthreads = PHAMT_POOL_MAXTHREADS;
+   if ((Py_ssize_t)nthreads > n / PHAMT_BULK_GRAIN + 1)
+      nthreads = (int)(n / PHAMT_BULK_GRAIN + 1);
+   if (nthreads < 1) nthreads = 1;
+   memset(&st, 0, sizeof(PHAMT_bulk_t));
+   st.keys = keys;
+   st.vals = vals;
+   st.n = n;
+   st.nchunks = 2*nthreads - 1;
+   st.items = (PHAMT_item_t*)PyMem_RawMalloc(sizeof(PHAMT_item_t)*n);
+   st.bounds = (hash_t*)PyMem_RawMalloc(sizeof(hash_t)*2*st.nchunks);
+   if (!st.items || !st.bounds) {
+      PyMem_RawFree(st.items);
+      PyMem_RawFree(st.bounds);
+      PyErr_NoMemory();
+      return NULL;
+   }
+   Py_BEGIN_ALLOW_THREADS
+   // With one thread, there is only one bucket; otherwise, there are about 8
+   // buckets per thread, but each spans at least one node's worth of twigs.
+   _phamt_pool_run(nthreads, st.nchunks, _phamt_bulk_range, &st);
+   lo = st.bounds[0];
+   hi = st.bounds[1];
+   for (c = 1; c < st.nchunks; ++c) {
+      if (st.bounds[2*c] < lo) lo = st.bounds[2*c];
+      if (st.bounds[2*c + 1] > hi) hi = st.bounds[2*c + 1];
+   }
+   if (nthreads > 1 && lo != hi) {
+      nvar = (unsigned)highbitdiff_hash(lo, hi) + 1;
+      while ((1 << nbits) < 8*nthreads && nbits < 12) ++nbits;
+      if (nvar < PHAMT_NODE_SHIFT + PHAMT_TWIG_SHIFT + nbits)
+         nbits = (nvar > PHAMT_NODE_SHIFT + PHAMT_TWIG_SHIFT
+                  ? nvar - PHAMT_NODE_SHIFT - PHAMT_TWIG_SHIFT
+                  : 0);
+      if (nbits) st.shift = nvar - nbits;
+   }
+   st.nbuckets = (Py_ssize_t)1 << nbits;
+   st.mask = (hash_t)(st.nbuckets - 1);
+   st.counts = (Py_ssize_t*)PyMem_RawCalloc(st.nchunks*st.nbuckets,
+                                            sizeof(Py_ssize_t));
+   st.buckets = (PHAMT_bucket_t*)PyMem_RawCalloc(st.nbuckets,
+                                                 sizeof(PHAMT_bucket_t));
+   if (st.counts && st.buckets) {
+      _phamt_pool_run(nthreads, st.nchunks, _phamt_bulk_count, &st);
+      // Each bucket's items are laid out in order of the chunks they came
+      // from, so the last value of a repeated key stays last.
+      for (off = 0, jj = 0; jj < st.nbuckets; ++jj) {
+         bk = st.buckets + jj;
+         bk->items = st.items + off;
+         bk->flag_pyobject = flag_pyobject;
+         for (c = 0; c < st.nchunks; ++c) {
+            ii = st.counts[c*st.nbuckets + jj];
+            st.counts[c*st.nbuckets + jj] = off;
+            off += ii;
+         }
+         bk->n = off - (bk->items - st.items);
+      }
+      _phamt_pool_run(nthreads, st.nchunks, _phamt_bulk_scatter, &st);
+      _phamt_pool_run(nthreads, st.nbuckets, _phamt_bulk_plan, &st);
+   } else {
+      err = 1;
+   }
+   Py_END_ALLOW_THREADS
+   for (jj = 0; !err && jj < st.nbuckets; ++jj) {
+      err = st.buckets[jj].err;
+      m += st.buckets[jj].n;
+   }
+   if (err) {
+      PyErr_NoMemory();
+   } else if (m <= PHAMT_SMALL_MAX) {
+      // A few items are assoc'd into a small map instead.
+      u = (flag_pyobject ? phamt_empty() : phamt_empty_ctype());
+      for (jj = 0; jj < st.nbuckets; ++jj) {
+         bk = st.buckets + jj;
+         for (ii = 0; u && ii < bk->n; ++ii) {
+            v = phamt_assoc(u, bk->items[ii].key, bk->items[ii].val);
+            Py_DECREF(u);
+            u = v;
+         }
+      }
+   } else {
+      // Allocate the planned nodes; ctype nodes never need a GC header.
+      for (jj = 0; !err && jj < st.nbuckets; ++jj) {
+         bk = st.buckets + jj;
+         if (!bk->n) continue;
+         bk->nodes = (PHAMT_t*)PyMem_RawMalloc(sizeof(PHAMT_t)*bk->nnodes);
+         if (!bk->nodes) {
+            PyErr_NoMemory();
+            err = 1;
+            break;
+         }
+         for (bk->next = 0; bk->next < bk->nnodes; ++bk->next) {
+            ii = bk->sizes[bk->next];
+            v = (flag_pyobject ? _phamt_new((unsigned)ii)
+                               : _phamt_new_nogc((unsigned)ii));
+            if (!v) {
+               err = 1;
+               break;
+            }
+            bk->nodes[bk->next] = v;
+         }
+      }
+      if (err) {
+         for (jj = 0; jj < st.nbuckets; ++jj) {
+            bk = st.buckets + jj;
+            if (!bk->nodes) continue;
+            for (ii = 0; ii < bk->next; ++ii) _phamt_bulk_discard(bk->nodes[ii]);
+         }
+      } else {
+         Py_BEGIN_ALLOW_THREADS
+         _phamt_pool_run(nthreads, st.nbuckets, _phamt_bulk_fill, &st);
+         Py_END_ALLOW_THREADS
+         // Each bucket's root owns its values before any are joined, so that
+         // the roots left over after a failed union can simply be released.
+         for (jj = 0; flag_pyobject && jj < st.nbuckets; ++jj) {
+            bk = st.buckets + jj;
+            if (!bk->n) continue;
+            for (ii = 0; ii < bk->n; ++ii)
+               Py_INCREF((PyObject*)bk->items[ii].val);
+            for (ii = 0; ii < bk->nnodes; ++ii)
+               _phamt_track(bk->nodes[ii]);
+         }
+         for (jj = 0; jj < st.nbuckets; ++jj) {
+            bk = st.buckets + jj;
+            if (!bk->n) continue;
+            if (!u) {
+               u = bk->root;
+               continue;
+            }
+            v = phamt_union(u, bk->root);
+            Py_DECREF(u);
+            Py_DECREF(bk->root);
+            u = v;
+            if (!u) {
+               for (++jj; jj < st.nbuckets; ++jj)
+                  if (st.buckets[jj].n) Py_DECREF(st.buckets[jj].root);
+               break;
+            }
+         }
+      }
+   }
+   PyMem_RawFree(st.items);
+   PyMem_RawFree(st.bounds);
+   PyMem_RawFree(st.counts);
+   if (st.buckets) {
+      for (jj = 0; jj < st.nbuckets; ++jj) {
+         PyMem_RawFree(st.buckets[jj].sizes);
+         PyMem_RawFree(st.buckets[jj].nodes);
+      }
+      PyMem_RawFree(st.buckets);
+   }
+   return u;
+}
+// phamt_assoc_arrays(node, keys, vals, n, nthreads)
+// Assoc's arrays of keys and values into a PHAMT; see phamt.h.
+PHAMT_t phamt_assoc_arrays(PHAMT_t node, const hash_t* keys, void* const* vals,
+                           Py_ssize_t n, int nthreads)
+{
+   PHAMT_t batch, u;
+   if (n == 0) {
+      Py_INCREF(node);
+      return node;
+   }
+   batch = phamt_from_arrays(keys, vals, n, node->flag_pyobject, nthreads);
+   if (!batch) return NULL;
+   // The union keeps the values of its first argument.
+   u = phamt_union(batch, node);
+   Py_DECREF(batch);
+   return u;
+}
+//------------------------------------------------------------------------------
+// Parallel Traversal
+// A parallel walk starts with the root in the deque of worker 0. Each worker
+// repeatedly takes a subtree from its own deque (or steals one from another
+// worker's) and either walks it, if it is small, or pushes its children onto
+// its own deque. The children are pushed in reverse order, so a worker walks
+// its subtrees in key order while the others steal from its larger, later
+// subtrees. The walk ends once no subtree is pending.
+
+// _phamt_walk_splits(st, node)
+// Yields 1 if the walk st should split node into its children rather than
+// walking it as one subtree.
+static inline int _phamt_walk_splits(PHAMT_walk_t* st, PHAMT_t node)
+{
+   return (!node->flag_small &&
+           node->addr_depth < PHAMT_TWIG_DEPTH && node->numel > st->grain);
+}
+// _phamt_walk_task(arg, task, worker)
+// Runs one worker of a parallel walk; the worker's index is the task number.
+static void _phamt_walk_task(void* arg, Py_ssize_t task, int worker)
+{
+   PHAMT_walk_t* st = (PHAMT_walk_t*)arg;
+   PHAMT_t* dq = st->deques + task*st->cap;
+   PHAMT_t node;
+   bits_t b, bi, ii, ncells;
+   Py_ssize_t v, nv;
+   PY_TIMEOUT_T nap = 0;
+   int r, split;
+   for (;;) {
+      node = NULL;
+      split = 0;
+      PyThread_acquire_lock(st->lock, WAIT_LOCK);
+      if (st->result || st->pending == 0) {
+         PyThread_release_lock(st->lock);
+         return;
+      }
+      if (st->backs[task] > st->fronts[task]) {
+         node = dq[--st->backs[task]];
+      } else {
+         for (nv = 1; nv < st->nworkers; ++nv) {
+            v = (task + nv) % st->nworkers;
+            if (st->backs[v] > st->fronts[v]) {
+               node = st->deques[v*st->cap + st->fronts[v]++];
+               break;
+            }
+         }
+      }
+      if (st->backs[task] == st->fronts[task])
+         st->backs[task] = st->fronts[task] = 0;
+      if (node && _phamt_walk_splits(st, node)) {
+         // Internal nodes are never packed, so their cells are their children.
+         ncells = popcount_bits(node->bits);
+         for (b = node->bits, ii = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+            bi = ctz_bits(b);
+            dq[st->backs[task] + ncells - 1 - ii] =
+               (PHAMT_t)node->cells[node->flag_full ? bi : ii];
+         }
+         st->backs[task] += ncells;
+         st->pending += ncells - 1;
+         split = 1;
+      }
+      PyThread_release_lock(st->lock);
+      if (split) continue;
+      if (!node) {
+         // There was nothing to steal, but other workers are still splitting
+         // or walking subtrees; we nap for longer each time that we find no
+         // work, so that idle workers don't crowd out the busy ones.
+         nap = (nap ? 2*nap : 10);
+         if (nap > PHAMT_WALK_NAP) nap = PHAMT_WALK_NAP;
+         PyThread_acquire_lock_timed(st->nap, nap, 0);
+         continue;
+      }
+      nap = 0;
+      r = (*st->fn)(node, (int)task, st->arg);
+      PyThread_acquire_lock(st->lock, WAIT_LOCK);
+      --st->pending;
+      if (r && !st->result) st->result = r;
+      PyThread_release_lock(st->lock);
+   }
+}
+// phamt_walk(node, fn, arg, nthreads, grain)
+// Walks the subtrees of node on up to nthreads threads; see phamt.h.
+int phamt_walk(PHAMT_t node, phamt_walkfn_t fn, void* arg, int nthreads,
+               numel_t grain)
+{
+   PHAMT_walk_t st;
+   if (nthreads > PHAMT_POOL_MAXTHREADS) nthreads = PHAMT_POOL_MAXTHREADS;
+   if (nthreads < 1) nthreads = 1;
+   if (grain == 0) {
+      // About 8 subtrees per thread, so that the threads can even out.
+      grain = node->numel / (8 * (numel_t)nthreads);
+      if (grain < PHAMT_WALK_GRAIN) grain = PHAMT_WALK_GRAIN;
+   }
+   st.nworkers = nthreads;
+   st.grain = grain;
+   st.fn = fn;
+   st.arg = arg;
+   if (nthreads == 1 || !_phamt_walk_splits(&st, node))
+      return (*fn)(node, 0, arg);
+   // A deque never holds more than the children of one node at each level.
+   st.cap = PHAMT_LEVELS * PHAMT_ANY_MAXCELLS;
+   st.deques = (PHAMT_t*)PyMem_RawMalloc(sizeof(PHAMT_t)*st.cap*nthreads);
+   st.fronts = (Py_ssize_t*)PyMem_RawCalloc(2*nthreads, sizeof(Py_ssize_t));
+   st.lock = PyThread_allocate_lock();
+   st.nap = PyThread_allocate_lock();
+   if (!st.deques || !st.fronts || !st.lock || !st.nap) {
+      // Without the memory for the deques, we walk the whole node at once.
+      PyMem_RawFree(st.deques);
+      PyMem_RawFree(st.fronts);
+      if (st.lock) PyThread_free_lock(st.lock);
+      if (st.nap) PyThread_free_lock(st.nap);
+      return (*fn)(node, 0, arg);
+   }
+   PyThread_acquire_lock(st.nap, WAIT_LOCK);
+   st.backs = st.fronts + nthreads;
+   st.deques[0] = node;
+   st.backs[0] = 1;
+   st.pending = 1;
+   st.result = 0;
+   _phamt_pool_run(nthreads, nthreads, _phamt_walk_task, &st);
+   PyMem_RawFree(st.deques);
+   PyMem_RawFree(st.fronts);
+   PyThread_free_lock(st.lock);
+   PyThread_release_lock(st.nap);
+   PyThread_free_lock(st.nap);
+   return st.result;
+}
+// _phamt_walk_each(node, worker, arg)
+// The walk function of phamt_foreach_parallel(); arg is its state, an array of
+// the function to call followed by the arguments of the workers.
+static int _phamt_walk_each(PHAMT_t node, int worker, void* arg)
+{
+   void** fa = (void**)arg;
+   return phamt_foreach(node, *(phamt_eachfn_t*)fa[0], fa[1 + worker]);
+}
+// phamt_foreach_parallel(node, fn, args, nthreads)
+// Calls fn on each item of node on up to nthreads threads; see phamt.h.
+int phamt_foreach_parallel(PHAMT_t node, phamt_eachfn_t fn, void* const* args,
+                           int nthreads)
+{
+   void* fa[PHAMT_POOL_MAXTHREADS + 1];
+   int ii;
+   if (nthreads > PHAMT_POOL_MAXTHREADS) nthreads = PHAMT_POOL_MAXTHREADS;
+   fa[0] = (void*)&fn;
+   for (ii = 0; ii < nthreads; ++ii) fa[1 + ii] = args[ii];
+   return phamt_walk(node, _phamt_walk_each, fa, nthreads, 0);
+}
+//------------------------------------------------------------------------------
+// PHAMT_iter Methods
+
+static void py_phamtiter_dealloc(PHAMT_iter_t self)
+{
+   PyTypeObject* tp;
+   tp = Py_TYPE(self);
+   // Untrack ourself.
+   PyObject_GC_UnTrack(self);
+   // Clear the children.
+   py_phamtiter_clear(self);
+   // Free the object.
+   tp->tp_free(self);
+}
+static int py_phamtiter_traverse(PHAMT_iter_t self, visitproc visit, void *arg)
+{
+   Py_VISIT(Py_TYPE(self));
+   Py_VISIT(self->path.steps[self->path.min_depth].node);
+   return 0;
+}
+static int py_phamtiter_clear(PHAMT_iter_t self)
+{
+   Py_CLEAR(self->path.steps[self->path.min_depth].node);   
+   return 0;
+}
+static PyObject* py_phamtiter_repr(PHAMT_iter_t self)
 {
    return PyUnicode_FromString("<PHAMT_iter>");
 }
-static PyObject* py_phamtiter_iter(PHAMT_iter_t self)
+static PyObject* py_phamtiter_iter(PHAMT_iter_t self)
+{
+   Py_INCREF(self);
+   return (PyObject*)self;
+}
+// _py_phamtiter_step(self, key)
+// Advances the iterator self and returns the next value, storing its key in
+// *key. If there are no more items, the StopIteration exception is raised and
+// NULL is returned.
+static void* _py_phamtiter_step(PHAMT_iter_t self, hash_t* key)
+{
+   PHAMT_loc_t* loc;
+   PHAMT_t node;
+   void* val = NULL;
+   // Depending on whether iteration hasn't started, has alerady ended, or is
+   // ongoing, we handle this differently.
+   loc = self->path.steps + self->path.min_depth;
+   node = loc->node;
+   if (self->path.value_found == 0xff) 
+      val = phamt_first(node, &self->path);
+   else if (self->path.value_found)
+      val = phamt_next(node, &self->path);
+   // If there aren't any more, raise the stop-iteration exception.
+   if (!self->path.value_found) {
+      PyErr_SetNone(PyExc_StopIteration);
+      return NULL;
+   }
+   // Otherwise, the key can be derived from the path.
+   *key = phamt_path_key(&self->path);
+   return val;
+}
+static PyObject* py_phamtiter_next(PHAMT_iter_t self)
+{
+   hash_t key;
+   void* val;
+   PyObject* res = NULL;
+   PHAMT_BEGIN_LOCK(self);
+   val = _py_phamtiter_step(self, &key);
+   if (val) res = Py_BuildValue("(NO)", _py_hash_to_key(key), val);
+   PHAMT_END_LOCK();
+   return res;
+}
+static PyObject* py_phamtkeyiter_next(PHAMT_iter_t self)
+{
+   hash_t key;
+   void* val;
+   PyObject* res = NULL;
+   PHAMT_BEGIN_LOCK(self);
+   val = _py_phamtiter_step(self, &key);
+   if (val) res = _py_hash_to_key(key);
+   PHAMT_END_LOCK();
+   return res;
+}
+static PyObject* py_phamtvaliter_next(PHAMT_iter_t self)
+{
+   hash_t key;
+   PyObject* val;
+   PHAMT_BEGIN_LOCK(self);
+   val = (PyObject*)_py_phamtiter_step(self, &key);
+   Py_XINCREF(val);
+   PHAMT_END_LOCK();
+   return val;
+}
+static PyObject* py_phamtiter_next_chunk(PHAMT_iter_t self, PyObject* arg)
+{
+   PHAMT_t node = self->path.steps[self->path.min_depth].node;
+   PyObject* res;
+   PHAMT_BEGIN_LOCK(self);
+   res = _py_iter_next_chunk(node, &self->path, arg);
+   PHAMT_END_LOCK();
+   return res;
+}
+// _py_iter_next_chunk(node, path, arg)
+// Implements the next_chunk method for both the PHAMT_iter and THAMT_iter
+// types: node is the node being iterated, path is the iterator's path, and arg
+// is the (Python integer) number of items requested.
+static PyObject* _py_iter_next_chunk(PHAMT_t node, PHAMT_path_t* path,
+                                     PyObject* arg)
+{
+   hash_t kbuf[PHAMT_CHUNK_BUFSIZE];
+   void* vbuf[PHAMT_CHUNK_BUFSIZE];
+   hash_t ii, got, want;
+   Py_ssize_t n, count = 0;
+   PyObject* keys, *vals, *k;
+   n = PyLong_AsSsize_t(arg);
+   if (n == -1 && PyErr_Occurred())
+      return NULL;
+   if (n < 0) {
+      PyErr_SetString(PyExc_ValueError, "next_chunk requires a count >= 0");
+      return NULL;
+   }
+   // We never need more space than there are elements in the node.
+   if ((hash_t)n > node->numel)
+      n = (Py_ssize_t)node->numel;
+   keys = PyList_New(n);
+   vals = PyList_New(n);
+   if (!keys || !vals)
+      goto fail;
+   // We fill the buffers then move their contents into the lists.
+   while (count < n && path->value_found) {
+      want = (hash_t)(n - count);
+      if (want > PHAMT_CHUNK_BUFSIZE)
+         want = PHAMT_CHUNK_BUFSIZE;
+      if (path->value_found == 0xff) {
+         // The iteration hasn't started yet, so we grab the first item.
+         vbuf[0] = phamt_first(node, path);
+         if (!path->value_found)
+            break;
+         kbuf[0] = phamt_path_key(path);
+         got = 1 + phamt_next_chunk(node, path, want - 1, kbuf + 1, vbuf + 1);
+      } else {
+         got = phamt_next_chunk(node, path, want, kbuf, vbuf);
+      }
+      for (ii = 0; ii < got; ++ii, ++count) {
+         k = _py_hash_to_key(kbuf[ii]);
+         if (!k)
+            goto fail;
+         PyList_SET_ITEM(keys, count, k);
+         Py_INCREF((PyObject*)vbuf[ii]);
+         PyList_SET_ITEM(vals, count, (PyObject*)vbuf[ii]);
+      }
+      if (got < want)
+         break;
+   }
+   // If we ran out of items, we trim the lists (the unused slots are NULL).
+   if (count < n) {
+      Py_SET_SIZE(keys, count);
+      Py_SET_SIZE(vals, count);
+   }
+   return Py_BuildValue("(NN)", keys, vals);
+fail:
+   Py_XDECREF(keys);
+   Py_XDECREF(vals);
+   return NULL;
+}
+
+//------------------------------------------------------------------------------
+// PHAMT_view Methods
+
+// _py_phamtview_new(phamt, type)
+// Creates a new view of the given PHAMT; the type must be one of the types that
+// share the PHAMT_view struct (PHAMT_keys_type, PHAMT_values_type, or
+// PHAMT_items_type).
+static PyObject* _py_phamtview_new(PHAMT_t phamt, PyTypeObject* type)
+{
+   PHAMT_view_t v = (PHAMT_view_t)PyObject_GC_New(struct PHAMT_view, type);
+   if (!v) return NULL;
+   Py_INCREF(phamt);
+   v->phamt = phamt;
+   PyObject_GC_Track(v);
+   return (PyObject*)v;
+}
+static void py_phamtview_dealloc(PHAMT_view_t self)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   PyObject_GC_UnTrack(self);
+   py_phamtview_clear(self);
+   tp->tp_free(self);
+}
+static int py_phamtview_traverse(PHAMT_view_t self, visitproc visit, void *arg)
+{
+   Py_VISIT(Py_TYPE(self));
+   Py_VISIT(self->phamt);
+   return 0;
+}
+static int py_phamtview_clear(PHAMT_view_t self)
+{
+   Py_CLEAR(self->phamt);
+   return 0;
+}
+static Py_ssize_t py_phamtview_len(PHAMT_view_t self)
+{
+   return (Py_ssize_t)self->phamt->numel;
+}
+static PyObject* py_phamtview_repr(PHAMT_view_t self)
+{
+   // The type names all start with the module name and a dot; we skip that.
+   return PyUnicode_FromFormat("<%s:n=%u>",
+                               Py_TYPE(self)->tp_name
+                                 + sizeof(PHAMT_MODULE_NAME),
+                               (unsigned)self->phamt->numel);
+}
+static PyObject* py_phamtview_mapping(PHAMT_view_t self, void* closure)
+{
+   Py_INCREF(self->phamt);
+   return (PyObject*)self->phamt;
+}
+static PyObject* py_phamtkeys_iter(PHAMT_view_t self)
+{
+   return _py_phamt_newiter(self->phamt, &PHAMT_keyiter_type);
+}
+static int py_phamtkeys_contains(PHAMT_view_t self, PyObject* key)
+{
+   return py_phamt_contains(self->phamt, key);
+}
+static PyObject* py_phamtkeys_and(PyObject* a, PyObject* b)
+{
+   return _py_phamtkeys_setop(a, b, phamt_intersect, "intersection_update");
+}
+static PyObject* py_phamtkeys_or(PyObject* a, PyObject* b)
+{
+   return _py_phamtkeys_setop(a, b, phamt_union, "update");
+}
+static PyObject* py_phamtkeys_sub(PyObject* a, PyObject* b)
+{
+   return _py_phamtkeys_setop(a, b, phamt_difference, "difference_update");
+}
+static PyObject* py_phamtkeys_xor(PyObject* a, PyObject* b)
+{
+   return _py_phamtkeys_setop(a, b, phamt_symdiff,
+                              "symmetric_difference_update");
+}
+// _py_phamtkeys_setop(a, b, op, method)
+// Implements the set operations of the PHAMT_keys type. Either a or b (or both)
+// is a PHAMT_keys view. If both are, then the PHAMT function op is applied to
+// their PHAMTs and a view of the result is returned. Otherwise, a set is made
+// from a then is updated with b using the set method of the given name, like
+// the set operations of Python's dictionary views.
+static PyObject* _py_phamtkeys_setop(PyObject* a, PyObject* b,
+                                     PHAMT_t (*op)(PHAMT_t, PHAMT_t),
+                                     const char* method)
+{
+   PHAMT_t u;
+   PyObject* res, *tmp;
+   if (Py_TYPE(a) == &PHAMT_keys_type && Py_TYPE(b) == &PHAMT_keys_type) {
+      u = (*op)(((PHAMT_view_t)a)->phamt, ((PHAMT_view_t)b)->phamt);
+      res = _py_phamtview_new(u, &PHAMT_keys_type);
+      Py_DECREF(u);
+      return res;
+   }
+   res = PySet_New(a);
+   if (!res) return NULL;
+   tmp = PyObject_CallMethod(res, method, "O", b);
+   if (!tmp) {
+      Py_DECREF(res);
+      return NULL;
+   }
+   Py_DECREF(tmp);
+   return res;
+}
+static PyObject* py_phamtvalues_iter(PHAMT_view_t self)
+{
+   return _py_phamt_newiter(self->phamt, &PHAMT_valiter_type);
+}
+static int py_phamtvalues_contains(PHAMT_view_t self, PyObject* val)
+{
+   PHAMT_path_t path;
+   PHAMT_t node = self->phamt;
+   void* u;
+   int r;
+   // There is no index of the values, so we just scan them.
+   for (u = phamt_first(node, &path); path.value_found;
+        u = phamt_next(node, &path)) {
+      r = PyObject_RichCompareBool((PyObject*)u, val, Py_EQ);
+      if (r != 0) return r;
+   }
+   return 0;
+}
+static PyObject* py_phamtitems_iter(PHAMT_view_t self)
+{
+   return _py_phamt_newiter(self->phamt, &PHAMT_iter_type);
+}
+static int py_phamtitems_contains(PHAMT_view_t self, PyObject* item)
+{
+   hash_t h;
+   int found;
+   PyObject* key, *val, *u;
+   if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) return 0;
+   key = PyTuple_GET_ITEM(item, 0);
+   val = PyTuple_GET_ITEM(item, 1);
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) return 0;
+   u = (PyObject*)phamt_lookup(self->phamt, h, &found);
+   if (!found) return 0;
+   return PyObject_RichCompareBool(u, val, Py_EQ);
+}
+
+//------------------------------------------------------------------------------
+// THAMT Methods
+
+// The THAMT methods below that touch self->phamt do so inside a critical
+// section on self (see PHAMT_BEGIN_LOCK), since its transient nodes may be
+// edited in place by another thread.
+static PyObject* py_thamt_get(THAMT_t self, PyObject* varargs)
+{
+   PyObject* res;
+   PHAMT_BEGIN_LOCK(self);
+   res = py_phamt_get(self->phamt, varargs);
+   PHAMT_END_LOCK();
+   return res;
+}
+static PyObject* py_thamt_persistent(THAMT_t self)
+{
+   PHAMT_t u;
+   _phamt_reclaim_due();
+   PHAMT_BEGIN_LOCK(self);
+   if (!self->phamt->flag_transient || self->iterators > 0) {
+      u = thamt_persist(self->phamt);
+   } else {
+      // Compact the transient nodes into a new persistent PHAMT, which the
+      // THAMT then continues from. While that happens, the THAMT must not
+      // refer to the nodes being consumed.
+      u = self->phamt;
+      self->phamt = phamt_empty_like(u);
+      u = thamt_compact(u);
+      Py_DECREF(self->phamt);
+      Py_INCREF(u);
+      self->phamt = u;
+   }
+   PHAMT_END_LOCK();
+   return (PyObject*)u;
+}
+static int py_thamt_contains(THAMT_t self, PyObject* key)
+{
+   int res;
+   PHAMT_BEGIN_LOCK(self);
+   res = py_phamt_contains(self->phamt, key);
+   PHAMT_END_LOCK();
+   return res;
+}
+static PyObject* py_thamt_subscript(THAMT_t self, PyObject* key)
+{
+   PyObject* res;
+   PHAMT_BEGIN_LOCK(self);
+   res = py_phamt_subscript(self->phamt, key);
+   PHAMT_END_LOCK();
+   return res;
+}
+static int py_thamt_ass_subscript(THAMT_t self, PyObject* key, PyObject* val)
+{
+   PHAMT_t u;
+   PHAMT_path_t path;
+   hash_t h;
+   int res = 0;
+   _phamt_reclaim_due();
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) {
+      PyErr_SetObject(PyExc_KeyError, key);
+      return -1;
+   }
+   PHAMT_BEGIN_LOCK(self);
+   u = self->phamt;
+   if (val) {
+      self->phamt = thamt_assoc(self->phamt, h, val);
+   } else {
+      // Find the location we're going to delete.
+      phamt_find(self->phamt, h, &path);
+      // We need to raise a key error when h is not found.
+      if (path.value_found) {
+         self->phamt = _thamt_dissoc_path(&path);
+      } else {
+         PyErr_SetObject(PyExc_KeyError, key);
+         res = -1;
+      }
+   }
+   if (res == 0) {
+      Py_DECREF(u);
+      ++(self->version);
+   }
+   PHAMT_END_LOCK();
+   return res;
+}
+static Py_ssize_t py_thamt_len(THAMT_t self)
+{
+   Py_ssize_t res;
+   PHAMT_BEGIN_LOCK(self);
+   res = (Py_ssize_t)self->phamt->numel;
+   PHAMT_END_LOCK();
+   return res;
+}
+static PyObject *py_thamt_iter(THAMT_t self)
+{
+   THAMT_iter_t it = (THAMT_iter_t)PyObject_GC_NewVar(struct THAMT_iter,
+                                                      &THAMT_iter_type, 0);
+   uint8_t d;
+   Py_INCREF(self);
+   it->thamt = self;
+   PHAMT_BEGIN_LOCK(self);
+   d = self->phamt->addr_depth;
+   ++(self->iterators);
+   it->version = self->version;
+   it->path.steps[d].node = self->phamt;
+   it->path.min_depth = d;
+   PHAMT_END_LOCK();
+   it->path.value_found = 0xff; // indicates we haven't started.
+   PyObject_GC_Track(it);
+   return (PyObject*)it;
+}
+static void py_thamt_dealloc(THAMT_t self)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   // Untrack ourself.
+   PyObject_GC_UnTrack(self);
+   // Clear the children.
+   py_thamt_clear(self);
+   // Free the node.
+   tp->tp_free(self);
+}
+static int py_thamt_traverse(THAMT_t self, visitproc visit, void *arg)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   Py_VISIT(tp);
+   Py_VISIT(self->phamt);
+   return 0;
+}
+static int py_thamt_clear(THAMT_t self)
+{
+   Py_CLEAR(self->phamt);
+   return 0;
+}
+static PyObject* py_thamt_repr(THAMT_t self)
+{
+   unsigned n;
+   PHAMT_BEGIN_LOCK(self);
+   dbgnode("[py_thamt_repr]", self->phamt);
+   n = (unsigned)self->phamt->numel;
+   PHAMT_END_LOCK();
+   return PyUnicode_FromFormat("<THAMT:n=%u>", n);
+}
+static PyObject* py_thamt_new(PyTypeObject *subtype, PyObject *args,
+                              PyObject *kw)
+{
+   PyObject* tmp;
+   PHAMT_t p;
+   THAMT_t u;
+   if (kw && PyDict_Size(kw) > 0) {
+      PyErr_SetString(PyExc_TypeError, "THAMT() takes no keyword arguments");
+      return NULL;
+   }
+   Py_ssize_t sz = PyTuple_Size(args);
+   if (sz == 1) {
+      if (!PyArg_ParseTuple(args, "O:get", &tmp))
+         return NULL;
+      if (Py_TYPE(tmp) != &PHAMT_type)
+         return _py_thamt_from_mapping(tmp);
+      p = (PHAMT_t)tmp;
+   } else if (sz == 0) {
+      p = PHAMT_EMPTY;
+   } else {
+      PyErr_SetString(PyExc_ValueError, "THAMT() requires 0 or 1 arguments");
+      return NULL;
+   }
+   u = (THAMT_t)PyObject_GC_NewVar(struct THAMT, &THAMT_type, 0);
+   u->phamt = phamt_expand(p);
+   u->version = 0;
+   u->iterators = 0;
+   PyObject_GC_Track((PyObject*)u);
+   return (PyObject*)u;
+}
+
+// _py_thamt_from_mapping(mapping)
+// Yields a new THAMT that holds the items of the given mapping, which need not
+// be a PHAMT of this module (so that, e.g., PHAMTs with 32-bit keys can be made
+// from PHAMTs with 64-bit keys); all of its keys must be valid PHAMT keys.
+static PyObject* _py_thamt_from_mapping(PyObject* mapping)
+{
+   PyObject* items, *it, *item, *res;
+   if (!PyMapping_Check(mapping) ||
+       !PyObject_HasAttrString(mapping, "items")) {
+      PyErr_SetString(PyExc_TypeError,
+                      "THAMT() argument must be a PHAMT or a mapping");
+      return NULL;
+   }
+   items = PyMapping_Items(mapping);
+   if (!items) return NULL;
+   it = PyObject_GetIter(items);
+   Py_DECREF(items);
+   if (!it) return NULL;
+   res = PyObject_CallObject((PyObject*)&THAMT_type, NULL);
+   while (res && (item = PyIter_Next(it))) {
+      if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+         PyErr_SetString(PyExc_TypeError, "mapping items must be pairs");
+         Py_CLEAR(res);
+      } else if (py_thamt_ass_subscript((THAMT_t)res,
+                                        PyTuple_GET_ITEM(item, 0),
+                                        PyTuple_GET_ITEM(item, 1)) < 0) {
+         Py_CLEAR(res);
+      }
+      Py_DECREF(item);
+   }
+   Py_DECREF(it);
+   if (res && PyErr_Occurred()) Py_CLEAR(res);
+   return res;
+}
+
+//------------------------------------------------------------------------------
+// THAMT_iter Methods
+
+static void py_thamtiter_dealloc(THAMT_iter_t self)
+{
+   PyTypeObject* tp;
+   tp = Py_TYPE(self);
+   // Untrack ourself.
+   PyObject_GC_UnTrack(self);
+   // Clear the children.
+   py_thamtiter_clear(self);
+   // Free the object.
+   tp->tp_free(self);
+}
+static int py_thamtiter_traverse(THAMT_iter_t self, visitproc visit, void *arg)
+{
+   Py_VISIT(Py_TYPE(self));
+   Py_VISIT(self->thamt);
+   return 0;
+}
+static int py_thamtiter_clear(THAMT_iter_t self)
+{
+   THAMT_t t = self->thamt;
+   if (t) {
+      PHAMT_BEGIN_LOCK(t);
+      --(t->iterators);
+      PHAMT_END_LOCK();
+   }
+   Py_CLEAR(self->thamt);
+   return 0;
+}
+static PyObject* py_thamtiter_repr(THAMT_iter_t self)
+{
+   return PyUnicode_FromString("<THAMT_iter>");
+}
+static PyObject* py_thamtiter_iter(THAMT_iter_t self)
 {
    Py_INCREF(self);
    return (PyObject*)self;
 }
-static PyObject* py_phamtiter_next(PHAMT_iter_t self)
+static PyObject* py_thamtiter_next(THAMT_iter_t self)
 {
-   PHAMT_loc_t* loc;
    PHAMT_t node;
-   void* val;
+   void* val = NULL;
    hash_t key;
+   PyObject* res = NULL;
+   // The iterator's path and the THAMT's nodes are both locked while we step.
+   PHAMT_BEGIN_LOCK2(self, self->thamt);
+   // If the  of the iterator doesn't match the version of the THAMT,
+   // that's a runtime error.
+   if (self->version != self->thamt->version) {
+      PyErr_SetString(PyExc_RuntimeError,
+                      "THAMT updated during iteration");
+      goto done;
+   }
    // Depending on whether iteration hasn't started, has alerady ended, or is
    // ongoing, we handle this differently.
-   loc = self->path.steps + self->path.min_depth;
-   node = loc->node;
-   if (self->path.value_found == 0xff) 
+   node = self->thamt->phamt;
+   if (self->path.value_found == 0xff)
       val = phamt_first(node, &self->path);
    else if (self->path.value_found)
       val = phamt_next(node, &self->path);
    // If there aren't any more, raise the stop-iteration exception.
    if (!self->path.value_found) {
       PyErr_SetNone(PyExc_StopIteration);
-      return NULL;
+      goto done;
    }
    // Otherwise, make a tuple and return it. The key can be derived from the
    // path.
-   loc = self->path.steps + self->path.max_depth;
-   key = loc->node->address | (hash_t)loc->index.bitindex;
-   return Py_BuildValue("(nO)", (Py_ssize_t)key, val);
+   key = phamt_path_key(&self->path);
+   dbgpath("[thamtiter_next]", &self->path);
+   res = Py_BuildValue("(NO)", _py_hash_to_key(key), val);
+  done:
+   PHAMT_END_LOCK2();
+   return res;
+}
+static PyObject* py_thamtiter_next_chunk(THAMT_iter_t self, PyObject* arg)
+{
+   PyObject* res = NULL;
+   PHAMT_BEGIN_LOCK2(self, self->thamt);
+   if (self->version != self->thamt->version)
+      PyErr_SetString(PyExc_RuntimeError,
+                      "THAMT updated during iteration");
+   else
+      res = _py_iter_next_chunk(self->thamt->phamt, &self->path, arg);
+   PHAMT_END_LOCK2();
+   return res;
 }
 
 //------------------------------------------------------------------------------
-// THAMT Methods
+// ShardedTHAMT Methods
+// Each shard is a THAMT, whose methods lock it (see PHAMT_BEGIN_LOCK), so these
+// methods only dispatch to the shards.
 
-static PyObject* py_thamt_get(THAMT_t self, PyObject* varargs)
+static PyObject* py_sthamt_new(PyTypeObject *subtype, PyObject *args,
+                               PyObject *kw)
+{
+   PyObject* tmp = (PyObject*)PHAMT_EMPTY, *t = NULL;
+   PHAMT_t parts[PHAMT_ROOT_MAXCELLS];
+   THAMT_sharded_t u;
+   int ii, err;
+   if (kw && PyDict_Size(kw) > 0) {
+      PyErr_SetString(PyExc_TypeError,
+                      "ShardedTHAMT() takes no keyword arguments");
+      return NULL;
+   }
+   if (!PyArg_ParseTuple(args, "|O:ShardedTHAMT", &tmp))
+      return NULL;
+   if (Py_TYPE(tmp) != &PHAMT_type) {
+      // Other mappings are copied into a THAMT, then persisted and split.
+      t = _py_thamt_from_mapping(tmp);
+      if (!t) return NULL;
+      tmp = py_thamt_persistent((THAMT_t)t);
+      Py_DECREF(t);
+      if (!tmp) return NULL;
+      t = tmp;
+   }
+   u = (THAMT_sharded_t)PyObject_GC_New(struct THAMT_sharded,
+                                        &THAMT_sharded_type);
+   if (u) {
+      phamt_split_root((PHAMT_t)tmp, parts);
+      for (ii = 0, err = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii) {
+         u->shards[ii] = (err ? NULL :
+                          (THAMT_t)PyObject_CallFunctionObjArgs(
+                             (PyObject*)&THAMT_type, (PyObject*)parts[ii],
+                             NULL));
+         if (!u->shards[ii]) err = 1;
+         Py_DECREF(parts[ii]);
+      }
+      PyObject_GC_Track((PyObject*)u);
+      if (err) Py_CLEAR(u);
+   }
+   Py_XDECREF(t);
+   return (PyObject*)u;
+}
+static void py_sthamt_dealloc(THAMT_sharded_t self)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   PyObject_GC_UnTrack(self);
+   py_sthamt_clear(self);
+   tp->tp_free(self);
+}
+static int py_sthamt_traverse(THAMT_sharded_t self, visitproc visit, void *arg)
+{
+   int ii;
+   Py_VISIT(Py_TYPE(self));
+   for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii)
+      Py_VISIT(self->shards[ii]);
+   return 0;
+}
+static int py_sthamt_clear(THAMT_sharded_t self)
+{
+   int ii;
+   for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii)
+      Py_CLEAR(self->shards[ii]);
+   return 0;
+}
+static PyObject* py_sthamt_repr(THAMT_sharded_t self)
+{
+   return PyUnicode_FromFormat("<ShardedTHAMT:n=%zd, nshards=%d>",
+                               py_sthamt_len(self), PHAMT_ROOT_MAXCELLS);
+}
+// _py_sthamt_shard(self, key)
+// Yields the (borrowed) shard of self that holds the given key. Keys that
+// aren't valid are given shard 0, whose THAMT raises the appropriate error.
+static THAMT_t _py_sthamt_shard(THAMT_sharded_t self, PyObject* key)
+{
+   hash_t h;
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) return self->shards[0];
+   return self->shards[h >> PHAMT_ROOT_FIRSTBIT];
+}
+static PyObject* py_sthamt_get(THAMT_sharded_t self, PyObject* varargs)
+{
+   if (PyTuple_GET_SIZE(varargs) < 1)
+      return py_thamt_get(self->shards[0], varargs);
+   return py_thamt_get(_py_sthamt_shard(self, PyTuple_GET_ITEM(varargs, 0)),
+                       varargs);
+}
+static PyObject* py_sthamt_persistent(THAMT_sharded_t self)
+{
+   PHAMT_t parts[PHAMT_ROOT_MAXCELLS], u = NULL;
+   int ii, jj;
+   for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii) {
+      parts[ii] = (PHAMT_t)py_thamt_persistent(self->shards[ii]);
+      if (!parts[ii]) break;
+   }
+   if (ii == PHAMT_ROOT_MAXCELLS) u = phamt_join_roots(parts);
+   for (jj = 0; jj < ii; ++jj)
+      Py_DECREF(parts[jj]);
+   return (PyObject*)u;
+}
+static PyObject* py_sthamt_shard(THAMT_sharded_t self, PyObject* arg)
+{
+   Py_ssize_t ii = PyLong_AsSsize_t(arg);
+   if (ii == -1 && PyErr_Occurred())
+      return NULL;
+   if (ii < 0 || ii >= PHAMT_ROOT_MAXCELLS) {
+      PyErr_SetString(PyExc_IndexError, "shard index out of range");
+      return NULL;
+   }
+   Py_INCREF(self->shards[ii]);
+   return (PyObject*)self->shards[ii];
+}
+static PyObject* py_sthamt_shard_of(THAMT_sharded_t self, PyObject* key)
+{
+   hash_t h;
+   if (!_py_is_key(key)) {
+      PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
+      return NULL;
+   }
+   if (!_py_key_to_hash(key, &h)) {
+      PyErr_SetObject(PyExc_KeyError, key);
+      return NULL;
+   }
+   return PyLong_FromLong((long)(h >> PHAMT_ROOT_FIRSTBIT));
+}
+static PyObject* py_sthamt_nshards(THAMT_sharded_t self, void* closure)
+{
+   return PyLong_FromLong(PHAMT_ROOT_MAXCELLS);
+}
+static int py_sthamt_contains(THAMT_sharded_t self, PyObject* key)
+{
+   return py_thamt_contains(_py_sthamt_shard(self, key), key);
+}
+static PyObject* py_sthamt_subscript(THAMT_sharded_t self, PyObject* key)
+{
+   return py_thamt_subscript(_py_sthamt_shard(self, key), key);
+}
+static int py_sthamt_ass_subscript(THAMT_sharded_t self, PyObject* key,
+                                   PyObject* val)
 {
-   return py_phamt_get(self->phamt, varargs);
+   return py_thamt_ass_subscript(_py_sthamt_shard(self, key), key, val);
+}
+static Py_ssize_t py_sthamt_len(THAMT_sharded_t self)
+{
+   Py_ssize_t n = 0;
+   int ii;
+   for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii)
+      n += py_thamt_len(self->shards[ii]);
+   return n;
+}
+static PyObject* py_sthamt_iter(THAMT_sharded_t self)
+{
+   PyObject* u = py_sthamt_persistent(self), *it;
+   if (!u) return NULL;
+   it = py_phamt_iter((PHAMT_t)u);
+   Py_DECREF(u);
+   return it;
+}
+
+//------------------------------------------------------------------------------
+// PHAMTRef Methods
+
+// The C API (see phamt.h). The critical sections on the reference are held
+// only while its PHAMT pointer is read or replaced; the PHAMTs themselves are
+// built outside of them.
+PHAMT_t phamtref_get(PHAMT_ref_t ref)
+{
+   PHAMT_t u;
+   PHAMT_BEGIN_LOCK(ref);
+   u = ref->phamt;
+   Py_INCREF(u);
+   PHAMT_END_LOCK();
+   return u;
+}
+int phamtref_compare_and_set(PHAMT_ref_t ref, PHAMT_t old, PHAMT_t u)
+{
+   int res = 0;
+   PHAMT_BEGIN_LOCK(ref);
+   if (ref->phamt == old) {
+      Py_INCREF(u);
+      ref->phamt = u;
+      res = 1;
+   }
+   PHAMT_END_LOCK();
+   // Releasing ref's reference to old may free it, so this waits until the
+   // critical section has ended.
+   if (res) Py_DECREF(old);
+   return res;
+}
+PHAMT_t phamtref_apply(PHAMT_ref_t ref, hash_t k, phamtfn_t fn, void* arg)
+{
+   PHAMT_t u, v;
+   for (;;) {
+      u = phamtref_get(ref);
+      v = phamt_apply(u, k, fn, arg);
+      if (!v) {
+         Py_DECREF(u);
+         return NULL;
+      }
+      if (v == u || phamtref_compare_and_set(ref, u, v)) {
+         Py_DECREF(u);
+         return v;
+      }
+      Py_DECREF(u);
+      Py_DECREF(v);
+   }
+}
+// The phamtfn_t functions that the assoc and dissoc methods apply.
+static uint8_t _phamtref_assocfn(uint8_t found, void** value, void* arg)
+{
+   *value = arg;
+   return 1;
+}
+static uint8_t _phamtref_dissocfn(uint8_t found, void** value, void* arg)
+{
+   return 0;
+}
+
+static PyObject* py_phamtref_new(PyTypeObject *subtype, PyObject *args,
+                                 PyObject *kw)
+{
+   PHAMT_t p = PHAMT_EMPTY;
+   PHAMT_ref_t u;
+   if (kw && PyDict_Size(kw) > 0) {
+      PyErr_SetString(PyExc_TypeError,
+                      "PHAMTRef() takes no keyword arguments");
+      return NULL;
+   }
+   if (!PyArg_ParseTuple(args, "|O!:PHAMTRef", &PHAMT_type, &p))
+      return NULL;
+   u = (PHAMT_ref_t)PyObject_GC_New(struct PHAMT_ref, &PHAMT_ref_type);
+   if (!u) return NULL;
+   Py_INCREF(p);
+   u->phamt = p;
+   PyObject_GC_Track((PyObject*)u);
+   return (PyObject*)u;
+}
+static void py_phamtref_dealloc(PHAMT_ref_t self)
+{
+   PyTypeObject* tp = Py_TYPE(self);
+   PyObject_GC_UnTrack(self);
+   py_phamtref_clear(self);
+   tp->tp_free(self);
+}
+static int py_phamtref_traverse(PHAMT_ref_t self, visitproc visit, void *arg)
+{
+   Py_VISIT(Py_TYPE(self));
+   Py_VISIT(self->phamt);
+   return 0;
+}
+static int py_phamtref_clear(PHAMT_ref_t self)
+{
+   Py_CLEAR(self->phamt);
+   return 0;
+}
+static PyObject* py_phamtref_repr(PHAMT_ref_t self)
+{
+   PHAMT_t u = phamtref_get(self);
+   PyObject* res = PyUnicode_FromFormat("<PHAMTRef:n=%u>",
+                                        (unsigned)u->numel);
+   Py_DECREF(u);
+   return res;
+}
+static PyObject* py_phamtref_get(PHAMT_ref_t self)
+{
+   return (PyObject*)phamtref_get(self);
+}
+static PyObject* py_phamtref_compare_and_set(PHAMT_ref_t self,
+                                             PyObject* varargs)
+{
+   PyObject* old;
+   PHAMT_t u;
+   if (!PyArg_ParseTuple(varargs, "OO!:compare_and_set",
+                         &old, &PHAMT_type, &u))
+      return NULL;
+   return PyBool_FromLong(phamtref_compare_and_set(self, (PHAMT_t)old, u));
+}
+static PyObject* py_phamtref_reset(PHAMT_ref_t self, PyObject* arg)
+{
+   PHAMT_t u;
+   if (Py_TYPE(arg) != &PHAMT_type) {
+      PyErr_SetString(PyExc_TypeError, "PHAMTRef.reset requires a PHAMT");
+      return NULL;
+   }
+   Py_INCREF(arg);
+   PHAMT_BEGIN_LOCK(self);
+   u = self->phamt;
+   self->phamt = (PHAMT_t)arg;
+   PHAMT_END_LOCK();
+   // The caller obtains the reference that self held.
+   return (PyObject*)u;
+}
+static PyObject* py_phamtref_swap(PHAMT_ref_t self, PyObject* varargs)
+{
+   Py_ssize_t ii, n = PyTuple_GET_SIZE(varargs);
+   PyObject* fn, *fnargs, *res, *arg;
+   PHAMT_t u;
+   if (n < 1) {
+      PyErr_SetString(PyExc_TypeError, "PHAMTRef.swap requires a function");
+      return NULL;
+   }
+   fn = PyTuple_GET_ITEM(varargs, 0);
+   for (;;) {
+      // The function is called as fn(u, *args). A new tuple is made for each
+      // call, since fn may keep the tuple that it was given.
+      fnargs = PyTuple_New(n);
+      if (!fnargs) return NULL;
+      u = phamtref_get(self);
+      PyTuple_SET_ITEM(fnargs, 0, (PyObject*)u);
+      for (ii = 1; ii < n; ++ii) {
+         arg = PyTuple_GET_ITEM(varargs, ii);
+         Py_INCREF(arg);
+         PyTuple_SET_ITEM(fnargs, ii, arg);
+      }
+      res = PyObject_Call(fn, fnargs, NULL);
+      if (res && Py_TYPE(res) != &PHAMT_type) {
+         PyErr_SetString(PyExc_TypeError,
+                         "PHAMTRef.swap function must return a PHAMT");
+         Py_CLEAR(res);
+      }
+      if (!res || phamtref_compare_and_set(self, u, (PHAMT_t)res)) {
+         Py_DECREF(fnargs);
+         return res;
+      }
+      Py_DECREF(fnargs);
+      Py_DECREF(res);
+   }
+}
+static PyObject* py_phamtref_assoc(PHAMT_ref_t self, PyObject* varargs)
+{
+   hash_t h;
+   PyObject* key, *val;
+   _phamt_reclaim_due();
+   if (!PyArg_ParseTuple(varargs, "OO:assoc", &key, &val))
+      return NULL;
+   if (!_py_is_key(key)) {
+      PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
+      return NULL;
+   }
+   if (!_py_key_to_hash(key, &h)) {
+      PyErr_SetObject(PyExc_KeyError, key);
+      return NULL;
+   }
+   return (PyObject*)phamtref_apply(self, h, _phamtref_assocfn, val);
+}
+static PyObject* py_phamtref_dissoc(PHAMT_ref_t self, PyObject* varargs)
+{
+   hash_t h;
+   PyObject* key;
+   _phamt_reclaim_due();
+   if (!PyArg_ParseTuple(varargs, "O:dissoc", &key))
+      return NULL;
+   if (!_py_is_key(key)) {
+      PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
+      return NULL;
+   }
+   // Keys out of range can't be in the PHAMT.
+   if (!_py_key_to_hash(key, &h))
+      return (PyObject*)phamtref_get(self);
+   return (PyObject*)phamtref_apply(self, h, _phamtref_dissocfn, NULL);
+}
+
+//------------------------------------------------------------------------------
+// ConcurrentTHAMT Methods
+// These follow the Ctrie of Prokopec et al. (2012), with PHAMT nodes for its
+// C-nodes and persistent subtries for its S-nodes (see THAMT_concurrent_t). The
+// main node of an I-node is read and replaced only inside a critical section on
+// the I-node, which is never held while nodes are built or released; in builds
+// with the GIL, nothing in these sections can release the GIL, so they are
+// atomic all the same. Because the generation of the ConcurrentTHAMT is read
+// inside the same section in which an I-node is updated (see _cthamt_gcas), no
+// I-node can be updated once a snapshot has ended its generation, which Ctrie
+// ensures with the helping protocol of its GCAS instead.
+
+// The last generation that was handed out. Snapshots share I-nodes, so the
+// generations are unique across all ConcurrentTHAMTs.
+static uint64_t phamt_cthamt_lastgen = 0;
+#ifdef Py_GIL_DISABLED
+#  define PHAMT_GEN_LOAD(p)     _Py_atomic_load_uint64(p)
+#  define PHAMT_GEN_STORE(p, g) _Py_atomic_store_uint64((p), (g))
+#  define PHAMT_GEN_NEXT() \
+      (_Py_atomic_add_uint64(&phamt_cthamt_lastgen, 1) + 1)
+#else
+#  define PHAMT_GEN_LOAD(p)     (*(p))
+#  define PHAMT_GEN_STORE(p, g) (*(p) = (g))
+#  define PHAMT_GEN_NEXT()      (++phamt_cthamt_lastgen)
+#endif
+
+// _cthamt_is_inode(cell)
+// Yields 1 if the given cell of a C-node is an I-node and 0 if it is a
+// persistent subtrie.
+static inline int _cthamt_is_inode(void* cell)
+{
+   return Py_TYPE((PyObject*)cell) == &PHAMT_inode_type;
+}
+// _cthamt_inode(gen, main, tomb)
+// Yields a new I-node of the given generation whose main node is main (whose
+// reference is stolen), or NULL on failure.
+static PHAMT_inode_t _cthamt_inode(uint64_t gen, PHAMT_t main, uint8_t tomb)
+{
+   PHAMT_inode_t in = (PHAMT_inode_t)PyObject_GC_New(struct PHAMT_inode,
+                                                     &PHAMT_inode_type);
+   if (!in) {
+      Py_DECREF(main);
+      return NULL;
+   }
+   in->gen = gen;
+   in->main = main;
+   in->cache = NULL;
+   in->tomb = tomb;
+   PyObject_GC_Track((PyObject*)in);
+   return in;
+}
+// _cthamt_read(in, tomb)
+// Yields the main node of the I-node in (caller obtains the reference) and
+// sets *tomb to 1 if in is entombed or to 0 otherwise.
+static PHAMT_t _cthamt_read(PHAMT_inode_t in, uint8_t* tomb)
+{
+   PHAMT_t m;
+   PHAMT_BEGIN_LOCK(in);
+   m = in->main;
+   *tomb = in->tomb;
+   Py_INCREF(m);
+   PHAMT_END_LOCK();
+   return m;
+}
+// _cthamt_root(c)
+// Yields the root I-node of c (caller obtains the reference).
+static PHAMT_inode_t _cthamt_root(THAMT_concurrent_t c)
+{
+   PHAMT_inode_t r;
+   PHAMT_BEGIN_LOCK(c);
+   r = c->root;
+   Py_INCREF(r);
+   PHAMT_END_LOCK();
+   return r;
+}
+// _cthamt_gcas(c, in, old, m, tomb)
+// If the main node of the I-node in is still old and in belongs to the current
+// generation of c, replaces the main node with m (and the tomb flag with tomb)
+// and yields 1; otherwise, leaves in unchanged and yields 0. The reference to
+// m is stolen.
+static int _cthamt_gcas(THAMT_concurrent_t c, PHAMT_inode_t in, PHAMT_t old,
+                        PHAMT_t m, uint8_t tomb)
+{
+   int res = 0;
+   PHAMT_BEGIN_LOCK(in);
+   if (in->main == old && in->gen == PHAMT_GEN_LOAD(&c->gen)) {
+      in->main = m;
+      in->tomb = tomb;
+      res = 1;
+   }
+   PHAMT_END_LOCK();
+   // Releasing in's reference to old (or ours to m) may free it, so this waits
+   // until the critical section has ended.
+   Py_DECREF(res ? old : m);
+   return res;
+}
+// _cthamt_commit(c, in, m, ci, cell, isroot)
+// Replaces the main node m of the I-node in, with _cthamt_gcas(), by a copy of
+// m whose cell ci is the given cell (whose reference is stolen): the cell is
+// added if ci isn't found and removed if cell is NULL. The numel of a C-node
+// counts the elements of its persistent cells only, so that a C-node without
+// I-nodes is a PHAMT in its own right. If in isn't the root and the copy would
+// hold no I-node and fewer than two cells, in is instead entombed with its one
+// cell (or the empty PHAMT), which the parent C-node may take in its place.
+// Yields 0 if the GCAS fails, 1 if it succeeds, and 2 if it entombs in.
+static int _cthamt_commit(THAMT_concurrent_t c, PHAMT_inode_t in, PHAMT_t m,
+                          PHAMT_index_t ci, PHAMT_t cell, int isroot)
+{
+   PHAMT_t u, old = (ci.is_found ? (PHAMT_t)m->cells[ci.cellindex] : NULL);
+   bits_t ncells = phamt_cellcount(m) - (old != NULL) + (cell != NULL);
+   hash_t numel = m->numel;
+   if (!isroot && ncells <= 1) {
+      u = cell;
+      if (!u && ncells == 1)
+         u = (PHAMT_t)_phamt_getcell(m, ctz_bits(m->bits
+                                                 & ~(BITS_ONE << ci.bitindex)));
+      if (!u || !_cthamt_is_inode(u)) {
+         if (!u)         u = phamt_empty_like(m);
+         else if (!cell) Py_INCREF(u);
+         return 2*_cthamt_gcas(c, in, m, u, 1);
+      }
+   }
+   if (old && !_cthamt_is_inode(old))   numel -= old->numel;
+   if (cell && !_cthamt_is_inode(cell)) numel += cell->numel;
+   if (!cell)    u = _phamt_copy_delcell(m, ci);
+   else if (old) u = _phamt_copy_chgcell(m, ci, cell);
+   else          u = _phamt_copy_addcell(m, ci, cell);
+   // The copy holds its own reference to the cell. (If the root is left with
+   // no cells, the copy is the empty PHAMT, whose numel is already right.)
+   Py_XDECREF(cell);
+   if (ncells) u->numel = numel;
+   return _cthamt_gcas(c, in, m, u, 0);
+}
+// _cthamt_clean(c, parent, pm, pci, in, isroot)
+// If the I-node in, which is cell pci of the main node pm of the I-node
+// parent, is entombed, replaces it in (a copy of) pm by its subtrie.
+static void _cthamt_clean(THAMT_concurrent_t c, PHAMT_inode_t parent,
+                          PHAMT_t pm, PHAMT_index_t pci, PHAMT_inode_t in,
+                          int isroot)
+{
+   uint8_t tomb;
+   PHAMT_t m = _cthamt_read(in, &tomb);
+   if (!tomb) {
+      Py_DECREF(m);
+      return;
+   }
+   if (!m->numel) Py_CLEAR(m);
+   _cthamt_commit(c, parent, pm, pci, m, isroot);
+}
+// _cthamt_update(c, k, v, remove)
+// Associates the hash k with the value v in c (if remove is 0) or removes k from
+// c (if remove is 1). Yields 1 if the update was made (or if k was already
+// associated with v), 0 if k was to be removed but isn't in c, or -1 on
+// failure. Whenever a GCAS fails, the update starts over from the root.
+static int _cthamt_update(THAMT_concurrent_t c, hash_t k, void* v, int remove)
+{
+   // The main nodes read on the way down are held until the update is done, so
+   // that the I-nodes in their cells stay alive.
+   PHAMT_t path[PHAMT_LEVELS + 1], m, cell, u;
+   PHAMT_inode_t root, in, parent, child;
+   PHAMT_index_t ci, pci = {0};
+   uint64_t gen;
+   uint8_t tomb;
+   int depth, res, found;
+   do {
+      root = _cthamt_root(c);
+      gen = root->gen;
+      in = root;
+      parent = NULL;
+      depth = 0;
+      // res is -2 until the update is made (or fails), and stays -2 when the
+      // update must start over.
+      for (res = -2; res == -2; ) {
+         m = _cthamt_read(in, &tomb);
+         path[depth++] = m;
+         if (tomb) {
+            // The subtrie of in is moved into the parent before the update is
+            // tried again.
+            _cthamt_clean(c, parent, path[depth - 2], pci, in, parent == root);
+            break;
+         }
+         if (!phamt_isbeneath(m->address, m->addr_depth, k)) {
+            // The parent's cell holds in, but k is not beneath its C-node (so in
+            // isn't the root); a new C-node is made for in and k's twig.
+            if (remove) {
+               res = 0;
+               break;
+            }
+            u = phamt_from_kv(k, v, m->flag_pyobject);
+            Py_INCREF(in);
+            cell = _phamt_join_cells(m, in, u, u);
+            cell->numel = 1;
+            child = _cthamt_inode(gen, cell, 0);
+            if (!child) res = -1;
+            else if (_cthamt_commit(c, parent, path[depth - 2], pci,
+                                    (PHAMT_t)child, parent == root))
+               res = 1;
+            break;
+         }
+         ci = phamt_cellindex(m, k);
+         if (!ci.is_found) {
+            if (remove) {
+               res = 0;
+            } else {
+               u = phamt_from_kv(k, v, m->flag_pyobject);
+               if (_cthamt_commit(c, in, m, ci, u, in == root)) res = 1;
+            }
+            break;
+         }
+         cell = (PHAMT_t)m->cells[ci.cellindex];
+         if (_cthamt_is_inode(cell)) {
+            child = (PHAMT_inode_t)cell;
+            if (child->gen == gen) {
+               parent = in;
+               pci = ci;
+               in = child;
+               continue;
+            }
+            // The I-node belongs to an ended generation, so it is copied into
+            // this one before it is entered.
+            u = _cthamt_read(child, &tomb);
+            child = _cthamt_inode(gen, u, tomb);
+         } else if (cell->addr_depth < PHAMT_TWIG_DEPTH &&
+                    phamt_isbeneath(cell->address, cell->addr_depth, k)) {
+            // The persistent node above k becomes the C-node of a new I-node.
+            if (remove) {
+               phamt_lookup(cell, k, &found);
+               if (!found) {
+                  res = 0;
+                  break;
+               }
+            }
+            Py_INCREF(cell);
+            child = _cthamt_inode(gen, cell, 0);
+         } else {
+            // Twigs (and subtries that k isn't beneath) are updated like any
+            // other persistent node.
+            u = (remove ? phamt_dissoc(cell, k) : phamt_assoc(cell, k, v));
+            if (u == cell) {
+               Py_DECREF(u);
+               res = !remove;
+               break;
+            }
+            if (!u->numel) Py_CLEAR(u);
+            res = _cthamt_commit(c, in, m, ci, u, in == root);
+            if (res == 2)
+               _cthamt_clean(c, parent, path[depth - 2], pci, in,
+                             parent == root);
+            res = (res ? 1 : -2);
+            break;
+         }
+         // A new I-node replaces the cell, and then in is read again.
+         if (!child) res = -1;
+         else if (!_cthamt_commit(c, in, m, ci, (PHAMT_t)child, in == root))
+            break;
+         else Py_DECREF(path[--depth]);
+      }
+      while (depth) Py_DECREF(path[--depth]);
+      Py_DECREF(root);
+   } while (res == -2);
+   return res;
 }
-static PyObject* py_thamt_persistent(THAMT_t self)
+// _cthamt_persist(in)
+// Yields the PHAMT with the contents of the I-node in, whose generation must
+// have ended (caller obtains the reference). The PHAMT is kept in the I-node's
+// cache, so each I-node is persisted at most once.
+static PHAMT_t _cthamt_persist(PHAMT_inode_t in)
 {
-   return (PyObject*)thamt_persist(self->phamt);
+   PHAMT_t m, u, cell, cells[PHAMT_ANY_MAXCELLS];
+   bits_t b, bi, ii, jj, bits;
+   uint8_t tomb;
+   PHAMT_BEGIN_LOCK(in);
+   m = in->main;
+   u = in->cache;
+   tomb = in->tomb;
+   Py_INCREF(m);
+   Py_XINCREF(u);
+   PHAMT_END_LOCK();
+   if (u || tomb) {
+      if (!u) return m;
+      Py_DECREF(m);
+      return u;
+   }
+   bits = m->bits;
+   for (b = m->bits, ii = 0, jj = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+      bi = ctz_bits(b);
+      cell = (PHAMT_t)m->cells[m->flag_full ? bi : ii];
+      if (!_cthamt_is_inode(cell)) {
+         Py_INCREF(cell);
+      } else {
+         cell = _cthamt_persist((PHAMT_inode_t)cell);
+         if (!cell->numel) {
+            Py_DECREF(cell);
+            bits &= ~(BITS_ONE << bi);
+            continue;
+         }
+      }
+      cells[jj++] = cell;
+   }
+   // If m has no I-nodes, it is itself returned.
+   u = _phamt_build_like(m, bits, (void**)cells);
+   Py_DECREF(m);
+   PHAMT_BEGIN_LOCK(in);
+   if (!in->cache) {
+      Py_INCREF(u);
+      in->cache = u;
+   }
+   PHAMT_END_LOCK();
+   return u;
 }
-static int py_thamt_contains(THAMT_t self, PyObject* key)
+// _cthamt_freeze(c)
+// Ends the current generation of c by replacing its root with an I-node of a
+// new generation that has the same main node. Yields the old root, none of
+// whose I-nodes will change again (caller obtains the reference), or NULL on
+// failure.
+static PHAMT_inode_t _cthamt_freeze(THAMT_concurrent_t c)
 {
-   return py_phamt_contains(self->phamt, key);
+   PHAMT_inode_t r, nr;
+   PHAMT_t m;
+   uint64_t gen = PHAMT_GEN_NEXT();
+   uint8_t tomb;
+   int done;
+   for (;;) {
+      r = _cthamt_root(c);
+      m = _cthamt_read(r, &tomb);
+      nr = _cthamt_inode(gen, m, 0);
+      if (!nr) {
+         Py_DECREF(r);
+         return NULL;
+      }
+      done = 0;
+      PHAMT_BEGIN_LOCK2(c, r);
+      if (c->root == r && r->main == m) {
+         c->root = nr;
+         PHAMT_GEN_STORE(&c->gen, gen);
+         done = 1;
+      }
+      PHAMT_END_LOCK2();
+      // If r was replaced, both c's reference to it and ours are held here.
+      Py_DECREF(done ? (PyObject*)r : (PyObject*)nr);
+      if (done) return r;
+      Py_DECREF(r);
+   }
 }
-static PyObject* py_thamt_subscript(THAMT_t self, PyObject* key)
+// _cthamt_make(m)
+// Yields a new ConcurrentTHAMT of a new generation whose root C-node is m
+// (whose reference is stolen), or NULL on failure.
+static THAMT_concurrent_t _cthamt_make(PHAMT_t m)
 {
-   return py_phamt_subscript(self->phamt, key);
+   THAMT_concurrent_t c = (THAMT_concurrent_t)PyObject_GC_New(
+      struct THAMT_concurrent, &THAMT_concurrent_type);
+   if (!c) {
+      Py_DECREF(m);
+      return NULL;
+   }
+   c->gen = PHAMT_GEN_NEXT();
+   c->root = _cthamt_inode(c->gen, m, 0);
+   if (!c->root) {
+      Py_DECREF(c);
+      return NULL;
+   }
+   PyObject_GC_Track((PyObject*)c);
+   return c;
 }
-static int py_thamt_ass_subscript(THAMT_t self, PyObject* key, PyObject* val)
+
+// The C API (see phamt.h).
+THAMT_concurrent_t cthamt_new(PHAMT_t u)
 {
-   PHAMT_t u;
-   PHAMT_path_t path;
-   hash_t h;
-   if (!PyLong_Check(key)) {
-      PyErr_SetObject(PyExc_KeyError, key);
-      return -1;
+   PHAMT_scratch_t scratch;
+   PHAMT_t m = phamt_expand(u), r;
+   if (m->addr_depth != PHAMT_ROOT_DEPTH) {
+      // The root C-node gets the one cell of the root that m is beneath.
+      r = _phamt_scratch(&scratch, 1);
+      r->address = 0;
+      r->numel = m->numel;
+      r->bits = BITS_ONE << (bits_t)(m->address >> PHAMT_ROOT_FIRSTBIT);
+      r->flag_pyobject = m->flag_pyobject;
+      r->flag_firstn = firstn_bits(r->bits);
+      r->flag_full = 0;
+      r->flag_transient = 0;
+      r->addr_depth = PHAMT_ROOT_DEPTH;
+      r->addr_shift = PHAMT_ROOT_SHIFT;
+      r->addr_startbit = PHAMT_ROOT_FIRSTBIT;
+      r->cells[0] = (void*)m;
+      m = _phamt_finish(r);
    }
-   h = (hash_t)PyLong_AsSsize_t(key);
-   u = self->phamt;
-   if (val) {
-      self->phamt = thamt_assoc(self->phamt, h, val);
-   } else {
-      // Find the location we're going to delete.
-      phamt_find(self->phamt, h, &path);
-      // We need to raise a key error when h is not found.
-      if (!path.value_found) {
-         PyErr_SetObject(PyExc_KeyError, key);
-         return -1;
+   return _cthamt_make(m);
+}
+void* cthamt_lookup(THAMT_concurrent_t c, hash_t k, int* found)
+{
+   PHAMT_inode_t r = _cthamt_root(c);
+   PHAMT_index_t ci;
+   PHAMT_t m, u, cell;
+   uint8_t tomb;
+   void* v;
+   m = _cthamt_read(r, &tomb);
+   Py_DECREF(r);
+   for (;;) {
+      // An entombed I-node's main node is a persistent subtrie.
+      cell = m;
+      if (!tomb) {
+         ci = phamt_cellindex(m, k);
+         cell = (ci.is_found ? (PHAMT_t)m->cells[ci.cellindex] : NULL);
+         if (cell && _cthamt_is_inode(cell)) {
+            u = _cthamt_read((PHAMT_inode_t)cell, &tomb);
+            Py_DECREF(m);
+            m = u;
+            continue;
+         }
+      }
+      if (cell) {
+         v = phamt_lookup(cell, k, found);
+      } else {
+         v = NULL;
+         *found = 0;
       }
-      self->phamt = _thamt_dissoc_path(&path);
+      if (*found && m->flag_pyobject) Py_INCREF((PyObject*)v);
+      Py_DECREF(m);
+      return v;
    }
-   Py_DECREF(u);
-   ++(self->version);
-   return 0;
 }
-static Py_ssize_t py_thamt_len(THAMT_t self)
+int cthamt_assoc(THAMT_concurrent_t c, hash_t k, void* v)
 {
-   return (Py_ssize_t)self->phamt->numel;
+   return (_cthamt_update(c, k, v, 0) < 0 ? -1 : 0);
 }
-static PyObject *py_thamt_iter(THAMT_t self)
+int cthamt_dissoc(THAMT_concurrent_t c, hash_t k)
 {
-   THAMT_iter_t it = (THAMT_iter_t)PyObject_GC_NewVar(struct THAMT_iter,
-                                                      &THAMT_iter_type, 0);
-   uint8_t d = self->phamt->addr_depth;
-   Py_INCREF(self);
-   it->thamt = self;
-   it->version = self->version;
-   it->path.steps[d].node = self->phamt;
-   it->path.min_depth = d;
-   it->path.value_found = 0xff; // indicates we haven't started.
-   PyObject_GC_Track(it);
-   return (PyObject*)it;
+   return _cthamt_update(c, k, NULL, 1);
 }
-static void py_thamt_dealloc(THAMT_t self)
+THAMT_concurrent_t cthamt_snapshot(THAMT_concurrent_t c)
+{
+   PHAMT_inode_t r = _cthamt_freeze(c);
+   PHAMT_t m;
+   uint8_t tomb;
+   if (!r) return NULL;
+   // The I-nodes below r are shared by c and the snapshot, each of which
+   // copies them into its own generation as its writers reach them.
+   m = _cthamt_read(r, &tomb);
+   Py_DECREF(r);
+   return _cthamt_make(m);
+}
+PHAMT_t cthamt_persistent(THAMT_concurrent_t c)
+{
+   PHAMT_inode_t r = _cthamt_freeze(c);
+   PHAMT_t u;
+   if (!r) return NULL;
+   u = _cthamt_persist(r);
+   Py_DECREF(r);
+   return u;
+}
+
+static void py_inode_dealloc(PHAMT_inode_t self)
 {
    PyTypeObject* tp = Py_TYPE(self);
-   // Untrack ourself.
    PyObject_GC_UnTrack(self);
-   // Clear the children.
-   py_thamt_clear(self);
-   // Free the node.
+   py_inode_clear(self);
    tp->tp_free(self);
 }
-static int py_thamt_traverse(THAMT_t self, visitproc visit, void *arg)
+static int py_inode_traverse(PHAMT_inode_t self, visitproc visit, void *arg)
 {
-   PyTypeObject* tp = Py_TYPE(self);
-   Py_VISIT(tp);
-   Py_VISIT(self->phamt);
+   Py_VISIT(Py_TYPE(self));
+   Py_VISIT(self->main);
+   Py_VISIT(self->cache);
    return 0;
 }
-static int py_thamt_clear(THAMT_t self)
+static int py_inode_clear(PHAMT_inode_t self)
 {
-   Py_CLEAR(self->phamt);
+   Py_CLEAR(self->main);
+   Py_CLEAR(self->cache);
    return 0;
 }
-static PyObject* py_thamt_repr(THAMT_t self)
-{
-   dbgnode("[py_thamt_repr]", self->phamt);
-   return PyUnicode_FromFormat("<THAMT:n=%u>", (unsigned)self->phamt->numel);
-}
-static PyObject* py_thamt_new(PyTypeObject *subtype, PyObject *args,
-                              PyObject *kw)
+static PyObject* py_cthamt_new(PyTypeObject *subtype, PyObject *args,
+                               PyObject *kw)
 {
-   PyObject* tmp;
-   PHAMT_t p;
-   THAMT_t u;
+   PyObject* tmp = (PyObject*)PHAMT_EMPTY, *t = NULL;
+   THAMT_concurrent_t u;
    if (kw && PyDict_Size(kw) > 0) {
-      PyErr_SetString(PyExc_TypeError, "THAMT() takes no keyword arguments");
+      PyErr_SetString(PyExc_TypeError,
+                      "ConcurrentTHAMT() takes no keyword arguments");
       return NULL;
    }
-   Py_ssize_t sz = PyTuple_Size(args);
-   if (sz == 1) {
-      if (!PyArg_ParseTuple(args, "O:get", &tmp))
-         return NULL;
-      if (Py_TYPE(tmp) != &PHAMT_type) {
-         PyErr_SetString(PyExc_TypeError, "THAMT() argument must be a PHAMT");
-         return NULL;
-      }
-      p = (PHAMT_t)tmp;
-   } else if (sz == 0) {
-      p = PHAMT_EMPTY;
-   } else {
-      PyErr_SetString(PyExc_ValueError, "THAMT() requires 0 or 1 arguments");
+   if (!PyArg_ParseTuple(args, "|O:ConcurrentTHAMT", &tmp))
       return NULL;
+   if (Py_TYPE(tmp) != &PHAMT_type) {
+      // Other mappings are copied into a THAMT, then persisted.
+      t = _py_thamt_from_mapping(tmp);
+      if (!t) return NULL;
+      tmp = py_thamt_persistent((THAMT_t)t);
+      Py_DECREF(t);
+      if (!tmp) return NULL;
+      t = tmp;
    }
-   u = (THAMT_t)PyObject_GC_NewVar(struct THAMT, &THAMT_type, 0);
-   Py_INCREF(p);
-   u->phamt = p;
-   u->version = 0;
-   PyObject_GC_Track((PyObject*)u);
+   u = cthamt_new((PHAMT_t)tmp);
+   Py_XDECREF(t);
    return (PyObject*)u;
 }
-
-//------------------------------------------------------------------------------
-// THAMT_iter Methods
-
-static void py_thamtiter_dealloc(THAMT_iter_t self)
+static void py_cthamt_dealloc(THAMT_concurrent_t self)
 {
-   PyTypeObject* tp;
-   tp = Py_TYPE(self);
-   // Untrack ourself.
+   PyTypeObject* tp = Py_TYPE(self);
    PyObject_GC_UnTrack(self);
-   // Clear the children.
-   py_thamtiter_clear(self);
-   // Free the object.
+   py_cthamt_clear(self);
    tp->tp_free(self);
 }
-static int py_thamtiter_traverse(THAMT_iter_t self, visitproc visit, void *arg)
+static int py_cthamt_traverse(THAMT_concurrent_t self, visitproc visit,
+                              void *arg)
 {
    Py_VISIT(Py_TYPE(self));
-   Py_VISIT(self->thamt);
+   Py_VISIT(self->root);
    return 0;
 }
-static int py_thamtiter_clear(THAMT_iter_t self)
+static int py_cthamt_clear(THAMT_concurrent_t self)
 {
-   Py_CLEAR(self->thamt);
+   Py_CLEAR(self->root);
    return 0;
 }
-static PyObject* py_thamtiter_repr(THAMT_iter_t self)
-{
-   return PyUnicode_FromString("<THAMT_iter>");
-}
-static PyObject* py_thamtiter_iter(THAMT_iter_t self)
+static PyObject* py_cthamt_repr(THAMT_concurrent_t self)
 {
-   Py_INCREF(self);
-   return (PyObject*)self;
+   PHAMT_t u = cthamt_persistent(self);
+   PyObject* res;
+   if (!u) return NULL;
+   res = PyUnicode_FromFormat("<ConcurrentTHAMT:n=%u>", (unsigned)u->numel);
+   Py_DECREF(u);
+   return res;
 }
-static PyObject* py_thamtiter_next(THAMT_iter_t self)
+static PyObject* py_cthamt_get(THAMT_concurrent_t self, PyObject* varargs)
 {
-   PHAMT_loc_t* loc;
-   PHAMT_t node;
-   void* val;
-   hash_t key;
-   // If the  of the iterator doesn't match the version of the THAMT,
-   // that's a runtime error.
-   if (self->version != self->thamt->version) {
-      PyErr_SetString(PyExc_RuntimeError,
-                      "THAMT updated during iteration");
+   PyObject* key, *res = NULL, *dv = Py_None;
+   hash_t h;
+   int found = 0;
+   if (!PyArg_ParseTuple(varargs, "O|O:get", &key, &dv))
       return NULL;
-   }
-   // Depending on whether iteration hasn't started, has alerady ended, or is
-   // ongoing, we handle this differently.
-   node = self->thamt->phamt;
-   if (self->path.value_found == 0xff)
-      val = phamt_first(node, &self->path);
-   else if (self->path.value_found)
-      val = phamt_next(node, &self->path);
-   // If there aren't any more, raise the stop-iteration exception.
-   if (!self->path.value_found) {
-      PyErr_SetNone(PyExc_StopIteration);
+   if (!_py_is_key(key)) {
+      PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
       return NULL;
    }
-   // Otherwise, make a tuple and return it. The key can be derived from the
-   // path.
-   loc = self->path.steps + self->path.max_depth;
-   key = loc->node->address | (hash_t)loc->index.bitindex;
-   dbgpath("[thamtiter_next]", &self->path);
-   return Py_BuildValue("(nO)", (Py_ssize_t)key, val);
+   if (_py_key_to_hash(key, &h))
+      res = (PyObject*)cthamt_lookup(self, h, &found);
+   if (found) return res;
+   Py_INCREF(dv);
+   return dv;
+}
+static PyObject* py_cthamt_snapshot(THAMT_concurrent_t self)
+{
+   return (PyObject*)cthamt_snapshot(self);
+}
+static PyObject* py_cthamt_persistent(THAMT_concurrent_t self)
+{
+   return (PyObject*)cthamt_persistent(self);
+}
+static int py_cthamt_contains(THAMT_concurrent_t self, PyObject* key)
+{
+   hash_t h;
+   int found;
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) return 0;
+   Py_XDECREF((PyObject*)cthamt_lookup(self, h, &found));
+   return found;
+}
+static PyObject* py_cthamt_subscript(THAMT_concurrent_t self, PyObject* key)
+{
+   PyObject* val = NULL;
+   hash_t h;
+   int found = 0;
+   if (_py_is_key(key) && _py_key_to_hash(key, &h))
+      val = (PyObject*)cthamt_lookup(self, h, &found);
+   if (!found) PyErr_SetObject(PyExc_KeyError, key);
+   return val;
+}
+static int py_cthamt_ass_subscript(THAMT_concurrent_t self, PyObject* key,
+                                   PyObject* val)
+{
+   hash_t h;
+   int res;
+   _phamt_reclaim_due();
+   if (!_py_is_key(key) || !_py_key_to_hash(key, &h)) {
+      PyErr_SetObject(PyExc_KeyError, key);
+      return -1;
+   }
+   if (val) return cthamt_assoc(self, h, val);
+   res = cthamt_dissoc(self, h);
+   if (res == 0) PyErr_SetObject(PyExc_KeyError, key);
+   return (res == 1 ? 0 : -1);
+}
+static Py_ssize_t py_cthamt_len(THAMT_concurrent_t self)
+{
+   PHAMT_t u = cthamt_persistent(self);
+   Py_ssize_t n;
+   if (!u) return -1;
+   n = (Py_ssize_t)u->numel;
+   Py_DECREF(u);
+   return n;
+}
+static PyObject* py_cthamt_iter(THAMT_concurrent_t self)
+{
+   PHAMT_t u = cthamt_persistent(self);
+   PyObject* it;
+   if (!u) return NULL;
+   it = py_phamt_iter(u);
+   Py_DECREF(u);
+   return it;
 }
 
 //------------------------------------------------------------------------------
@@ -740,18 +4552,21 @@ static PyObject* py_PHAMT_from_iter(PyObject* self, PyObject *const *args,
                                     Py_ssize_t nargs)
 {
    PyObject* arg, *it;
-   PHAMT_t thamt;
+   PHAMT_t thamt, u;
    hash_t k = 0;
    if (nargs > 2 || nargs < 1) {
       PyErr_SetString(PyExc_ValueError, "PHAMT.from_iter requires 1 or 2 args");
       return NULL;
    } else if (nargs == 2) {
       arg = args[1];
-      if (!PyLong_Check(arg)) {
+      if (!_py_is_key(arg)) {
          PyErr_SetString(PyExc_ValueError, "k0 must be a long integer");
          return NULL;
       }
-      k = (hash_t)PyLong_AsSsize_t(arg);
+      if (!_py_key_to_hash(arg, &k)) {
+         PyErr_SetObject(PyExc_KeyError, arg);
+         return NULL;
+      }
    }
    arg = args[0];
    // Get the iterator:
@@ -759,18 +4574,32 @@ static PyObject* py_PHAMT_from_iter(PyObject* self, PyObject *const *args,
    if (it == NULL)
       return NULL;
    // We start with the empty PHAMT and build up the entire THAMT.
-   thamt = PHAMT_EMPTY;
+   thamt = phamt_empty();
    while ((arg = PyIter_Next(it))) {
-      thamt = thamt_assoc(thamt, k++, arg);
+      u = thamt_assoc(thamt, k++, arg);
+      Py_DECREF(thamt);
+      thamt = u;
       Py_DECREF(arg);
    }
    // We're done with the iterator now.
    Py_DECREF(it);
    // If there was an error, we just return NULL too propogate it.
-   if (PyErr_Occurred())
+   if (PyErr_Occurred()) {
+      Py_DECREF(thamt);
+      return NULL;
+   }
+   // Otherwise, we juust need to return the (compacted) persistent PHAMT.
+   return (PyObject*)thamt_compact(thamt);
+}
+static PyObject* py_PHAMT_from_arrays(PyObject* type, PyObject* args,
+                                      PyObject* kw)
+{
+   static char* kwlist[] = {"keys", "values", "nthreads", NULL};
+   PyObject* keys, *values, *nthreads = NULL;
+   if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O:from_arrays", kwlist,
+                                    &keys, &values, &nthreads))
       return NULL;
-   // Otherwise, we juust need to return the persistent PHAMT.
-   return (PyObject*)thamt_persist(thamt);
+   return _py_phamt_bulk(NULL, keys, values, nthreads);
 }
 
 //------------------------------------------------------------------------------
@@ -794,22 +4623,353 @@ static void py_phamtmod_free(void* mod)
    tmp = PHAMT_EMPTY_CTYPE;
    PHAMT_EMPTY_CTYPE = NULL;
    Py_DECREF(tmp);
+   PHAMT_RECLAIM_SET_BUDGET(-1);
+   _phamt_reclaim(-1);
+   PyMem_Free(phamt_reclaim_queue);
+   phamt_reclaim_queue = NULL;
+   phamt_reclaim_cap = 0;
+   _phamt_clear_freelists();
+}
+static PyObject* py_set_deferred_free(PyObject* self, PyObject* arg)
+{
+   Py_ssize_t budget = -1, prev;
+   if (arg != Py_None) {
+      budget = PyLong_AsSsize_t(arg);
+      if (budget == -1 && PyErr_Occurred()) return NULL;
+      if (budget < 0) {
+         PyErr_SetString(PyExc_ValueError, "budget must be None or >= 0");
+         return NULL;
+      }
+   }
+   PHAMT_RECLAIM_LOCK();
+   prev = phamt_reclaim_budget;
+   PHAMT_RECLAIM_SET_BUDGET(budget);
+   if (budget < 0) phamt_reclaim_paid = 0;
+   PHAMT_RECLAIM_UNLOCK();
+   if (budget < 0) _phamt_reclaim(-1);
+   if (prev < 0) Py_RETURN_NONE;
+   return PyLong_FromSsize_t(prev);
+}
+static PyObject* py_freeze(PyObject* self, PyObject* arg)
+{
+   if (!PyObject_TypeCheck(arg, &PHAMT_type)) {
+      PyErr_SetString(PyExc_TypeError, "freeze requires a PHAMT");
+      return NULL;
+   }
+   return (PyObject*)phamt_freeze((PHAMT_t)arg);
+}
+// _py_ctype_packings(node, counts)
+// Counts the twigs (but not the small maps) of the ctype PHAMT
+// node by their cell_packing.
+static void _py_ctype_packings(PHAMT_t node, Py_ssize_t* counts)
+{
+   Py_ssize_t ii;
+   if (node->flag_small) return;
+   if (node->addr_depth == PHAMT_TWIG_DEPTH) {
+      ++counts[node->cell_packing];
+      return;
+   }
+   for (ii = 0; ii < Py_SIZE(node); ++ii)
+      if (node->cells[ii])
+         _py_ctype_packings((PHAMT_t)node->cells[ii], counts);
+}
+// _py_ctype_item(k, v, arg)
+// Appends the item (k, v) of a ctype PHAMT to the Python list arg.
+static int _py_ctype_item(hash_t k, void* v, void* arg)
+{
+   PyObject* item = Py_BuildValue("(NN)", _py_hash_to_key(k),
+                                  PyLong_FromSize_t((size_t)(uintptr_t)v));
+   int r = (item ? PyList_Append((PyObject*)arg, item) : -1);
+   Py_XDECREF(item);
+   return r;
+}
+static PyObject* py_freelists(PyObject* self, PyObject* varargs)
+{
+   PyObject *counts, *key, *val;
+   unsigned gc, n;
+   int clear = 0, r;
+#ifdef PHAMT_HUGEPAGE_SLABS
+   int slabs = 1;
+#else
+   int slabs = 0;
+#endif
+   if (!PyArg_ParseTuple(varargs, "|p:_freelists", &clear)) return NULL;
+   if (clear) _phamt_clear_freelists();
+   counts = PyDict_New();
+   if (!counts) return NULL;
+   for (gc = 0; gc < 2; ++gc) {
+      for (n = 0; n <= PHAMT_ANY_MAXCELLS; ++n) {
+         if (!phamt_numfree[gc][n]) continue;
+         key = Py_BuildValue("(II)", gc, n);
+         val = PyLong_FromUnsignedLong(phamt_numfree[gc][n]);
+         r = (key && val ? PyDict_SetItem(counts, key, val) : -1);
+         Py_XDECREF(key);
+         Py_XDECREF(val);
+         if (r < 0) {
+            Py_DECREF(counts);
+            return NULL;
+         }
+      }
+   }
+   return Py_BuildValue("(NiO)", counts, PHAMT_FREELIST_MAXLEN,
+                        slabs ? Py_True : Py_False);
+}
+static PyObject* py_ctype_build(PyObject* self, PyObject* varargs)
+{
+   PyObject* keys, *vals, *items = NULL, *found = NULL, *packs = NULL;
+   PyObject* res = NULL, *o;
+   Py_ssize_t n, ii, nbase = 0, counts[8] = {0};
+   int nthreads = 1, isin;
+   hash_t* hs = NULL;
+   void** vs = NULL;
+   char* rm = NULL;
+   PHAMT_t u = NULL, v;
+   size_t x;
+   if (!PyArg_ParseTuple(varargs, "OO|in:_ctype_build", &keys, &vals,
+                         &nthreads, &nbase))
+      return NULL;
+   keys = PySequence_Fast(keys, "keys must be a sequence");
+   vals = keys ? PySequence_Fast(vals, "values must be a sequence") : NULL;
+   if (!vals) goto done;
+   n = PySequence_Fast_GET_SIZE(keys);
+   if (PySequence_Fast_GET_SIZE(vals) != n || nbase < 0 || nbase > n) {
+      PyErr_SetString(PyExc_ValueError, "invalid _ctype_build arguments");
+      goto done;
+   }
+   hs = (hash_t*)PyMem_Malloc(sizeof(hash_t)*(n + 1));
+   vs = (void**)PyMem_Malloc(sizeof(void*)*(n + 1));
+   rm = (char*)PyMem_Malloc(n + 1);
+   if (!hs || !vs || !rm) {
+      PyErr_NoMemory();
+      goto done;
+   }
+   for (ii = 0; ii < n; ++ii) {
+      o = PySequence_Fast_GET_ITEM(keys, ii);
+      if (!_py_is_key(o) || !_py_key_to_hash(o, hs + ii)) {
+         PyErr_SetObject(PyExc_KeyError, o);
+         goto done;
+      }
+      // A value of None dissoc's its key (only while assoc'ing one at a time).
+      o = PySequence_Fast_GET_ITEM(vals, ii);
+      rm[ii] = (o == Py_None && ii < nbase);
+      x = (rm[ii] ? 0 : PyLong_AsSize_t(o));
+      if (x == (size_t)-1 && PyErr_Occurred()) goto done;
+      vs[ii] = (void*)(uintptr_t)x;
+   }
+   if (nbase == 0) {
+      u = phamt_from_arrays(hs, vs, n, 0, nthreads);
+   } else {
+      u = phamt_empty_ctype();
+      for (ii = 0; u && ii < nbase; ++ii) {
+         if (rm[ii]) v = phamt_dissoc(u, hs[ii]);
+         else v = phamt_assoc(u, hs[ii], vs[ii]);
+         Py_DECREF(u);
+         u = v;
+      }
+      if (u && nbase < n) {
+         v = phamt_assoc_arrays(u, hs + nbase, vs + nbase, n - nbase, nthreads);
+         Py_DECREF(u);
+         u = v;
+      }
+   }
+   if (!u) goto done;
+   items = PyList_New(0);
+   found = PyList_New(n);
+   if (!items || !found || phamt_foreach(u, _py_ctype_item, items)) goto done;
+   for (ii = 0; ii < n; ++ii) {
+      x = (size_t)(uintptr_t)phamt_lookup(u, hs[ii], &isin);
+      if (isin) {
+         o = PyLong_FromSize_t(x);
+         if (!o) goto done;
+      } else {
+         Py_INCREF(Py_None);
+         o = Py_None;
+      }
+      PyList_SET_ITEM(found, ii, o);
+   }
+   // The twigs are counted by the width of their packed fields (or 0).
+   _py_ctype_packings(u, counts);
+   packs = PyDict_New();
+   for (ii = 0; packs && ii < 8; ++ii) {
+      if (!counts[ii]) continue;
+      o = Py_BuildValue("(nn)", (Py_ssize_t)(ii ? 1 << (ii - 1) : 0),
+                        counts[ii]);
+      if (!o || PyDict_SetItem(packs, PyTuple_GET_ITEM(o, 0),
+                               PyTuple_GET_ITEM(o, 1))) {
+         Py_XDECREF(o);
+         goto done;
+      }
+      Py_DECREF(o);
+   }
+   if (packs) res = PyTuple_Pack(3, items, found, packs);
+done:
+   Py_XDECREF(u);
+   Py_XDECREF(items);
+   Py_XDECREF(found);
+   Py_XDECREF(packs);
+   Py_XDECREF(keys);
+   Py_XDECREF(vals);
+   PyMem_Free(hs);
+   PyMem_Free(vs);
+   PyMem_Free(rm);
+   return res;
+}
+static PyObject* py_reclaim(PyObject* self, PyObject* varargs)
+{
+   PyObject* arg = Py_None;
+   Py_ssize_t budget = -1;
+   if (!PyArg_ParseTuple(varargs, "|O:reclaim", &arg)) return NULL;
+   if (arg != Py_None) {
+      budget = PyLong_AsSsize_t(arg);
+      if (budget == -1 && PyErr_Occurred()) return NULL;
+      if (budget < 0) {
+         PyErr_SetString(PyExc_ValueError, "budget must be None or >= 0");
+         return NULL;
+      }
+   }
+   return PyLong_FromSsize_t(_phamt_reclaim(budget));
+}
+static PyObject* py_morton_encode(PyObject* self, PyObject* arg)
+{
+   hash_t coords[PHAMT_MORTON_MAXDIMS];
+   hash_t h;
+   unsigned ndim = 0;
+   if (_py_parse_coords(arg, coords, &ndim) < 0) return NULL;
+   h = phamt_morton_encode(coords, ndim);
+   return _py_hash_to_key(h);
+}
+static PyObject* py_morton_decode(PyObject* self, PyObject* varargs)
+{
+   hash_t coords[PHAMT_MORTON_MAXDIMS];
+   hash_t h;
+   int ndim, d;
+   PyObject* key, *res, *c;
+   if (!PyArg_ParseTuple(varargs, "Oi:morton_decode", &key, &ndim))
+      return NULL;
+   if (!_py_is_key(key)) {
+      PyErr_SetString(PyExc_TypeError, "PHAMT keys must be integers");
+      return NULL;
+   }
+   if (ndim < 1 || ndim > PHAMT_MORTON_MAXDIMS) {
+      PyErr_Format(PyExc_ValueError, "ndim must be between 1 and %d",
+                   PHAMT_MORTON_MAXDIMS);
+      return NULL;
+   }
+   if (!_py_key_to_hash(key, &h)) {
+      PyErr_SetString(PyExc_OverflowError, "key is out of range for a PHAMT");
+      return NULL;
+   }
+   phamt_morton_decode(h, (unsigned)ndim, coords);
+   res = PyTuple_New(ndim);
+   if (!res) return NULL;
+   for (d = 0; d < ndim; ++d) {
+      c = _py_hash_to_int(coords[d]);
+      if (!c) {
+         Py_DECREF(res);
+         return NULL;
+      }
+      PyTuple_SET_ITEM(res, d, c);
+   }
+   return res;
+}
+// _py_parse_coords(seq, coords, ndim)
+// Parses a sequence of Morton coordinates into coords. If *ndim is 0, then it
+// is set to the length of the sequence; otherwise the sequence must have *ndim
+// elements. Yields 0 on success and -1 (with an exception set) on failure.
+static int _py_parse_coords(PyObject* seq, hash_t* coords, unsigned* ndim)
+{
+   PyObject* fast;
+   Py_ssize_t n, d;
+   unsigned long long c;
+   unsigned nbits;
+   fast = PySequence_Fast(seq, "Morton coordinates must be a sequence");
+   if (!fast) return -1;
+   n = PySequence_Fast_GET_SIZE(fast);
+   if (*ndim == 0 && (n < 1 || n > PHAMT_MORTON_MAXDIMS)) {
+      PyErr_Format(PyExc_ValueError,
+                   "Morton coordinates must have between 1 and %d dimensions",
+                   PHAMT_MORTON_MAXDIMS);
+      Py_DECREF(fast);
+      return -1;
+   } else if (*ndim != 0 && n != (Py_ssize_t)*ndim) {
+      PyErr_SetString(PyExc_ValueError,
+                      "Morton coordinates must have the same dimensions");
+      Py_DECREF(fast);
+      return -1;
+   }
+   *ndim = (unsigned)n;
+   nbits = HASH_BITCOUNT / *ndim;
+   for (d = 0; d < n; ++d) {
+      c = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(fast, d));
+      if (c == (unsigned long long)-1 && PyErr_Occurred()) {
+         Py_DECREF(fast);
+         return -1;
+      }
+      // (A coordinate can't have more bits than c does.)
+      if (nbits < 8*sizeof(c) && (c >> nbits) != 0) {
+         PyErr_Format(PyExc_ValueError,
+                      "Morton coordinates in %d dimensions must have at most "
+                      "%u bits", (int)n, nbits);
+         Py_DECREF(fast);
+         return -1;
+      }
+      coords[d] = (hash_t)c;
+   }
+   Py_DECREF(fast);
+   return 0;
 }
 // The moodule's initialization function.
-PyMODINIT_FUNC PyInit_c_core(void)
+PyMODINIT_FUNC PHAMT_CAT(PyInit_, PHAMT_MODULE)(void)
 {
    PyObject* m = PyModule_Create(&phamt_pymodule);
    if (m == NULL) return NULL;
+#ifdef Py_GIL_DISABLED
+   // The module is safe to use without the GIL (see PHAMT_BEGIN_LOCK).
+   PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
    // Initialize the PHAMT_type a tp_dict.
    if (PyType_Ready(&PHAMT_type) < 0) return NULL;
    Py_INCREF(&PHAMT_type);
    // Same for the others.
    if (PyType_Ready(&PHAMT_iter_type) < 0) return NULL;
    Py_INCREF(&PHAMT_iter_type);
+   if (PyType_Ready(&PHAMT_keyiter_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_keyiter_type);
+   if (PyType_Ready(&PHAMT_valiter_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_valiter_type);
+   if (PyType_Ready(&PHAMT_keys_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_keys_type);
+   if (PyType_Ready(&PHAMT_values_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_values_type);
+   if (PyType_Ready(&PHAMT_items_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_items_type);
    if (PyType_Ready(&THAMT_type) < 0) return NULL;
    Py_INCREF(&THAMT_type);
    if (PyType_Ready(&THAMT_iter_type) < 0) return NULL;
    Py_INCREF(&THAMT_iter_type);
+   if (PyType_Ready(&THAMT_sharded_type) < 0) return NULL;
+   Py_INCREF(&THAMT_sharded_type);
+   if (PyType_Ready(&PHAMT_ref_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_ref_type);
+   if (PyType_Ready(&PHAMT_inode_type) < 0) return NULL;
+   Py_INCREF(&PHAMT_inode_type);
+   if (PyType_Ready(&THAMT_concurrent_type) < 0) return NULL;
+   Py_INCREF(&THAMT_concurrent_type);
+   // The thread pool's locks outlive the module (its threads may be waiting on
+   // them), so they are created only once.
+   if (!phamt_pool_mutex) {
+      phamt_pool_mutex = PyThread_allocate_lock();
+      phamt_pool_busy = PyThread_allocate_lock();
+      phamt_pool_done = PyThread_allocate_lock();
+      if (!phamt_pool_mutex || !phamt_pool_busy || !phamt_pool_done) {
+         PyErr_NoMemory();
+         return NULL;
+      }
+      PyThread_acquire_lock(phamt_pool_done, WAIT_LOCK);
+#ifdef PHAMT_POOL_ATFORK
+      pthread_atfork(NULL, NULL, _phamt_pool_atfork);
+#endif
+   }
    // Get the Empty PHAMT ready.
    PHAMT_EMPTY = (PHAMT_t)PyObject_GC_NewVar(struct PHAMT, &PHAMT_type, 0);
    if (!PHAMT_EMPTY) return NULL;
@@ -819,11 +4979,15 @@ PyMODINIT_FUNC PyInit_c_core(void)
    PHAMT_EMPTY->flag_transient = 0;
    PHAMT_EMPTY->flag_firstn = 0;
    PHAMT_EMPTY->flag_full = 0;
+   PHAMT_EMPTY->flag_gc = 1;
+   PHAMT_EMPTY->flag_small = 0;
+   PHAMT_EMPTY->cell_packing = 0;
+   PHAMT_EMPTY->flag_frozen = 0;
    PHAMT_EMPTY->flag_pyobject = 1;
    PHAMT_EMPTY->addr_startbit = HASH_BITCOUNT - PHAMT_ROOT_SHIFT;
    PHAMT_EMPTY->addr_shift = PHAMT_ROOT_SHIFT;
    PHAMT_EMPTY->addr_depth = 0;
-   PyObject_GC_Track(PHAMT_EMPTY);
+   _phamt_track(PHAMT_EMPTY);
    PyDict_SetItemString(PHAMT_type.tp_dict, "empty", (PyObject*)PHAMT_EMPTY);
    // Also the Empty non-Python-object PHAMT for use with C code.
    PHAMT_EMPTY_CTYPE = (PHAMT_t)PyObject_GC_NewVar(struct PHAMT, &PHAMT_type, 0);
@@ -834,11 +4998,15 @@ PyMODINIT_FUNC PyInit_c_core(void)
    PHAMT_EMPTY_CTYPE->flag_transient = 0;
    PHAMT_EMPTY_CTYPE->flag_firstn = 0;
    PHAMT_EMPTY_CTYPE->flag_full = 0;
+   PHAMT_EMPTY_CTYPE->flag_gc = 1;
+   PHAMT_EMPTY_CTYPE->flag_small = 0;
+   PHAMT_EMPTY_CTYPE->cell_packing = 0;
+   PHAMT_EMPTY_CTYPE->flag_frozen = 0;
    PHAMT_EMPTY_CTYPE->flag_pyobject = 0;
    PHAMT_EMPTY_CTYPE->addr_startbit = HASH_BITCOUNT - PHAMT_ROOT_SHIFT;
    PHAMT_EMPTY_CTYPE->addr_shift = PHAMT_ROOT_SHIFT;
    PHAMT_EMPTY_CTYPE->addr_depth = 0;
-   PyObject_GC_Track(PHAMT_EMPTY_CTYPE);
+   _phamt_track(PHAMT_EMPTY_CTYPE);
    // We don't add this one to the type's dictionary--it's for C use only.
    // The PHAMT type.
    if (PyModule_AddObject(m, "PHAMT", (PyObject*)&PHAMT_type) < 0) {
@@ -850,6 +5018,30 @@ PyMODINIT_FUNC PyInit_c_core(void)
       Py_DECREF(&THAMT_type);
       return NULL;
    }
+   // The ShardedTHAMT type.
+   if (PyModule_AddObject(m, "ShardedTHAMT",
+                          (PyObject*)&THAMT_sharded_type) < 0) {
+      Py_DECREF(&THAMT_sharded_type);
+      return NULL;
+   }
+   // The PHAMTRef type.
+   if (PyModule_AddObject(m, "PHAMTRef", (PyObject*)&PHAMT_ref_type) < 0) {
+      Py_DECREF(&PHAMT_ref_type);
+      return NULL;
+   }
+   // The ConcurrentTHAMT type.
+   if (PyModule_AddObject(m, "ConcurrentTHAMT",
+                          (PyObject*)&THAMT_concurrent_type) < 0) {
+      Py_DECREF(&THAMT_concurrent_type);
+      return NULL;
+   }
+   // The node layout that this module was compiled with.
+   if (PyModule_AddIntConstant(m, "hash_bits", HASH_BITCOUNT) < 0 ||
+       PyModule_AddIntConstant(m, "root_shift", PHAMT_ROOT_SHIFT) < 0 ||
+       PyModule_AddIntConstant(m, "node_shift", PHAMT_NODE_SHIFT) < 0 ||
+       PyModule_AddIntConstant(m, "twig_shift", PHAMT_TWIG_SHIFT) < 0 ||
+       PyModule_AddIntConstant(m, "levels", PHAMT_LEVELS) < 0)
+      return NULL;
    // Debugging things that are useful to print.
    dbgmsg("Initialized PHAMT C API.\n"
           "    PHAMT size:      %u\n"
@@ -19,6 +19,12 @@
 extern "C" {
 #endif
 
+// Python 3.9 added a public function for testing whether an object is tracked
+// by the garbage collector; older versions have only the private macro.
+#if PY_VERSION_HEX < 0x03090000
+#  define PyObject_GC_IsTracked(o) (PyObject_IS_GC(o) && _PyObject_GC_IS_TRACKED(o))
+#endif
+
 
 //==============================================================================
 // Configuration.
@@ -79,6 +85,26 @@ extern "C" {
    "\n"                                                                        \
    "`PHAMT.from_iter(items, k0)` returns a `PHAMT` object whose keys are the\n"\
    "integers `k0, k0+1 ... k0+len(items)`.\n")
+#define PHAMT_FROM_ARRAYS_DOCSTRING (                                          \
+   "Constructs a PHAMT object from a sequence of keys and one of values.\n"    \
+   "\n"                                                                        \
+   "`PHAMT.from_arrays(keys, values)` returns a `PHAMT` object that maps\n"    \
+   "each `keys[i]` to `values[i]`; when a key is repeated, its last value is\n"\
+   "kept. The `keys` may be a buffer of 64-bit integers (such as an\n"        \
+   "`array('q')`, a `numpy` array, or the result of `keys_array()`) or any\n" \
+   "sequence of integers, and the `values` may be any sequence of the same\n" \
+   "length. The items are sorted and the nodes of the trie are filled in\n"  \
+   "without holding the GIL, split across up to `nthreads` threads (by\n"     \
+   "default, `os.cpu_count()`); only the allocation of the nodes and the\n"   \
+   "final joining of the subtries built by each thread hold the GIL.\n")
+#define PHAMT_ASSOC_ARRAYS_DOCSTRING (                                         \
+   "Returns a copy of a PHAMT object with a batch of items assoc'd.\n"         \
+   "\n"                                                                        \
+   "`phamt_obj.assoc_arrays(keys, values)` is equivalent to assoc'ing each\n" \
+   "`keys[i]` to `values[i]` in turn. The batch is instead built into a\n"    \
+   "`PHAMT` as by `PHAMT.from_arrays(keys, values, nthreads)`, which is then\n"\
+   "merged into `phamt_obj`, so the subtrees of `phamt_obj` that the batch\n" \
+   "doesn't touch are shared with the result.\n")
 #define PHAMT_TRANSIENT_DOCSTRING (                                            \
    "Returns an equivalent transient HAMT (`THAMT`) object.\n"                  \
    "\n"                                                                        \
@@ -101,13 +127,281 @@ extern "C" {
    "are more efficient with respect to time than update to the `PHAMT` tyoe,\n"\
    "however, they are slightly less space efficient than pure `PHAMT`s. Once\n"\
    "a `THAMT` has been edited, it can be efficiently converted back into a\n"  \
-   "`PHAMT` object using the `thamt.persistent()` method.\n")
+   "`PHAMT` object using the `thamt.persistent()` method.\n"                  \
+   "\n"                                                                        \
+   "`THAMT(mapping)` instead copies the items of any other mapping with\n"    \
+   "integer keys, such as a `PHAMT` of another build (e.g., `PHAMT32`) or a\n"\
+   "`dict`; a `KeyError` is raised if a key is out of range.\n")
 #define THAMT_PERSISTENT_DOCSTRING (                                           \
    "Returns an equivalent persistent HAMT (`PHAMT`) object.\n"                 \
    "\n"                                                                        \
    "`thamt.persistent()` returns a persistent `PHAMT` object that is\n"        \
-   "equivalent to `thamt`. This operation can be performed very efficiently\n" \
-   "as it requires no allocations.\n")
+   "equivalent to `thamt`. The nodes that were edited since the last call\n"   \
+   "are compacted into right-sized persistent nodes, and the transient\n"      \
+   "nodes are released; the `THAMT` may continue to be edited afterwards.\n"   \
+   "While an iterator over `thamt` is alive, the nodes are instead made\n"     \
+   "persistent in place, which requires no allocations.\n")
+#define PHAMT_ITER_NEXT_CHUNK_DOCSTRING (                                      \
+   "Returns the next `n` items of the iterator as a list of keys and a list\n" \
+   "of values.\n"                                                              \
+   "\n"                                                                        \
+   "`it.next_chunk(n)` returns a tuple `(keys, values)` of two lists, each of\n"\
+   "which has at most `n` elements, such that `keys[i]` and `values[i]` are\n" \
+   "the key and value of the `i`th of the next `n` items in the iteration.\n"  \
+   "This is much faster than calling `next(it)` `n` times because no tuples\n" \
+   "are allocated for the individual items and because the cells of each\n"    \
+   "node are copied in a single pass. If the lists are shorter than `n`, the\n"\
+   "iteration is finished; once finished, empty lists are returned.\n")
+#define PHAMT_TO_DICT_DOCSTRING (                                              \
+   "Returns a `dict` with the same key-value pairs as a `PHAMT` object.\n"     \
+   "\n"                                                                        \
+   "`phamt_obj.to_dict()` is equivalent to `dict(phamt_obj)` but is much\n"   \
+   "faster: the trie is walked directly, no `(key, value)` tuples are\n"      \
+   "allocated, and the `dict` is presized to hold `len(phamt_obj)` items.\n")
+#define PHAMT_TO_LISTS_DOCSTRING (                                             \
+   "Returns a list of the keys and a list of the values of a `PHAMT` object.\n"\
+   "\n"                                                                        \
+   "`phamt_obj.to_lists()` returns a tuple `(keys, values)` of two lists in\n"\
+   "iteration order such that `keys[i]` is mapped to `values[i]`.\n")
+#define PHAMT_KEYS_ARRAY_DOCSTRING (                                           \
+   "Returns the keys of a `PHAMT` object in a buffer of 64-bit numbers.\n"     \
+   "\n"                                                                        \
+   "`phamt_obj.keys_array()` returns a `memoryview` of format `'q'` (int64)\n"\
+   "that holds the keys of `phamt_obj` in iteration order. The optional\n"    \
+   "argument `dtype` may instead be `'Q'` or `'uint64'` for unsigned keys or\n"\
+   "`'d'` or `'float64'` for floating-point keys. If the optional argument\n" \
+   "`out` is given, it must be a writable, contiguous buffer (such as a\n"    \
+   "`numpy` array) of 64-bit items with at least `len(phamt_obj)` elements\n" \
+   "of the matching type; the keys are written into its first elements and\n"\
+   "`out` is returned. The result can be passed to `numpy.asarray()` without\n"\
+   "copying.\n")
+#define PHAMT_VALUES_ARRAY_DOCSTRING (                                         \
+   "Returns the values of a `PHAMT` object in a buffer of 64-bit numbers.\n"   \
+   "\n"                                                                        \
+   "`phamt_obj.values_array()` returns a `memoryview` of format `'d'`\n"      \
+   "(float64) that holds the values of `phamt_obj`, which must be numbers,\n" \
+   "in iteration order. The optional arguments `dtype` and `out` behave as\n" \
+   "in `phamt_obj.keys_array()`; for integer types, each value must be an\n"  \
+   "integer that fits in 64 bits.\n")
+#define PHAMT_SHARDS_DOCSTRING (                                               \
+   "Partitions a `PHAMT` object into disjoint shards of roughly equal size.\n" \
+   "\n"                                                                        \
+   "`phamt_obj.shards(n)` returns a list of at most `n` `PHAMT` objects that\n"\
+   "have no keys in common, whose union is `phamt_obj`, and whose lengths\n"  \
+   "are roughly equal. The shards are listed in iteration order, so\n"        \
+   "iterating over each shard in turn is equivalent to iterating over\n"      \
+   "`phamt_obj`. The shards are found by splitting the top levels of the\n"   \
+   "trie, and they share its subtrees, so no values are copied; the time\n"   \
+   "required is roughly proportional to `n` rather than to `len(phamt_obj)`.\n"\
+   "Because the leaves of the trie are never split, fewer than `n` shards\n"  \
+   "may be returned; none are returned for an empty `PHAMT`.\n")
+#define PHAMT_FOREACH_DOCSTRING (                                              \
+   "Calls a function on each key and value of a PHAMT object.\n"              \
+   "\n"                                                                        \
+   "`phamt_obj.foreach(fn)` calls `fn(k, v)` for each key `k` and value `v`\n"\
+   "of `phamt_obj` in iteration order and returns `None`. The trie is walked\n"\
+   "directly, without the iterator's state or the `(k, v)` tuples that\n"     \
+   "iteration makes. With the optional argument `nthreads` (default 1), the\n"\
+   "subtrees of the trie are instead handed out to up to `nthreads` threads,\n"\
+   "which take subtrees from each other as they run out of work, so the\n"    \
+   "calls are made in no particular order; the calls only run in parallel\n"  \
+   "in free-threaded builds of Python. If `fn` raises an exception, the walk\n"\
+   "stops and the exception is raised.\n")
+#define PHAMT_REDUCE_DOCSTRING (                                               \
+   "Reduces the keys and values of a PHAMT object to a single value.\n"       \
+   "\n"                                                                        \
+   "`phamt_obj.reduce(fn, initial)` returns the result of calling\n"          \
+   "`acc = fn(acc, k, v)` for each key `k` and value `v` of `phamt_obj` in\n" \
+   "iteration order, starting from `acc = initial`. With the optional\n"      \
+   "arguments `combine` and `nthreads`, the trie is walked by up to\n"        \
+   "`nthreads` threads as in `phamt_obj.foreach()`, each of which reduces\n"  \
+   "the subtrees it walks starting from `initial`; their results are then\n" \
+   "combined by `combine(acc1, acc2)`. For the result not to depend on how\n" \
+   "the work was divided, `initial` must be an identity of `combine`, which\n"\
+   "must be associative and commutative (e.g., `0` and addition).\n")
+#define PHAMT_QUERY_BOX_DOCSTRING (                                            \
+   "Returns the subset of a `PHAMT` whose Morton keys lie inside a box.\n"     \
+   "\n"                                                                        \
+   "`phamt_obj.query_box(lo, hi)` treats the keys of `phamt_obj` as Morton\n" \
+   "(Z-order) keys of points with `len(lo)` coordinates (see\n"               \
+   "`morton_encode`) and returns a `PHAMT` of the key-value pairs whose\n"    \
+   "points `p` satisfy `lo[d] <= p[d] <= hi[d]` for every dimension `d`.\n"   \
+   "Because each node of the trie covers a box of points, subtrees outside\n" \
+   "of the query box are skipped and subtrees inside of it are shared with\n" \
+   "the result, so the running time depends on the size of the boundary of\n"\
+   "the box rather than on `len(phamt_obj)`.\n")
+#define MORTON_ENCODE_DOCSTRING (                                              \
+   "Returns the Morton (Z-order) key of a point.\n"                            \
+   "\n"                                                                        \
+   "`morton_encode(coords)` returns the integer key that interleaves the bits\n"\
+   "of the non-negative integer coordinates in the sequence `coords`: bit `i`\n"\
+   "of `coords[d]` becomes bit `i*len(coords) + d` of the key. Each\n"        \
+   "coordinate may have at most `N // len(coords)` bits, where `N` is the\n"  \
+   "number of bits in a key (`sys.hash_info.width`). Like all `PHAMT` keys,\n"\
+   "the result is a signed integer.\n")
+#define MORTON_DECODE_DOCSTRING (                                              \
+   "Returns the point whose Morton (Z-order) key is given.\n"                  \
+   "\n"                                                                        \
+   "`morton_decode(key, ndim)` returns the tuple of `ndim` coordinates that\n"\
+   "`morton_encode` interleaves to produce `key`.\n")
+#define SET_DEFERRED_FREE_DOCSTRING (                                          \
+   "Sets whether the nodes of dead `PHAMT` objects are freed later.\n"         \
+   "\n"                                                                        \
+   "By default, dropping the last reference to a `PHAMT` frees all of its\n"  \
+   "nodes that aren't shared with other `PHAMT`s at once, which can take a\n" \
+   "long time for a large `PHAMT`. `set_deferred_free(budget)`, with an\n"    \
+   "integer `budget >= 0`, instead puts each dead node onto a reclamation\n"  \
+   "queue, which `reclaim()` drains. Each node that is allocated while the\n" \
+   "queue isn't empty also pays for freeing up to `budget` queued nodes;\n"   \
+   "these are freed at the start of the next `assoc`, `dissoc`, or `THAMT`\n" \
+   "update, so that a dead `PHAMT` is freed in small slices as other\n"       \
+   "`PHAMT`s are edited. A `budget` of 0 leaves the queue to `reclaim()`.\n"  \
+   "`set_deferred_free(None)` restores immediate freeing and frees every\n"   \
+   "queued node. The previous `budget` (or `None`) is returned. Each build\n" \
+   "of the C core (e.g., `phamt.c_core32`) has its own setting and queue.\n")
+#define RECLAIM_DOCSTRING (                                                    \
+   "Frees nodes from the reclamation queue of dead `PHAMT` nodes.\n"          \
+   "\n"                                                                        \
+   "`reclaim(budget)` frees up to `budget` nodes from the queue that\n"       \
+   "`set_deferred_free` enables and returns the number of nodes that remain\n"\
+   "queued; `reclaim()` frees every queued node, and `reclaim(0)` only\n"     \
+   "returns the length of the queue. Freeing a node releases its values and\n"\
+   "queues its dead children, so each node costs at most one node's worth of\n"\
+   "work. To free dead `PHAMT`s in the background, a thread can call\n"       \
+   "`reclaim` with a small `budget` in a loop.\n")
+#define FREEZE_DOCSTRING (                                                     \
+   "Returns a frozen copy of a `PHAMT` whose nodes are never written to.\n"   \
+   "\n"                                                                        \
+   "`freeze(phamt_obj)` copies the nodes of `phamt_obj` into one contiguous\n"\
+   "block of memory that is never freed. The copies are never tracked by the\n"\
+   "garbage collector and, in Python 3.12 and later, are immortal, so that\n" \
+   "neither lookups, iteration, nor the `PHAMT`s derived from the copy (by\n" \
+   "`assoc`, `dissoc`, or a `THAMT`) write to them. This lets the processes\n"\
+   "forked from a process that holds a large frozen `PHAMT` share one\n"      \
+   "physical copy of it. The values of the `PHAMT` are not frozen (see\n"     \
+   "`gc.freeze`), and they are never freed once frozen. Subtrees that are\n"  \
+   "already frozen are shared, so `freeze` may be called again on an edited\n"\
+   "copy of a frozen `PHAMT` to freeze only the changed nodes.\n")
+#define CTYPE_BUILD_DOCSTRING (                                                \
+   "Builds a ctype `PHAMT` and returns its contents (for the tests only).\n" \
+   "\n"                                                                        \
+   "`_ctype_build(keys, values, nthreads=1, nbase=0)` assoc's the first\n"   \
+   "`nbase` of the given keys and (non-negative integer) values into an\n"   \
+   "empty ctype `PHAMT` one at a time, adds the rest with\n"                 \
+   "`phamt_assoc_arrays` (or, if `nbase` is 0, `phamt_from_arrays`) on up\n" \
+   "to `nthreads` threads, and returns a tuple of the `(k, v)` items of the\n"\
+   "result, in order, the values that lookups of `keys` find (or `None`),\n" \
+   "and a dict of the number of twigs whose values are packed into fields\n" \
+   "of each width in bits (0 for unpacked twigs). A value of `None` among\n" \
+   "the first `nbase` dissoc's its key. Ctype `PHAMT`s can't be used from\n" \
+   "Python, so this is the only way to test them from Python.\n")
+#define FREELISTS_DOCSTRING (                                                  \
+   "Returns the state of the node freelists (for the tests only).\n"         \
+   "\n"                                                                        \
+   "`_freelists(clear=False)` returns a tuple of a dict that maps each\n"     \
+   "`(gc, ncells)` pair, where `gc` is 1 for the list of nodes with a GC\n"   \
+   "header and 0 for the list of those without one, to the number of freed\n"\
+   "nodes with `ncells` cells on that list (if any), the maximum length of\n"\
+   "each list, and whether nodes are carved from huge-page slabs. If `clear`\n"\
+   "is true, the lists are first emptied as when the module is freed.\n")
+#define PHAMTREF_DOCSTRING (                                                   \
+   "A mutable reference to a `PHAMT` that can be updated atomically.\n"        \
+   "\n"                                                                        \
+   "`PHAMTRef(phamt_obj)` (or `PHAMTRef()` for an empty `PHAMT`) returns a\n"  \
+   "reference whose current `PHAMT` may be read with `ref.get()` and replaced\n"\
+   "with `ref.compare_and_set(old, new)`, `ref.swap(fn, *args)`,\n"            \
+   "`ref.assoc(k, v)`, `ref.dissoc(k)`, or `ref.reset(new)`. Updates are made\n"\
+   "by copying the path to the changed key outside of any lock and then\n"     \
+   "publishing the new `PHAMT` only if the reference still holds the `PHAMT`\n"\
+   "that was copied, retrying otherwise, so that threads (or asyncio tasks)\n" \
+   "sharing a `PHAMTRef` never hold a lock while a `PHAMT` is updated.\n")
+#define PHAMTREF_GET_DOCSTRING (                                               \
+   "Returns the current `PHAMT` of the reference.\n")
+#define PHAMTREF_COMPARE_AND_SET_DOCSTRING (                                   \
+   "Replaces the `PHAMT` of the reference if it is a given `PHAMT`.\n"         \
+   "\n"                                                                        \
+   "`ref.compare_and_set(old, new)` stores the `PHAMT` `new` in `ref` and\n"   \
+   "returns `True` if the current `PHAMT` of `ref` is `old` (i.e., `is old`);\n"\
+   "otherwise `ref` is unchanged and `False` is returned.\n")
+#define PHAMTREF_RESET_DOCSTRING (                                             \
+   "Replaces the `PHAMT` of the reference and returns the previous one.\n")
+#define PHAMTREF_SWAP_DOCSTRING (                                              \
+   "Atomically replaces the `PHAMT` of the reference with a function of it.\n" \
+   "\n"                                                                        \
+   "`ref.swap(fn, *args)` calls `fn(u, *args)`, where `u` is the current\n"    \
+   "`PHAMT` of `ref`, and stores the resulting `PHAMT` if `ref` still holds\n" \
+   "`u`; if another thread replaced `u` in the meantime, `fn` is called again\n"\
+   "with the new `PHAMT`. Because `fn` may be called more than once, it should\n"\
+   "not have side effects. The `PHAMT` that was stored is returned.\n")
+#define PHAMTREF_ASSOC_DOCSTRING (                                             \
+   "Atomically associates a key with a value in the referenced `PHAMT`.\n"     \
+   "\n"                                                                        \
+   "`ref.assoc(k, v)` is equivalent to `ref.swap(PHAMT.assoc, k, v)` but\n"    \
+   "never calls back into Python. The `PHAMT` that was stored is returned.\n")
+#define PHAMTREF_DISSOC_DOCSTRING (                                            \
+   "Atomically removes a key from the referenced `PHAMT`.\n"                   \
+   "\n"                                                                        \
+   "`ref.dissoc(k)` is equivalent to `ref.swap(PHAMT.dissoc, k)` but never\n"  \
+   "calls back into Python. The `PHAMT` that was stored is returned.\n")
+#define SHARDED_THAMT_DOCSTRING (                                              \
+   "A `THAMT` that is split by key into shards for parallel writers.\n"        \
+   "\n"                                                                        \
+   "A `ShardedTHAMT` is edited like a `THAMT` (`s[k] = v`, `del s[k]`), but\n" \
+   "its keys are split by their top bits into `s.nshards` independent\n"       \
+   "`THAMT`s, one for each cell of the root of a `PHAMT`. Each shard is\n"     \
+   "locked separately, so threads that write keys in different shards never\n" \
+   "contend; `s.shard_of(k)` yields the index of the shard that holds `k`, and\n"\
+   "`s.shard(i)` yields the `THAMT` of shard `i` itself, which a writer that\n"\
+   "owns the shard may edit directly. `s.persistent()` persists each shard\n"  \
+   "and then joins their roots into one `PHAMT` in `O(nshards)` time; edits\n" \
+   "made to other shards while it runs may or may not be included. Iterating\n"\
+   "over `s` iterates over `s.persistent()`. `ShardedTHAMT(phamt_obj)`\n"      \
+   "splits a `PHAMT` into shards in `O(nshards)` time; other mappings are\n"   \
+   "copied in.\n")
+#define SHARDED_THAMT_SHARD_DOCSTRING (                                        \
+   "Returns the `THAMT` that holds the keys of the given shard.\n")
+#define SHARDED_THAMT_SHARD_OF_DOCSTRING (                                     \
+   "Returns the index of the shard that holds the given key.\n")
+#define CONCURRENT_THAMT_DOCSTRING (                                           \
+   "A mutable mapping that many threads may update and snapshot at once.\n"    \
+   "\n"                                                                        \
+   "A `ConcurrentTHAMT` is edited like a `THAMT` (`c[k] = v`, `del c[k]`),\n"  \
+   "but any number of threads may read and write it at the same time. Each\n"  \
+   "internal node of its trie is reached through an indirection node that is\n"\
+   "updated with a compare-and-set of its own, so writers to different parts\n"\
+   "of the map don't contend. `c.snapshot()` returns, in constant time, a new\n"\
+   "`ConcurrentTHAMT` that holds the current contents of `c` and that is\n"    \
+   "edited independently of `c` afterwards. `c.persistent()` returns the\n"    \
+   "current contents of `c` as a `PHAMT`; it reuses the `PHAMT`s that it made\n"\
+   "for the parts of the trie that weren't edited since its last call.\n"      \
+   "Iterating over `c` iterates over `c.persistent()`.\n"                      \
+   "`ConcurrentTHAMT(phamt_obj)` starts from a `PHAMT` in constant time;\n"    \
+   "other mappings are copied in.\n")
+#define CONCURRENT_THAMT_SNAPSHOT_DOCSTRING (                                  \
+   "Returns a copy of the `ConcurrentTHAMT` in constant time.\n")
+#define CONCURRENT_THAMT_PERSISTENT_DOCSTRING (                                \
+   "Returns the current contents of the `ConcurrentTHAMT` as a `PHAMT`.\n")
+#define PHAMT_KEYS_DOCSTRING (                                                 \
+   "Returns a set-like view of the keys of a `PHAMT` object.\n"                \
+   "\n"                                                                        \
+   "`phamt_obj.keys()` returns a view object that iterates over the keys of\n"\
+   "`phamt_obj` without allocating the `(key, value)` tuples that iterating\n" \
+   "over `phamt_obj` itself produces. Key views support `len()`, `in`, and\n" \
+   "the set operators `&`, `|`, `-`, and `^`. When both operands are `PHAMT`\n"\
+   "key views, these operators are computed by walking the two tries in\n"    \
+   "parallel, skipping disjoint subtrees and sharing unchanged ones, and they\n"\
+   "return a key view of the resulting `PHAMT`; otherwise they return a `set`.\n")
+#define PHAMT_VALUES_DOCSTRING (                                               \
+   "Returns a view of the values of a `PHAMT` object.\n"                      \
+   "\n"                                                                        \
+   "`phamt_obj.values()` returns a view object that iterates over the values\n"\
+   "of `phamt_obj` in key order without allocating any tuples.\n")
+#define PHAMT_ITEMS_DOCSTRING (                                                \
+   "Returns a view of the `(key, value)` pairs of a `PHAMT` object.\n"         \
+   "\n"                                                                        \
+   "`phamt_obj.items()` returns a view object that iterates over the\n"       \
+   "`(key, value)` tuples of `phamt_obj`; this is equivalent to iterating\n"  \
+   "over `phamt_obj` itself.\n")
 
 //------------------------------------------------------------------------------
 // hash_t and bits_t
@@ -120,12 +414,59 @@ extern "C" {
 // In this case, the size_t type is the same size as Py_hash_t (which is just
 // defined from Py_ssize_t, which in turn is defined from ssize_t), but size_t
 // is also unsigned, so we use it.
-typedef size_t hash_t;
+// If PHAMT_HASH_BITS is defined as 32, then the hash is instead a 32-bit
+// integer: such PHAMTs only accept keys that fit in a signed 32-bit integer, but
+// their tries have fewer levels and their nodes have smaller headers. setup.py
+// builds this variant as the module phamt.c_core32. If it is defined as 128
+// (which requires a compiler with 128-bit integers), the hash is a 128-bit
+// integer, so that composite keys such as (tenant, object) pairs can share one
+// trie; setup.py builds this variant as the module phamt.c_core128.
+#if defined(PHAMT_HASH_BITS) && PHAMT_HASH_BITS == 32
+   typedef uint32_t hash_t;
+#  define HASH_MAX UINT32_MAX
+#elif defined(PHAMT_HASH_BITS) && PHAMT_HASH_BITS == 128
+#  ifndef __SIZEOF_INT128__
+#    error PHAMT_HASH_BITS of 128 requires 128-bit integer support
+#  endif
+   typedef unsigned __int128 uint128_t;
+#  define PHAMT_HAVE_UINT128 1
+// The hash is only 8-byte aligned so that node headers need no padding. (Only
+// compilers with the GCC extensions have __int128 in the first place.)
+#  if defined(__GNUC__) || defined(__clang__)
+   typedef uint128_t hash_t __attribute__((aligned(8)));
+#  else
+   typedef uint128_t hash_t;
+#  endif
+#  define HASH_MAX (~(hash_t)0)
+// HASH_MAX can't be compared in the preprocessor, so we set the bitcount here.
+#  define HASH_BITCOUNT 128
+#elif defined(PHAMT_HASH_BITS)
+#  error PHAMT_HASH_BITS may only be defined as 32 or 128
+#else
+   typedef size_t hash_t;
 // The max value of the hash is the same as the max value of a site_t integer.
-#define HASH_MAX SIZE_MAX
+#  define HASH_MAX SIZE_MAX
+#endif
+// The number of leaves in a node: a node can't hold more leaves than there are
+// keys or than there are bytes of memory, so 64 bits are always enough.
+#if defined(HASH_BITCOUNT) && HASH_BITCOUNT > 64
+   typedef uint64_t numel_t;
+#else
+   typedef hash_t numel_t;
+#endif
 // These are useful constants: 0 and 1 for the hash type.
 #define HASH_ZERO ((hash_t)0)
 #define HASH_ONE  ((hash_t)1)
+// On the Python side, keys are the signed integers of the same width as the
+// hash (a negative key k has the hash k + 2**HASH_BITCOUNT), whose type is
+// phamt_key_t; these are the least and greatest keys.
+#if defined(PHAMT_HASH_BITS) && PHAMT_HASH_BITS == 128
+   typedef __int128 phamt_key_t;
+#else
+   typedef long long phamt_key_t;
+#endif
+#define PHAMT_KEY_MAX ((phamt_key_t)(HASH_MAX >> 1))
+#define PHAMT_KEY_MIN (-PHAMT_KEY_MAX - 1)
 
 // We now need to figure out what size the hash actually is and define some
 // values based on it its size.
@@ -136,44 +477,65 @@ typedef size_t hash_t;
 #define MAX_64BIT  0xffffffffffffffff
 #define MAX_128BIT 0xffffffffffffffffffffffffffffffff
 //  - Check what size the hash is by comparing to the above max values. We
-//    define the HASH_BITCOUNT and PHAMT_ROOT_SHIFT based on this. The root
-//    shift is the remainder of the bitcount divided by 5.
-#if   (HASH_MAX == MAX_16BIT)
-#   define HASH_BITCOUNT 16
-#   define PHAMT_ROOT_SHIFT 1
-#elif (HASH_MAX == MAX_32BIT)
-#   define HASH_BITCOUNT 32
-#   define PHAMT_ROOT_SHIFT 2
-#elif (HASH_MAX == MAX_64BIT)
-#   define HASH_BITCOUNT 64
-#   define PHAMT_ROOT_SHIFT 4
-#elif (HASH_MAX == MAX_128BIT)
-#   define HASH_BITCOUNT 128
-#   define PHAMT_ROOT_SHIFT 3
+//    define the HASH_BITCOUNT based on this.
+#ifndef HASH_BITCOUNT
+#  if   (HASH_MAX == MAX_16BIT)
+#     define HASH_BITCOUNT 16
+#  elif (HASH_MAX == MAX_32BIT)
+#     define HASH_BITCOUNT 32
+#  elif (HASH_MAX == MAX_64BIT)
+#     define HASH_BITCOUNT 64
+#  elif (HASH_MAX == MAX_128BIT)
+#     define HASH_BITCOUNT 128
+#  else
+#     error unhandled size for hash_t
+#  endif
+#endif
+
+// Internal nodes and twigs have 1 << PHAMT_NODE_SHIFT and 1 << PHAMT_TWIG_SHIFT
+// cells, respectively. Each shift may be 4, 5, or 6 (i.e., 16-, 32-, or 64-way
+// nodes); the default is 5, and setup.py also builds the 16-way and 64-way
+// layouts as the modules phamt.c_core16 and phamt.c_core64. The root node can't
+// generally use the node shift due to how the bits line-up--it instead gets the
+// number of leftover bits in the hash integer (PHAMT_ROOT_SHIFT).
+#ifndef PHAMT_NODE_SHIFT
+#  define PHAMT_NODE_SHIFT 5
+#endif
+#ifndef PHAMT_TWIG_SHIFT
+#  define PHAMT_TWIG_SHIFT 5
+#endif
+#if (PHAMT_NODE_SHIFT < 4 || PHAMT_NODE_SHIFT > 6 \
+     || PHAMT_TWIG_SHIFT < 4 || PHAMT_TWIG_SHIFT > 6)
+#  error PHAMT_NODE_SHIFT and PHAMT_TWIG_SHIFT must each be 4, 5, or 6
+#endif
+#if ((HASH_BITCOUNT - PHAMT_TWIG_SHIFT) % PHAMT_NODE_SHIFT == 0)
+#  define PHAMT_ROOT_SHIFT PHAMT_NODE_SHIFT
 #else
-#   error unhandled size for hash_t
+#  define PHAMT_ROOT_SHIFT ((HASH_BITCOUNT - PHAMT_TWIG_SHIFT) % PHAMT_NODE_SHIFT)
 #endif
 
-// We also define the bits type. Because we use a max shift of 5, the bits type
-// can always be a 32-bit unsigned integer.
-typedef uint32_t bits_t;
-#define BITS_BITCOUNT 32
-#define BITS_MAX      (0xffffffff)
+// We also define the bits type, which must have a bit for each cell of the
+// widest node: with a max shift of 5, the bits type can be a 32-bit unsigned
+// integer, but 64-way nodes need a 64-bit integer.
+#if (PHAMT_NODE_SHIFT == 6 || PHAMT_TWIG_SHIFT == 6)
+   typedef uint64_t bits_t;
+#  define BITS_BITCOUNT 64
+#  define BITS_MAX      (0xffffffffffffffff)
+#else
+   typedef uint32_t bits_t;
+#  define BITS_BITCOUNT 32
+#  define BITS_MAX      (0xffffffff)
+#endif
 #define BITS_ZERO     ((bits_t)0)
 #define BITS_ONE      ((bits_t)1)
 
-// We use a constant shift of 5 throughout except at the root node (which can't
-// generally be shifted at 5 due to how the bits line-up--it instead gets the
-// number of leftover bits in the hash integer, which was defined above as
-// PHAMT_ROOT_SHIFT).
-#define PHAMT_NODE_SHIFT 5
-#define PHAMT_TWIG_SHIFT 5
 // Here we define some consequences of the above definitions, which we use
 #define PHAMT_ROOT_FIRSTBIT (HASH_BITCOUNT - PHAMT_ROOT_SHIFT)
 #define PHAMT_ROOT_MAXCELLS (1 << PHAMT_ROOT_SHIFT)
 #define PHAMT_NODE_MAXCELLS (1 << PHAMT_NODE_SHIFT)
 #define PHAMT_TWIG_MAXCELLS (1 << PHAMT_TWIG_SHIFT)
-#define PHAMT_ANY_MAXCELLS  (1 << PHAMT_TWIG_SHIFT) // Assuming twig is largest.
+#define PHAMT_ANY_MAXCELLS  (PHAMT_NODE_MAXCELLS > PHAMT_TWIG_MAXCELLS \
+                             ? PHAMT_NODE_MAXCELLS : PHAMT_TWIG_MAXCELLS)
 #define PHAMT_NODE_BITS     (HASH_BITCOUNT-PHAMT_ROOT_SHIFT-PHAMT_TWIG_SHIFT)
 #define PHAMT_NODE_LEVELS   (PHAMT_NODE_BITS / PHAMT_NODE_SHIFT)
 #define PHAMT_LEVELS        (PHAMT_NODE_LEVELS + 2) // (nodes + root + twig)
@@ -183,6 +545,49 @@ typedef uint32_t bits_t;
 #define PHAMT_ROOT_MASK     ((HASH_ONE << PHAMT_ROOT_SHIFT) - HASH_ONE)
 #define PHAMT_NODE_MASK     ((HASH_ONE << PHAMT_NODE_SHIFT) - HASH_ONE)
 #define PHAMT_TWIG_MASK     ((HASH_ONE << PHAMT_TWIG_SHIFT) - HASH_ONE)
+// Persistent nodes in which at least PHAMT_FULL_PERCENT percent of the
+// possible cells are in use are stored with the full layout (flag_full), in
+// which cells are indexed directly by their bit index; sparser nodes store only
+// their cells and index them by popcount (or directly, when flag_firstn). This
+// may be defined as 101 so that only nodes with every cell in use are full.
+#ifndef PHAMT_FULL_PERCENT
+#  define PHAMT_FULL_PERCENT 75
+#endif
+// PHAMTs of up to PHAMT_SMALL_MAX elements that are built by assoc'ing to the
+// empty PHAMT are stored as a single flat node (a small map) instead of a trie;
+// see the Small maps section below. This may be defined as 0 to disable small
+// maps. A small map keeps two cells per element, so it must fit in a node.
+#ifndef PHAMT_SMALL_MAX
+#  if HASH_BITCOUNT > 64
+      // Small maps keep their keys in the (pointer-sized) cells.
+#     define PHAMT_SMALL_MAX 0
+#  else
+#     define PHAMT_SMALL_MAX 8
+#  endif
+#endif
+#if PHAMT_SMALL_MAX * 2 > PHAMT_ANY_MAXCELLS
+#  error PHAMT_SMALL_MAX is too large for a single node
+#endif
+// The persistent twigs of ctype PHAMTs whose values are all small unsigned
+// integers store them packed into 1-, 8-, 16-, or 32-bit fields rather than in
+// pointer-sized cells; see the Packed twigs section below. This may be defined
+// as 0 to disable packing.
+#ifndef PHAMT_PACKED
+#  define PHAMT_PACKED 1
+#endif
+// The number of bits in a cell.
+#define PHAMT_CELL_BITS (8*sizeof(void*))
+// The refcount given to the nodes of frozen PHAMTs (see phamt_freeze()). In
+// Python 3.12 and later, this makes them immortal, so that Py_INCREF and
+// Py_DECREF don't write to them; in earlier versions, it is merely too large
+// for them to ever be freed.
+#if defined(_Py_IMMORTAL_INITIAL_REFCNT)
+#  define PHAMT_FROZEN_REFCNT _Py_IMMORTAL_INITIAL_REFCNT
+#elif defined(_Py_IMMORTAL_REFCNT)
+#  define PHAMT_FROZEN_REFCNT _Py_IMMORTAL_REFCNT
+#else
+#  define PHAMT_FROZEN_REFCNT ((Py_ssize_t)((size_t)-1 >> 2))
+#endif
 
 //------------------------------------------------------------------------------
 // Bit Operations.
@@ -192,12 +597,14 @@ typedef uint32_t bits_t;
 // a _hash and _bits version (e.g., popcount_hash, popcount_bits).
 
 // For starters, it's possible that the uint128_t isn't defined explicitly but
-// could be... if this is the case, we can go ahead and define it.
-#ifndef uint128_t
+// could be... if this is the case, we can go ahead and define it. Either way,
+// PHAMT_HAVE_UINT128 is defined when it exists.
+#ifndef PHAMT_HAVE_UINT128
 #  if defined (ULLONG_MAX)                \
        && (ULLONG_MAX > MAX_64BIT)        \
        && (ULLONG_MAX >> 64 == MAX_64BIT)
       typedef unsigned long long uint128_t;
+#     define PHAMT_HAVE_UINT128 1
 #  endif
 #endif
 
@@ -208,13 +615,13 @@ typedef uint32_t bits_t;
 // defined interms of C types (and not interms of the number of bits
 // in the type) so we need to do some preprocessor magic to make sure
 // we are using the correct version of the builtin popcount.
-#if defined (__builtin_popcount) && (UINT_MAX == BITS_MAX)
+#if defined (__builtin_popcount) && (UINT_MAX == MAX_32BIT)
 #   define popcount32 __builtin_popcount
-#elif defined (__builtin_popcountl) && (ULONG_MAX == BITS_MAX)
+#elif defined (__builtin_popcountl) && (ULONG_MAX == MAX_32BIT)
 #   define popcount32 __builtin_popcountl
 #elif defined (ULLONG_MAX)               \
        && defined (__builtin_popcountll) \
-       && (ULLONG_MAX == BITS_MAX)
+       && (ULLONG_MAX == MAX_32BIT)
 #   define popcount32 __builtin_popcountll
 #else
     static inline uint32_t popcount32(uint32_t w)
@@ -238,7 +645,7 @@ static inline uint16_t popcount16(uint16_t w)
 #   define popcount64 __builtin_popcountl
 #elif defined (ULLONG_MAX)               \
        && defined (__builtin_popcountll) \
-       && (ULLONG_MAX == MAX_64BBIT)
+       && (ULLONG_MAX == MAX_64BIT)
 #   define popcount64 __builtin_popcountll
 #else
     static inline uint64_t popcount64(uint64_t w)
@@ -248,13 +655,13 @@ static inline uint16_t popcount16(uint16_t w)
 #endif
 // It's unlikely there will need to be a 128-bit popcount for this library, but
 // we'll just use the 32-bit version for the sake of completeness.
-#ifdef uint128_t
+#ifdef PHAMT_HAVE_UINT128
     static inline uint64_t popcount128(uint128_t w)
     {
        return (popcount32((uint32_t)w) +
                popcount32((uint32_t)(w >> 32)) +
                popcount32((uint32_t)(w >> 64)) +
-               popcount32((uint32_t)(w >> 96)))
+               popcount32((uint32_t)(w >> 96)));
     }
 #endif
 
@@ -282,7 +689,7 @@ static inline uint64_t clz64(uint64_t w)
    uint32_t c = clz32((uint32_t)(w >> 32));
    return (c == 32 ? 32 + clz32((uint32_t)w) : c);
 }
-#ifdef uint128_t
+#ifdef PHAMT_HAVE_UINT128
     static inline uint64_t clz128(uint128_t w)
     {
        uint32_t c = clz32((uint32_t)(w >> 96));
@@ -310,30 +717,34 @@ static inline uint16_t ctz16(uint16_t w)
 {
    return ctz32((uint32_t)w);
 }
+// Note that ctz32(0) is 0 rather than 32, so the wider versions test which
+// 32-bit word holds the lowest set bit rather than testing the result.
 static inline uint64_t ctz64(uint64_t w)
 {
-   uint32_t c = ctz32((uint32_t)w);
-   return (c == 32 ? 32 + ctz32((uint32_t)(w >> 32)) : c);
+   return ((uint32_t)w ? ctz32((uint32_t)w) : 32 + ctz32((uint32_t)(w >> 32)));
 }
-#ifdef uint128_t
+#ifdef PHAMT_HAVE_UINT128
     static inline uint128_t ctz128(uint128_t w)
     {
-       uint32_t c = ctz32((uint32_t)w);
-       if (c < 32) return c;
-       c = ctz32((uint32_t)(w >> 32));
-       if (c < 32) return c + 32;
-       c = ctz32((uint32_t)(w >> 64));
-       if (c < 32) return c + 64;
+       if ((uint32_t)w) return ctz32((uint32_t)w);
+       if ((uint32_t)(w >> 32)) return ctz32((uint32_t)(w >> 32)) + 32;
+       if ((uint32_t)(w >> 64)) return ctz32((uint32_t)(w >> 64)) + 64;
        return ctz32((uint32_t)(w >> 96)) + 96;
     }
 #endif
 
 // Finally, now that we have functions for each type defined, we can finally
 // define the _hash and _bits functions.
-// The bits type is actually always of size 32, so it's easy to define.
-#define popcount_bits popcount32
-#define clz_bits      clz32
-#define ctz_bits      ctz32
+// The bits type is either 32 or 64 bits, depending on the node shifts.
+#if (BITS_BITCOUNT == 64)
+#   define popcount_bits popcount64
+#   define clz_bits      clz64
+#   define ctz_bits      ctz64
+#else
+#   define popcount_bits popcount32
+#   define clz_bits      clz32
+#   define ctz_bits      ctz32
+#endif
 // The hash functions depend on the size of the hash bitcount, though.
 #if   (HASH_BITCOUNT == 16)
 #   define popcount_hash    popcount16
@@ -377,7 +788,7 @@ typedef struct PHAMT {
    // The node's address in the PHAMT.
    hash_t address;
    // The number of leaves beneath this node.
-   hash_t numel;
+   numel_t numel;
    // The bitmask of children.
    bits_t bits;
    // What follows, between the addr_startbit and _empty members, is a
@@ -398,8 +809,20 @@ typedef struct PHAMT {
    bits_t flag_firstn : 1;
    // Whether the PHAMT has allocated all cells, even empty ones.
    bits_t flag_full : 1;
+   // Whether the node was allocated with a GC header (1) or without one (0);
+   // see _phamt_finish().
+   bits_t flag_gc : 1;
+   // Whether the node is a small map (see PHAMT_SMALL_MAX) rather than a node
+   // of the trie.
+   bits_t flag_small : 1;
+   // How the values of a ctype twig are packed (see PHAMT_PACKED): 0 if they
+   // are stored one per cell, otherwise 1 plus the base-2 log of their width
+   // in bits.
+   bits_t cell_packing : 3;
+   // Whether the node is part of a frozen PHAMT (see phamt_freeze()).
+   bits_t flag_frozen : 1;
    // The remaining bits are just empty for now.
-   bits_t _empty : 7;
+   bits_t _empty : 1;
    // ^-----------------------------------------------------------------^
    // And finally the variable-length list of children.
    void* cells[];
@@ -472,6 +895,16 @@ typedef struct PHAMT_iter {
    PHAMT_path_t path;
 }* PHAMT_iter_t;
 
+// The PHAMT view type for Python.
+// The keys(), values(), and items() views of a PHAMT all share this struct; they
+// differ only in their Python types.
+typedef struct PHAMT_view {
+   // The Python data.
+   PyObject_HEAD
+   // The PHAMT whose contents are being viewed.
+   PHAMT_t phamt;
+}* PHAMT_view_t;
+
 // The THAMT type for Python.
 // THAMTs are just thin layers around PHAMTs; note that the PHAMT type already
 // has all the machinery for dealing with transients via the flag_transient bit,
@@ -486,13 +919,17 @@ typedef struct THAMT {
    PyObject_HEAD
    // The PHAMT that we wrap. This may be pesistent or transient--the idea is
    // that once we start updating it, we replace it with transient nodes and
-   // mutate them directly in further updates. When a THAMT is persisted, we
-   // just flip the transient bit on all the non-persistent nodes and return
-   // this value.
+   // mutate them directly in further updates. When a THAMT is persisted, its
+   // transient nodes are compacted into persistent nodes (see thamt_compact),
+   // which the THAMT then continues from.
    PHAMT_t phamt;
    // THAMTs track a version number specifically so that iterators don't get
    // screwed up when the THAMT changes underneath them.
    hash_t version;
+   // The number of live iterators over the THAMT. While there are any, the
+   // persistent() method flips the THAMT's nodes in place instead of
+   // compacting them, so that the iterators' paths remain valid.
+   Py_ssize_t iterators;
 }* THAMT_t;
 
 // The PHAMT iterator type for Python.
@@ -509,6 +946,60 @@ typedef struct THAMT_iter {
    hash_t version;
 }* THAMT_iter_t;
 
+// The ShardedTHAMT type for Python.
+// A ShardedTHAMT holds one THAMT for each cell of the root; the THAMT of cell i
+// holds the keys whose top PHAMT_ROOT_SHIFT bits are i.
+typedef struct THAMT_sharded {
+   // The Python data.
+   PyObject_HEAD
+   // The shards.
+   THAMT_t shards[PHAMT_ROOT_MAXCELLS];
+}* THAMT_sharded_t;
+
+// The PHAMTRef type for Python.
+// A PHAMTRef holds a persistent PHAMT that may be replaced by any thread; the
+// phamtref_* functions below read and replace it atomically.
+typedef struct PHAMT_ref {
+   // The Python data.
+   PyObject_HEAD
+   // The current PHAMT; this is never transient.
+   PHAMT_t phamt;
+}* PHAMT_ref_t;
+
+// The ConcurrentTHAMT types for Python.
+// A ConcurrentTHAMT is a Ctrie built from PHAMT nodes: each of its internal
+// nodes (C-nodes) is the main node of an indirection node (I-node), which
+// writers replace with a compare-and-set (see the cthamt_* functions below).
+// A C-node has the layout of any other internal node, but each of its cells
+// holds either an I-node or a persistent subtrie; twigs are always persistent.
+// Each I-node belongs to a generation, and only writers of that generation may
+// replace its main node; a snapshot starts a new generation, so the I-nodes of
+// the old one never change again and are copied by the writers that reach them.
+typedef struct PHAMT_inode {
+   // The Python data.
+   PyObject_HEAD
+   // The generation of the I-node.
+   uint64_t gen;
+   // The main node: a C-node, or, if tomb is set, the persistent subtrie that a
+   // C-node left with a single cell was reduced to (the next writer that finds
+   // it moves it into the parent C-node).
+   PHAMT_t main;
+   // Once the generation has ended, the PHAMT made from main by persistent()
+   // (or NULL if there isn't one yet).
+   PHAMT_t cache;
+   uint8_t tomb;
+}* PHAMT_inode_t;
+typedef struct THAMT_concurrent {
+   // The Python data.
+   PyObject_HEAD
+   // The root I-node, whose main node is always a C-node at the root depth.
+   PHAMT_inode_t root;
+   // The generation of root. Writers read it atomically while they hold the
+   // I-node that they update; it is written while both the ConcurrentTHAMT and
+   // its root are held.
+   uint64_t gen;
+}* THAMT_concurrent_t;
+
 
 //==============================================================================
 // Debugging Code.
@@ -573,13 +1064,15 @@ typedef struct THAMT_iter {
 // bits below that number set to true. The bit itself is set to false. Bits are
 // indexed starting at 0.
 // lowmask(bitno) is equal to ~highmask(bitno).
+// (A shift by the full width of the type is undefined, so that case, which
+// firstn reaches for a full bitmask, is handled separately.)
 static inline bits_t lowmask_bits(bits_t bitno)
 {
-   return ((BITS_ONE << bitno) - BITS_ONE);
+   return (bitno < BITS_BITCOUNT ? (BITS_ONE << bitno) - BITS_ONE : BITS_MAX);
 }
 static inline hash_t lowmask_hash(hash_t bitno)
 {
-   return ((HASH_ONE << bitno) - HASH_ONE);
+   return (bitno < HASH_BITCOUNT ? (HASH_ONE << bitno) - HASH_ONE : HASH_MAX);
 }
 // highmask(bitno)
 // Yields a mask of all bits above the given bit number set to true and all
@@ -588,11 +1081,11 @@ static inline hash_t lowmask_hash(hash_t bitno)
 // highmask(bitno) is equal to ~lowmask(bitno).
 static inline bits_t highmask_bits(bits_t bitno)
 {
-   return ~((BITS_ONE << bitno) - BITS_ONE) * (bitno != BITS_BITCOUNT);
+   return ~lowmask_bits(bitno);
 }
 static inline hash_t highmask_hash(hash_t bitno)
 {
-   return ~((HASH_ONE << bitno) - HASH_ONE) * (bitno != HASH_BITCOUNT);
+   return ~lowmask_hash(bitno);
 }
 // highbitdiff(id1, id2)
 // Yields the highest bit that is different between id1 and id2.
@@ -627,7 +1120,8 @@ static inline hash_t phamt_depthmask(hash_t depth)
    uint8_t t = depth == PHAMT_TWIG_DEPTH,
            r = depth == PHAMT_ROOT_DEPTH,
            n = (t | r) == 0;
-   hash_t h = (PHAMT_ROOT_FIRSTBIT - (depth-1)*PHAMT_NODE_SHIFT);
+   // (The shift is zeroed unless n so that it is never out of range.)
+   hash_t h = n * (PHAMT_ROOT_FIRSTBIT - (depth-1)*PHAMT_NODE_SHIFT);
    h = ((HASH_ONE << h) - HASH_ONE);
    return ( (r * HASH_MAX)
           | (t * PHAMT_TWIG_MASK)
@@ -651,6 +1145,15 @@ static inline hash_t phamt_isbeneath(hash_t nodeid, hash_t depth, hash_t leafid)
 {
    return leafid >= nodeid && leafid <= (nodeid | phamt_depthmask(depth));
 }
+// phamt_key(h)
+// Yields the (signed) key whose hash is h; see PHAMT_KEY_MIN.
+static inline phamt_key_t phamt_key(hash_t h)
+{
+   if (h > (hash_t)PHAMT_KEY_MAX)
+      return (phamt_key_t)(h - (hash_t)PHAMT_KEY_MAX - 1) + PHAMT_KEY_MIN;
+   else
+      return (phamt_key_t)h;
+}
 // phamt_maxcells(depth)
 // Get the maximum number of cells at a particula depth.
 static inline bits_t phamt_maxcells(bits_t depth)
@@ -673,7 +1176,7 @@ static inline bits_t phamt_maxcells(bits_t depth)
 // Get the number of cells in the PHAMT node (not the number of elements).
 static inline bits_t phamt_cellcount(PHAMT_t u)
 {
-   return (u->flag_full ? popcount_bits(u->bits) : Py_SIZE(u));
+   return (u->flag_full ? popcount_bits(u->bits) : (bits_t)Py_SIZE(u));
 }
 // phamt_cellcapacity(node)
 // Get the number of allocated cells in this node.
@@ -778,22 +1281,282 @@ static inline PHAMT_t phamt_empty_like(PHAMT_t like)
    if (like == NULL || like->flag_pyobject) return phamt_empty();
    else return phamt_empty_ctype();
 }
+// phamt_freeze(node)
+// Returns a frozen copy of the persistent PHAMT node (caller obtains the
+// reference), or NULL with an exception set on failure. The nodes of a frozen
+// PHAMT are laid out depth-first in a single block of memory, are never
+// tracked by the garbage collector, and are never freed (see
+// PHAMT_FROZEN_REFCNT), so that reading them never writes to their memory. The
+// subtrees of node that are already frozen are shared rather than copied.
+PHAMT_t phamt_freeze(PHAMT_t node);
+// phamt_from_arrays(keys, vals, n, flag_pyobject, nthreads)
+// Returns a new PHAMT (caller obtains the reference) that maps keys[i] to
+// vals[i] for each i < n, or NULL with an exception set on failure. When a key
+// is repeated, its last value is kept. The values are Python objects, which
+// gain references, if flag_pyobject is 1 and C values otherwise. This must be
+// called with the GIL held, but the GIL is released while the items are sorted
+// and while the nodes are filled in, which is split across up to nthreads
+// threads; the arrays must not change until this returns.
+PHAMT_t phamt_from_arrays(const hash_t* keys, void* const* vals, Py_ssize_t n,
+                          uint8_t flag_pyobject, int nthreads);
+// phamt_assoc_arrays(node, keys, vals, n, nthreads)
+// Yields a copy of the persistent node with keys[i] assoc'd to vals[i] for each
+// i < n (caller obtains the reference), or NULL with an exception set on
+// failure. The items are built into a PHAMT by phamt_from_arrays(), which is
+// then merged into node by phamt_union().
+PHAMT_t phamt_assoc_arrays(PHAMT_t node, const hash_t* keys, void* const* vals,
+                           Py_ssize_t n, int nthreads);
 // _phamt_new(ncells)
 // Create a new PHAMT with a size of ncells. This object is not initialized
 // beyond Python's initialization, and it has not been added to the garbage
 // collector, so it should not be used in general except by the phamt core
 // functions themselves.
 PHAMT_t _phamt_new(unsigned ncells);
+// _phamt_new_nogc(ncells)
+// Like _phamt_new(ncells), but the node is allocated without the garbage
+// collector's header, so it can never be tracked. The PHAMT type reports the
+// GC-ness of each node individually (via its tp_is_gc slot and the node's
+// flag_gc bit), so such nodes are otherwise ordinary PHAMTs.
+PHAMT_t _phamt_new_nogc(unsigned ncells);
+// PHAMT_scratch_t
+// Stack storage for a persistent node that is still being built; see
+// _phamt_scratch() and _phamt_finish().
+typedef union {
+   struct PHAMT node;
+   void* words[PHAMT_SIZE/sizeof(void*) + PHAMT_ANY_MAXCELLS];
+} PHAMT_scratch_t;
+// _phamt_scratch(scratch, ncells)
+// Prepares the given scratch space to hold a node of ncells cells and returns
+// the (uninitialized) node it contains. Only the type and size of the node's
+// Python header and its flag_small, cell_packing, and flag_frozen members (0)
+// are set; the node must be passed to _phamt_finish() once its data and cells
+// have been filled in.
+PHAMT_t _phamt_scratch(PHAMT_scratch_t* scratch, unsigned ncells);
+// _phamt_may_be_tracked(node, obj)
+// Yields 1 if the Python object obj, a value in the twig node, is or may later
+// become tracked by the garbage collector and 0 otherwise. Like CPython's own
+// rule for tuples, this treats untracked tuples and PHAMTs as permanently
+// untracked because they are immutable.
+static inline int _phamt_may_be_tracked(PHAMT_t node, PyObject* obj)
+{
+   if (!PyObject_IS_GC(obj)) return 0;
+   if (PyTuple_CheckExact(obj) || Py_TYPE(obj) == Py_TYPE(node))
+      return PyObject_GC_IsTracked(obj);
+   return 1;
+}
+// _phamt_wants_tracking(node)
+// Yields 1 if the fully-initialized node should be tracked by the garbage
+// collector because it could be part of a reference cycle, otherwise 0. Only
+// nodes that can reach a tracked Python object are tracked: a persistent twig
+// (or small map) is tracked if any of its values may be tracked, and a
+// persistent internal node is tracked if any of its children is tracked.
+// Twigs of ctype PHAMTs and the nodes above them therefore never enter the
+// GC's generations. Transient nodes are always tracked, since their cells
+// change; thamt_persist() reconsiders them once they become persistent.
+static inline int _phamt_wants_tracking(PHAMT_t node)
+{
+   bits_t b, bi, ii;
+   PyObject* cell;
+   if (node->flag_transient) return 1;
+   if (node->flag_small) {
+      // A small map's values follow its numel keys.
+      if (node->flag_pyobject) {
+         for (ii = 0; ii < node->numel; ++ii) {
+            cell = (PyObject*)node->cells[node->numel + ii];
+            if (_phamt_may_be_tracked(node, cell)) return 1;
+         }
+      }
+      return 0;
+   }
+   if (node->addr_depth == PHAMT_TWIG_DEPTH && !node->flag_pyobject) return 0;
+   for (b = node->bits, ii = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+      bi = ctz_bits(b);
+      cell = (PyObject*)node->cells[node->flag_full ? bi : ii];
+      if (node->addr_depth == PHAMT_TWIG_DEPTH
+          ? _phamt_may_be_tracked(node, cell)
+          : PyObject_GC_IsTracked(cell))
+         return 1;
+   }
+   return 0;
+}
+// _phamt_track(node)
+// Registers the fully-initialized node, which must have been allocated by
+// _phamt_new(), with the garbage collector if _phamt_wants_tracking(node).
+static inline void _phamt_track(PHAMT_t node)
+{
+   if (_phamt_wants_tracking(node)) PyObject_GC_Track((PyObject*)node);
+}
+// _phamt_copy_tracking(node, oldcell, newcell)
+// Yields _phamt_wants_tracking() for a persistent copy of the persistent node
+// in which oldcell has been removed and newcell added (either may be NULL), or
+// -1 if it can't be known without scanning the copy's cells. Since a persistent
+// node that isn't frozen is tracked (i.e., has flag_gc set and is tracked)
+// exactly when one of its cells needs it, the copy needs a scan only when a
+// cell that needs tracking is removed and newcell doesn't need it; otherwise,
+// the cells that a copy shares with node (which may be as many as
+// PHAMT_ANY_MAXCELLS, each in its own cache line) needn't be visited again.
+// Frozen nodes are never tracked, whatever their cells hold, so their copies
+// are always scanned.
+static inline int _phamt_copy_tracking(PHAMT_t node, void* oldcell,
+                                       void* newcell)
+{
+   if (node->addr_depth == PHAMT_TWIG_DEPTH) {
+      if (!node->flag_pyobject) return 0;
+      if (newcell && _phamt_may_be_tracked(node, (PyObject*)newcell)) return 1;
+      if (oldcell && _phamt_may_be_tracked(node, (PyObject*)oldcell)) return -1;
+   } else {
+      if (newcell && PyObject_GC_IsTracked((PyObject*)newcell)) return 1;
+      if (oldcell && PyObject_GC_IsTracked((PyObject*)oldcell)) return -1;
+   }
+   if (node->flag_frozen) return -1;
+   return node->flag_gc && PyObject_GC_IsTracked((PyObject*)node);
+}
+// _phamt_choose_layout(node)
+// Given a node in scratch space whose cells are stored compactly (i.e., in the
+// order of their bits, with flag_full unset), switches the node to the full
+// layout if it is dense enough (see PHAMT_FULL_PERCENT). Nodes whose cells are
+// contiguous from bit 0 (flag_firstn) are already directly indexed, so they
+// switch only once every cell is in use.
+static inline void _phamt_choose_layout(PHAMT_t node)
+{
+   bits_t bi, ii = (bits_t)Py_SIZE(node);
+   bits_t maxcells = phamt_maxcells(node->addr_depth);
+   if (node->flag_small) return;
+   if (ii < maxcells
+       && (node->flag_firstn || ii*100 < maxcells*PHAMT_FULL_PERCENT))
+      return;
+   // Spread the cells out to their bit indices, starting from the back so that
+   // no cell is overwritten before it is moved.
+   for (bi = maxcells; bi-- > 0; ) {
+      if (node->bits & (BITS_ONE << bi)) node->cells[bi] = node->cells[--ii];
+      else node->cells[bi] = NULL;
+   }
+   ((PyVarObject*)node)->ob_size = maxcells;
+   node->flag_full = 1;
+}
+
+//------------------------------------------------------------------------------
+// Packed twigs.
+// The values of a ctype PHAMT are often small unsigned integers (flags, counts,
+// enum codes) that use only a few bits of their cells. When a persistent twig
+// of a ctype PHAMT is built (see _phamt_finish()), its values are therefore
+// packed into the narrowest of 1-, 8-, 16-, or 32-bit fields that holds all of
+// them, provided that this saves at least one cell; cell_packing records the
+// width. The fields follow the node's layout (full or compact) and are stored
+// in order from the low bits of cells[0], so the node's Python size is the
+// number of cells that they occupy. Lookups and iteration read the cells of
+// twigs via _phamt_cell(); the functions that copy a twig read it via
+// _phamt_unpack(), and because the copy is packed anew, a twig is widened
+// (or narrowed) whenever its values require it. Transient nodes are never
+// packed.
+
+// _phamt_cell(node, ii)
+// Yields the ii'th cell of node, which is the ii'th field of its cells if the
+// node is a packed twig.
+static inline void* _phamt_cell(PHAMT_t node, bits_t ii)
+{
+   unsigned width, bi;
+   if (!node->cell_packing) return node->cells[ii];
+   width = 1u << (node->cell_packing - 1);
+   bi = ii * width;
+   // (On a platform with 32-bit cells, the mask below is correctly all ones
+   // for 32-bit fields, since the shift overflows to 0.)
+   return (void*)(((uintptr_t)node->cells[bi / PHAMT_CELL_BITS]
+                   >> (bi % PHAMT_CELL_BITS))
+                  & (((uintptr_t)2 << (width - 1)) - 1));
+}
+// _phamt_pack(node)
+// Packs the cells of the given node, which must live in scratch space and have
+// its layout chosen already, if it is a persistent ctype twig whose values fit
+// into fewer cells once packed.
+static inline void _phamt_pack(PHAMT_t node)
+{
+   bits_t ii, ncells = (bits_t)Py_SIZE(node), nwords;
+   uintptr_t top = 0, words[PHAMT_TWIG_MAXCELLS];
+   unsigned packing, width;
+   if (!PHAMT_PACKED || node->flag_pyobject || node->flag_transient
+       || node->flag_small
+       || node->addr_depth != PHAMT_TWIG_DEPTH)
+      return;
+   for (ii = 0; ii < ncells; ++ii) top |= (uintptr_t)node->cells[ii];
+   packing = (top <= 1          ? 1 :
+              top <= 0xff       ? 4 :
+              top <= 0xffff     ? 5 :
+              top <= 0xffffffff ? 6 : 0);
+   if (!packing) return;
+   width = 1u << (packing - 1);
+   nwords = (ncells*width + PHAMT_CELL_BITS - 1) / PHAMT_CELL_BITS;
+   if (nwords >= ncells) return;
+   memset(words, 0, sizeof(uintptr_t)*nwords);
+   for (ii = 0; ii < ncells; ++ii) {
+      words[ii*width / PHAMT_CELL_BITS] |= ((uintptr_t)node->cells[ii]
+                                            << (ii*width % PHAMT_CELL_BITS));
+   }
+   for (ii = 0; ii < nwords; ++ii) node->cells[ii] = (void*)words[ii];
+   ((PyVarObject*)node)->ob_size = nwords;
+   node->cell_packing = packing;
+}
+// _phamt_unpack(node, scratch)
+// Yields node itself if it isn't a packed twig; otherwise, copies node into the
+// given scratch space with its cells unpacked and yields the copy. The copy may
+// be read in place of node (e.g., by the functions that copy nodes) but is not
+// a Python object in its own right.
+static inline PHAMT_t _phamt_unpack(PHAMT_t node, PHAMT_scratch_t* scratch)
+{
+   PHAMT_t u;
+   bits_t ii, ncells;
+   if (!node->cell_packing) return node;
+   ncells = (node->flag_full ? PHAMT_TWIG_MAXCELLS : popcount_bits(node->bits));
+   u = _phamt_scratch(scratch, ncells);
+   memcpy(&u->address, &node->address,
+          offsetof(struct PHAMT, cells) - offsetof(struct PHAMT, address));
+   u->cell_packing = 0;
+   for (ii = 0; ii < ncells; ++ii) u->cells[ii] = _phamt_cell(node, ii);
+   return u;
+}
+// _phamt_finish_tracking(node, gc)
+// Copies the fully-initialized persistent node, which must live in scratch
+// space obtained from _phamt_scratch() and have its cells stored compactly
+// (the layout and packing are chosen here), into a newly allocated PHAMT and
+// returns it (with a refcount of 1). If gc is 1, the garbage collector tracks
+// the node, which is allocated with _phamt_new(); if it is 0, the node is
+// allocated with _phamt_new_nogc(), which saves the GC header on every such
+// node; and if it is -1, _phamt_wants_tracking(node) decides.
+static inline PHAMT_t _phamt_finish_tracking(PHAMT_t node, int gc)
+{
+   PHAMT_t u;
+   unsigned ncells;
+   _phamt_choose_layout(node);
+   _phamt_pack(node);
+   ncells = (unsigned)Py_SIZE(node);
+   if (gc < 0) gc = _phamt_wants_tracking(node);
+   u = gc ? _phamt_new(ncells) : _phamt_new_nogc(ncells);
+   memcpy(&u->address, &node->address,
+          offsetof(struct PHAMT, cells) - offsetof(struct PHAMT, address)
+          + sizeof(void*)*ncells);
+   u->flag_gc = gc;
+   u->flag_frozen = 0;
+   if (gc) PyObject_GC_Track((PyObject*)u);
+   return u;
+}
+// _phamt_finish(node)
+// Equivalent to _phamt_finish_tracking(node, -1): the node is tracked by the
+// garbage collector if _phamt_wants_tracking(node).
+static inline PHAMT_t _phamt_finish(PHAMT_t node)
+{
+   return _phamt_finish_tracking(node, -1);
+}
 // phamt_from_kv(k, v)
 // Create a new PHAMT node that holds a single key-value pair.
-// The returned node is fully initialized and has had the
-// PyObject_GC_Track() function already called for it.
+// The returned node is fully initialized and has already been registered with
+// the garbage collector if need be (see _phamt_finish()).
 // The argument flag_pyobject should be 1 if v is a Python object and 0 if
 // it is not (this determines whether the resulting PHAMT is a Python PHAMT
 // or a c-type PHAMT).
 static inline PHAMT_t phamt_from_kv(hash_t k, void* v, uint8_t flag_pyobject)
 {
-   PHAMT_t node = _phamt_new(1);
+   PHAMT_scratch_t scratch;
+   PHAMT_t node = _phamt_scratch(&scratch, 1);
    node->bits = (BITS_ONE << (k & PHAMT_TWIG_MASK));
    node->address = k & ~PHAMT_TWIG_MASK;
    node->numel = 1;
@@ -809,9 +1572,8 @@ static inline PHAMT_t phamt_from_kv(hash_t k, void* v, uint8_t flag_pyobject)
    node->cells[0] = (void*)v;
    // Update that refcount and notify the GC tracker!
    if (flag_pyobject) Py_INCREF(v);
-   PyObject_GC_Track((PyObject*)node);
    // Otherwise, that's all!
-   return node;
+   return _phamt_finish(node);
 }
 // phamt_copy_chgcell(node)
 // Creates an exact copy of the given node with a single element replaced,
@@ -821,16 +1583,20 @@ static inline PHAMT_t _phamt_copy_chgcell(PHAMT_t node, PHAMT_index_t ci,
                                           void* val)
 {
    PHAMT_t u;
-   bits_t ncells = phamt_cellcount(node);
+   PHAMT_scratch_t scratch, unpacked;
+   bits_t ncells;
+   int gc = _phamt_copy_tracking(node, _phamt_cell(node, ci.cellindex), val);
+   node = _phamt_unpack(node, &unpacked);
+   ncells = phamt_cellcount(node);
    dbgnode("[_phamt_copy_chgcell]", node);
    dbgci("[_phamt_copy_chgcell]", ci);
-   u = _phamt_new(ncells);
+   u = _phamt_scratch(&scratch, ncells);
    u->address = node->address;
    u->bits = node->bits;
    u->numel = node->numel;
    u->flag_pyobject = node->flag_pyobject;
    u->flag_firstn = node->flag_firstn;
-   u->flag_full = ncells == phamt_maxcells(node->addr_depth);
+   u->flag_full = 0;
    u->flag_transient = 0;
    u->addr_depth = node->addr_depth;
    u->addr_shift = node->addr_shift;
@@ -859,8 +1625,7 @@ static inline PHAMT_t _phamt_copy_chgcell(PHAMT_t node, PHAMT_index_t ci,
       for (ii = 0; ii < ncells; ++ii)
          Py_INCREF((PyObject*)u->cells[ii]);
    }
-   PyObject_GC_Track((PyObject*)u);
-   return u;
+   return _phamt_finish_tracking(u, gc);
 }
 // _phamt_copy_addcell(node, cellinfo)
 // Creates a copy of the given node with a new cell inserted at the appropriate
@@ -872,16 +1637,20 @@ static inline PHAMT_t _phamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
                                           void* val)
 {
    PHAMT_t u;
-   bits_t ncells = phamt_cellcount(node);
+   PHAMT_scratch_t scratch, unpacked;
+   bits_t ncells;
+   int gc = _phamt_copy_tracking(node, NULL, val);
+   node = _phamt_unpack(node, &unpacked);
+   ncells = phamt_cellcount(node);
    dbgnode("[_phamt_copy_addcell]", node);
    dbgci("[_phamt_copy_addcell]", ci);
-   u = _phamt_new(ncells + 1);
+   u = _phamt_scratch(&scratch, ncells + 1);
    u->address = node->address;
    u->bits = node->bits | (BITS_ONE << ci.bitindex);
    u->numel = node->numel;
    u->flag_pyobject = node->flag_pyobject;
    u->flag_firstn = firstn_bits(u->bits);
-   u->flag_full = ncells + 1 == phamt_maxcells(node->addr_depth);
+   u->flag_full = 0;
    u->flag_transient = 0;
    u->addr_depth = node->addr_depth;
    u->addr_shift = node->addr_shift;
@@ -913,8 +1682,7 @@ static inline PHAMT_t _phamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
       for (ii = 0; ii < ncells; ++ii)
          Py_INCREF((PyObject*)u->cells[ii]);
    }
-   PyObject_GC_Track((PyObject*)u);
-   return u;
+   return _phamt_finish_tracking(u, gc);
 }
 // _phamt_copy_delcell(node, cellinfo)
 // Creates a copy of the given node with a cell deleted at the appropriate
@@ -924,9 +1692,13 @@ static inline PHAMT_t _phamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
 static inline PHAMT_t _phamt_copy_delcell(PHAMT_t node, PHAMT_index_t ci)
 {
    PHAMT_t u;
-   bits_t ncells = phamt_cellcount(node) - 1;
+   PHAMT_scratch_t scratch, unpacked;
+   bits_t ncells;
+   int gc = _phamt_copy_tracking(node, _phamt_cell(node, ci.cellindex), NULL);
+   node = _phamt_unpack(node, &unpacked);
+   ncells = phamt_cellcount(node) - 1;
    if (ncells == 0) return phamt_empty_like(node);
-   u = _phamt_new(ncells);
+   u = _phamt_scratch(&scratch, ncells);
    u->address = node->address;
    u->bits = node->bits & ~(BITS_ONE << ci.bitindex);
    u->numel = node->numel;
@@ -955,19 +1727,18 @@ static inline PHAMT_t _phamt_copy_delcell(PHAMT_t node, PHAMT_index_t ci)
       for (ii = 0; ii < ncells; ++ii)
          Py_INCREF((PyObject*)u->cells[ii]);
    }
-   PyObject_GC_Track((PyObject*)u);
-   return u;
+   return _phamt_finish_tracking(u, gc);
 }
-// _phamt_join_disjoint(node1, node2)
-// Yields a single PHAMT that has as children the two PHAMTs node1 and node2.
-// The nodes must be disjoint--i.e., node1 is not a subnode of node2 and node2
-// is not a subnode of node1. Both nodes must have the same pyobject flag.
-// This function does not update the references of either node, so this must be
-// accounted for by the caller (in other words, make sure to INCREF both nodes
-// before calling this function). The return value has a refcount of 1.
-static inline PHAMT_t _phamt_join_disjoint(PHAMT_t a, PHAMT_t b)
+// _phamt_join_cells(a, acell, b, bcell)
+// Like _phamt_join_disjoint(a, b), except that the cells of the new node that
+// a and b would fill are given acell and bcell instead (whose references are
+// likewise stolen). A ConcurrentTHAMT uses this to join the C-node a to the
+// subtrie b when acell is the I-node of a.
+static inline PHAMT_t _phamt_join_cells(PHAMT_t a, void* acell,
+                                        PHAMT_t b, void* bcell)
 {
    PHAMT_t u;
+   PHAMT_scratch_t scratch;
    uint8_t bit0, shift, newdepth;
    hash_t h;
    // What's the highest bit at which they differ?
@@ -985,7 +1756,7 @@ static inline PHAMT_t _phamt_join_disjoint(PHAMT_t a, PHAMT_t b)
       shift = PHAMT_ROOT_SHIFT;
    }
    // Go ahead and allocate the new node.
-   u = _phamt_new(2);
+   u = _phamt_scratch(&scratch, 2);
    u->address = a->address & highmask_hash(bit0 + shift);
    u->numel = a->numel + b->numel;
    u->flag_pyobject = a->flag_pyobject;
@@ -1000,17 +1771,27 @@ static inline PHAMT_t _phamt_join_disjoint(PHAMT_t a, PHAMT_t b)
    u->bits |= BITS_ONE << (h & (a->address >> bit0));
    u->bits |= BITS_ONE << (h & (b->address >> bit0));
    if (a->address < b->address) {
-      u->cells[0] = (void*)a;
-      u->cells[1] = (void*)b;
+      u->cells[0] = acell;
+      u->cells[1] = bcell;
    } else {
-      u->cells[0] = (void*)b;
-      u->cells[1] = (void*)a;
+      u->cells[0] = bcell;
+      u->cells[1] = acell;
    }
    u->flag_firstn = firstn_bits(u->bits);
-   // We need to register the new node u with the garbage collector.
-   PyObject_GC_Track((PyObject*)u);
-   // That's all.
-   return u;
+   // Allocate the real node (registering it with the garbage collector if
+   // need be); that's all.
+   return _phamt_finish(u);
+}
+// _phamt_join_disjoint(node1, node2)
+// Yields a single PHAMT that has as children the two PHAMTs node1 and node2.
+// The nodes must be disjoint--i.e., node1 is not a subnode of node2 and node2
+// is not a subnode of node1. Both nodes must have the same pyobject flag.
+// This function does not update the references of either node, so this must be
+// accounted for by the caller (in other words, make sure to INCREF both nodes
+// before calling this function). The return value has a refcount of 1.
+static inline PHAMT_t _phamt_join_disjoint(PHAMT_t a, PHAMT_t b)
+{
+   return _phamt_join_cells(a, (void*)a, b, (void*)b);
 }
 
 //------------------------------------------------------------------------------
@@ -1038,7 +1819,7 @@ static inline PHAMT_t _thamt_empty(uint8_t pyobject)
    node->addr_shift    = PHAMT_ROOT_SHIFT;
    node->address = 0;
    // Add to the garbage collector:
-   PyObject_GC_Track((PyObject*)node);
+   _phamt_track(node);
    // That's it--node is ready!
    return node;
 }
@@ -1080,7 +1861,7 @@ static inline PHAMT_t _thamt_from_kv(hash_t k, void* v, uint8_t flag_pyobject)
    node->cells[cellindex] = (void*)v;
    // Update that refcount and notify the GC tracker!
    if (flag_pyobject) Py_INCREF(v);
-   PyObject_GC_Track((PyObject*)node);
+   _phamt_track(node);
    // Otherwise, that's all!
    return node;
 }
@@ -1099,6 +1880,7 @@ static inline PHAMT_t _thamt_copy_chgcell(PHAMT_t node, PHAMT_index_t ci,
                                           void* val)
 {
    PHAMT_t u;
+   PHAMT_scratch_t unpacked;
    bits_t ncells;
    if (node->flag_transient) {
       // We don't need to allocate anything--we just change in place.
@@ -1111,6 +1893,7 @@ static inline PHAMT_t _thamt_copy_chgcell(PHAMT_t node, PHAMT_index_t ci,
       return node;
    }
    // Otherwise, we need to do an allocation, much like with phamts.
+   node = _phamt_unpack(node, &unpacked);
    dbgnode("[_thamt_copy_addcell]", node);
    dbgci("[_thamt_copy_addcell]", ci);
    u = _phamt_new(PHAMT_ANY_MAXCELLS);
@@ -1142,15 +1925,15 @@ static inline PHAMT_t _thamt_copy_chgcell(PHAMT_t node, PHAMT_index_t ci,
    // Increase the refcount for all these cells!
    if (u->addr_depth < PHAMT_TWIG_DEPTH || u->flag_pyobject)
       _thamt_refcount_cells(u);
-   PyObject_GC_Track((PyObject*)u);
+   _phamt_track(u);
    return u;
 }
 static inline PHAMT_t _thamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
                                           void* val)
 {
    PHAMT_t u;
-   bits_t ncells = phamt_cellcount(node),
-          maxcells = phamt_maxcells(node->addr_depth);
+   PHAMT_scratch_t unpacked;
+   bits_t ncells, maxcells = phamt_maxcells(node->addr_depth);
    dbgnode("[_thamt_copy_addcell]", node);
    dbgci("[_thamt_copy_addcell]", ci);
    if (node->flag_transient) {
@@ -1164,6 +1947,8 @@ static inline PHAMT_t _thamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
       return node;
    }
    // Otherwise, we need to do an allocation, much like with phamts.
+   node = _phamt_unpack(node, &unpacked);
+   ncells = phamt_cellcount(node);
    u = _phamt_new(PHAMT_ANY_MAXCELLS);
    u->address = node->address;
    u->bits = node->bits | (BITS_ONE << ci.bitindex);
@@ -1190,12 +1975,13 @@ static inline PHAMT_t _thamt_copy_addcell(PHAMT_t node, PHAMT_index_t ci,
    u->cells[ci.bitindex] = val;
    if (u->addr_depth < PHAMT_TWIG_DEPTH || u->flag_pyobject)
       _thamt_refcount_cells(u);
-   PyObject_GC_Track((PyObject*)u);
+   _phamt_track(u);
    return u;
 }
 static inline PHAMT_t _thamt_copy_delcell(PHAMT_t node, PHAMT_index_t ci)
 {
    PHAMT_t u;
+   PHAMT_scratch_t unpacked;
    bits_t ncells, maxcells;
    if (node->flag_transient) {
       // We don't need to allocate anything--we just change the bit.
@@ -1209,6 +1995,7 @@ static inline PHAMT_t _thamt_copy_delcell(PHAMT_t node, PHAMT_index_t ci)
    // Otherwise, we need to do an allocation, much like with phamts.
    // We don't check for ncells == 0 because we're actually fine making a new
    // empty transient node.
+   node = _phamt_unpack(node, &unpacked);
    u = _phamt_new(PHAMT_ANY_MAXCELLS);
    u->address = node->address;
    u->bits = node->bits & ~(BITS_ONE << ci.bitindex);
@@ -1241,7 +2028,7 @@ static inline PHAMT_t _thamt_copy_delcell(PHAMT_t node, PHAMT_index_t ci)
    // Increase the refcount for all these cells!
    if (u->addr_depth < PHAMT_TWIG_DEPTH || u->flag_pyobject)
       _thamt_refcount_cells(u);
-   PyObject_GC_Track((PyObject*)u);
+   _phamt_track(u);
    return u;
 }
 static inline PHAMT_t _thamt_join_disjoint(PHAMT_t a, PHAMT_t b)
@@ -1284,11 +2071,79 @@ static inline PHAMT_t _thamt_join_disjoint(PHAMT_t a, PHAMT_t b)
    u->cells[ii] = b;
    u->flag_firstn = u->bits == 3;
    // We need to register the new node u with the garbage collector.
-   PyObject_GC_Track((PyObject*)u);
+   _phamt_track(u);
    // That's all.
    return u;
 }
 
+//------------------------------------------------------------------------------
+// Small maps.
+// A PHAMT with few elements would otherwise need a root, a twig, and usually
+// several internal nodes between them, since its keys rarely share a twig. A
+// small map instead stores up to PHAMT_SMALL_MAX elements in a single node (with
+// flag_small set): its numel keys, in increasing order, fill the first numel
+// cells, and their values fill the next numel cells. Small maps are only ever
+// roots, never children of other nodes. The functions phamt_lookup(),
+// phamt_assoc(), phamt_dissoc(), phamt_apply(), and the iteration functions
+// handle small maps directly; assoc'ing a new key to a full small map promotes
+// it to a trie, and the remaining PHAMT functions work on the trie yielded by
+// phamt_expand(). THAMTs never wrap small maps.
+
+// _phamt_small_key(node, ii)
+// Yields the ii'th key of the small map node.
+static inline hash_t _phamt_small_key(PHAMT_t node, bits_t ii)
+{
+   return (hash_t)(uintptr_t)node->cells[ii];
+}
+// _phamt_small_index(node, k, found)
+// Yields the index of the first key in the small (or empty) node that is not
+// less than k and sets *found to 1 if that key is k or to 0 otherwise.
+static inline bits_t _phamt_small_index(PHAMT_t node, hash_t k, int* found)
+{
+   bits_t ii, n = (bits_t)node->numel;
+   for (ii = 0; ii < n && _phamt_small_key(node, ii) < k; ++ii) ;
+   *found = (ii < n && _phamt_small_key(node, ii) == k);
+   return ii;
+}
+// _phamt_small_copy(node, ii, k, v, op)
+// Yields a new small map that is a copy of the small (or empty) node with the
+// value at index ii replaced by v (if op is 0), with k => v inserted at index ii
+// (if op is 1), or with the element at index ii removed (if op is -1). The
+// result must not be empty. The refcounts of the values are updated.
+static inline PHAMT_t _phamt_small_copy(PHAMT_t node, bits_t ii, hash_t k,
+                                        void* v, int op)
+{
+   PHAMT_scratch_t scratch;
+   bits_t jj, n0 = (bits_t)node->numel, n = (bits_t)((int)n0 + op);
+   bits_t src = ii + (op <= 0), dst = ii + (op >= 0);
+   PHAMT_t u = _phamt_scratch(&scratch, 2*n);
+   u->address = 0;
+   u->numel = n;
+   u->bits = 0;
+   u->flag_pyobject = node->flag_pyobject;
+   u->flag_firstn = 0;
+   u->flag_full = 0;
+   u->flag_transient = 0;
+   u->flag_small = 1;
+   u->addr_depth = PHAMT_ROOT_DEPTH;
+   u->addr_startbit = PHAMT_ROOT_FIRSTBIT;
+   u->addr_shift = PHAMT_ROOT_SHIFT;
+   // The keys and values before ii are unchanged, and those after it shift to
+   // make room for (or to cover) the edited element.
+   memcpy(u->cells, node->cells, sizeof(void*)*ii);
+   memcpy(u->cells + n, node->cells + n0, sizeof(void*)*ii);
+   if (op >= 0) {
+      u->cells[ii] = (void*)(uintptr_t)k;
+      u->cells[n + ii] = v;
+   }
+   memcpy(u->cells + dst, node->cells + src, sizeof(void*)*(n0 - src));
+   memcpy(u->cells + n + dst, node->cells + n0 + src, sizeof(void*)*(n0 - src));
+   if (u->flag_pyobject) {
+      for (jj = 0; jj < n; ++jj) Py_INCREF((PyObject*)u->cells[n + jj]);
+   }
+   return _phamt_finish(u);
+}
+
 //------------------------------------------------------------------------------
 // Lookup and finding functions.
 
@@ -1304,9 +2159,14 @@ static inline void* phamt_lookup(PHAMT_t node, hash_t k, int* found)
 {
    PHAMT_index_t ci;
    uint8_t depth;
+   bits_t ii;
    int dummy;
    if (!found) found = &dummy;
    dbgmsg("[phamt_lookup] call: key=%p\n", (void*)k);
+   if (node->flag_small) {
+      ii = _phamt_small_index(node, k, found);
+      return *found ? node->cells[node->numel + ii] : NULL;
+   }
    do {
       ci = phamt_cellindex(node, k);
       dbgnode("[phamt_lookup]      ", node);      
@@ -1316,7 +2176,7 @@ static inline void* phamt_lookup(PHAMT_t node, hash_t k, int* found)
          return NULL;
       }
       depth = node->addr_depth;
-      node = (PHAMT_t)node->cells[ci.cellindex];
+      node = (PHAMT_t)_phamt_cell(node, ci.cellindex);
    } while (depth != PHAMT_TWIG_DEPTH);
    dbgmsg("[phamt_lookup]       return %p\n", (void*)node);
    *found = 1;
@@ -1325,7 +2185,7 @@ static inline void* phamt_lookup(PHAMT_t node, hash_t k, int* found)
 // phamt_find(node, k, path)
 // Finds and returns the value associated with the given key k in the given
 // node. Update the given path-object in order to indicate where in the node
-// the key lies.
+// the key lies. The node must not be a small map (see phamt_expand()).
 static inline void* phamt_find(PHAMT_t node, hash_t k, PHAMT_path_t* path)
 {
    PHAMT_loc_t* loc;
@@ -1346,7 +2206,7 @@ static inline void* phamt_find(PHAMT_t node, hash_t k, PHAMT_path_t* path)
       }
       loc->index.is_beneath = updepth;
       updepth = depth;
-      node = (PHAMT_t)node->cells[loc->index.cellindex];
+      node = (PHAMT_t)_phamt_cell(node, loc->index.cellindex);
    } while (depth != PHAMT_TWIG_DEPTH);
    // If we reach this point, node is the correct/found value.
    path->max_depth = PHAMT_TWIG_DEPTH;
@@ -1374,7 +2234,7 @@ static inline PHAMT_t _phamt_assoc_path(PHAMT_path_t* path, hash_t k,
    // deepest node in the path (u).
    if (path->value_found) {
       // We'e replacing a leaf. Check that there's reason to.
-      void* curval = loc->node->cells[loc->index.cellindex];
+      void* curval = _phamt_cell(loc->node, loc->index.cellindex);
       if (curval == newval) {
          Py_INCREF(node);
          return node;
@@ -1477,15 +2337,66 @@ static inline PHAMT_t _phamt_dissoc_path(PHAMT_path_t* path)
    // At the end of this loop, u is the replacement node, and should be ready.
    return u;
 }
+// _phamt_trie_assoc(node, k, v)
+// Like phamt_assoc(node, k, v), but node must not be a small map, and the
+// result is never a small map.
+static inline PHAMT_t _phamt_trie_assoc(PHAMT_t node, hash_t k, void* v)
+{
+   PHAMT_path_t path;
+   phamt_find(node, k, &path);
+   return _phamt_assoc_path(&path, k, v);
+}
+// phamt_expand(node)
+// Yields a PHAMT equal to node that is not a small map: if node is a small map,
+// a trie holding the same elements is built; otherwise, node itself is
+// returned. The return value's refcount has been incremented for the caller.
+static inline PHAMT_t phamt_expand(PHAMT_t node)
+{
+   PHAMT_t u, v;
+   bits_t ii;
+   if (!node->flag_small) {
+      Py_INCREF(node);
+      return node;
+   }
+   u = phamt_from_kv(_phamt_small_key(node, 0), node->cells[node->numel],
+                     node->flag_pyobject);
+   for (ii = 1; ii < node->numel; ++ii) {
+      v = _phamt_trie_assoc(u, _phamt_small_key(node, ii),
+                            node->cells[node->numel + ii]);
+      Py_DECREF(u);
+      u = v;
+   }
+   return u;
+}
 // phamt_assoc(node, k, v)
 // Yields a copy of the given PHAMT with the new key associated. All return
 // values and touches objects should be correctly reference-tracked, and this
 // function's return-value has been reference-incremented for the caller.
 static inline PHAMT_t phamt_assoc(PHAMT_t node, hash_t k, void* v)
 {
-   PHAMT_path_t path;
-   phamt_find(node, k, &path);
-   return _phamt_assoc_path(&path, k, v);
+   PHAMT_t u, w;
+   bits_t ii;
+   int found;
+   if (!node->flag_small && node->numel > 0)
+      return _phamt_trie_assoc(node, k, v);
+   // The node is empty or a small map.
+   ii = _phamt_small_index(node, k, &found);
+   if (found) {
+      if (node->cells[node->numel + ii] == v) {
+         Py_INCREF(node);
+         return node;
+      }
+      return _phamt_small_copy(node, ii, k, v, 0);
+   }
+#if PHAMT_SMALL_MAX > 0
+   if (node->numel < PHAMT_SMALL_MAX)
+      return _phamt_small_copy(node, ii, k, v, 1);
+#endif
+   // The small map is full, so we promote it to a trie.
+   u = phamt_expand(node);
+   w = _phamt_trie_assoc(u, k, v);
+   Py_DECREF(u);
+   return w;
 }
 // phamt_dissoc(node, k)
 // Yields a copy of the given PHAMT with the given key removed. All return
@@ -1494,6 +2405,18 @@ static inline PHAMT_t phamt_assoc(PHAMT_t node, hash_t k, void* v)
 static inline PHAMT_t phamt_dissoc(PHAMT_t node, hash_t k)
 {
    PHAMT_path_t path;
+   bits_t ii;
+   int found;
+   if (node->flag_small) {
+      ii = _phamt_small_index(node, k, &found);
+      if (!found) {
+         Py_INCREF(node);
+         return node;
+      } else if (node->numel == 1) {
+         return phamt_empty_like(node);
+      }
+      return _phamt_small_copy(node, ii, k, NULL, -1);
+   }
    phamt_find(node, k, &path);
    return _phamt_dissoc_path(&path);
 }
@@ -1522,11 +2445,73 @@ static inline PHAMT_t phamt_apply(PHAMT_t node, hash_t k,
 {
    uint8_t rval;
    PHAMT_path_t path;
-   void* val = phamt_find(node, k, &path);
+   void* val;
+   int found;
+   if (node->flag_small || node->numel == 0) {
+      val = phamt_lookup(node, k, &found);
+      rval = (*fn)((uint8_t)found, &val, arg);
+      return rval ? phamt_assoc(node, k, val) : phamt_dissoc(node, k);
+   }
+   val = phamt_find(node, k, &path);
    rval = (*fn)(path.value_found, &val, arg);
    return _phamt_update(&path, k, val, rval);
 }
 
+//------------------------------------------------------------------------------
+// PHAMTRef functions.
+// These functions are defined in phamt.c, since, in free-threaded builds of
+// Python, they lock the reference that they are given.
+
+// phamtref_get(ref)
+// Returns the current PHAMT of the given reference; the caller obtains the
+// reference to the PHAMT.
+PHAMT_t phamtref_get(PHAMT_ref_t ref);
+// phamtref_compare_and_set(ref, old, u)
+// If the current PHAMT of ref is old, replaces it with u and returns 1;
+// otherwise, returns 0 and leaves ref unchanged. The caller's references to old
+// and u are not consumed.
+int phamtref_compare_and_set(PHAMT_ref_t ref, PHAMT_t old, PHAMT_t u);
+// phamtref_apply(ref, k, fn, arg)
+// Replaces the current PHAMT u of ref with phamt_apply(u, k, fn, arg), and
+// returns the new PHAMT (caller obtains the reference). If another thread
+// replaces u first, the update is made again to the new PHAMT, so fn may be
+// called more than once.
+PHAMT_t phamtref_apply(PHAMT_ref_t ref, hash_t k, phamtfn_t fn, void* arg);
+
+//------------------------------------------------------------------------------
+// ConcurrentTHAMT functions.
+// These functions are defined in phamt.c, since they lock the I-nodes that they
+// read and update (see THAMT_concurrent_t). No lock is held while nodes are
+// copied, and each update replaces the main node of only the I-node just above
+// the changed key, so writers to different parts of the map don't contend.
+
+// cthamt_new(u)
+// Returns a new ConcurrentTHAMT with the contents of the PHAMT u (which may be
+// a ctype PHAMT), or NULL on failure. This takes O(1) time unless u is a small
+// map.
+THAMT_concurrent_t cthamt_new(PHAMT_t u);
+// cthamt_lookup(c, k, found)
+// Like phamt_lookup(), but if the values of c are Python objects, the caller
+// obtains a reference to the value that is returned.
+void* cthamt_lookup(THAMT_concurrent_t c, hash_t k, int* found);
+// cthamt_assoc(c, k, v)
+// Associates the hash k with the value v in c and returns 0, or returns -1 on
+// failure.
+int cthamt_assoc(THAMT_concurrent_t c, hash_t k, void* v);
+// cthamt_dissoc(c, k)
+// Removes the hash k from c and returns 1, returns 0 if k isn't in c, or
+// returns -1 on failure.
+int cthamt_dissoc(THAMT_concurrent_t c, hash_t k);
+// cthamt_snapshot(c)
+// Returns a new ConcurrentTHAMT with the current contents of c in O(1) time,
+// or NULL on failure. The two maps share their nodes until they are edited.
+THAMT_concurrent_t cthamt_snapshot(THAMT_concurrent_t c);
+// cthamt_persistent(c)
+// Returns the current contents of c as a PHAMT (caller obtains the reference),
+// or NULL on failure. The PHAMTs made for the I-nodes that persist them are
+// kept, so that a later call only visits the I-nodes that were edited since.
+PHAMT_t cthamt_persistent(THAMT_concurrent_t c);
+
 //------------------------------------------------------------------------------
 // Iteration functions.
 
@@ -1544,7 +2529,7 @@ static inline void* _phamt_digfirst(PHAMT_t node, PHAMT_path_t* path)
       loc->index = phamt_firstcell(node);
       loc->index.is_beneath = last_depth;
       last_depth = node->addr_depth;
-      node = (PHAMT_t)node->cells[loc->index.cellindex];
+      node = (PHAMT_t)_phamt_cell(node, loc->index.cellindex);
    } while (last_depth < PHAMT_TWIG_DEPTH);
    path->value_found = 1;
    path->max_depth = PHAMT_TWIG_DEPTH;
@@ -1569,6 +2554,16 @@ static inline void* phamt_first(PHAMT_t node, PHAMT_path_t* path)
       path->edit_depth = 0;
       return NULL;
    }
+   // A small map's path is just the index of the current element.
+   if (node->flag_small) {
+      path->steps[d].index.cellindex = 0;
+      path->steps[d].index.bitindex = 0;
+      path->steps[d].index.is_found = 1;
+      path->value_found = 1;
+      path->max_depth = d;
+      path->edit_depth = d;
+      return node->cells[node->numel];
+   }
    // Otherwise, digfirst will take care of things.
    return _phamt_digfirst(node, path);
 }
@@ -1585,8 +2580,16 @@ static inline void* phamt_next(PHAMT_t node0, PHAMT_path_t* path)
    PHAMT_loc_t* loc;
    // We should always return from twig depth, but we can start at whatever
    // depth the path gives us, in case someone has a path pointing to the middle
-   // of a phamt somewhere.
-   d = path->max_depth;
+   // of a phamt somewhere. Small maps just step to their next element (and skip
+   // the walk below if there isn't one).
+   if (node0->flag_small) {
+      loc = path->steps + path->min_depth;
+      if ((hash_t)loc->index.cellindex + 1 < node0->numel)
+         return node0->cells[node0->numel + ++(loc->index.cellindex)];
+      d = PHAMT_LEAF_DEPTH;
+   } else {
+      d = path->max_depth;
+   }
    while (d <= PHAMT_TWIG_DEPTH) {
       loc = path->steps + d;
       // Get the next bitindex, assuming there are more.
@@ -1600,7 +2603,7 @@ static inline void* phamt_next(PHAMT_t node0, PHAMT_path_t* path)
          else
             ++(loc->index.cellindex);
          // We can dig for the rest.
-         node = loc->node->cells[loc->index.cellindex];
+         node = _phamt_cell(loc->node, loc->index.cellindex);
          if (d < PHAMT_TWIG_DEPTH) {
             path->steps[node->addr_depth].index.is_beneath = d;
             node = _phamt_digfirst(node, path);
@@ -1612,13 +2615,703 @@ static inline void* phamt_next(PHAMT_t node0, PHAMT_path_t* path)
          d = loc->index.is_beneath;
       }
    }
-   // If we reach this point, we didn't find anything.
+   // If we reach this point, we didn't find anything. Note that we leave the
+   // min_depth alone so that the path's starting node can still be found.
    path->value_found = 0;
    path->max_depth = 0xff;
    path->edit_depth = 0;
-   path->min_depth = 0;
    return NULL;
 }
+// phamt_path_key(path)
+// Yields the key of the item that the given path points to; the path must point
+// to an item (i.e., path->value_found must be 1).
+static inline hash_t phamt_path_key(PHAMT_path_t* path)
+{
+   PHAMT_loc_t* loc = path->steps + path->max_depth;
+   if (loc->node->flag_small)
+      return _phamt_small_key(loc->node, loc->index.cellindex);
+   return loc->node->address | (hash_t)loc->index.bitindex;
+}
+// phamt_next_chunk(node, path, n, keys, vals)
+// Like phamt_next(node, path), but copies up to n of the items that follow the
+// path's current item into the arrays keys and vals (either of which may be
+// NULL) and leaves the path at the last item copied. The path must point to an
+// item already (i.e., path->value_found must be 1). The remaining cells of a
+// twig are copied in a single pass; the path is only walked when a twig runs
+// out. The number of items copied is returned; if this is less than n, then
+// the iteration is finished. No refcounting is performed by this function.
+static inline hash_t phamt_next_chunk(PHAMT_t node0, PHAMT_path_t* path,
+                                      hash_t n, hash_t* keys, void** vals)
+{
+   PHAMT_loc_t* loc = path->steps + PHAMT_TWIG_DEPTH;
+   PHAMT_t twig;
+   hash_t count = 0, m, ii;
+   bits_t b, bi, ci;
+   void* val;
+   if (node0->flag_small) {
+      // The rest of a small map's keys and values are contiguous.
+      loc = path->steps + path->min_depth;
+      ci = loc->index.cellindex + 1;
+      m = node0->numel - ci;
+      if (m > n) m = n;
+      if (vals) memcpy(vals, node0->cells + node0->numel + ci, sizeof(void*)*m);
+      if (keys) {
+         for (ii = 0; ii < m; ++ii) keys[ii] = _phamt_small_key(node0, ci + ii);
+      }
+      loc->index.cellindex += m;
+      if (m < n) phamt_next(node0, path);
+      return m;
+   }
+   while (count < n) {
+      twig = loc->node;
+      bi = loc->index.bitindex;
+      if (twig->flag_firstn) {
+         // The twig's cells are exactly its first popcount(bits) cells, so the
+         // rest of the twig is one contiguous block.
+         m = popcount_bits(twig->bits) - (bi + 1);
+         if (m > n - count) m = n - count;
+         if (m > 0) {
+            if (vals && twig->cell_packing) {
+               for (ii = 0; ii < m; ++ii)
+                  vals[count + ii] = _phamt_cell(twig, bi + 1 + ii);
+            } else if (vals) {
+               memcpy(vals + count, twig->cells + bi + 1, sizeof(void*)*m);
+            }
+            if (keys) {
+               for (ii = 0; ii < m; ++ii)
+                  keys[count + ii] = twig->address | (hash_t)(bi + 1 + ii);
+            }
+            count += m;
+            loc->index.bitindex += m;
+            loc->index.cellindex = loc->index.bitindex;
+         }
+      } else {
+         b = twig->bits & (highmask_bits(bi) << 1);
+         ci = loc->index.cellindex;
+         for (; b && count < n; b &= ~(BITS_ONE << bi), ++count) {
+            bi = ctz_bits(b);
+            ci = (twig->flag_full ? bi : ci + 1);
+            if (vals) vals[count] = _phamt_cell(twig, ci);
+            if (keys) keys[count] = twig->address | (hash_t)bi;
+         }
+         loc->index.bitindex = bi;
+         loc->index.cellindex = ci;
+      }
+      if (count == n) break;
+      // This twig is exhausted, so we use phamt_next to find the next one.
+      val = phamt_next(node0, path);
+      if (!path->value_found) break;
+      if (vals) vals[count] = val;
+      if (keys) keys[count] = phamt_path_key(path);
+      ++count;
+   }
+   return count;
+}
+// phamt_foreach(node, fn, arg)
+// Calls fn(key, value, arg) for each key-value pair in node, in the same order
+// as iteration, by walking the node's cells directly instead of maintaining a
+// PHAMT_path_t. If fn returns a non-zero value, the walk stops and that value
+// is returned; otherwise 0 is returned.
+typedef int (*phamt_eachfn_t)(hash_t k, void* v, void* arg);
+static int phamt_foreach(PHAMT_t node, phamt_eachfn_t fn, void* arg)
+{
+   bits_t b, bi, ii;
+   void* cell;
+   int r;
+   if (node->flag_small) {
+      for (ii = 0; ii < node->numel; ++ii) {
+         r = (*fn)(_phamt_small_key(node, ii), node->cells[node->numel + ii],
+                   arg);
+         if (r) return r;
+      }
+      return 0;
+   }
+   for (b = node->bits, ii = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+      bi = ctz_bits(b);
+      cell = _phamt_cell(node, node->flag_full ? bi : ii);
+      if (node->addr_depth == PHAMT_TWIG_DEPTH)
+         r = (*fn)(node->address | (hash_t)bi, cell, arg);
+      else
+         r = phamt_foreach((PHAMT_t)cell, fn, arg);
+      if (r) return r;
+   }
+   return 0;
+}
+// phamt_walk(node, fn, arg, nthreads, grain)
+// Calls fn(subtree, worker, arg) for each subtree in a partition of node into
+// subtrees of at most grain items (or of single nodes), on up to nthreads
+// threads, which steal subtrees from each other as they run out of work;
+// worker is the index (below nthreads) of the thread, so that fn can keep its
+// results for each thread apart. If grain is 0, a size suited to nthreads and
+// the size of node is used. If fn returns a non-zero value, no more subtrees
+// are started, and the first such value is returned; otherwise 0 is returned.
+// The GIL isn't released by phamt_walk(): a caller that holds it must release
+// it around the call, and fn must then attach a thread state (e.g., with
+// PyGILState_Ensure()) if it uses the Python API.
+typedef int (*phamt_walkfn_t)(PHAMT_t node, int worker, void* arg);
+int phamt_walk(PHAMT_t node, phamt_walkfn_t fn, void* arg, int nthreads,
+               numel_t grain);
+// phamt_foreach_parallel(node, fn, args, nthreads)
+// Like phamt_foreach(node, fn, arg), but the key-value pairs are visited by up
+// to nthreads threads (see phamt_walk()) in no particular order; the thread
+// with index w passes args[w] to fn, so args must hold nthreads arguments
+// (e.g., one accumulator per thread for a reduction).
+int phamt_foreach_parallel(PHAMT_t node, phamt_eachfn_t fn, void* const* args,
+                           int nthreads);
+
+//------------------------------------------------------------------------------
+// Set operations.
+// These functions combine two PHAMTs by walking their tries in parallel: two
+// nodes whose address ranges are disjoint are never descended into, and any
+// subtree that survives an operation unchanged is shared with the result
+// rather than copied. Both PHAMTs must have the same pyobject flag.
+
+// _phamt_getcell(node, bitindex)
+// Yields the cell of node that corresponds to the given bit index; the bit must
+// be set in node's bits.
+static inline void* _phamt_getcell(PHAMT_t node, bits_t bi)
+{
+   if (node->flag_full || node->flag_firstn) return _phamt_cell(node, bi);
+   else return _phamt_cell(node, popcount_bits(node->bits & lowmask_bits(bi)));
+}
+// _phamt_build_like(like, bits, cells)
+// Yields a persistent node with the same position in the trie as the node like
+// (i.e., the same address and depth) whose bits are the given bits and whose
+// cells are the given cells, which must be ordered by bit index. The references
+// to the cells are stolen. If the result would be an internal node with a
+// single child, the child itself is returned; if it would have no cells, the
+// empty PHAMT is returned; and if it would be identical to like, then like is
+// returned.
+static inline PHAMT_t _phamt_build_like(PHAMT_t like, bits_t bits, void** cells)
+{
+   PHAMT_t u;
+   PHAMT_scratch_t scratch;
+   bits_t b, bi, ii, ncells = popcount_bits(bits);
+   uint8_t refd = (like->addr_depth < PHAMT_TWIG_DEPTH || like->flag_pyobject);
+   if (ncells == 0) return phamt_empty_like(like);
+   if (ncells == 1 && like->addr_depth < PHAMT_TWIG_DEPTH)
+      return (PHAMT_t)cells[0];
+   if (bits == like->bits) {
+      // If every cell is the same as in like, we can just return like.
+      for (b = bits, ii = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+         bi = ctz_bits(b);
+         if (cells[ii] != _phamt_getcell(like, bi)) break;
+      }
+      if (!b) {
+         if (refd) {
+            for (ii = 0; ii < ncells; ++ii)
+               Py_DECREF((PyObject*)cells[ii]);
+         }
+         Py_INCREF(like);
+         return like;
+      }
+   }
+   u = _phamt_scratch(&scratch, ncells);
+   u->address = like->address;
+   u->bits = bits;
+   u->flag_pyobject = like->flag_pyobject;
+   u->flag_firstn = firstn_bits(bits);
+   u->flag_full = 0;
+   u->flag_transient = 0;
+   u->addr_depth = like->addr_depth;
+   u->addr_shift = like->addr_shift;
+   u->addr_startbit = like->addr_startbit;
+   memcpy(u->cells, cells, sizeof(void*)*ncells);
+   if (u->addr_depth == PHAMT_TWIG_DEPTH) {
+      u->numel = ncells;
+   } else {
+      u->numel = 0;
+      for (ii = 0; ii < ncells; ++ii)
+         u->numel += ((PHAMT_t)cells[ii])->numel;
+   }
+   return _phamt_finish(u);
+}
+// _phamt_keepcell(node, cell)
+// Increments the refcount of the given cell of node, if the cell is a Python
+// object, and returns the cell.
+static inline void* _phamt_keepcell(PHAMT_t node, void* cell)
+{
+   if (node->addr_depth < PHAMT_TWIG_DEPTH || node->flag_pyobject)
+      Py_INCREF((PyObject*)cell);
+   return cell;
+}
+// _phamt_setop_small(op, a, b)
+// Applies the set operation op (e.g., phamt_union) to a and b, at least one of
+// which is a small map, by applying it to their expansions (see
+// phamt_expand()). If the result is the expansion of a or of b, then a or b
+// itself is returned instead; otherwise, a result with few enough elements is
+// rebuilt as a small map.
+typedef PHAMT_t (*phamt_setop_t)(PHAMT_t a, PHAMT_t b);
+static PHAMT_t _phamt_setop_small(phamt_setop_t op, PHAMT_t a, PHAMT_t b)
+{
+   PHAMT_path_t path;
+   PHAMT_t ea = phamt_expand(a), eb = phamt_expand(b), u = (*op)(ea, eb), w, x;
+   void* v;
+   if (u == ea || u == eb) {
+      Py_DECREF(u);
+      u = (u == ea ? a : b);
+      Py_INCREF(u);
+   } else if (u->numel <= PHAMT_SMALL_MAX) {
+      w = phamt_empty_like(u);
+      for (v = phamt_first(u, &path); path.value_found;
+           v = phamt_next(u, &path)) {
+         x = phamt_assoc(w, phamt_path_key(&path), v);
+         Py_DECREF(w);
+         w = x;
+      }
+      Py_DECREF(u);
+      u = w;
+   }
+   Py_DECREF(ea);
+   Py_DECREF(eb);
+   return u;
+}
+// phamt_intersect(a, b)
+// Yields a PHAMT containing the keys that are in both a and b; the values are
+// those of a. The return value's refcount has been incremented for the caller.
+static PHAMT_t phamt_intersect(PHAMT_t a, PHAMT_t b)
+{
+   PHAMT_index_t ci;
+   PHAMT_t u;
+   void* cells[PHAMT_ANY_MAXCELLS];
+   bits_t b0, bits, bi, ncells = 0;
+   if (a->numel == 0 || b->numel == 0) return phamt_empty_like(a);
+   if (a == b) {
+      Py_INCREF(a);
+      return a;
+   }
+   if (a->flag_small || b->flag_small)
+      return _phamt_setop_small(phamt_intersect, a, b);
+   // If one node is deeper than the other, it can only intersect one of the
+   // other node's children.
+   if (a->addr_depth < b->addr_depth) {
+      ci = phamt_cellindex(a, b->address);
+      if (!ci.is_found) return phamt_empty_like(a);
+      return phamt_intersect((PHAMT_t)a->cells[ci.cellindex], b);
+   } else if (a->addr_depth > b->addr_depth) {
+      ci = phamt_cellindex(b, a->address);
+      if (!ci.is_found) return phamt_empty_like(a);
+      return phamt_intersect(a, (PHAMT_t)b->cells[ci.cellindex]);
+   } else if (a->address != b->address) {
+      // Same depth but different addresses: disjoint.
+      return phamt_empty_like(a);
+   }
+   // Otherwise, the nodes are at the same position, so we merge their cells.
+   bits = a->bits & b->bits;
+   for (b0 = bits; b0; b0 &= ~(BITS_ONE << bi)) {
+      bi = ctz_bits(b0);
+      if (a->addr_depth == PHAMT_TWIG_DEPTH) {
+         cells[ncells++] = _phamt_keepcell(a, _phamt_getcell(a, bi));
+      } else {
+         u = phamt_intersect((PHAMT_t)_phamt_getcell(a, bi),
+                             (PHAMT_t)_phamt_getcell(b, bi));
+         if (u->numel == 0) {
+            Py_DECREF(u);
+            bits &= ~(BITS_ONE << bi);
+         } else {
+            cells[ncells++] = u;
+         }
+      }
+   }
+   return _phamt_build_like(a, bits, cells);
+}
+// phamt_union(a, b)
+// Yields a PHAMT containing the keys that are in either a or b; the values are
+// those of a for keys in a and those of b otherwise. The return value's
+// refcount has been incremented for the caller.
+static PHAMT_t phamt_union(PHAMT_t a, PHAMT_t b)
+{
+   PHAMT_index_t ci;
+   PHAMT_t u, v, w;
+   void* cells[PHAMT_ANY_MAXCELLS];
+   bits_t b0, bits, bi, ncells = 0;
+   if (b->numel == 0 || a == b) {
+      Py_INCREF(a);
+      return a;
+   } else if (a->numel == 0) {
+      Py_INCREF(b);
+      return b;
+   }
+   if (a->flag_small || b->flag_small)
+      return _phamt_setop_small(phamt_union, a, b);
+   if (a->addr_depth != b->addr_depth || a->address != b->address) {
+      // The nodes are at different positions; u is the higher of the two.
+      if (a->addr_depth <= b->addr_depth) {
+         u = a;
+         v = b;
+      } else {
+         u = b;
+         v = a;
+      }
+      ci = phamt_cellindex(u, v->address);
+      if (u->addr_depth == v->addr_depth || !ci.is_beneath) {
+         // The nodes are disjoint, so they get a new parent.
+         Py_INCREF(a);
+         Py_INCREF(b);
+         return _phamt_join_disjoint(a, b);
+      } else if (!ci.is_found) {
+         // The lower node goes in an empty cell of the higher node.
+         w = _phamt_copy_addcell(u, ci, v);
+         w->numel += v->numel;
+         return w;
+      }
+      // Otherwise, we merge the lower node into a cell of the higher node.
+      v = (u == a
+           ? phamt_union((PHAMT_t)u->cells[ci.cellindex], b)
+           : phamt_union(a, (PHAMT_t)u->cells[ci.cellindex]));
+      w = _phamt_copy_chgcell(u, ci, v);
+      w->numel += v->numel - ((PHAMT_t)u->cells[ci.cellindex])->numel;
+      Py_DECREF(v);
+      return w;
+   }
+   // The nodes are at the same position, so we merge their cells.
+   bits = a->bits | b->bits;
+   for (b0 = bits; b0; b0 &= ~(BITS_ONE << bi)) {
+      bi = ctz_bits(b0);
+      if (!(b->bits & (BITS_ONE << bi)))
+         cells[ncells++] = _phamt_keepcell(a, _phamt_getcell(a, bi));
+      else if (!(a->bits & (BITS_ONE << bi)))
+         cells[ncells++] = _phamt_keepcell(b, _phamt_getcell(b, bi));
+      else if (a->addr_depth == PHAMT_TWIG_DEPTH)
+         cells[ncells++] = _phamt_keepcell(a, _phamt_getcell(a, bi));
+      else
+         cells[ncells++] = phamt_union((PHAMT_t)_phamt_getcell(a, bi),
+                                       (PHAMT_t)_phamt_getcell(b, bi));
+   }
+   return _phamt_build_like(a, bits, cells);
+}
+// phamt_difference(a, b)
+// Yields a PHAMT containing the keys that are in a but not in b; the values are
+// those of a. The return value's refcount has been incremented for the caller.
+static PHAMT_t phamt_difference(PHAMT_t a, PHAMT_t b)
+{
+   PHAMT_index_t ci;
+   PHAMT_t u, v;
+   void* cells[PHAMT_ANY_MAXCELLS];
+   bits_t b0, bits, bi, ncells = 0;
+   if (a->numel == 0 || b->numel == 0) {
+      Py_INCREF(a);
+      return a;
+   } else if (a == b) {
+      return phamt_empty_like(a);
+   }
+   if (a->flag_small || b->flag_small)
+      return _phamt_setop_small(phamt_difference, a, b);
+   if (a->addr_depth < b->addr_depth) {
+      // Only one of a's children can overlap with b.
+      ci = phamt_cellindex(a, b->address);
+      if (!ci.is_found) {
+         Py_INCREF(a);
+         return a;
+      }
+      v = (PHAMT_t)a->cells[ci.cellindex];
+      u = phamt_difference(v, b);
+      if (u == v) {
+         Py_DECREF(u);
+         Py_INCREF(a);
+         return a;
+      } else if (u->numel > 0) {
+         v = _phamt_copy_chgcell(a, ci, u);
+         v->numel -= ((PHAMT_t)a->cells[ci.cellindex])->numel - u->numel;
+         Py_DECREF(u);
+         return v;
+      }
+      // The child is gone, so we remove its cell.
+      Py_DECREF(u);
+      if (phamt_cellcount(a) == 2) {
+         // Internal nodes with one child are replaced by the child.
+         bi = ctz_bits(a->bits & ~(BITS_ONE << ci.bitindex));
+         return (PHAMT_t)_phamt_keepcell(a, _phamt_getcell(a, bi));
+      }
+      u = _phamt_copy_delcell(a, ci);
+      u->numel -= v->numel;
+      return u;
+   } else if (a->addr_depth > b->addr_depth) {
+      ci = phamt_cellindex(b, a->address);
+      if (!ci.is_found) {
+         Py_INCREF(a);
+         return a;
+      }
+      return phamt_difference(a, (PHAMT_t)b->cells[ci.cellindex]);
+   } else if (a->address != b->address) {
+      Py_INCREF(a);
+      return a;
+   }
+   // The nodes are at the same position, so we filter a's cells.
+   bits = a->bits;
+   for (b0 = bits; b0; b0 &= ~(BITS_ONE << bi)) {
+      bi = ctz_bits(b0);
+      if (!(b->bits & (BITS_ONE << bi))) {
+         cells[ncells++] = _phamt_keepcell(a, _phamt_getcell(a, bi));
+      } else if (a->addr_depth == PHAMT_TWIG_DEPTH) {
+         bits &= ~(BITS_ONE << bi);
+      } else {
+         u = phamt_difference((PHAMT_t)_phamt_getcell(a, bi),
+                              (PHAMT_t)_phamt_getcell(b, bi));
+         if (u->numel == 0) {
+            Py_DECREF(u);
+            bits &= ~(BITS_ONE << bi);
+         } else {
+            cells[ncells++] = u;
+         }
+      }
+   }
+   return _phamt_build_like(a, bits, cells);
+}
+// phamt_symdiff(a, b)
+// Yields a PHAMT containing the keys that are in exactly one of a and b; the
+// values are those of the PHAMT that contains the key. The return value's
+// refcount has been incremented for the caller.
+static inline PHAMT_t phamt_symdiff(PHAMT_t a, PHAMT_t b)
+{
+   PHAMT_t u = phamt_difference(a, b);
+   PHAMT_t v = phamt_difference(b, a);
+   PHAMT_t w = phamt_union(u, v);
+   Py_DECREF(u);
+   Py_DECREF(v);
+   return w;
+}
+
+// phamt_shards(node, n, buf)
+// Partitions node into at most n disjoint PHAMTs whose union is node and whose
+// numel values are roughly equal, and writes them into buf, which must have
+// room for n PHAMTs, in iteration order. The trie is walked in iteration order
+// down to the pieces of node: its twigs and the largest subtrees that hold at
+// most 1/n of its numel. Each piece is then either joined to the current
+// shard or starts the next one: shard g ends at the piece that brings the
+// running total closest to (g+1)/n of the total numel. The subtrees of node
+// are thus shared with the shards, no leaves are copied, and only the nodes
+// above the pieces are visited. The return value is the number of shards
+// written; each of them has had its refcount incremented for the caller. If
+// node is empty or n is 0, then 0 is returned; 0 is also returned, with an
+// exception set, if a shard can't be allocated.
+static hash_t phamt_shards(PHAMT_t node, hash_t n, PHAMT_t* buf)
+{
+   struct { PHAMT_t node; bits_t bits, ci; } stack[PHAMT_LEVELS], *top;
+   hash_t ngroups = 0, acc = 0, bound, limit;
+   PHAMT_t u = NULL, v, piece = node;
+   bits_t bi;
+   int d = 0;
+   if (node->numel == 0 || n == 0) return 0;
+   // A small map is never split (it has too few elements to be worth it).
+   if (node->flag_small) {
+      Py_INCREF(node);
+      buf[0] = node;
+      return 1;
+   }
+   limit = node->numel / n;
+   for (;;) {
+      if (piece->addr_depth < PHAMT_TWIG_DEPTH && piece->numel > limit) {
+         // This subtree is too large to be one piece, so we visit its
+         // children in turn.
+         stack[d].node = piece;
+         stack[d].bits = piece->bits;
+         stack[d].ci = 0;
+         ++d;
+      } else {
+         // Otherwise, the piece ends the current shard if the shard is
+         // already large enough or if adding the piece would overshoot the
+         // shard's bound by more than leaving it out would undershoot it.
+         if (u) {
+            bound = ((node->numel / n) * (ngroups + 1)
+                     + ((node->numel % n) * (ngroups + 1)) / n);
+            if (acc >= bound ||
+                (acc + piece->numel > bound &&
+                 acc + piece->numel - bound >= bound - acc)) {
+               buf[ngroups++] = u;
+               u = NULL;
+            }
+         }
+         if (u) {
+            v = phamt_union(u, piece);
+            Py_DECREF(u);
+            u = v;
+            if (!u) break;
+         } else {
+            Py_INCREF(piece);
+            u = piece;
+         }
+         acc += piece->numel;
+      }
+      // Find the next piece: the next child of the deepest unfinished node.
+      while (d > 0 && !stack[d-1].bits) --d;
+      if (d == 0) break;
+      top = stack + d - 1;
+      bi = ctz_bits(top->bits);
+      top->bits &= ~(BITS_ONE << bi);
+      piece = (PHAMT_t)top->node->cells[top->node->flag_full ? bi : top->ci];
+      ++(top->ci);
+   }
+   if (!u) {
+      // A union failed, so we release the shards that were made.
+      while (ngroups > 0) Py_DECREF(buf[--ngroups]);
+      return 0;
+   }
+   buf[ngroups++] = u;
+   return ngroups;
+}
+// phamt_split_root(node, buf)
+// Splits node by the cells of the root: writes into buf[i], for each of the
+// PHAMT_ROOT_MAXCELLS cells of the root, a PHAMT of the keys of node whose top
+// PHAMT_ROOT_SHIFT bits are i (the empty PHAMT if there are none). Each has had
+// its refcount incremented for the caller. The subtrees of node are shared with
+// the pieces, so this takes O(PHAMT_ROOT_MAXCELLS) time.
+static inline void phamt_split_root(PHAMT_t node, PHAMT_t* buf)
+{
+   bits_t ii, jj;
+   hash_t k;
+   PHAMT_t u;
+   for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii)
+      buf[ii] = phamt_empty_like(node);
+   if (node->numel == 0) {
+      return;
+   } else if (node->flag_small) {
+      // Small maps are split element by element.
+      for (jj = 0; jj < (bits_t)node->numel; ++jj) {
+         k = _phamt_small_key(node, jj);
+         ii = (bits_t)(k >> PHAMT_ROOT_FIRSTBIT);
+         u = phamt_assoc(buf[ii], k, node->cells[node->numel + jj]);
+         Py_DECREF(buf[ii]);
+         buf[ii] = u;
+      }
+   } else if (node->addr_depth > PHAMT_ROOT_DEPTH) {
+      // All of the keys are beneath one cell of the root.
+      ii = (bits_t)(node->address >> PHAMT_ROOT_FIRSTBIT);
+      Py_DECREF(buf[ii]);
+      Py_INCREF(node);
+      buf[ii] = node;
+   } else {
+      for (ii = 0; ii < PHAMT_ROOT_MAXCELLS; ++ii) {
+         if (!(node->bits & (BITS_ONE << ii))) continue;
+         Py_DECREF(buf[ii]);
+         buf[ii] = (PHAMT_t)_phamt_getcell(node, ii);
+         Py_INCREF(buf[ii]);
+      }
+   }
+}
+// phamt_join_roots(buf)
+// The inverse of phamt_split_root(): yields the union of the
+// PHAMT_ROOT_MAXCELLS PHAMTs in buf, each of whose keys must all be beneath the
+// cell of the root with its index in buf. Because these PHAMTs are disjoint,
+// each union adds a cell to (a copy of) the root, so this takes
+// O(PHAMT_ROOT_MAXCELLS) time. The return value's refcount has been
+// incremented for the caller.
+static inline PHAMT_t phamt_join_roots(PHAMT_t* buf)
+{
+   bits_t ii;
+   PHAMT_t u = buf[0], v;
+   Py_INCREF(u);
+   for (ii = 1; ii < PHAMT_ROOT_MAXCELLS; ++ii) {
+      v = phamt_union(u, buf[ii]);
+      Py_DECREF(u);
+      u = v;
+   }
+   return u;
+}
+
+//------------------------------------------------------------------------------
+// Morton (Z-order) keys.
+// A Morton key of an ndim-dimensional point interleaves the bits of the point's
+// coordinates: bit i of coordinate d is bit (i*ndim + d) of the key. Each
+// coordinate may thus have up to HASH_BITCOUNT / ndim bits. Because every node
+// of a PHAMT covers an aligned block of keys, it also covers an axis-aligned
+// box of points, so the levels of the trie act as a quadtree or octree.
+
+// The maximum number of dimensions of a Morton key.
+#define PHAMT_MORTON_MAXDIMS 16
+
+// phamt_morton_encode(coords, ndim)
+// Yields the Morton key of the point whose ndim coordinates are given.
+static inline hash_t phamt_morton_encode(const hash_t* coords, unsigned ndim)
+{
+   hash_t h = 0;
+   unsigned bit, d, nbits = HASH_BITCOUNT / ndim;
+   for (bit = 0; bit < nbits; ++bit) {
+      for (d = 0; d < ndim; ++d)
+         h |= ((coords[d] >> bit) & HASH_ONE) << (bit*ndim + d);
+   }
+   return h;
+}
+// phamt_morton_decode(h, ndim, coords)
+// Writes the ndim coordinates of the point whose Morton key is h into coords.
+static inline void phamt_morton_decode(hash_t h, unsigned ndim, hash_t* coords)
+{
+   unsigned bit, d, nbits = HASH_BITCOUNT / ndim;
+   for (d = 0; d < ndim; ++d)
+      coords[d] = 0;
+   for (bit = 0; bit < nbits; ++bit) {
+      for (d = 0; d < ndim; ++d)
+         coords[d] |= ((h >> (bit*ndim + d)) & HASH_ONE) << bit;
+   }
+}
+// phamt_query_box(node, ndim, lo, hi)
+// Yields a PHAMT of the key-value pairs in node whose keys are the Morton keys
+// of ndim-dimensional points p such that lo[d] <= p[d] <= hi[d] for every
+// dimension d. Subtrees whose boxes are disjoint from the query box are never
+// visited, and subtrees whose boxes lie inside the query box are shared with
+// the result, so the time required depends on the size of the boundary of the
+// box rather than on the size of node. The return value's refcount has been
+// incremented for the caller.
+static PHAMT_t phamt_query_box(PHAMT_t node, unsigned ndim,
+                               const hash_t* lo, const hash_t* hi)
+{
+   hash_t nlo[PHAMT_MORTON_MAXDIMS], nhi[PHAMT_MORTON_MAXDIMS];
+   void* cells[PHAMT_ANY_MAXCELLS];
+   bits_t b, bi, bits, ncells = 0;
+   unsigned d;
+   uint8_t inside = 1;
+   PHAMT_t u, w;
+   if (node->numel == 0) return phamt_empty_like(node);
+   if (node->flag_small) {
+      // Small maps are filtered element by element.
+      Py_INCREF(node);
+      u = node;
+      for (bi = 0; bi < node->numel; ++bi) {
+         phamt_morton_decode(_phamt_small_key(node, bi), ndim, nlo);
+         for (d = 0; d < ndim && lo[d] <= nlo[d] && nlo[d] <= hi[d]; ++d) ;
+         if (d == ndim) continue;
+         w = phamt_dissoc(u, _phamt_small_key(node, bi));
+         Py_DECREF(u);
+         u = w;
+      }
+      return u;
+   }
+   // The box of this node comes from its smallest and largest keys.
+   phamt_morton_decode(node->address, ndim, nlo);
+   phamt_morton_decode(node->address | phamt_depthmask(node->addr_depth),
+                       ndim, nhi);
+   for (d = 0; d < ndim; ++d) {
+      if (nhi[d] < lo[d] || nlo[d] > hi[d]) return phamt_empty_like(node);
+      if (nlo[d] < lo[d] || nhi[d] > hi[d]) inside = 0;
+   }
+   if (inside) {
+      Py_INCREF(node);
+      return node;
+   }
+   // The node straddles the edge of the box, so we check each cell.
+   bits = node->bits;
+   for (b = bits; b; b &= ~(BITS_ONE << bi)) {
+      bi = ctz_bits(b);
+      if (node->addr_depth == PHAMT_TWIG_DEPTH) {
+         phamt_morton_decode(node->address | (hash_t)bi, ndim, nlo);
+         for (d = 0; d < ndim; ++d)
+            if (nlo[d] < lo[d] || nlo[d] > hi[d]) break;
+         if (d < ndim)
+            bits &= ~(BITS_ONE << bi);
+         else
+            cells[ncells++] = _phamt_keepcell(node, _phamt_getcell(node, bi));
+      } else {
+         u = phamt_query_box((PHAMT_t)_phamt_getcell(node, bi), ndim, lo, hi);
+         if (u->numel == 0) {
+            Py_DECREF(u);
+            bits &= ~(BITS_ONE << bi);
+         } else {
+            cells[ncells++] = u;
+         }
+      }
+   }
+   return _phamt_build_like(node, bits, cells);
+}
 
 //------------------------------------------------------------------------------
 // THAMT functions.
@@ -1646,7 +3339,7 @@ static inline PHAMT_t _thamt_assoc_path(PHAMT_path_t* path, hash_t k,
    // deepest node in the path (u).
    if (path->value_found) {
       // We'e replacing a leaf. Check that there's reason to.
-      void* curval = loc->node->cells[loc->index.cellindex];
+      void* curval = _phamt_cell(loc->node, loc->index.cellindex);
       if (curval == newval) {
          Py_INCREF(node);
          return node;
@@ -1655,8 +3348,11 @@ static inline PHAMT_t _thamt_assoc_path(PHAMT_path_t* path, hash_t k,
       u = _thamt_copy_chgcell(loc->node, loc->index, newval);
    } else if (depth != path->edit_depth) {
       // The key isn't beneath the deepest node; we need to join a new twig
-      // with the disjoint deep node.
-      u = _thamt_from_kv(k, newval, node->flag_pyobject);
+      // with the disjoint deep node. New twigs below the root are persistent
+      // and hold just their one cell: most twigs of a sparse map never get a
+      // second key, and the first edit that adds one makes a transient copy,
+      // so thamt_compact() needn't copy them again.
+      u = phamt_from_kv(k, newval, node->flag_pyobject);
       Py_INCREF(loc->node); // The new parent node gets this ref.
       u = _thamt_join_disjoint(loc->node, u);
    } else if (depth == PHAMT_TWIG_DEPTH) {
@@ -1676,8 +3372,8 @@ static inline PHAMT_t _thamt_assoc_path(PHAMT_path_t* path, hash_t k,
          return _thamt_from_kv(k, newval, node->flag_pyobject);
       }
    } else {
-      // We are adding a new twig to an internal node.
-      node = _thamt_from_kv(k, newval, node->flag_pyobject);
+      // We are adding a new (persistent) twig to an internal node.
+      node = phamt_from_kv(k, newval, node->flag_pyobject);
       // The key is beneath this node, so we insert u into it.
       u = _thamt_copy_addcell(loc->node, loc->index, node);
       Py_DECREF(node);
@@ -1836,6 +3532,15 @@ static inline PHAMT_t thamt_apply(PHAMT_t node, hash_t k,
    rval = (*fn)(path.value_found, &val, arg);
    return _thamt_update(&path, k, val, rval);
 }
+// _thamt_retrack(node)
+// Reconsiders whether the garbage collector should track node, which was
+// transient (and thus tracked) but has just been made persistent. All of its
+// children must already have been made persistent and reconsidered.
+static inline void _thamt_retrack(PHAMT_t node)
+{
+   PyObject_GC_UnTrack((PyObject*)node);
+   _phamt_track(node);
+}
 // thampt_persist(thamt)
 // Flips all of the flag_transient bits in the thamt object and returns it.
 // This does not change the refcount of node.
@@ -1845,6 +3550,7 @@ static inline PHAMT_t thamt_persist(PHAMT_t node)
    PHAMT_t u;
    PHAMT_path_t path;
    PHAMT_loc_t* loc;
+   uint8_t flipped;
    if (node->numel == 0) return phamt_empty_like(node);
    // We're going to return node at the end, so go ahead and incref it.
    Py_INCREF(node);
@@ -1860,7 +3566,8 @@ static inline PHAMT_t thamt_persist(PHAMT_t node)
       dbgnode("   ", loc->node);
       // Upon starting this loop, we are encountering the node at the given
       // depth for the first time.
-      if (loc->node->flag_transient) {
+      flipped = loc->node->flag_transient;
+      if (flipped) {
          // Unset the transient bit.
          loc->node->flag_transient = 0;
          // Unless we're a twig node, we need to recurse on our children.
@@ -1883,7 +3590,9 @@ static inline PHAMT_t thamt_persist(PHAMT_t node)
       }
       // If we reach this point, then u is either not transient, or it was a
       // twig that has now been made non-transient. Either way, we need to
-      // pop up the stack (path) to find the next node in our search.
+      // pop up the stack (path) to find the next node in our search. Each node
+      // that we finish persisting gets reconsidered by the garbage collector.
+      if (flipped) _thamt_retrack(loc->node);
       do {
          d = loc->index.is_beneath;
          if (d > PHAMT_TWIG_DEPTH) return node;
@@ -1892,6 +3601,7 @@ static inline PHAMT_t thamt_persist(PHAMT_t node)
          d = loc->index.is_beneath;
          loc->index = phamt_nextcell(loc->node, loc->index);
          loc->index.is_beneath = d; // Preserve the previous depth!
+         if (!loc->index.is_found) _thamt_retrack(loc->node);
       } while (!loc->index.is_found);
       d = loc->node->addr_depth;
       u = loc->node->cells[loc->index.cellindex];
@@ -1902,6 +3612,81 @@ static inline PHAMT_t thamt_persist(PHAMT_t node)
    }
    return node;
 }
+// thamt_compact(thamt)
+// Returns a persistent PHAMT equivalent to the given THAMT node, whose
+// reference is stolen. Unlike thamt_persist(), which flips the transient nodes
+// into (full, always-allocated) persistent nodes in place, this copies each
+// transient node into a compact persistent node of the right size--allocated
+// without a GC header when possible--and releases the transient node. The
+// cells of transient nodes that nothing else references are moved rather than
+// copied, so the values and subnodes don't see any refcount changes, and such
+// nodes whose cells are all in use are simply flipped in place (except for the
+// twigs of ctype PHAMTs, which may be packed; see _phamt_pack()). Nodes that
+// are already persistent are shared as usual.
+static PHAMT_t thamt_compact(PHAMT_t node)
+{
+   PHAMT_scratch_t scratch;
+   PHAMT_t u;
+   bits_t b, bi, ii, ncells;
+   void* cell;
+   uint8_t steal, refd;
+   if (!node->flag_transient) return node;
+   if (node->numel == 0) {
+      u = phamt_empty_like(node);
+      Py_DECREF(node);
+      return u;
+   }
+   refd = (node->addr_depth < PHAMT_TWIG_DEPTH || node->flag_pyobject);
+   // If we hold the only reference to node, we can take over its cells. The
+   // node mustn't be visited by the garbage collector once it no longer owns
+   // its cells, so we untrack it first (its cells, until they're moved, are
+   // then just referenced from outside the collector's view).
+   steal = (Py_REFCNT(node) == 1);
+   if (steal) PyObject_GC_UnTrack((PyObject*)node);
+   ncells = popcount_bits(node->bits);
+   if (steal && ncells == phamt_maxcells(node->addr_depth)
+       && (refd || !PHAMT_PACKED)) {
+      // A node with every cell in use wastes no space, so we keep it and just
+      // make it persistent in place, as thamt_persist() does. (The twigs of
+      // ctype PHAMTs are copied instead so that they can be packed.)
+      if (node->addr_depth < PHAMT_TWIG_DEPTH) {
+         for (b = node->bits; b; b &= ~(BITS_ONE << bi)) {
+            bi = ctz_bits(b);
+            node->cells[bi] = thamt_compact((PHAMT_t)node->cells[bi]);
+         }
+      }
+      node->flag_transient = 0;
+      _phamt_track(node);
+      return node;
+   }
+   u = _phamt_scratch(&scratch, ncells);
+   u->address = node->address;
+   u->numel = node->numel;
+   u->bits = node->bits;
+   u->flag_pyobject = node->flag_pyobject;
+   u->flag_firstn = firstn_bits(node->bits);
+   u->flag_full = 0;
+   u->flag_transient = 0;
+   u->addr_depth = node->addr_depth;
+   u->addr_shift = node->addr_shift;
+   u->addr_startbit = node->addr_startbit;
+   for (b = node->bits, ii = 0; b; b &= ~(BITS_ONE << bi), ++ii) {
+      bi = ctz_bits(b);
+      cell = _phamt_getcell(node, bi);
+      if (refd && !steal) Py_INCREF((PyObject*)cell);
+      if (node->addr_depth < PHAMT_TWIG_DEPTH)
+         cell = thamt_compact((PHAMT_t)cell);
+      u->cells[ii] = cell;
+   }
+   if (steal) {
+      // The cells now belong to u, so node must not release them; with no
+      // bits set, a full node has no cells to clear.
+      node->bits = 0;
+      node->flag_full = 1;
+   }
+   Py_DECREF(node);
+   return _phamt_finish(u);
+}
 
 // Undefine the debug statements now.
 /*
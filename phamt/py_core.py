@@ -4,8 +4,10 @@
 # The core Python implementation of the PHAMT and THAMT types.
 # By Noah C. Benson
 
-import sys, math
-from collections.abc import Mapping
+import sys, math, threading
+from array import array
+from itertools import islice
+from collections.abc import (Mapping, KeysView, ValuesView, ItemsView)
 
 # ==============================================================================
 # Constants
@@ -53,6 +55,9 @@ PHAMT_KEY_MIN = -(1 << (sys.hash_info[0] - 1))
 PHAMT_KEY_MAX =  (1 << (sys.hash_info[0] - 1)) - 1
 PHAMT_KEY_MOD = (1 << sys.hash_info[0])
 
+# The maximum number of dimensions of a Morton key.
+PHAMT_MORTON_MAXDIMS = 16
+
 
 # ==============================================================================
 # Private Functions
@@ -78,6 +83,84 @@ def _index_to_key(addr, ii):
     addr = addr | ii
     if addr > PHAMT_KEY_MAX: return addr - PHAMT_KEY_MOD
     else:                    return addr
+def _iter_next_chunk(it, n):
+    if n < 0: raise ValueError("next_chunk requires a count >= 0")
+    keys = []
+    vals = []
+    for (k,v) in islice(it, n):
+        keys.append(k)
+        vals.append(v)
+    return (keys, vals)
+_DTYPES = {'q': 'q', 'int64': 'q', 'i8': 'q',
+           'Q': 'Q', 'uint64': 'Q', 'u8': 'Q',
+           'd': 'd', 'float64': 'd', 'f8': 'd'}
+def _parse_dtype(dtype, kind):
+    if dtype is None: return kind
+    name = dtype if isinstance(dtype, str) else \
+           getattr(dtype, 'name', getattr(dtype, '__name__', None))
+    kind = _DTYPES.get(name)
+    if kind is None:
+        raise ValueError(
+            "dtype must be int64 ('q'), uint64 ('Q'), or float64 ('d')")
+    return kind
+def _to_array(items, kind, out, n):
+    arr = array(kind, items)
+    if out is None: return memoryview(arr)
+    mv = memoryview(out)
+    fmt = mv.format.lstrip('@=<')
+    if mv.itemsize != 8 or fmt not in {'q':'qln','Q':'QLN','d':'d'}[kind]:
+        raise ValueError(
+            "out must be a buffer of 64-bit items of format '%s'" % kind)
+    if mv.nbytes < 8*n: raise ValueError("out is too small")
+    mv.cast('B')[:8*n] = arr.tobytes()
+    return out
+def _parse_coords(coords, ndim=None):
+    coords = tuple(coords)
+    n = len(coords)
+    if ndim is None and (n < 1 or n > PHAMT_MORTON_MAXDIMS):
+        raise ValueError(
+            "Morton coordinates must have between 1 and %d dimensions"
+            % PHAMT_MORTON_MAXDIMS)
+    elif ndim is not None and n != ndim:
+        raise ValueError("Morton coordinates must have the same dimensions")
+    nbits = HASH_BITCOUNT // n
+    for c in coords:
+        if not isinstance(c, int):
+            raise TypeError("Morton coordinates must be integers")
+        if c < 0:
+            raise OverflowError("Morton coordinates must be non-negative")
+        if c >> nbits:
+            raise ValueError(
+                "Morton coordinates in %d dimensions must have at most %d bits"
+                % (n, nbits))
+    return coords
+def _morton_decode_hash(h, ndim):
+    coords = [0]*ndim
+    for bit in range(HASH_BITCOUNT // ndim):
+        for d in range(ndim):
+            coords[d] |= ((h >> (bit*ndim + d)) & 1) << bit
+    return coords
+def _query_box(node, lo, hi, thamt):
+    if node._numel == 0: return
+    ndim = len(lo)
+    (bit0, shift) = node._b0sh
+    addr = node._address
+    nlo = _morton_decode_hash(addr, ndim)
+    nhi = _morton_decode_hash(addr | ((1 << (bit0 + shift)) - 1), ndim)
+    if any(h < l or l0 > h0 for (l,h,l0,h0) in zip(lo, nhi, nlo, hi)): return
+    if all(l <= l0 and h0 <= h for (l,h,l0,h0) in zip(lo, hi, nlo, nhi)):
+        for (k,v) in node:
+            thamt[k] = v
+    elif node._depth == PHAMT_TWIG_DEPTH:
+        for (ii,c) in enumerate(node._cells):
+            if c is None: continue
+            p = _morton_decode_hash(addr | ii, ndim)
+            if all(l <= x <= h for (l,x,h) in zip(lo, p, hi)):
+                thamt[_index_to_key(addr, ii)] = c[0]
+    else:
+        for c in node._cells:
+            if c is not None:
+                _query_box(c, lo, hi, thamt)
 def _phamt_from_kv(k, v, transient=False):
     h = _key_to_hash(k)
     addr = h & ~PHAMT_TWIG_MASK
@@ -253,6 +336,135 @@ class PHAMT(Mapping):
         return self._numel
     def __iter__(self):
         return PHAMTIter(self)
+    def query_box(self, lo, hi):
+        """Returns the subset of a `PHAMT` whose Morton keys lie inside a box.
+
+        `phamt_obj.query_box(lo, hi)` treats the keys of `phamt_obj` as Morton
+        (Z-order) keys of points with `len(lo)` coordinates (see
+        `morton_encode`) and returns a `PHAMT` of the key-value pairs whose
+        points `p` satisfy `lo[d] <= p[d] <= hi[d]` for every dimension `d`.
+        Subtrees of the trie whose boxes of points lie outside of the query box
+        are skipped.
+        """
+        lo = _parse_coords(lo)
+        hi = _parse_coords(hi, len(lo))
+        thamt = THAMT(PHAMT.empty)
+        _query_box(self, lo, hi, thamt)
+        return thamt.persistent()
+    def shards(self, n):
+        """Partitions a `PHAMT` object into disjoint shards of roughly equal
+        size.
+
+        `phamt_obj.shards(n)` returns a list of at most `n` `PHAMT` objects that
+        have no keys in common, whose union is `phamt_obj`, and whose lengths
+        are roughly equal. The shards are listed in iteration order, so
+        iterating over each shard in turn is equivalent to iterating over
+        `phamt_obj`. The shards are found by splitting the top levels of the
+        trie, and they share its subtrees. Because the leaves of the trie are
+        never split, fewer than `n` shards may be returned; none are returned
+        for an empty `PHAMT`.
+        """
+        if n < 1: raise ValueError("shards requires a count >= 1")
+        total = self._numel
+        n = min(n, total)
+        if n == 0: return []
+        # Walk the trie in order down to its pieces: its twigs and the largest
+        # subtrees that hold at most 1/n of the total.
+        limit = total // n
+        pieces = []
+        stack = [self]
+        while len(stack) > 0:
+            u = stack.pop()
+            if u._depth < PHAMT_TWIG_DEPTH and u._numel > limit:
+                stack.extend(reversed([c for c in u._cells if c is not None]))
+            else:
+                pieces.append(u)
+        # Join adjacent pieces into groups of roughly total/n elements.
+        groups = []
+        (ii, acc) = (0, 0)
+        while ii < len(pieces):
+            bound = total * (len(groups) + 1) // n
+            u = pieces[ii]
+            acc += u._numel
+            ii += 1
+            while ii < len(pieces) and acc < bound:
+                p = pieces[ii]
+                if acc + p._numel - bound >= bound - acc: break
+                thamt = THAMT(u)
+                for (k,v) in p:
+                    thamt[k] = v
+                u = thamt.persistent()
+                acc += p._numel
+                ii += 1
+            groups.append(u)
+        return groups
+    def to_dict(self):
+        """Returns a `dict` with the same key-value pairs as a `PHAMT` object.
+
+        `phamt_obj.to_dict()` is equivalent to `dict(phamt_obj)`.
+        """
+        return dict(self)
+    def to_lists(self):
+        """Returns a list of the keys and a list of the values of a `PHAMT`
+        object.
+
+        `phamt_obj.to_lists()` returns a tuple `(keys, values)` of two lists in
+        iteration order such that `keys[i]` is mapped to `values[i]`.
+        """
+        return _iter_next_chunk(iter(self), self._numel)
+    def keys_array(self, dtype=None, out=None):
+        """Returns the keys of a `PHAMT` object in a buffer of 64-bit numbers.
+
+        `phamt_obj.keys_array()` returns a `memoryview` of format `'q'` (int64)
+        that holds the keys of `phamt_obj` in iteration order. The optional
+        argument `dtype` may instead be `'Q'` or `'uint64'` for unsigned keys or
+        `'d'` or `'float64'` for floating-point keys. If the optional argument
+        `out` is given, it must be a writable, contiguous buffer (such as a
+        `numpy` array) of 64-bit items with at least `len(phamt_obj)` elements
+        of the matching type; the keys are written into its first elements and
+        `out` is returned.
+        """
+        kind = _parse_dtype(dtype, 'q')
+        ks = self.to_lists()[0]
+        if kind == 'Q': ks = [k % PHAMT_KEY_MOD for k in ks]
+        return _to_array(ks, kind, out, self._numel)
+    def values_array(self, dtype=None, out=None):
+        """Returns the values of a `PHAMT` object in a buffer of 64-bit numbers.
+
+        `phamt_obj.values_array()` returns a `memoryview` of format `'d'`
+        (float64) that holds the values of `phamt_obj`, which must be numbers,
+        in iteration order. The optional arguments `dtype` and `out` behave as
+        in `phamt_obj.keys_array()`; for integer types, each value must be an
+        integer that fits in 64 bits.
+        """
+        kind = _parse_dtype(dtype, 'd')
+        return _to_array(self.to_lists()[1], kind, out, self._numel)
+    def keys(self):
+        """Returns a set-like view of the keys of a `PHAMT` object.
+
+        `phamt_obj.keys()` returns a view object that iterates over the keys of
+        `phamt_obj` without allocating the `(key, value)` tuples that iterating
+        over `phamt_obj` itself produces. Key views support `len()`, `in`, and
+        the set operators `&`, `|`, `-`, and `^`. When both operands are `PHAMT`
+        key views, these operators return a key view of the resulting `PHAMT`;
+        otherwise they return a `set`.
+        """
+        return PHAMTKeysView(self)
+    def values(self):
+        """Returns a view of the values of a `PHAMT` object.
+
+        `phamt_obj.values()` returns a view object that iterates over the values
+        of `phamt_obj` in key order without allocating any tuples.
+        """
+        return PHAMTValuesView(self)
+    def items(self):
+        """Returns a view of the `(key, value)` pairs of a `PHAMT` object.
+
+        `phamt_obj.items()` returns a view object that iterates over the
+        `(key, value)` tuples of `phamt_obj`; this is equivalent to iterating
+        over `phamt_obj` itself.
+        """
+        return PHAMTItemsView(self)
     def assoc(self, k, v):
         """Returns a new `PHAMT` object with an additional association.
 
@@ -361,6 +573,84 @@ class PHAMT(Mapping):
             thamt[k0] = obj
             k0 += 1
         return thamt.persistent()
+    @staticmethod
+    def from_arrays(keys, values, nthreads=None):
+        """Constructs a PHAMT object from a sequence of keys and one of values.
+
+        `PHAMT.from_arrays(keys, values)` returns a `PHAMT` object that maps
+        each `keys[i]` to `values[i]`; when a key is repeated, its last value is
+        kept. The `keys` may be a buffer of 64-bit integers (such as an
+        `array('q')`, a `numpy` array, or the result of `keys_array()`) or any
+        sequence of integers, and the `values` may be any sequence of the same
+        length. The C implementation builds the trie on up to `nthreads`
+        threads; this implementation ignores `nthreads`.
+        """
+        return PHAMT.empty.assoc_arrays(keys, values, nthreads)
+    def assoc_arrays(self, keys, values, nthreads=None):
+        """Returns a copy of a PHAMT object with a batch of items assoc'd.
+
+        `phamt_obj.assoc_arrays(keys, values)` is equivalent to assoc'ing each
+        `keys[i]` to `values[i]` in turn; see `PHAMT.from_arrays`.
+        """
+        if nthreads is not None and nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        try:
+            mv = memoryview(keys)
+        except TypeError:
+            keys = list(keys)
+        else:
+            fmt = mv.format.lstrip('@=')
+            if mv.itemsize != 8 or fmt not in ('q', 'l', 'n'):
+                raise ValueError(
+                    "keys must be a buffer of 64-bit items of format 'q'")
+            keys = mv.tolist()
+        values = list(values)
+        if len(keys) != len(values):
+            raise ValueError("keys and values must have the same length")
+        thamt = THAMT(self)
+        for (k,v) in zip(keys, values):
+            thamt[k] = v
+        return thamt.persistent()
+    def foreach(self, fn, nthreads=None):
+        """Calls a function on each key and value of a PHAMT object.
+
+        `phamt_obj.foreach(fn)` calls `fn(k, v)` for each key `k` and value `v`
+        of `phamt_obj` in iteration order and returns `None`. The C
+        implementation can split the walk across up to `nthreads` threads; this
+        implementation ignores `nthreads`.
+        """
+        if nthreads is not None and nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        for (k,v) in self:
+            fn(k, v)
+    def reduce(self, fn, initial, combine=None, nthreads=None):
+        """Reduces the keys and values of a PHAMT object to a single value.
+
+        `phamt_obj.reduce(fn, initial)` returns the result of calling
+        `acc = fn(acc, k, v)` for each key `k` and value `v` of `phamt_obj` in
+        iteration order, starting from `acc = initial`. With `nthreads`
+        greater than 1, the C implementation splits the walk across up to
+        `nthreads` threads, whose results are combined by
+        `combine(acc1, acc2)`; this implementation runs on one thread but
+        likewise reduces each of `phamt_obj.shards(nthreads)` starting from
+        `initial` and combines their results, so `combine` is called in the
+        same way.
+        """
+        if nthreads is not None and nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        if nthreads is None or nthreads == 1:
+            shards = [self]
+        elif combine is None:
+            raise ValueError("reduce requires combine when nthreads > 1")
+        else:
+            shards = self.shards(nthreads)
+        if len(shards) == 0: return initial
+        for (ii,u) in enumerate(shards):
+            acc = initial
+            for (k,v) in u:
+                acc = fn(acc, k, v)
+            res = acc if ii == 0 else combine(res, acc)
+        return res
         
 PHAMT.empty = PHAMT(0, PHAMT_ROOT_DEPTH, 0, (None,)*PHAMT_NCELLS)
 
@@ -393,6 +683,335 @@ class PHAMTIter(object):
                 self._stack.append(
                     (cell._cells, None, cell._depth, cell._address))
         raise StopIteration
+    def next_chunk(self, n):
+        """Returns the next `n` items of the iterator as a list of keys and a
+        list of values.
+
+        `it.next_chunk(n)` returns a tuple `(keys, values)` of two lists, each
+        of which has at most `n` elements, such that `keys[i]` and `values[i]`
+        are the key and value of the `i`th of the next `n` items in the
+        iteration. If the lists are shorter than `n`, the iteration is
+        finished; once finished, empty lists are returned.
+        """
+        return _iter_next_chunk(self, n)
+
+# The PHAMT view classes.
+# Iterating over a PHAMT yields (key, value) tuples, so the iteration methods of
+# the Mapping views, which assume that iteration yields keys, are overloaded.
+def _keys_setop(a, b, op):
+    (pa, pb) = (a._mapping, b._mapping)
+    if (pa is pb and op in '&|') or (len(pb) == 0 and op != '&'):
+        return PHAMTKeysView(pa)
+    thamt = THAMT(pb if op == '|' else PHAMT.empty)
+    for (k,v) in pa:
+        if (k in pb) == (op == '&') or op == '|':
+            thamt[k] = v
+    if op == '^':
+        for (k,v) in pb:
+            if k not in pa:
+                thamt[k] = v
+    return PHAMTKeysView(thamt.persistent())
+class PHAMTKeysView(KeysView):
+    __slots__ = ()
+    mapping = property(lambda self: self._mapping)
+    def __iter__(self):
+        for (k,v) in self._mapping:
+            yield k
+    def __and__(self, other):
+        if isinstance(other, PHAMTKeysView): return _keys_setop(self, other, '&')
+        else: return set(self).intersection(other)
+    def __or__(self, other):
+        if isinstance(other, PHAMTKeysView): return _keys_setop(self, other, '|')
+        else: return set(self).union(other)
+    def __sub__(self, other):
+        if isinstance(other, PHAMTKeysView): return _keys_setop(self, other, '-')
+        else: return set(self).difference(other)
+    def __xor__(self, other):
+        if isinstance(other, PHAMTKeysView): return _keys_setop(self, other, '^')
+        else: return set(self).symmetric_difference(other)
+    __rand__ = __and__
+    __ror__ = __or__
+    __rxor__ = __xor__
+    def __rsub__(self, other):
+        return set(other).difference(self)
+class PHAMTValuesView(ValuesView):
+    __slots__ = ()
+    mapping = property(lambda self: self._mapping)
+    def __iter__(self):
+        for (k,v) in self._mapping:
+            yield v
+    def __contains__(self, value):
+        for v in self:
+            if v is value or v == value:
+                return True
+        return False
+class PHAMTItemsView(ItemsView):
+    __slots__ = ()
+    mapping = property(lambda self: self._mapping)
+    def __iter__(self):
+        return iter(self._mapping)
+
+
+# Morton Keys ==================================================================
+
+def morton_encode(coords):
+    """Returns the Morton (Z-order) key of a point.
+
+    `morton_encode(coords)` returns the integer key that interleaves the bits
+    of the non-negative integer coordinates in the sequence `coords`: bit `i`
+    of `coords[d]` becomes bit `i*len(coords) + d` of the key. Each coordinate
+    may have at most `N // len(coords)` bits, where `N` is the number of bits in
+    a key (`sys.hash_info.width`). Like all `PHAMT` keys, the result is a signed
+    integer.
+    """
+    coords = _parse_coords(coords)
+    ndim = len(coords)
+    h = 0
+    for bit in range(HASH_BITCOUNT // ndim):
+        for (d,c) in enumerate(coords):
+            h |= ((c >> bit) & 1) << (bit*ndim + d)
+    return _index_to_key(h, 0)
+def morton_decode(key, ndim):
+    """Returns the point whose Morton (Z-order) key is given.
+
+    `morton_decode(key, ndim)` returns the tuple of `ndim` coordinates that
+    `morton_encode` interleaves to produce `key`.
+    """
+    if ndim < 1 or ndim > PHAMT_MORTON_MAXDIMS:
+        raise ValueError("ndim must be between 1 and %d" % PHAMT_MORTON_MAXDIMS)
+    if not isinstance(key, int):
+        raise TypeError("PHAMT keys must be integers")
+    return tuple(_morton_decode_hash(_key_to_hash(key), ndim))
+
+
+# Deferred Freeing =============================================================
+
+# The nodes of the Python PHAMTs are ordinary Python objects, so they are always
+# freed by Python as soon as they die; these functions only mirror the API of
+# the C core.
+_deferred_free_budget = None
+def _parse_budget(budget):
+    if budget is None: return None
+    budget = int(budget)
+    if budget < 0: raise ValueError("budget must be None or >= 0")
+    return budget
+def set_deferred_free(budget):
+    """Sets whether the nodes of dead `PHAMT` objects are freed later.
+
+    In the C core, `set_deferred_free(budget)` puts the nodes of dead `PHAMT`s
+    onto a reclamation queue that is drained in slices (see `reclaim`). The
+    Python core always frees nodes immediately, so this only records `budget`
+    and returns the previous `budget` (or `None`).
+    """
+    global _deferred_free_budget
+    prev = _deferred_free_budget
+    _deferred_free_budget = _parse_budget(budget)
+    return prev
+def reclaim(budget=None):
+    """Frees nodes from the reclamation queue of dead `PHAMT` nodes.
+
+    In the C core, `reclaim(budget)` frees up to `budget` queued nodes and
+    returns the number that remain queued. The Python core never queues nodes,
+    so this always returns 0.
+    """
+    _parse_budget(budget)
+    return 0
+
+
+# Frozen PHAMTs ================================================================
+
+def freeze(phamt_obj):
+    """Returns a frozen copy of a `PHAMT` whose nodes are never written to.
+
+    In the C core, `freeze(phamt_obj)` copies the nodes of `phamt_obj` into a
+    contiguous block of immortal, untracked memory. The nodes of the Python
+    core are ordinary Python objects, so this returns `phamt_obj` itself.
+    """
+    if not isinstance(phamt_obj, PHAMT):
+        raise TypeError("freeze requires a PHAMT")
+    return phamt_obj
+
+
+# ShardedTHAMT Class ===========================================================
+
+class ShardedTHAMT(object):
+    """A `THAMT` that is split by key into shards for parallel writers.
+
+    A `ShardedTHAMT` is edited like a `THAMT` (`s[k] = v`, `del s[k]`), but its
+    keys are split by their top bits into `s.nshards` independent `THAMT`s,
+    one for each cell of the root of a `PHAMT`, each of which is locked
+    separately. `s.shard_of(k)` yields the index of the shard that holds `k`,
+    and `s.shard(i)` yields the `THAMT` of shard `i` itself. In the C core,
+    `s.persistent()` joins the roots of the persisted shards in
+    `O(nshards)` time; the Python core instead copies the shards' items into
+    one `THAMT`.
+    """
+    __slots__ = ('_shards', '_locks')
+    nshards = PHAMT_ROOT_MAXCELLS
+    def __init__(self, phamt=PHAMT.empty):
+        shards = [THAMT() for _ in range(PHAMT_ROOT_MAXCELLS)]
+        object.__setattr__(self, '_shards', shards)
+        object.__setattr__(self, '_locks', [threading.Lock() for _ in shards])
+        for (k,v) in phamt.items(): self[k] = v
+    def __setattr__(self, k, v):
+        raise TypeError("type ShardedTHAMT does not allow attribute mutation")
+    def __repr__(self):
+        return "<ShardedTHAMT:n=%d, nshards=%d>" % (len(self), self.nshards)
+    def shard_of(self, k):
+        """Returns the index of the shard that holds the given key."""
+        if not isinstance(k, int): raise TypeError("PHAMT keys must be integers")
+        return _key_to_hash(k) >> PHAMT_ROOT_FIRSTBIT
+    def shard(self, i):
+        """Returns the `THAMT` that holds the keys of the given shard."""
+        if i < 0 or i >= PHAMT_ROOT_MAXCELLS:
+            raise IndexError("shard index out of range")
+        return self._shards[i]
+    def _index(self, k):
+        try: return self.shard_of(k)
+        except (KeyError, TypeError): return 0
+    def __setitem__(self, k, v):
+        ii = self._index(k)
+        with self._locks[ii]: self._shards[ii][k] = v
+    def __delitem__(self, k):
+        ii = self._index(k)
+        with self._locks[ii]: del self._shards[ii][k]
+    def __getitem__(self, k):
+        return self._shards[self._index(k)][k]
+    def __contains__(self, k):
+        return k in self._shards[self._index(k)]
+    def __len__(self):
+        return sum(len(sh) for sh in self._shards)
+    def __iter__(self):
+        return iter(self.persistent())
+    def get(self, k, nf=None):
+        return self._shards[self._index(k)].get(k, nf)
+    def persistent(self):
+        t = THAMT()
+        for (sh, lock) in zip(self._shards, self._locks):
+            with lock: u = sh.persistent()
+            for (k,v) in u: t[k] = v
+        return t.persistent()
+
+
+# PHAMTRef Class ===============================================================
+
+class PHAMTRef(object):
+    """A mutable reference to a `PHAMT` that can be updated atomically.
+
+    `PHAMTRef(phamt_obj)` (or `PHAMTRef()` for an empty `PHAMT`) returns a
+    reference whose current `PHAMT` may be read with `ref.get()` and replaced
+    with `ref.compare_and_set(old, new)`, `ref.swap(fn, *args)`,
+    `ref.assoc(k, v)`, `ref.dissoc(k)`, or `ref.reset(new)`. Updates are made
+    by copying the path to the changed key outside of any lock and then
+    publishing the new `PHAMT` only if the reference still holds the `PHAMT`
+    that was copied, retrying otherwise.
+    """
+    __slots__ = ('_phamt', '_lock')
+    def __init__(self, phamt=PHAMT.empty):
+        if not isinstance(phamt, PHAMT):
+            raise TypeError("PHAMTRef requires a PHAMT")
+        self._phamt = phamt
+        self._lock = threading.Lock()
+    def __repr__(self):
+        return "<PHAMTRef:n=%d>" % len(self._phamt)
+    def get(self):
+        """Returns the current `PHAMT` of the reference."""
+        return self._phamt
+    def compare_and_set(self, old, new):
+        """Replaces the `PHAMT` of the reference if it is a given `PHAMT`.
+
+        `ref.compare_and_set(old, new)` stores the `PHAMT` `new` in `ref` and
+        returns `True` if the current `PHAMT` of `ref` is `old` (i.e.,
+        `is old`); otherwise `ref` is unchanged and `False` is returned.
+        """
+        if not isinstance(new, PHAMT):
+            raise TypeError("PHAMTRef requires a PHAMT")
+        with self._lock:
+            if self._phamt is not old: return False
+            self._phamt = new
+            return True
+    def reset(self, new):
+        """Replaces the `PHAMT` of the reference and returns the previous one.
+        """
+        if not isinstance(new, PHAMT):
+            raise TypeError("PHAMTRef.reset requires a PHAMT")
+        with self._lock:
+            (old, self._phamt) = (self._phamt, new)
+        return old
+    def swap(self, fn, *args):
+        """Atomically replaces the `PHAMT` of the reference with a function of
+        it.
+
+        `ref.swap(fn, *args)` calls `fn(u, *args)`, where `u` is the current
+        `PHAMT` of `ref`, and stores the resulting `PHAMT` if `ref` still holds
+        `u`; if another thread replaced `u` in the meantime, `fn` is called
+        again with the new `PHAMT`. The `PHAMT` that was stored is returned.
+        """
+        while True:
+            u = self._phamt
+            v = fn(u, *args)
+            if not isinstance(v, PHAMT):
+                raise TypeError("PHAMTRef.swap function must return a PHAMT")
+            if self.compare_and_set(u, v): return v
+    def assoc(self, k, v):
+        """Atomically associates a key with a value in the referenced `PHAMT`.
+        """
+        return self.swap(PHAMT.assoc, k, v)
+    def dissoc(self, k):
+        """Atomically removes a key from the referenced `PHAMT`."""
+        return self.swap(PHAMT.dissoc, k)
+
+
+# ConcurrentTHAMT Class ========================================================
+
+class ConcurrentTHAMT(object):
+    """A mutable mapping that many threads may update and snapshot at once.
+
+    A `ConcurrentTHAMT` is edited like a `THAMT` (`c[k] = v`, `del c[k]`), but
+    any number of threads may read and write it at the same time.
+    `c.snapshot()` returns, in constant time, a new `ConcurrentTHAMT` that
+    holds the current contents of `c` and that is edited independently of `c`
+    afterwards, and `c.persistent()` returns the current contents of `c` as a
+    `PHAMT`. In the C core, each internal node of the trie is reached through
+    an indirection node that is updated with a compare-and-set of its own; the
+    Python core instead keeps the whole map in a `PHAMTRef`, whose root each
+    edit replaces.
+    """
+    __slots__ = ('_ref',)
+    def __init__(self, phamt=PHAMT.empty):
+        if not isinstance(phamt, PHAMT):
+            phamt = THAMT(phamt).persistent()
+        object.__setattr__(self, '_ref', PHAMTRef(phamt))
+    def __setattr__(self, k, v):
+        raise TypeError("type ConcurrentTHAMT does not allow attribute mutation")
+    def __repr__(self):
+        return "<ConcurrentTHAMT:n=%d>" % len(self)
+    def __setitem__(self, k, v):
+        self._ref.assoc(k, v)
+    def __delitem__(self, k):
+        found = [True]
+        def fn(u):
+            found[0] = k in u
+            return u.dissoc(k) if found[0] else u
+        self._ref.swap(fn)
+        if not found[0]: raise KeyError(k)
+    def __getitem__(self, k):
+        return self._ref.get()[k]
+    def __contains__(self, k):
+        return k in self._ref.get()
+    def __len__(self):
+        return len(self._ref.get())
+    def __iter__(self):
+        return iter(self._ref.get())
+    def get(self, k, nf=None):
+        return self._ref.get().get(k, nf)
+    def snapshot(self):
+        """Returns a copy of the `ConcurrentTHAMT` in constant time."""
+        return ConcurrentTHAMT(self._ref.get())
+    def persistent(self):
+        """Returns the current contents of the `ConcurrentTHAMT` as a `PHAMT`.
+        """
+        return self._ref.get()
 
 
 # THAMT Class ==================================================================
@@ -417,7 +1036,13 @@ class THAMT(object):
     __slots__ = ('_phamt', '_version')
     def __init__(self, phamt=PHAMT.empty):
         if not isinstance(phamt, PHAMT):
-            raise TypeError("can only make THAMTs from PHAMTs")
+            # Other mappings (such as PHAMTs of the C core) are copied in.
+            if not hasattr(phamt, 'items'):
+                raise TypeError("can only make THAMTs from PHAMTs or mappings")
+            items = phamt.items()
+            THAMT.__init__(self)
+            for (k,v) in items: self[k] = v
+            return
         object.__setattr__(self, '_phamt', phamt)
         object.__setattr__(self, '_version', 0)
     def __setattr__(self, k, v):
@@ -493,3 +1118,14 @@ class THAMTIter(object):
                 self._stack.append(
                     (cell._cells, None, cell._depth, cell._address))
         raise StopIteration
+    def next_chunk(self, n):
+        """Returns the next `n` items of the iterator as a list of keys and a
+        list of values.
+
+        `it.next_chunk(n)` returns a tuple `(keys, values)` of two lists, each
+        of which has at most `n` elements, such that `keys[i]` and `values[i]`
+        are the key and value of the `i`th of the next `n` items in the
+        iteration. If the lists are shorter than `n`, the iteration is
+        finished; once finished, empty lists are returned.
+        """
+        return _iter_next_chunk(self, n)
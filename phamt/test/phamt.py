@@ -25,8 +25,8 @@ class TestPHAMT(TestCase):
         """
         from random import (randint, choice)
         from weakref import ref
-        if minint is None: minint = TestPHAMT.MIN_INT
-        if maxint is None: maxint = TestPHAMT.MAX_INT
+        if minint is None: minint = self.MIN_INT
+        if maxint is None: maxint = self.MAX_INT
         d = {}
         u = PHAMT.empty
         inserts = []
@@ -68,8 +68,8 @@ class TestPHAMT(TestCase):
         """
         from random import (randint, choice)
         from weakref import ref
-        if minint is None: minint = TestPHAMT.MIN_INT
-        if maxint is None: maxint = TestPHAMT.MAX_INT
+        if minint is None: minint = self.MIN_INT
+        if maxint is None: maxint = self.MAX_INT
         d = {}
         u = THAMT()
         inserts = []
@@ -216,6 +216,173 @@ class TestPHAMT(TestCase):
         self.pt_test_edit(PHAMT, THAMT)
         from ..py_core import PHAMT, THAMT
         self.pt_test_edit(PHAMT, THAMT)
+    def pt_test_dense_edit(self, PHAMT, THAMT):
+        import random
+        random.seed(35)
+        # Nodes change layout as they fill up and empty out, so we fill and
+        # empty dense runs of keys (next to some sparse outliers) in random
+        # orders and check the PHAMT against a dict at every step.
+        for k0 in [0, 7, -64, 1 << 40]:
+            ks = [k0 + k for k in range(1100)] + [k0 + (1 << 30), -(1 << 50)]
+            random.shuffle(ks)
+            (u, d) = (PHAMT.empty, {})
+            for (ii, k) in enumerate(ks):
+                u = u.assoc(k, k)
+                d[k] = k
+                if ii % 97 == 0: self.assertEqual(dict(u), d)
+                self.assertEqual(u[k], k)
+            self.assertEqual(dict(u), d)
+            # Replace some values, then remove everything again.
+            for k in ks[::3]:
+                u = u.assoc(k, -k)
+                d[k] = -k
+            self.assertEqual(dict(u), d)
+            random.shuffle(ks)
+            for (ii, k) in enumerate(ks):
+                u = u.dissoc(k)
+                del d[k]
+                self.assertFalse(k in u)
+                if ii % 97 == 0: self.assertEqual(dict(u), d)
+            self.assertEqual(len(u), 0)
+    def test_dense_edit(self):
+        """Tests that PHAMTs remain correct as their nodes fill and empty.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_dense_edit(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_dense_edit(PHAMT, THAMT)
+    def pt_test_runs(self, PHAMT, THAMT):
+        import random, gc
+        from weakref import ref
+        random.seed(38)
+        # Long runs of consecutive keys (which fill whole nodes) must act like
+        # dicts as holes are punched into them and filled back in, both
+        # persistently and transiently.
+        n = 5000
+        d = {k: k for k in range(-300, n - 300)}
+        u = PHAMT.from_iter(range(-300, n - 300), -300)
+        self.assertEqual(dict(u), d)
+        ks = random.sample(range(-300, n - 300), 400)
+        v = u
+        for k in ks[:200]:
+            v = v.dissoc(k)
+            del d[k]
+            self.assertFalse(k in v)
+        self.assertEqual(dict(v), d)
+        for k in ks[:200] + ks[200:]:
+            v = v.assoc(k, -k)
+            d[k] = -k
+            self.assertEqual(v[k], -k)
+        self.assertEqual(dict(v), d)
+        self.assertEqual(dict(u), {k: k for k in range(-300, n - 300)})
+        t = THAMT(u)
+        for k in ks[:200]: del t[k]
+        for k in ks[200:]: t[k] = None
+        w = t.persistent()
+        e = {k: k for k in range(-300, n - 300)}
+        for k in ks[:200]: del e[k]
+        for k in ks[200:]: e[k] = None
+        self.assertEqual(dict(w), e)
+        t = THAMT(w)
+        for k in ks[:200]: t[k] = k
+        for k in ks[200:]: t[k] = k
+        self.assertEqual(dict(t.persistent()), dict(u))
+        for m in [1, 7, 1000]:
+            (kk, vv) = iter(u).next_chunk(m)
+            self.assertEqual(list(zip(kk, vv)), list(u)[:m])
+        self.assertEqual([x for sh in u.shards(5) for x in sh], list(u))
+        # Set operations between runs, runs with holes, and sparse maps.
+        a = PHAMT.from_iter(range(3000))
+        b = PHAMT.from_iter(range(1000, 6000)).dissoc(1500).dissoc(4000)
+        c = PHAMT.from_iter(range(0, 8000, 3))
+        for (x, y) in [(a, b), (b, a), (a, c), (c, b), (a, a), (b, v)]:
+            (kx, ky) = (set(dict(x)), set(dict(y)))
+            self.assertEqual(set(x.keys() & y.keys()), kx & ky)
+            self.assertEqual(set(x.keys() | y.keys()), kx | ky)
+            self.assertEqual(set(x.keys() - y.keys()), kx - ky)
+            self.assertEqual(set(x.keys() ^ y.keys()), kx ^ ky)
+        self.assertTrue((a.keys() & a.keys()).mapping is a)
+        self.assertTrue((a.keys() | PHAMT.empty.keys()).mapping is a)
+        # Cycles through full nodes are collected.
+        class List(list): pass
+        lst = List()
+        lr = ref(lst)
+        lst.append(PHAMT.from_iter([lst] + list(range(3000))))
+        del lst
+        gc.collect()
+        self.assertTrue(lr() is None)
+    def test_runs(self):
+        """Tests that long runs of consecutive keys work correctly.
+        """
+        from .. import c_core, c_core16, c_core64
+        for m in (c_core, c_core16, c_core64):
+            self.pt_test_runs(m.PHAMT, m.THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_runs(PHAMT, THAMT)
+    def pt_test_small(self, PHAMT, THAMT):
+        import random, gc
+        from weakref import ref
+        random.seed(36)
+        # Maps of a few keys spread over the whole key space grow past the
+        # small-map size and shrink back; they must act like dicts throughout
+        # and iterate in the same order as the equivalent trie.
+        for trial in range(20):
+            ks = [random.randrange(-(1 << 63), 1 << 63) for _ in range(12)]
+            ks += [0, -1, 7]
+            (u, d) = (PHAMT.empty, {})
+            for k in ks:
+                u = u.assoc(k, str(k))
+                d[k] = str(k)
+                self.assertEqual(dict(u), d)
+                self.assertEqual(len(u), len(d))
+                self.assertEqual(list(u), list(THAMT(u).persistent()))
+                for n in [1, 3, 20]:
+                    (kk, vv) = iter(u).next_chunk(n)
+                    self.assertEqual(list(zip(kk, vv)), list(u)[:n])
+            random.shuffle(ks)
+            for k in ks:
+                u = u.dissoc(k)
+                del d[k]
+                self.assertFalse(k in u)
+                self.assertEqual(dict(u), d)
+            self.assertEqual(len(u), 0)
+        # Set operations, shards, and THAMTs accept small maps.
+        a = PHAMT.empty.assoc(1, 'a').assoc(-5, 'b').assoc(1 << 50, 'c')
+        b = PHAMT.empty.assoc(1, 'x').assoc(2, 'y')
+        c = PHAMT.from_iter(range(100))
+        for (x, y) in [(a, b), (b, a), (a, c), (c, b), (a, a)]:
+            (kx, ky) = (set(dict(x)), set(dict(y)))
+            self.assertEqual(set(x.keys() & y.keys()), kx & ky)
+            self.assertEqual(set(x.keys() | y.keys()), kx | ky)
+            self.assertEqual(set(x.keys() - y.keys()), kx - ky)
+            self.assertEqual(set(x.keys() ^ y.keys()), kx ^ ky)
+        self.assertTrue((a.keys() & a.keys()).mapping is a)
+        self.assertTrue((a.keys() | PHAMT.empty.keys()).mapping is a)
+        self.assertEqual([x for sh in a.shards(2) for x in sh], list(a))
+        t = THAMT(a)
+        t[3] = 'd'
+        del t[1]
+        self.assertEqual(dict(t.persistent()), {-5: 'b', 1 << 50: 'c', 3: 'd'})
+        self.assertEqual(dict(a), {1: 'a', -5: 'b', 1 << 50: 'c'})
+        # Cycles through small maps are collected.
+        class List(list): pass
+        lst = List()
+        lr = ref(lst)
+        lst.append(PHAMT.empty.assoc(-3, lst).assoc(4, 4))
+        del lst
+        gc.collect()
+        self.assertTrue(lr() is None)
+    def test_small(self):
+        """Tests that PHAMTs with few elements work correctly.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_small(PHAMT, THAMT)
+        # Edits that change nothing return the small map itself.
+        u = PHAMT.empty.assoc(1, 'a').assoc(-5, 'b')
+        self.assertTrue(u.assoc(1, u[1]) is u)
+        self.assertTrue(u.dissoc(2) is u)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_small(PHAMT, THAMT)
     def pt_test_thamt(self, PHAMT, THAMT):
         import gc
         for k in range(5):
@@ -256,6 +423,43 @@ class TestPHAMT(TestCase):
         self.pt_test_thamt(PHAMT, THAMT)
         from ..py_core import PHAMT, THAMT
         self.pt_test_thamt(PHAMT, THAMT)
+    def pt_test_persistent_session(self, PHAMT, THAMT):
+        import random
+        random.seed(34)
+        t = THAMT(PHAMT.from_iter(range(1000)))
+        d = dict(enumerate(range(1000)))
+        snaps = []
+        for r in range(10):
+            for ii in range(300):
+                k = random.randrange(-(1 << 40), 1 << 40, 1 << 20)
+                if ii % 3 == 0 and d:
+                    k = random.choice(list(d.keys()))
+                    del t[k]
+                    del d[k]
+                else:
+                    t[k] = [k] if ii % 5 == 0 else k
+                    d[k] = t[k]
+            # The THAMT may go on being edited after it is persisted.
+            snaps.append((t.persistent(), dict(d)))
+            self.assertEqual(dict(t.persistent()), d)
+            # Persisting while iterating over the THAMT must not disturb the
+            # iterator.
+            it = iter(t)
+            first = next(it)
+            p = t.persistent()
+            self.assertEqual(sorted([first] + list(it)), sorted(d.items()))
+            self.assertEqual(dict(p), d)
+        for (p, dd) in snaps:
+            self.assertEqual(len(p), len(dd))
+            self.assertEqual(dict(p), dd)
+    def test_persistent_session(self):
+        """Tests that THAMT objects can be persisted repeatedly while they are
+        being edited and iterated.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_persistent_session(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_persistent_session(PHAMT, THAMT)
     def pt_test_gc(self, PHAMT, THAMT):
         import gc
         from weakref import ref
@@ -309,10 +513,810 @@ class TestPHAMT(TestCase):
         """Tests that PHAMT objects are garbage collectable and allow their
         values to be garbage collected.
         """
+        import gc
+        from weakref import ref
         from ..c_core import PHAMT, THAMT
         self.pt_test_gc(PHAMT, THAMT)
+        # Nodes that can't reach a tracked object aren't tracked by the GC.
+        self.assertFalse(gc.is_tracked(PHAMT.empty))
+        self.assertFalse(gc.is_tracked(PHAMT.from_iter(range(5000))))
+        self.assertFalse(gc.is_tracked(PHAMT.from_iter(['a', 1.5, (1, 2)])))
+        u = PHAMT.from_iter(range(5000)).assoc(4000, [])
+        self.assertTrue(gc.is_tracked(u))
+        self.assertFalse(gc.is_tracked(u.dissoc(4000)))
+        self.assertFalse(gc.is_tracked(u.assoc(4000, None)))
+        # Replacing one of two tracked values leaves the copy tracked.
+        v = u.assoc(10, {})
+        self.assertTrue(gc.is_tracked(v.assoc(4000, None)))
+        self.assertTrue(gc.is_tracked(v.dissoc(10)))
+        self.assertFalse(gc.is_tracked(v.assoc(4000, None).assoc(10, 10)))
+        self.assertFalse(gc.is_tracked(PHAMT.empty.assoc(0, PHAMT.empty)))
+        t = THAMT(PHAMT.empty)
+        for ii in range(100): t[ii] = ii
+        self.assertFalse(gc.is_tracked(t.persistent()))
+        t[50] = {}
+        self.assertTrue(gc.is_tracked(t.persistent()))
+        # Cycles through values are still collected.
+        class List(list): pass
+        for n in [1, 100, 5000]:
+            lst = List()
+            lr = ref(lst)
+            lst.append(PHAMT.from_iter(range(n)).assoc(n // 2, lst))
+            t = THAMT(PHAMT.from_iter(range(n)))
+            t[n // 2] = lst
+            lst.append(t)
+            lst.append(t.persistent())
+            del lst, t
+            gc.collect()
+            self.assertTrue(lr() is None)
+        # Nodes allocated without a GC header may be shared with tracked nodes
+        # that are part of a cycle.
+        u = PHAMT.empty
+        for ii in range(0, 1 << 40, 1 << 33): u = u.assoc(ii, ii)
+        self.assertFalse(gc.is_tracked(u))
+        lst = List()
+        lr = ref(lst)
+        lst.append(u.assoc(5, lst))
+        lst.append(u.dissoc(0))
+        self.assertTrue(gc.is_tracked(lst[0]))
+        del lst, u
+        gc.collect()
+        self.assertTrue(lr() is None)
         from ..py_core import PHAMT, THAMT
         self.pt_test_gc(PHAMT, THAMT)
+    def pt_test_reclaim(self, PHAMT, THAMT, set_deferred_free, reclaim):
+        import gc
+        from weakref import ref
+        class Obj(object): pass
+        self.assertEqual(reclaim(0), 0)
+        self.assertEqual(set_deferred_free(0), None)
+        try:
+            # Dead PHAMTs aren't freed until the queue is drained.
+            objs = [Obj() for _ in range(2000)]
+            refs = [ref(o) for o in objs]
+            u = PHAMT.from_iter(objs)
+            v = u.assoc(5000, objs[0])
+            del objs, u
+            self.assertTrue(all(r() is not None for r in refs))
+            self.assertTrue(reclaim(0) > 0)
+            self.assertTrue(reclaim(1) > 0)
+            self.assertEqual(reclaim(), 0)
+            # The values are still held by the nodes that v shares with u.
+            self.assertEqual(sum(r() is not None for r in refs), 2000)
+            del v
+            self.assertEqual(reclaim(), 0)
+            self.assertTrue(all(r() is None for r in refs))
+            # Updates pay for freeing queued nodes as they allocate nodes.
+            self.assertEqual(set_deferred_free(8), 0)
+            objs = [Obj() for _ in range(2000)]
+            refs = [ref(o) for o in objs]
+            t = THAMT(PHAMT.empty)
+            for (k,o) in enumerate(objs): t[k] = o
+            del objs, o, t
+            u = PHAMT.from_iter(range(100))
+            us = []
+            for k in range(10000):
+                if reclaim(0) == 0: break
+                us.append(u.assoc(k, None))
+            self.assertTrue(0 < len(us) < 10000)
+            self.assertEqual(reclaim(0), 0)
+            self.assertTrue(all(r() is None for r in refs))
+            # Values that drop PHAMTs when they are freed are fine.
+            class Holder(object):
+                def __del__(self): self.u = None
+            h = Holder()
+            hr = ref(h)
+            h.u = PHAMT.from_iter(range(1000)).assoc(5, h)
+            del h
+            gc.collect()
+            self.assertEqual(reclaim(), 0)
+            self.assertTrue(hr() is None)
+            # Cycles are still collected.
+            class List(list): pass
+            lst = List()
+            lr = ref(lst)
+            lst.append(PHAMT.from_iter(range(1000)).assoc(500, lst))
+            del lst
+            gc.collect()
+            self.assertEqual(reclaim(), 0)
+            self.assertTrue(lr() is None)
+            with self.assertRaises(ValueError): set_deferred_free(-1)
+            with self.assertRaises(ValueError): reclaim(-1)
+            # Disabling deferral frees every queued node.
+            objs = [Obj() for _ in range(100)]
+            refs = [ref(o) for o in objs]
+            u = PHAMT.from_iter(objs)
+            del objs, u
+            self.assertEqual(set_deferred_free(None), 8)
+            self.assertTrue(all(r() is None for r in refs))
+        finally:
+            set_deferred_free(None)
+        self.assertEqual(reclaim(0), 0)
+    def test_reclaim(self):
+        """Tests deferred freeing (`set_deferred_free` and `reclaim`).
+        """
+        from .. import c_core, c_core16, c_core32
+        for m in (c_core, c_core16, c_core32):
+            self.pt_test_reclaim(m.PHAMT, m.THAMT, m.set_deferred_free,
+                                 m.reclaim)
+        from ..py_core import set_deferred_free, reclaim
+        self.assertEqual(set_deferred_free(4), None)
+        self.assertEqual(set_deferred_free(None), 4)
+        self.assertEqual(reclaim(), 0)
+    def pt_test_freelists(self, core, bits, n=2000):
+        import os, sysconfig
+        from random import randint
+        PHAMT = core.PHAMT
+        (counts, maxlen, slabs) = core._freelists(True)
+        self.assertEqual(counts, {} if not slabs else
+                         {c:m for (c,m) in counts.items() if c[0] == 0})
+        # The CI job that builds with CFLAGS=-DPHAMT_HUGEPAGE_SLABS must get
+        # the slabs (which are only used on Linux with the GIL).
+        if '-DPHAMT_HUGEPAGE_SLABS' in os.environ.get('CFLAGS', '') and \
+           sys.platform.startswith('linux') and \
+           not sysconfig.get_config_var('Py_GIL_DISABLED'):
+            self.assertTrue(slabs)
+        # Random keys make nodes of many sizes, and a run of consecutive keys
+        # makes full nodes.
+        ks = [randint(-2**(bits-1), 2**(bits-1) - 1) for _ in range(n)]
+        ks += list(range(n))
+        # Values that are ints make nodes without a GC header, and values that
+        # are lists make nodes with one.
+        for (gc, mk) in ((0, lambda k: k), (1, lambda k: [k])):
+            core._freelists(True)
+            d = {}
+            u = PHAMT.empty
+            for rep in range(4):
+                # Churn: add every key, then drop and re-add half of them, so
+                # that replaced nodes are freed and their cells reused.
+                for k in ks:
+                    v = mk(k + rep)
+                    u = u.assoc(k, v)
+                    d[k] = v
+                for k in ks[rep::2]:
+                    u = u.dissoc(k)
+                    d.pop(k, None)
+                for k in ks[rep::3]:
+                    v = mk(-k)
+                    u = u.assoc(k, v)
+                    d[k] = v
+                self.assertEqual(len(u), len(d))
+                self.assertTrue(all(u[k] == v for (k,v) in d.items()))
+                self.assertEqual(dict(u), d)
+            keeps = maxlen > 0 or (gc == 0 and slabs)
+            if keeps:
+                # A path copy reuses the nodes that freeing an identical path
+                # copy put onto the lists.
+                k = ks[0]
+                x = u.assoc(k, mk(1))
+                del x
+                (c0, _, _) = core._freelists()
+                x = u.assoc(k, mk(2))
+                (c1, _, _) = core._freelists()
+                self.assertTrue(sum(c1.values()) < sum(c0.values()))
+                self.assertEqual(x[k], mk(2))
+                self.assertEqual(dict(x.dissoc(k)), dict(u.dissoc(k)))
+                del x
+            del u
+            (counts, _, _) = core._freelists()
+            for ((g, ncells), m) in counts.items():
+                self.assertTrue(g in (0, 1) and ncells > 0 and m > 0)
+                if g == 1 or not slabs: self.assertTrue(m <= maxlen)
+            mine = {c:m for (c,m) in counts.items() if c[0] == gc}
+            if not keeps:
+                # E.g., in free-threaded builds, which don't keep freelists.
+                self.assertEqual(mine, {})
+                continue
+            # Nodes of several sizes were kept, and freeing the whole PHAMT
+            # filled up at least one of the lists.
+            self.assertTrue(len(mine) > 1)
+            self.assertTrue(max(mine.values()) >= maxlen)
+            # Reused nodes hold only their new contents.
+            u = PHAMT.from_iter(mk(k) for k in range(n))
+            self.assertEqual(dict(u), {k:mk(k) for k in range(n)})
+            del u
+        # Emptying the lists (as the module's m_free does) frees every node
+        # that didn't come from a slab.
+        (counts, _, _) = core._freelists(True)
+        self.assertTrue(all(g == 0 and slabs for (g, _) in counts))
+        self.assertEqual(dict(PHAMT.from_iter(range(n))),
+                         {k:k for k in range(n)})
+    def test_freelists(self):
+        """Tests that freed nodes are reused through the freelists.
+        """
+        from .. import c_core, c_core16, c_core64, c_core32, c_core128
+        for m in (c_core, c_core16, c_core64, c_core32, c_core128):
+            self.pt_test_freelists(m, m.hash_bits)
+    def pt_test_freeze(self, PHAMT, THAMT, freeze):
+        import gc
+        from random import randint
+        from weakref import ref
+        class Obj(object): pass
+        self.assertTrue(freeze(PHAMT.empty) is PHAMT.empty)
+        with self.assertRaises(TypeError): freeze({})
+        for n in [5, 1000, 20000]:
+            t = THAMT(PHAMT.empty)
+            for ii in range(n): t[randint(-2**31, 2**31 - 1)] = ii
+            for ii in range(n): t[ii] = ii
+            t[7] = Obj()
+            u = t.persistent()
+            d = u.to_dict()
+            f = freeze(u)
+            del u, t
+            gc.collect()
+            self.assertEqual(f.to_dict(), d)
+            self.assertEqual(len(f), len(d))
+            self.assertFalse(gc.is_tracked(f))
+            self.assertTrue(sys.getrefcount(f) > 2**20)
+            self.assertTrue(freeze(f) is f)
+            # Frozen values are never freed.
+            r = ref(f[7])
+            # PHAMTs derived from a frozen PHAMT are ordinary PHAMTs.
+            lst = []
+            g = f.assoc(7, lst).dissoc(8).assoc(-1, -1)
+            self.assertTrue(gc.is_tracked(g))
+            self.assertTrue(g[7] is lst and -1 in g and 8 not in g)
+            # Copies of frozen nodes that hold values that may be part of a
+            # reference cycle (here, f[7]) are tracked like any other node.
+            self.assertTrue(gc.is_tracked(f.assoc(3, -3)))
+            self.assertTrue(gc.is_tracked(f.dissoc(3)))
+            self.assertEqual(f.to_dict(), d)
+            h = freeze(g)
+            self.assertEqual(h.to_dict(), g.to_dict())
+            t = THAMT(f)
+            for k in list(d)[:n//2]: del t[k]
+            t[-2] = -2
+            self.assertEqual(len(t.persistent()), len(d) - n//2 + 1)
+            del g, h, t, f
+            gc.collect()
+            self.assertTrue(r() is not None)
+            self.assertEqual(dict(freeze(PHAMT.from_iter(range(n)))),
+                             dict(PHAMT.from_iter(range(n))))
+    def test_freeze(self):
+        """Tests that frozen PHAMTs (see `freeze`) work like other PHAMTs.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128
+        for m in (c_core, c_core16, c_core32, c_core128):
+            self.pt_test_freeze(m.PHAMT, m.THAMT, m.freeze)
+        from ..py_core import PHAMT, freeze
+        u = PHAMT.from_iter(range(10))
+        self.assertTrue(freeze(u) is u)
+    def pt_test_threads(self, PHAMT, THAMT, freeze, nthreads=4, n=4000):
+        import threading
+        u = PHAMT.from_iter(range(n))
+        f = freeze(u)
+        t = THAMT(u)
+        it = iter(f.items())
+        errs = []
+        seen = [[] for _ in range(nthreads)]
+        def work(i):
+            try:
+                # Concurrent reads and updates of shared PHAMTs.
+                for g in (u, f):
+                    v = g
+                    for k in range(i, n, nthreads):
+                        assert g[k] == k
+                        v = v.assoc(k, -k).dissoc(k + 1)
+                    assert len(g) == n
+                    for k in range(i, n, nthreads):
+                        assert v.get(k) == -k
+                # Concurrent updates of a shared THAMT, to disjoint keys.
+                for k in range(i, n, nthreads):
+                    t[k] = -k
+                    t[n + k] = k
+                    del t[n + k]
+                # A shared iterator hands out each item exactly once.
+                for kv in it: seen[i].append(kv)
+            except Exception as e:
+                errs.append(e)
+        sw = sys.getswitchinterval()
+        sys.setswitchinterval(1e-6)
+        try:
+            ths = [threading.Thread(target=work, args=(i,))
+                   for i in range(nthreads)]
+            for th in ths: th.start()
+            for th in ths: th.join()
+        finally:
+            sys.setswitchinterval(sw)
+        self.assertEqual(errs, [])
+        self.assertEqual(dict(u), {k:k for k in range(n)})
+        self.assertEqual(dict(t.persistent()), {k:-k for k in range(n)})
+        items = [kv for s in seen for kv in s]
+        self.assertEqual(len(items), n)
+        self.assertEqual(dict(items), dict(u))
+    def pt_test_threads_edit(self, PHAMT, THAMT, ShardedTHAMT, nthreads=4,
+                             n=2000, reps=3):
+        import threading
+        for T in (THAMT, ShardedTHAMT):
+            t = T(PHAMT.from_iter(range(n)))
+            errs = []
+            stats = {'passes': 0, 'stopped': 0}
+            writing = threading.Event()
+            writing.set()
+            def check(items):
+                # Every item that is seen was written by some writer.
+                for (k, v) in items:
+                    if 0 <= k < n: assert k <= v <= k + reps, (k, v)
+                    else: assert n <= k < 2*n and v == n - k, (k, v)
+            def write(i):
+                try:
+                    for rep in range(1, reps + 1):
+                        for k in range(i, n, nthreads):
+                            t[k] = k + rep
+                            t[n + k] = -k
+                            del t[n + k]
+                except Exception as e:
+                    errs.append(e)
+            def read(i):
+                try:
+                    while writing.is_set():
+                        # Iterating over a THAMT that the writers edit stops
+                        # with a RuntimeError; iterating over a ShardedTHAMT
+                        # iterates over a snapshot of it.
+                        try:
+                            it = iter(t)
+                            if i % 2: check(zip(*it.next_chunk(64)))
+                            check(it)
+                            stats['passes'] += 1
+                        except RuntimeError:
+                            if T is ShardedTHAMT: raise
+                            stats['stopped'] += 1
+                        assert 0 <= len(t) <= 2*n and (i in t) and t[i] >= i
+                except Exception as e:
+                    errs.append(e)
+            sw = sys.getswitchinterval()
+            sys.setswitchinterval(1e-6)
+            try:
+                rs = [threading.Thread(target=read, args=(i,))
+                      for i in range(2)]
+                ws = [threading.Thread(target=write, args=(i,))
+                      for i in range(nthreads)]
+                for th in rs + ws: th.start()
+                for th in ws: th.join()
+                writing.clear()
+                for th in rs: th.join()
+            finally:
+                sys.setswitchinterval(sw)
+            self.assertEqual(errs, [])
+            self.assertTrue(stats['passes'] + stats['stopped'] > 0)
+            self.assertEqual(dict(t), {k:k + reps for k in range(n)})
+            self.assertEqual(len(t), n)
+    def test_threads(self):
+        """Tests that PHAMTs and THAMTs can be shared between threads.
+        """
+        import os, sysconfig
+        from .. import c_core, c_core16, c_core32, c_core128
+        for m in (c_core, c_core16, c_core32, c_core128):
+            self.pt_test_threads(m.PHAMT, m.THAMT, m.freeze)
+            self.pt_test_threads_edit(m.PHAMT, m.THAMT, m.ShardedTHAMT)
+        # In free-threaded builds, importing the modules must not have turned
+        # the GIL back on (unless the user asked for it).
+        if sysconfig.get_config_var('Py_GIL_DISABLED') and \
+           os.environ.get('PYTHON_GIL', '0') == '0':
+            self.assertFalse(sys._is_gil_enabled())
+    def pt_test_ref(self, PHAMT, PHAMTRef, nthreads=4, n=2000):
+        import threading
+        r = PHAMTRef()
+        self.assertTrue(r.get() is PHAMT.empty)
+        u = PHAMT.from_iter(range(10))
+        r = PHAMTRef(u)
+        self.assertTrue(r.get() is u)
+        with self.assertRaises(TypeError): PHAMTRef({})
+        with self.assertRaises(TypeError): r.reset({})
+        # Compare-and-set only replaces the PHAMT that it is given.
+        v = u.assoc(10, 10)
+        self.assertFalse(r.compare_and_set(v, u))
+        self.assertTrue(r.get() is u)
+        self.assertTrue(r.compare_and_set(u, v))
+        self.assertTrue(r.get() is v)
+        self.assertTrue(r.reset(u) is v)
+        self.assertTrue(r.get() is u)
+        # Updates return the PHAMT that they stored.
+        w = r.assoc(-1, 'a')
+        self.assertTrue(r.get() is w)
+        self.assertEqual(w[-1], 'a')
+        self.assertEqual(dict(r.dissoc(-1)), dict(u))
+        self.assertEqual(dict(r.dissoc(-1)), dict(u))
+        self.assertEqual(r.swap(lambda u, k, v: u.assoc(k, v), 5, 'b')[5], 'b')
+        with self.assertRaises(TypeError): r.swap(lambda u: None)
+        with self.assertRaises(ZeroDivisionError): r.swap(lambda u: 1/0)
+        with self.assertRaises(TypeError): r.assoc('a', 1)
+        self.assertEqual(len(r.get()), 10)
+        # A swap whose PHAMT is replaced while it runs is retried.
+        calls = []
+        def fn(u):
+            calls.append(u)
+            if len(calls) == 1: r.assoc(100, 100)
+            return u.assoc(101, 101)
+        x = r.swap(fn)
+        self.assertEqual(len(calls), 2)
+        self.assertTrue(100 in x and 101 in x and r.get() is x)
+        # Concurrent updates are never lost.
+        r = PHAMTRef()
+        def work(i):
+            for k in range(i, n, nthreads):
+                if k % 2: r.assoc(k, k)
+                else:     r.swap(PHAMT.assoc, k, k)
+                r.assoc(-k - 1, k)
+                r.dissoc(-k - 1)
+        sw = sys.getswitchinterval()
+        sys.setswitchinterval(1e-6)
+        try:
+            ths = [threading.Thread(target=work, args=(i,))
+                   for i in range(nthreads)]
+            for th in ths: th.start()
+            for th in ths: th.join()
+        finally:
+            sys.setswitchinterval(sw)
+        self.assertEqual(dict(r.get()), {k:k for k in range(n)})
+    def test_ref(self):
+        """Tests that PHAMTRef objects update their PHAMTs atomically.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128, py_core
+        for m in (c_core, c_core16, c_core32, c_core128, py_core):
+            self.pt_test_ref(m.PHAMT, m.PHAMTRef)
+    def pt_test_sharded(self, PHAMT, THAMT, ShardedTHAMT, bits, n=2000):
+        import threading
+        from random import randint
+        s = ShardedTHAMT()
+        self.assertEqual(len(s), 0)
+        self.assertTrue(s.persistent() is PHAMT.empty)
+        nsh = s.nshards
+        self.assertTrue(nsh > 1)
+        self.assertEqual(s.shard_of(0), 0)
+        self.assertEqual(s.shard_of(-1), nsh - 1)
+        with self.assertRaises(IndexError): s.shard(nsh)
+        with self.assertRaises(TypeError): s.shard_of('a')
+        # Keys from all over the key space, small maps, and large tries all
+        # survive a round trip through the shards.
+        d = {randint(-2**(bits-1), 2**(bits-1) - 1): ii for ii in range(n)}
+        for ii in range(n): d[ii - n//2] = ii
+        for u in [PHAMT.empty.assoc(-3, 1).assoc(4, 2),
+                  THAMT(d).persistent(),
+                  PHAMT.from_iter(range(n))]:
+            s = ShardedTHAMT(u)
+            self.assertEqual(len(s), len(u))
+            self.assertEqual(dict(s.persistent()), dict(u))
+            self.assertEqual(dict(s), dict(u))
+            for k in u.keys():
+                self.assertTrue(k in s and s[k] is u[k])
+                self.assertTrue(k in s.shard(s.shard_of(k)))
+        self.assertEqual(dict(ShardedTHAMT(d).persistent()), d)
+        # Edits, including edits made directly to a shard's THAMT.
+        s = ShardedTHAMT(PHAMT.from_iter(range(10)))
+        s[-1] = -1
+        del s[0]
+        with self.assertRaises(KeyError): del s[0]
+        with self.assertRaises((KeyError, TypeError)): s['a'] = 1
+        s.shard(s.shard_of(-2))[-2] = -2
+        self.assertEqual(s.get(-2), -2)
+        self.assertEqual(s.get(0, 'nf'), 'nf')
+        u = s.persistent()
+        s[100] = 100
+        self.assertEqual(dict(u), {k:k for k in list(range(1, 10)) + [-1, -2]})
+        self.assertEqual(len(s), len(u) + 1)
+        # One writer per shard.
+        s = ShardedTHAMT()
+        def work(i):
+            for k in range(n):
+                k = -k - 1 if i % 2 else k
+                if s.shard_of(k) == (0 if i % 2 == 0 else nsh - 1):
+                    s[k] = i
+        ths = [threading.Thread(target=work, args=(i,)) for i in range(2)]
+        for th in ths: th.start()
+        for th in ths: th.join()
+        self.assertEqual(dict(s.persistent()),
+                         dict([(k, 0) for k in range(n)] +
+                              [(-k - 1, 1) for k in range(n)]))
+    def test_sharded(self):
+        """Tests that ShardedTHAMT objects split and join their keys correctly.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128, py_core
+        for m in (c_core, c_core16, c_core32, c_core128, py_core):
+            bits = getattr(m, 'hash_bits', sys.hash_info[0])
+            self.pt_test_sharded(m.PHAMT, m.THAMT, m.ShardedTHAMT, bits)
+    def pt_test_concurrent(self, PHAMT, THAMT, ConcurrentTHAMT, bits,
+                           nthreads=4, n=1000):
+        import threading, gc, weakref
+        from random import randint, random, choice
+        c = ConcurrentTHAMT()
+        self.assertEqual(len(c), 0)
+        u = PHAMT.from_iter(range(100))
+        c = ConcurrentTHAMT(u)
+        self.assertTrue(c.persistent() is u)
+        self.assertEqual(dict(ConcurrentTHAMT({1: 'a'})), {1: 'a'})
+        # Edits, and snapshots that are edited independently.
+        s = c.snapshot()
+        c[100] = 100
+        del c[0]
+        with self.assertRaises(KeyError): del c[0]
+        with self.assertRaises((KeyError, TypeError)): c['a'] = 1
+        s[-1] = -1
+        self.assertEqual(dict(u), {k:k for k in range(100)})
+        self.assertEqual(dict(c), {k:k for k in range(1, 101)})
+        self.assertEqual(dict(s), {k:k for k in range(-1, 100)})
+        self.assertTrue(100 in c and 0 not in c and 100 not in s)
+        self.assertEqual((c[100], c.get(0), c.get(0, -1)), (100, None, -1))
+        with self.assertRaises(KeyError): c[0]
+        # Iterators aren't invalidated by edits.
+        it = iter(c)
+        next(it)
+        for k in range(200): c[k] = k
+        self.assertEqual(len(list(it)), 99)
+        # Random edits from all over the key space, with the snapshots and
+        # PHAMTs made along the way checked at the end.
+        d = {}
+        c = ConcurrentTHAMT()
+        saved = []
+        for ii in range(20000):
+            k = choice([randint(-2**(bits-1), 2**(bits-1) - 1),
+                        randint(0, 3000), randint(0, 100000)])
+            if d and random() < 0.4:
+                if random() < 0.9: k = choice(list(d))
+                if k in d:
+                    del c[k]
+                    del d[k]
+                else:
+                    with self.assertRaises(KeyError): del c[k]
+            else:
+                c[k] = d[k] = ii
+            if ii % 2000 == 0:
+                saved.append((c.snapshot(), c.persistent(), dict(d)))
+        for (s, p, dd) in saved:
+            self.assertEqual(len(p), len(dd))
+            self.assertEqual(dict(p), dd)
+            self.assertEqual(dict(s.persistent()), dd)
+            # The PHAMTs are made of ordinary nodes.
+            self.assertEqual(dict(THAMT(p).persistent()), dd)
+            dd = dict(dd)
+            dd[-5] = 'x'
+            self.assertEqual(dict(p.assoc(-5, 'x')), dd)
+        for k in d: self.assertTrue(k in c and c[k] == d[k])
+        for k in list(d): del c[k]
+        self.assertEqual(len(c), 0)
+        self.assertEqual(dict(c.persistent()), {})
+        # A ConcurrentTHAMT in a reference cycle is collected.
+        class Obj(object): pass
+        o = Obj()
+        o.c = ConcurrentTHAMT()
+        for k in range(100): o.c[k * 1000] = o
+        o.s = o.c.snapshot()
+        o.p = o.c.persistent()
+        wr = weakref.ref(o)
+        del o
+        gc.collect()
+        self.assertTrue(wr() is None)
+        # Concurrent edits aren't lost, and each snapshot holds, for each
+        # writer, a prefix of the keys that it has written.
+        c = ConcurrentTHAMT()
+        snaps = []
+        def work(i):
+            for k in range(i, n*nthreads, nthreads):
+                c[k] = k
+                c[-k - 1] = k
+                del c[-k - 1]
+                if k % 97 == 0: snaps.append(c.snapshot())
+                if k % 101 == 0: snaps.append(c.persistent())
+        sw = sys.getswitchinterval()
+        sys.setswitchinterval(1e-6)
+        try:
+            ths = [threading.Thread(target=work, args=(i,))
+                   for i in range(nthreads)]
+            for th in ths: th.start()
+            for th in ths: th.join()
+        finally:
+            sys.setswitchinterval(sw)
+        self.assertEqual(dict(c), {k:k for k in range(n*nthreads)})
+        for s in snaps:
+            if not isinstance(s, PHAMT): s = s.persistent()
+            ks = [k for k in s.keys() if k >= 0]
+            for i in range(nthreads):
+                mine = sorted(k for k in ks if k % nthreads == i)
+                self.assertEqual(mine, list(range(i, len(mine)*nthreads,
+                                                  nthreads)))
+    def test_concurrent(self):
+        """Tests that ConcurrentTHAMT objects can be edited by many threads.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128, py_core
+        for m in (c_core, c_core16, c_core32, c_core128, py_core):
+            bits = getattr(m, 'hash_bits', sys.hash_info[0])
+            self.pt_test_concurrent(m.PHAMT, m.THAMT, m.ConcurrentTHAMT, bits)
+    def pt_test_bulk(self, PHAMT, bits, n=20000):
+        import gc
+        from array import array
+        from random import randint
+        self.assertTrue(PHAMT.from_arrays([], []) is PHAMT.empty)
+        # Random keys from all over the key space, with repeats, whose last
+        # values win; the keys may be a buffer or a list.
+        ks = [randint(-2**(bits-1), 2**(bits-1) - 1) for _ in range(n // 2)]
+        ks += [randint(-n, n) for _ in range(n // 2)]
+        vs = list(range(n))
+        d = dict(zip(ks, vs))
+        # (Keys wider than 64 bits can't be put in a buffer.)
+        buf = array('q', ks) if bits <= 64 else ks
+        for nthreads in (1, 4):
+            for keys in (ks, buf):
+                u = PHAMT.from_arrays(keys, vs, nthreads)
+                self.assertEqual(len(u), len(d))
+                self.assertEqual(dict(u), d)
+                for k in ks[:100]: self.assertTrue(u[k] is d[k])
+            u = PHAMT.from_arrays(range(n), vs, nthreads=nthreads)
+            self.assertEqual(dict(u), dict(enumerate(vs)))
+            self.assertEqual(dict(u.dissoc(5).assoc(n, 0)),
+                             dict([(k, k) for k in range(n) if k != 5] +
+                                  [(n, 0)]))
+            # A batch assoc'd into an existing PHAMT.
+            u0 = PHAMT.from_iter(range(100), -50)
+            u = u0.assoc_arrays(buf, vs, nthreads=nthreads)
+            e = dict(u0)
+            e.update(d)
+            self.assertEqual(dict(u), e)
+            self.assertEqual(dict(u0), dict(zip(range(-50, 50), range(100))))
+            self.assertEqual(dict(u0.assoc_arrays([3, 1000], 'ab')),
+                             dict(u0.assoc(3, 'a').assoc(1000, 'b')))
+        with self.assertRaises(ValueError): PHAMT.from_arrays([1, 2], [1])
+        with self.assertRaises(ValueError): PHAMT.from_arrays(array('i'), [])
+        with self.assertRaises(ValueError): PHAMT.from_arrays([1], [1], 0)
+        with self.assertRaises((KeyError, TypeError)):
+            PHAMT.from_arrays(['a'], [1])
+        # The values' refcounts are kept, and values that may be part of
+        # reference cycles are visible to the garbage collector.
+        x = []
+        rc = sys.getrefcount(x)
+        u = PHAMT.from_arrays(range(n), [x]*n, nthreads=4)
+        self.assertEqual(sys.getrefcount(x), rc + n)
+        x.append(u)
+        del u
+        gc.collect()
+        self.assertEqual(sys.getrefcount(x), rc + n)
+        x.pop()
+        gc.collect()
+        self.assertEqual(sys.getrefcount(x), rc)
+    def test_bulk(self):
+        """Tests that PHAMT.from_arrays and assoc_arrays build the same maps as
+        assoc does.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128, py_core
+        for m in (c_core, c_core16, c_core32, c_core128, py_core):
+            bits = getattr(m, 'hash_bits', sys.hash_info[0])
+            self.pt_test_bulk(m.PHAMT, bits, 2000 if m is py_core else 20000)
+    def pt_test_ctype_bulk(self, core, bits, n=20000):
+        from random import randint
+        build = core._ctype_build
+        ks = [randint(-2**(bits-1), 2**(bits-1) - 1) for _ in range(n // 2)]
+        ks += [randint(-n, n) for _ in range(n // 2)]
+        vs = [randint(0, 2**randint(1, 40)) for _ in range(n)]
+        d = dict(zip(ks, vs))
+        for nthreads in (1, 4):
+            # Random keys, dense keys, and a few keys (which make a small map).
+            for (keys, vals) in ((ks, vs), (range(n), vs), (ks[:5], vs[:5])):
+                e = dict(zip(keys, vals))
+                (items, found, _) = build(keys, vals, nthreads)
+                self.assertEqual(len(items), len(e))
+                self.assertEqual(dict(items), e)
+                self.assertEqual(found, [e[k] for k in keys])
+            # A batch assoc'd into a map built by assoc.
+            (items, found, _) = build(ks, vs, nthreads, 100)
+            self.assertEqual(dict(items), d)
+            self.assertEqual(found, [d[k] for k in ks])
+    def test_ctype_bulk(self):
+        """Tests that phamt_from_arrays and phamt_assoc_arrays build ctype
+        PHAMTs on several threads.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128
+        for m in (c_core, c_core16, c_core32, c_core128):
+            self.pt_test_ctype_bulk(m, m.hash_bits)
+    def pt_test_packing(self, core):
+        build = core._ctype_build
+        # Twenty keys fill one or two twigs, which aren't small maps; key 7 gets
+        # the value whose width is tested.
+        ks = list(range(20))
+        def packs(vals, nbase=None):
+            (items, found, packs) = build(ks + [7]*(len(vals) - 20), vals, 1,
+                                          len(vals) if nbase is None else nbase)
+            e = dict(zip(ks + [7]*(len(vals) - 20), vals))
+            self.assertEqual(found[:20], [e[k] for k in ks])
+            if e[7] is None: del e[7]
+            self.assertEqual(dict(items), e)
+            return packs
+        ones = packs([1]*20)
+        ntwigs = ones[1]
+        self.assertEqual(ones, {1: ntwigs})
+        self.assertEqual(packs([0]*20), {1: ntwigs})
+        # The twig that holds key 7 is packed into the narrowest fields that
+        # hold all of its values, whether it is built by assoc or in bulk.
+        for (v, w) in ((1, 1), (2, 8), (2**8 - 1, 8), (2**8, 16),
+                       (2**16 - 1, 16), (2**16, 32), (2**32 - 1, 32),
+                       (2**32, 0), (2**64 - 1, 0)):
+            e = {w: 1}
+            if ntwigs > 1: e[1] = e.get(1, 0) + ntwigs - 1
+            vals = [1]*20
+            vals[7] = v
+            self.assertEqual(packs(vals), e)
+            self.assertEqual(packs(vals, 0), e)
+            self.assertEqual(packs(vals, 10), e)
+            # Widening a twig by assoc'ing a wider value into it.
+            self.assertEqual(packs([1]*20 + [v]), e)
+            # Narrowing it by assoc'ing a narrower value in place of the
+            # widest one, or by dissoc'ing the widest one.
+            self.assertEqual(packs(vals + [1]), ones)
+            self.assertEqual(packs(vals + [None]), ones)
+        # A chain of widenings and narrowings of one twig.
+        vals = [1]*20
+        for (v, w) in ((300, 16), (3, 8), (70000, 32), (2**40, 0), (None, 1),
+                       (2**16, 32), (0, 1)):
+            vals.append(v)
+            e = {w: 1}
+            if ntwigs > 1: e[1] = e.get(1, 0) + ntwigs - 1
+            self.assertEqual(packs(vals), e)
+    def test_packing(self):
+        """Tests that the twigs of ctype PHAMTs are packed into fields of the
+        right width and that their values are read back unchanged.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128
+        for m in (c_core, c_core16, c_core32, c_core128):
+            self.pt_test_packing(m)
+    def pt_test_walk(self, PHAMT, THAMT, n=20000):
+        from operator import add
+        from random import randint
+        t = THAMT({randint(-2**30, 2**30): ii for ii in range(500)})
+        for u in [PHAMT.empty, PHAMT.empty.assoc(-1, 1), t.persistent(),
+                  PHAMT.from_iter(range(n), -n//2)]:
+            items = list(u)
+            d = dict(items)
+            for nthreads in (1, 4):
+                out = []
+                self.assertTrue(u.foreach(lambda k, v: out.append((k, v)),
+                                          nthreads=nthreads) is None)
+                if nthreads == 1: self.assertEqual(out, items)
+                else: self.assertEqual(dict(out), d)
+                self.assertEqual(len(out), len(d))
+                # A sum and a histogram of the keys' residues.
+                s = u.reduce(lambda acc, k, v: acc + k, 0, add, nthreads)
+                self.assertEqual(s, sum(d.keys()))
+                def count(acc, k, v):
+                    acc = dict(acc)
+                    acc[k % 3] = acc.get(k % 3, 0) + 1
+                    return acc
+                def merge(a, b):
+                    return {r: a.get(r, 0) + b.get(r, 0) for r in set(a) | set(b)}
+                h = u.reduce(count, {}, merge, nthreads)
+                self.assertEqual({r: c for (r, c) in h.items() if c},
+                                 {r: len([k for k in d if k % 3 == r])
+                                  for r in set(k % 3 for k in d)})
+                # The threads' results are joined by fewer than nthreads
+                # calls to combine.
+                calls = []
+                def join(a, b):
+                    calls.append((a, b))
+                    return a + b
+                self.assertEqual(sorted(u.reduce(lambda acc, k, v: acc + [k],
+                                                 [], join, nthreads)),
+                                 sorted(d))
+                self.assertLess(len(calls), nthreads)
+        # Exceptions raised by the function stop the walk.
+        k0 = list(u.keys())[n//3]
+        def check(k, v):
+            if k == k0: raise ValueError(k)
+        for nthreads in (1, 4):
+            with self.assertRaises(ValueError): u.foreach(check, nthreads)
+        with self.assertRaises(ValueError): u.reduce(add, 0, None, 4)
+        with self.assertRaises(ValueError): u.foreach(check, 0)
+    def test_walk(self):
+        """Tests that the foreach and reduce methods visit every item once.
+        """
+        from .. import c_core, c_core16, c_core32, c_core128, py_core
+        for m in (c_core, c_core16, c_core32, c_core128, py_core):
+            self.pt_test_walk(m.PHAMT, m.THAMT, 2000 if m is py_core else 20000)
+        # The Python implementation reduces each shard and combines them.
+        u = py_core.PHAMT.from_iter(range(2000))
+        calls = []
+        def join(a, b):
+            calls.append((a, b))
+            return a + b
+        self.assertEqual(u.reduce(lambda acc, k, v: acc + 1, 0, join, 4), 2000)
+        self.assertEqual(len(calls), len(u.shards(4)) - 1)
+        self.assertEqual([a + b for (a, b) in calls][-1], 2000)
     def test_from_iter(self):
         """Tests that PHAMT.from_iter works correctly.
         """
@@ -328,3 +1332,375 @@ class TestPHAMT(TestCase):
                     self.assertTrue(u[k] == v)
                 for (k,v) in u:
                     self.assertTrue(d[k] == v)
+    def pt_test_next_chunk(self, PHAMT, THAMT):
+        (u, d, assocs) = self.make_random_pair(PHAMT, THAMT, 500)
+        items = list(u)
+        for n in [1, 2, 7, 32, 33, 100, 1000]:
+            # Chunked iteration must yield the same items as normal iteration.
+            it = iter(u)
+            (ks, vs) = ([], [])
+            while True:
+                (kk, vv) = it.next_chunk(n)
+                self.assertEqual(len(kk), len(vv))
+                self.assertTrue(len(kk) <= n)
+                ks.extend(kk)
+                vs.extend(vv)
+                if len(kk) < n: break
+            self.assertEqual(list(zip(ks, vs)), items)
+            self.assertEqual(it.next_chunk(n), ([], []))
+            # Chunks can be mixed with calls to next.
+            it = iter(u)
+            first = next(it)
+            (kk, vv) = it.next_chunk(n)
+            self.assertEqual([first] + list(zip(kk, vv)), items[:n+1])
+        # Dense PHAMTs use the single-pass twig copy.
+        u = PHAMT.from_iter(range(1000), -10)
+        (kk, vv) = iter(u).next_chunk(2000)
+        self.assertEqual(list(zip(kk, vv)), list(u))
+        self.assertEqual(sorted(kk), list(range(-10, 990)))
+        self.assertEqual(iter(PHAMT.empty).next_chunk(10), ([], []))
+        # THAMT iterators also support chunks.
+        t = THAMT(u)
+        t[5000] = 'x'
+        (kk, vv) = iter(t).next_chunk(2000)
+        self.assertEqual(list(zip(kk, vv)), list(t))
+        self.assertEqual(len(kk), 1001)
+    def test_next_chunk(self):
+        """Tests that the `next_chunk` method of PHAMT and THAMT iterators
+        yields the same items as normal iteration.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_next_chunk(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_next_chunk(PHAMT, THAMT)
+    def pt_test_views(self, PHAMT, THAMT):
+        from random import randint
+        # The views iterate over the same items as the PHAMT itself.
+        (u, d, assocs) = self.make_random_pair(PHAMT, THAMT, 500)
+        items = list(u)
+        self.assertEqual(list(u.keys()), [k for (k,v) in items])
+        self.assertEqual(list(u.values()), [v for (k,v) in items])
+        self.assertEqual(list(u.items()), items)
+        self.assertEqual(len(u.keys()), len(d))
+        self.assertEqual(len(u.values()), len(d))
+        self.assertEqual(len(u.items()), len(d))
+        self.assertTrue(u.keys().mapping is u)
+        (k0, v0) = items[0]
+        self.assertTrue(k0 in u.keys())
+        self.assertTrue(v0 in u.values())
+        self.assertTrue((k0, v0) in u.items())
+        self.assertFalse((k0, None) in u.items())
+        self.assertFalse(None in u.keys())
+        self.assertFalse(None in u.values())
+        # Set operations between two key views yield PHAMT key views.
+        for (minint, maxint) in [(0, 100), (-1000, 1000), (None, None)]:
+            (a, da, _) = self.make_random_pair(PHAMT, THAMT, 300, minint, maxint)
+            (b, db, _) = self.make_random_pair(PHAMT, THAMT, 300, minint, maxint)
+            (ka, kb) = (set(da.keys()), set(db.keys()))
+            for (r, s) in [(a.keys() & b.keys(), ka & kb),
+                           (a.keys() | b.keys(), ka | kb),
+                           (a.keys() - b.keys(), ka - kb),
+                           (a.keys() ^ b.keys(), ka ^ kb)]:
+                self.assertEqual(set(r), s)
+                self.assertEqual(len(r), len(s))
+                m = r.mapping
+                self.assertEqual(len(m), len(s))
+                self.assertEqual(sorted(m.keys()), sorted(s))
+                for k in s:
+                    self.assertTrue(k in r)
+                    self.assertTrue(m[k] is (a[k] if k in a else b[k]))
+            self.assertEqual(len(a.keys() - a.keys()), 0)
+            self.assertTrue((a.keys() & a.keys()).mapping is a)
+            self.assertTrue((a.keys() | PHAMT.empty.keys()).mapping is a)
+            # Other operands yield sets.
+            self.assertEqual(a.keys() & kb, ka & kb)
+            self.assertEqual(kb & a.keys(), ka & kb)
+            self.assertEqual(a.keys() | list(kb), ka | kb)
+            self.assertEqual(kb - a.keys(), kb - ka)
+        # Dense PHAMTs share their untouched subtrees.
+        a = PHAMT.from_iter(range(5000))
+        b = PHAMT.from_iter(range(2500), 4000)
+        self.assertEqual(set(a.keys() & b.keys()), set(range(4000, 5000)))
+        self.assertEqual(set(a.keys() - b.keys()), set(range(4000)))
+        self.assertEqual(set((a.keys() | b.keys()).mapping.values()),
+                         set(range(5000)) | set(range(1000, 2500)))
+    def test_views(self):
+        """Tests that the `keys`, `values`, and `items` views of PHAMTs iterate
+        correctly and support set operations.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_views(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_views(PHAMT, THAMT)
+    def pt_test_export(self, PHAMT, THAMT):
+        from array import array
+        (u, d, assocs) = self.make_random_pair(PHAMT, THAMT, 500)
+        items = list(u)
+        self.assertEqual(u.to_dict(), dict(items))
+        self.assertEqual(u.to_lists(),
+                         ([k for (k,v) in items], [v for (k,v) in items]))
+        self.assertEqual(PHAMT.empty.to_dict(), {})
+        self.assertEqual(PHAMT.empty.to_lists(), ([], []))
+        self.assertEqual(PHAMT.empty.keys_array().tolist(), [])
+        # The array exports hold the keys and values as 64-bit numbers.
+        ks = [k for (k,v) in items]
+        self.assertEqual(u.keys_array().format, 'q')
+        self.assertEqual(u.keys_array().tolist(), ks)
+        self.assertEqual(u.keys_array('uint64').tolist(),
+                         [k % 2**64 for k in ks])
+        self.assertEqual(u.keys_array('d').tolist(), [float(k) for k in ks])
+        u = PHAMT.from_iter(range(1000), -10)
+        self.assertEqual(u.values_array().format, 'd')
+        self.assertEqual(u.values_array().tolist(), [float(x) for x in u.values()])
+        self.assertEqual(u.values_array(dtype='q').tolist(), list(u.values()))
+        out = array('q', [0]*1010)
+        self.assertTrue(u.values_array('int64', out) is out)
+        self.assertEqual(list(out[:1000]), list(u.values()))
+        self.assertEqual(list(out[1000:]), [0]*10)
+        with self.assertRaises(ValueError): u.values_array('d', out)
+        with self.assertRaises(ValueError): u.values_array('q', array('q'))
+        with self.assertRaises(ValueError): u.values_array('int32')
+        with self.assertRaises(TypeError): u.assoc(0, 'x').values_array()
+        with self.assertRaises(OverflowError): u.assoc(0, -1).values_array('Q')
+    def test_export(self):
+        """Tests that the bulk-export methods `to_dict`, `to_lists`,
+        `keys_array`, and `values_array` agree with iteration.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_export(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_export(PHAMT, THAMT)
+    def pt_test_shards(self, PHAMT, THAMT):
+        (u, d, assocs) = self.make_random_pair(PHAMT, THAMT, 500)
+        items = list(u)
+        for n in [1, 2, 3, 8, 100, 1000]:
+            shards = u.shards(n)
+            self.assertTrue(0 < len(shards) <= n)
+            # Iterating over the shards in order is iterating over the PHAMT.
+            self.assertEqual([x for sh in shards for x in sh], items)
+            self.assertEqual(sum(len(sh) for sh in shards), len(u))
+        self.assertEqual(u.shards(1)[0].to_dict(), u.to_dict())
+        self.assertEqual(PHAMT.empty.shards(4), [])
+        with self.assertRaises(ValueError): u.shards(0)
+        # Dense PHAMTs split into balanced shards.
+        u = PHAMT.from_iter(range(100000), -500)
+        for n in [2, 4, 7, 16]:
+            shards = u.shards(n)
+            self.assertEqual(len(shards), n)
+            self.assertEqual([x for sh in shards for x in sh], list(u))
+            for sh in shards:
+                self.assertTrue(len(sh) < 2 * len(u) / n)
+        # Asking for many small shards splits the trie down to its twigs.
+        for n in [3000, len(u)]:
+            shards = u.shards(n)
+            self.assertTrue(len(u) // 1024 <= len(shards) <= n)
+            self.assertEqual([x for sh in shards for x in sh], list(u))
+    def test_shards(self):
+        """Tests that `PHAMT.shards(n)` partitions a PHAMT into balanced,
+        disjoint pieces.
+        """
+        from ..c_core import PHAMT, THAMT
+        self.pt_test_shards(PHAMT, THAMT)
+        from ..py_core import PHAMT, THAMT
+        self.pt_test_shards(PHAMT, THAMT)
+    def pt_test_morton(self, PHAMT, morton_encode, morton_decode):
+        from random import randint
+        nbits = sys.hash_info[0]
+        # Encoding and decoding are inverses.
+        self.assertEqual(morton_encode((1, 0)), 1)
+        self.assertEqual(morton_encode((0, 1)), 2)
+        self.assertEqual(morton_encode((3, 0, 1)), 0b1001 | 0b100)
+        self.assertEqual(morton_decode(-1, 1), (2**nbits - 1,))
+        for ndim in [1, 2, 3, 5]:
+            for ii in range(50):
+                p = tuple(randint(0, 2**(nbits // ndim) - 1) for _ in range(ndim))
+                k = morton_encode(p)
+                self.assertTrue(self.MIN_INT <= k <= self.MAX_INT)
+                self.assertEqual(morton_decode(k, ndim), p)
+        with self.assertRaises(ValueError): morton_encode((2**(nbits // 2), 0))
+        with self.assertRaises(OverflowError): morton_encode((-1, 0))
+        with self.assertRaises(ValueError): morton_encode(())
+        # Box queries agree with a brute-force filter.
+        for (ndim, side) in [(2, 64), (3, 16), (2, 2**(nbits // 2))]:
+            u = PHAMT.empty
+            pts = {}
+            for ii in range(800):
+                p = tuple(randint(0, side - 1) for _ in range(ndim))
+                u = u.assoc(morton_encode(p), ii)
+                pts[p] = ii
+            for ii in range(20):
+                lo = [randint(0, side - 1) for _ in range(ndim)]
+                hi = [randint(l, side - 1) for l in lo]
+                q = u.query_box(lo, hi)
+                expect = {morton_encode(p): v for (p,v) in pts.items()
+                          if all(l <= x <= h for (l,x,h) in zip(lo, p, hi))}
+                self.assertEqual(q.to_dict(), expect)
+            self.assertEqual(u.query_box([0]*ndim, [side - 1]*ndim).to_dict(),
+                             u.to_dict())
+            self.assertEqual(len(u.query_box([1]*ndim, [0]*ndim)), 0)
+        with self.assertRaises(ValueError): u.query_box((0, 0), (1, 1, 1))
+    def test_morton(self):
+        """Tests the Morton key functions and `PHAMT.query_box`.
+        """
+        from ..c_core import PHAMT, morton_encode, morton_decode
+        self.pt_test_morton(PHAMT, morton_encode, morton_decode)
+        from ..py_core import PHAMT, morton_encode, morton_decode
+        self.pt_test_morton(PHAMT, morton_encode, morton_decode)
+    def test_variants(self):
+        """Tests the 16-way and 64-way builds of the C core (`c_core16` and
+        `c_core64`) against the same PHAMT/THAMT tests as the 32-way build.
+        """
+        from .. import c_core, c_core16, c_core64
+        nbits = sys.hash_info[0]
+        for (m, shift) in [(c_core, 5), (c_core16, 4), (c_core64, 6)]:
+            self.assertEqual(m.node_shift, shift)
+            self.assertEqual(m.twig_shift, shift)
+            self.assertEqual(m.hash_bits, nbits)
+            self.assertEqual(m.root_shift + (m.levels - 2)*m.node_shift + m.twig_shift,
+                             nbits)
+            self.assertTrue(0 < m.root_shift <= m.node_shift)
+        for m in (c_core16, c_core64):
+            self.pt_test_empty(m.PHAMT, m.THAMT)
+            self.pt_test_iteration(m.PHAMT, m.THAMT)
+            self.pt_test_edit(m.PHAMT, m.THAMT)
+            self.pt_test_dense_edit(m.PHAMT, m.THAMT)
+            self.pt_test_small(m.PHAMT, m.THAMT)
+            self.pt_test_thamt(m.PHAMT, m.THAMT)
+            self.pt_test_persistent_session(m.PHAMT, m.THAMT)
+            self.pt_test_gc(m.PHAMT, m.THAMT)
+            self.pt_test_next_chunk(m.PHAMT, m.THAMT)
+            self.pt_test_views(m.PHAMT, m.THAMT)
+            self.pt_test_export(m.PHAMT, m.THAMT)
+            self.pt_test_shards(m.PHAMT, m.THAMT)
+            self.pt_test_morton(m.PHAMT, m.morton_encode, m.morton_decode)
+    def test_narrow_keys(self):
+        """Tests the PHAMTs with 32-bit keys (`PHAMT32` and `THAMT32`).
+        """
+        import gc
+        from weakref import ref
+        from .. import c_core, c_core32, PHAMT32, THAMT32
+        from .. import py_core
+        self.assertTrue(PHAMT32 is c_core32.PHAMT and THAMT32 is c_core32.THAMT)
+        self.assertEqual(c_core32.hash_bits, 32)
+        self.assertEqual(c_core32.root_shift + (c_core32.levels - 2)*5 + 5, 32)
+        self.assertTrue(c_core32.levels < c_core.levels)
+        (kmin, kmax) = (-(1 << 31), (1 << 31) - 1)
+        # The random-edit tests run with keys drawn from the 32-bit range.
+        class Narrow(TestPHAMT):
+            MIN_INT = kmin
+            MAX_INT = kmax
+        t = Narrow()
+        for test in [t.pt_test_empty, t.pt_test_iteration, t.pt_test_edit,
+                     t.pt_test_runs, t.pt_test_thamt, t.pt_test_gc,
+                     t.pt_test_next_chunk, t.pt_test_views, t.pt_test_export,
+                     t.pt_test_shards]:
+            test(PHAMT32, THAMT32)
+        # Keys at and beyond the edges of the range.
+        u = PHAMT32.empty
+        for k in [kmin, kmax, -1, 0, 1]: u = u.assoc(k, str(k))
+        self.assertEqual(list(u.keys()), [0, 1, kmax, kmin, -1])
+        self.assertEqual(dict(u), {k: str(k) for k in [kmin, kmax, -1, 0, 1]})
+        self.assertEqual(u.keys_array().tolist(), list(u.keys()))
+        for k in [kmax + 1, kmin - 1, 1 << 40, 1 << 70]:
+            self.assertFalse(k in u)
+            self.assertEqual(u.get(k, 'x'), 'x')
+            self.assertTrue(u.dissoc(k) is u)
+            with self.assertRaises(KeyError): u[k]
+            with self.assertRaises(KeyError): u.assoc(k, 0)
+            with self.assertRaises(KeyError): THAMT32(u)[k] = 0
+        with self.assertRaises(KeyError): PHAMT32.from_iter(range(3), 1 << 40)
+        self.assertEqual(dict(PHAMT32.from_iter(range(3), -1)),
+                         {-1: 0, 0: 1, 1: 2})
+        # PHAMTs of the two widths (and of the Python core) convert into each
+        # other through their THAMTs wherever the keys fit.
+        w = c_core.PHAMT.from_iter(range(-500, 500), -500).assoc(kmin, 'a')
+        n = THAMT32(w).persistent()
+        self.assertEqual(dict(n), dict(w))
+        self.assertEqual(list(n), list(w))
+        self.assertEqual(dict(c_core.THAMT(n).persistent()), dict(w))
+        self.assertEqual(dict(py_core.THAMT(n).persistent()), dict(w))
+        self.assertEqual(dict(THAMT32({5: 'a', -5: 'b'}).persistent()),
+                         {5: 'a', -5: 'b'})
+        with self.assertRaises(KeyError): THAMT32(w.assoc(1 << 40, 0))
+        with self.assertRaises(TypeError): THAMT32([1, 2])
+        with self.assertRaises(TypeError): py_core.THAMT([1, 2])
+        # Morton keys have 32 bits to share between the dimensions.
+        self.assertEqual(c_core32.morton_decode(c_core32.morton_encode(
+            (65535, 3)), 2), (65535, 3))
+        with self.assertRaises(ValueError): c_core32.morton_encode((1 << 16, 0))
+        # Cycles through PHAMT32s are collected.
+        class List(list): pass
+        lst = List()
+        lr = ref(lst)
+        lst.append(PHAMT32.from_iter([lst, 1, 2]))
+        del lst
+        gc.collect()
+        self.assertTrue(lr() is None)
+    def test_wide_keys(self):
+        """Tests the PHAMTs with 128-bit keys (`PHAMT128` and `THAMT128`).
+        """
+        from .. import c_core, c_core128, PHAMT128, THAMT128
+        self.assertTrue(PHAMT128 is c_core128.PHAMT)
+        self.assertTrue(THAMT128 is c_core128.THAMT)
+        self.assertEqual(c_core128.hash_bits, 128)
+        self.assertEqual(c_core128.root_shift + (c_core128.levels - 2)*5 + 5,
+                         128)
+        (kmin, kmax) = (-(1 << 127), (1 << 127) - 1)
+        # The random-edit tests run with keys drawn from the 128-bit range; the
+        # rest run with 64-bit keys, which 128-bit PHAMTs also accept.
+        class Wide(TestPHAMT):
+            MIN_INT = kmin
+            MAX_INT = kmax
+        t = Wide()
+        for test in [t.pt_test_empty, t.pt_test_iteration, t.pt_test_edit,
+                     t.pt_test_thamt, t.pt_test_gc, t.pt_test_next_chunk,
+                     t.pt_test_views, t.pt_test_shards]:
+            test(PHAMT128, THAMT128)
+        for test in [self.pt_test_dense_edit, self.pt_test_runs,
+                     self.pt_test_small, self.pt_test_persistent_session,
+                     self.pt_test_export]:
+            test(PHAMT128, THAMT128)
+        # Keys at and beyond the edges of the range.
+        ks = [kmin, kmax, -1, 0, 1, 1 << 64, -(1 << 64), (1 << 63) - 1]
+        u = PHAMT128.empty
+        for k in ks: u = u.assoc(k, str(k))
+        self.assertEqual(dict(u), {k: str(k) for k in ks})
+        self.assertEqual(list(u.keys()), sorted(ks, key=lambda k: k % 2**128))
+        self.assertEqual(u.keys_array('d').tolist(), [float(k) for k in u.keys()])
+        with self.assertRaises(OverflowError): u.keys_array()
+        for k in [kmax + 1, kmin - 1, 1 << 200]:
+            self.assertFalse(k in u)
+            self.assertEqual(u.get(k, 'x'), 'x')
+            self.assertTrue(u.dissoc(k) is u)
+            with self.assertRaises(KeyError): u[k]
+            with self.assertRaises(KeyError): u.assoc(k, 0)
+        # A (hi, lo) pair is the key (hi << 64) | lo, so the keys that share
+        # a hi part are next to one another in the trie.
+        t = THAMT128()
+        for tenant in [2, 0, 1, -3]:
+            for obj in [5, 0, (1 << 64) - 1]:
+                t[(tenant, obj)] = (tenant, obj)
+        u = t.persistent()
+        for (k, v) in u:
+            self.assertEqual(k, (v[0] << 64) | v[1])
+            self.assertEqual(divmod(k, 1 << 64), v)
+            self.assertTrue(v in u and u[v] is u[k])
+        self.assertEqual([v[0] for v in u.values()],
+                         [0, 0, 0, 1, 1, 1, 2, 2, 2, -3, -3, -3])
+        self.assertEqual(u.dissoc((1, 5)).get((1, 5), None), None)
+        for k in [(1,), (1, 2, 3), (1 << 64, 0), (0, -1), (0, 1 << 64),
+                  ('a', 0)]:
+            self.assertFalse(k in u)
+            with self.assertRaises(KeyError): u.assoc(k, 0)
+        with self.assertRaises(TypeError): u.assoc('a', 0)
+        # 128-bit and 64-bit PHAMTs convert into each other where keys fit.
+        w = c_core.PHAMT.from_iter(range(1000), -500).assoc(-(1 << 63), 'a')
+        n = THAMT128(w).persistent()
+        self.assertEqual(dict(n), dict(w))
+        self.assertEqual(dict(c_core.THAMT(n).persistent()), dict(w))
+        with self.assertRaises(KeyError): c_core.THAMT(u)
+        # Morton keys have 128 bits to share between the dimensions.
+        for cs in [(3, (1 << 64) - 1), (1 << 31, 7, 9, (1 << 32) - 1)]:
+            k = c_core128.morton_encode(cs)
+            self.assertEqual(c_core128.morton_decode(k, len(cs)), cs)
+        self.assertEqual(c_core128.morton_decode(-1, 1), ((1 << 128) - 1,))
@@ -12,6 +12,10 @@ class BuildExt(build_ext):
                      "unix": ["-std=c11", "-O3"]}
     def build_extensions(self):
         opts = self.compile_flags.get(self.compiler.compiler_type, [])
+        # MSVC lacks 128-bit integers, so it can't build phamt.c_core128.
+        if self.compiler.compiler_type == "msvc":
+            self.extensions = [ext for ext in self.extensions
+                               if ext.name != 'phamt.c_core128']
         for ext in self.extensions:
             ext.extra_compile_args = opts
         build_ext.build_extensions(self)
@@ -53,11 +57,21 @@ setup(
         'Topic :: Software Development :: Libraries :: Python Modules'],
     packages=['phamt', 'phamt.test'],
     ext_modules=[
-        Extension('phamt.c_core',
+        Extension('phamt.' + name,
                   ['phamt/phamt.c'],
                   depends=['phamt/phamt.h'],
                   include_dirs=["phamt"],
-                  language="c")],
+                  define_macros=[('PHAMT_MODULE', name),
+                                 ('PHAMT_NODE_SHIFT', str(shift)),
+                                 ('PHAMT_TWIG_SHIFT', str(shift))] + macros,
+                  language="c")
+        for (name, shift, macros) in [('c_core',   5, []),
+                                      ('c_core16', 4, []),
+                                      ('c_core64', 6, []),
+                                      ('c_core32', 5, [('PHAMT_HASH_BITS',
+                                                        '32')]),
+                                      ('c_core128', 5, [('PHAMT_HASH_BITS',
+                                                         '128')])]],
     package_data={'': ['LICENSE.txt']},
     zip_safe=False,
     include_package_data=True,